@@ -36,14 +36,65 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/*
+ * The first login attempt, started once the domain controller is picked
+ * so that its AS exchange runs alongside the LDAP connect.
+ */
+typedef struct {
+	adcli_login_type type;
+	krb5_principal principal;
+	krb5_get_init_creds_opt *opt;
+	krb5_init_creds_context icc;
+	krb5_ccache ccache;
+	char *new_password;
+	int use_default;
+	double started;
+	_adcli_krb5_as *as;
+} early_login;
+
+/* How long a non-blocking TCP connect may take */
+#define CONNECT_TIMEOUT 10.0
+
+typedef enum {
+	ASYNC_TCP = 1,
+	ASYNC_ROOT_DSE,
+	ASYNC_LOGIN,
+	ASYNC_BIND,
+	ASYNC_DONE,
+} async_state;
+
+/* State of adcli_conn_connect_start() and adcli_conn_connect_step() */
+typedef struct {
+	async_state state;
+	adcli_result result;
+	adcli_disco *disco;
+	bool had_any;
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+	int error;
+	int sock;
+	LDAP *ldap;
+	int msgid;
+	const char *mech;
+	const char *rmech;
+	double started;
+	double deadline;
+	_adcli_phase phase;
+} async_connect;
+
 struct _adcli_conn_ctx {
 	int refs;
 
@@ -59,9 +110,11 @@ struct _adcli_conn_ctx {
 	int login_keytab_name_is_krb5;
 	adcli_login_type login_type;
 	int logins_allowed;
+	bool changepw_planned;
 
 	char *krb5_conf_dir;
 	char *krb5_conf_snippet;
+	bool krb5_conf_in_memory;
 
 	adcli_password_func password_func;
 	adcli_destroy_func password_destroy;
@@ -79,8 +132,15 @@ struct _adcli_conn_ctx {
 	enum conn_is_writeable is_writeable;
 	char *default_naming_context;
 	char *configuration_naming_context;
+	char *root_domain_naming_context;
+	bool is_global_catalog;
 	char **supported_capabilities;
 	char **supported_sasl_mechs;
+	unsigned int capability_bits;
+	unsigned int sasl_mech_bits;
+
+	/* Scratch space for filters, DNs and other temporaries */
+	_adcli_arena arena;
 
 	/* Connect state */
 	LDAP *ldap;
@@ -88,6 +148,11 @@ struct _adcli_conn_ctx {
 	krb5_context k5;
 	krb5_ccache ccache;
 	krb5_keytab keytab;
+	early_login *early_login;
+	async_connect *async;
+	LDAP *gc_ldap;
+	bool own_login;
+	time_t last_checked;
 };
 
 static char *try_to_get_fqdn (const char *host_name)
@@ -396,7 +461,9 @@ clear_krb5_conf_snippet (adcli_conn *conn)
 }
 
 static adcli_result
-setup_krb5_conf_snippet (adcli_conn *conn)
+setup_krb5_conf_snippet (adcli_conn *conn,
+                         const char *domain_controller,
+                         const char *canonical_host)
 {
 	char *filename;
 	char *snippet;
@@ -418,11 +485,11 @@ setup_krb5_conf_snippet (adcli_conn *conn)
 	if (asprintf (&filename, "%s/adcli-krb5-conf-XXXXXX", conn->krb5_conf_dir) < 0)
 		return_unexpected_if_reached ();
 
-	if (strchr (conn->domain_controller, ':')) {
-		if (asprintf (&controller, "[%s]", conn->domain_controller) < 0)
+	if (strchr (domain_controller, ':')) {
+		if (asprintf (&controller, "[%s]", domain_controller) < 0)
 			controller = NULL;
 	} else {
-		controller = strdup (conn->domain_controller);
+		controller = strdup (domain_controller);
 	}
 
 	return_unexpected_if_fail (controller != NULL);
@@ -437,8 +504,8 @@ setup_krb5_conf_snippet (adcli_conn *conn)
 	                        "  %s = %s\n"
 	                        "  %s = %s\n",
 	              conn->domain_realm, controller, controller, controller,
-	              conn->canonical_host, conn->domain_realm,
-	              conn->domain_controller, conn->domain_realm) < 0)
+	              canonical_host, conn->domain_realm,
+	              domain_controller, conn->domain_realm) < 0)
 		return_unexpected_if_reached ();
 
 	old_mask = umask (0177);
@@ -477,6 +544,41 @@ setup_krb5_conf_snippet (adcli_conn *conn)
 	return ADCLI_SUCCESS;
 }
 
+static adcli_result
+init_krb5_context_pinned (adcli_conn *conn,
+                          const char *domain_controller,
+                          const char *canonical_host)
+{
+	const char *hosts[] = {
+		canonical_host,
+		domain_controller,
+		NULL
+	};
+
+	/* Same settings as the snippet above, but without touching the disk */
+	return _adcli_krb5_init_context_pinned (&conn->k5, conn->domain_realm,
+	                                        domain_controller, hosts);
+}
+
+/* Guarantee consistency and communication with one dc */
+static adcli_result
+init_krb5_context (adcli_conn *conn,
+                   const char *domain_controller,
+                   const char *canonical_host)
+{
+	adcli_result res;
+
+	return_unexpected_if_fail (conn->k5 == NULL);
+
+	if (conn->krb5_conf_in_memory)
+		return init_krb5_context_pinned (conn, domain_controller, canonical_host);
+
+	res = setup_krb5_conf_snippet (conn, domain_controller, canonical_host);
+	if (res == ADCLI_SUCCESS)
+		res = _adcli_krb5_init_context (&conn->k5);
+	return res;
+}
+
 /*
  * HACK: This is to work around a bug in krb5 where if an empty password
  * preauth will fail unless a prompter is present.
@@ -497,6 +599,34 @@ null_prompter (krb5_context context,
 	return 0;
 }
 
+/*
+ * Note that we only prompt for computer account passwords if
+ * explicitly requested.
+ */
+static const char *
+computer_login_password (adcli_conn *conn,
+                         const char *sam,
+                         char **new_password)
+{
+	const char *password = conn->computer_password;
+
+	*new_password = NULL;
+
+	if (!password && conn->password_func &&
+	    conn->logins_allowed == ADCLI_LOGIN_COMPUTER_ACCOUNT) {
+		*new_password = (conn->password_func) (ADCLI_LOGIN_COMPUTER_ACCOUNT,
+		                                       sam, 0, conn->password_data);
+		password = *new_password;
+	}
+
+	if (password == NULL) {
+		*new_password = _adcli_calc_reset_password (conn->netbios_computer_name);
+		password = *new_password;
+	}
+
+	return password;
+}
+
 krb5_error_code
 _adcli_kinit_computer_creds (adcli_conn *conn,
                              const char *in_tkt_service,
@@ -510,6 +640,7 @@ _adcli_kinit_computer_creds (adcli_conn *conn,
 	krb5_creds dummy;
 	char *new_password;
 	const char *password;
+	double started;
 	char *sam;
 
 	assert (conn != NULL);
@@ -534,31 +665,15 @@ _adcli_kinit_computer_creds (adcli_conn *conn,
 	if (!creds)
 		creds = &dummy;
 
-	password = conn->computer_password;
 	new_password = NULL;
-
-	/*
-	 * Note that we only prompt for computer account passwords if
-	 * explicitly requested.
-	 */
+	started = _adcli_trace_clock ();
 
 	if (conn->keytab) {
 		code = krb5_get_init_creds_keytab (k5, creds, principal, conn->keytab,
 		                                   0, (char *)in_tkt_service, opt);
 
 	} else {
-		if (!password && conn->password_func &&
-		    conn->logins_allowed == ADCLI_LOGIN_COMPUTER_ACCOUNT) {
-			new_password = (conn->password_func) (ADCLI_LOGIN_COMPUTER_ACCOUNT,
-			                                      sam, 0, conn->password_data);
-			password = new_password;
-		}
-
-		if (password == NULL) {
-			new_password = _adcli_calc_reset_password (conn->netbios_computer_name);
-			password = new_password;
-		}
-
+		password = computer_login_password (conn, sam, &new_password);
 		code = krb5_get_init_creds_password (k5, creds, principal, (char *)password,
 		                                     null_prompter, NULL, 0, (char *)in_tkt_service, opt);
 
@@ -568,6 +683,7 @@ _adcli_kinit_computer_creds (adcli_conn *conn,
 		}
 	}
 
+	_adcli_krb5_trace (k5, "as-req", conn->domain_controller, principal, code, started);
 	krb5_free_principal (k5, principal);
 	krb5_get_init_creds_opt_free (k5, opt);
 	krb5_free_cred_contents (k5, &dummy);
@@ -576,6 +692,13 @@ _adcli_kinit_computer_creds (adcli_conn *conn,
 	return code;
 }
 
+_adcli_arena *
+_adcli_conn_get_arena (adcli_conn *conn)
+{
+	return_val_if_fail (conn != NULL, NULL);
+	return &conn->arena;
+}
+
 krb5_error_code
 _adcli_kinit_user_creds (adcli_conn *conn,
                          const char *in_tkt_service,
@@ -587,6 +710,7 @@ _adcli_kinit_user_creds (adcli_conn *conn,
 	krb5_error_code code;
 	krb5_context k5;
 	krb5_creds dummy;
+	double started;
 
 	assert (conn != NULL);
 
@@ -607,9 +731,11 @@ _adcli_kinit_user_creds (adcli_conn *conn,
 	if (!creds)
 		creds = &dummy;
 
+	started = _adcli_trace_clock ();
 	code = krb5_get_init_creds_password (k5, creds, principal,
 	                                     conn->user_password, null_prompter, NULL,
 	                                     0, (char *)in_tkt_service, opt);
+	_adcli_krb5_trace (k5, "as-req", conn->domain_controller, principal, code, started);
 
 	krb5_free_principal (k5, principal);
 	krb5_get_init_creds_opt_free (k5, opt);
@@ -618,39 +744,39 @@ _adcli_kinit_user_creds (adcli_conn *conn,
 	return code;
 }
 
+static adcli_result
+computer_login_result (adcli_conn *conn,
+                       krb5_error_code code,
+                       int use_default)
+{
+	if (code != 0) {
+		return handle_kinit_krb5_code (conn, ADCLI_LOGIN_COMPUTER_ACCOUNT,
+		                               conn->netbios_computer_name, code);
+	}
+
+	_adcli_info ("Authenticated as %scomputer account: %s",
+	             use_default ? "default/reset " : "", conn->netbios_computer_name);
+
+	conn->login_type = ADCLI_LOGIN_COMPUTER_ACCOUNT;
+	return ADCLI_SUCCESS;
+}
+
 static adcli_result
 kinit_with_computer_credentials (adcli_conn *conn,
                                  krb5_ccache ccache)
 {
-	adcli_result res;
 	krb5_error_code code;
 	int use_default;
 
 	use_default = (conn->computer_password == NULL);
 
 	code = _adcli_kinit_computer_creds (conn, NULL, ccache, NULL);
-
-	if (code == 0) {
-		_adcli_info ("Authenticated as %scomputer account: %s",
-		             use_default ? "default/reset " : "", conn->netbios_computer_name);
-
-		conn->login_type = ADCLI_LOGIN_COMPUTER_ACCOUNT;
-		res = ADCLI_SUCCESS;
-
-	} else {
-		res = handle_kinit_krb5_code (conn, ADCLI_LOGIN_COMPUTER_ACCOUNT,
-		                              conn->netbios_computer_name, code);
-	}
-
-	return res;
+	return computer_login_result (conn, code, use_default);
 }
 
 static adcli_result
-kinit_with_user_credentials (adcli_conn *conn,
-                             krb5_ccache ccache)
+prepare_user_login (adcli_conn *conn)
 {
-	adcli_result res;
-	krb5_error_code code;
 	char *name;
 
 	/* Build out the admin principal name */
@@ -664,19 +790,357 @@ kinit_with_user_credentials (adcli_conn *conn,
 		conn->user_name = name;
 	}
 
-	res = ensure_user_password (conn);
+	return ensure_user_password (conn);
+}
+
+static adcli_result
+user_login_result (adcli_conn *conn,
+                   krb5_error_code code)
+{
+	if (code != 0)
+		return handle_kinit_krb5_code (conn, ADCLI_LOGIN_USER_ACCOUNT, conn->user_name, code);
+
+	conn->login_type = ADCLI_LOGIN_USER_ACCOUNT;
+	_adcli_info ("Authenticated as user: %s", conn->user_name);
+	return ADCLI_SUCCESS;
+}
+
+static adcli_result
+kinit_with_user_credentials (adcli_conn *conn,
+                             krb5_ccache ccache)
+{
+	adcli_result res;
+	krb5_error_code code;
+
+	res = prepare_user_login (conn);
 	if (res != ADCLI_SUCCESS)
 		return res;
 
 	code = _adcli_kinit_user_creds (conn, NULL, ccache, NULL);
+	return user_login_result (conn, code);
+}
 
-	if (code == 0) {
-		conn->login_type = ADCLI_LOGIN_USER_ACCOUNT;
-		_adcli_info ("Authenticated as user: %s", conn->user_name);
+static adcli_result
+open_login_keytab (adcli_conn *conn)
+{
+	krb5_error_code code;
+	adcli_result res;
+
+	if (conn->login_keytab_name == NULL || conn->keytab)
 		return ADCLI_SUCCESS;
+
+	res = _adcli_krb5_open_keytab (conn->k5, conn->login_keytab_name, &conn->keytab);
+	if (res != ADCLI_SUCCESS) {
+		if (res == ADCLI_ERR_FAIL)
+			res = ADCLI_ERR_CONFIG;
+		return res;
+	}
+
+	if (strcmp (conn->login_keytab_name, "") == 0) {
+		free (conn->login_keytab_name);
+		conn->login_keytab_name = malloc (MAX_KEYTAB_NAME_LEN);
+		code = krb5_kt_get_name (conn->k5, conn->keytab,
+		                         conn->login_keytab_name, MAX_KEYTAB_NAME_LEN);
+		conn->login_keytab_name_is_krb5 = 1;
+		return_unexpected_if_fail (code == 0);
+	}
+
+	return ADCLI_SUCCESS;
+}
+
+static void
+free_early_login (adcli_conn *conn,
+                  early_login *login)
+{
+	_adcli_krb5_as_free (login->as);
+	if (login->icc)
+		krb5_init_creds_free (conn->k5, login->icc);
+	if (login->opt)
+		krb5_get_init_creds_opt_free (conn->k5, login->opt);
+	if (login->ccache)
+		krb5_cc_close (conn->k5, login->ccache);
+	if (login->principal)
+		krb5_free_principal (conn->k5, login->principal);
+	_adcli_password_free (login->new_password);
+	free (login);
+}
+
+static krb5_error_code
+init_early_login (adcli_conn *conn,
+                  early_login *login,
+                  const char *domain_controller)
+{
+	krb5_error_code code;
+	const char *password;
+	char *sam;
+
+	if (login->type == ADCLI_LOGIN_COMPUTER_ACCOUNT) {
+		if (asprintf (&sam, "%s$", conn->netbios_computer_name) < 0)
+			return ENOMEM;
+		code = _adcli_krb5_build_principal (conn->k5, sam, conn->domain_realm,
+		                                    &login->principal);
+		password = conn->keytab ? NULL : computer_login_password (conn, sam,
+		                                                          &login->new_password);
+		free (sam);
+	} else {
+		code = krb5_parse_name (conn->k5, conn->user_name, &login->principal);
+		password = conn->user_password;
+	}
+
+	if (code == 0)
+		code = krb5_cc_new_unique (conn->k5, "MEMORY", NULL, &login->ccache);
+	if (code == 0)
+		code = krb5_get_init_creds_opt_alloc (conn->k5, &login->opt);
+	if (code == 0)
+		code = krb5_get_init_creds_opt_set_out_ccache (conn->k5, login->opt, login->ccache);
+	if (code == 0)
+		code = krb5_init_creds_init (conn->k5, login->principal, null_prompter, NULL,
+		                             0, login->opt, &login->icc);
+	if (code == 0) {
+		if (password)
+			code = krb5_init_creds_set_password (conn->k5, login->icc, password);
+		else
+			code = krb5_init_creds_set_keytab (conn->k5, login->icc, conn->keytab);
+	}
+
+	login->started = _adcli_trace_clock ();
+	if (code == 0)
+		code = _adcli_krb5_as_start (conn->k5, login->icc, domain_controller,
+		                             conn->domain_realm, &login->as);
+	return code;
+}
+
+/* Undo begin_early_login(), when this controller is not used after all */
+static void
+abandon_early_login (adcli_conn *conn)
+{
+	if (conn->early_login)
+		free_early_login (conn, conn->early_login);
+	conn->early_login = NULL;
+
+	if (conn->keytab)
+		krb5_kt_close (conn->k5, conn->keytab);
+	conn->keytab = NULL;
+
+	if (conn->k5)
+		krb5_free_context (conn->k5);
+	conn->k5 = NULL;
+
+	clear_krb5_conf_snippet (conn);
+}
+
+/*
+ * Once the domain controller is picked, the first login attempt of
+ * prep_kerberos_and_kinit() does not depend on the LDAP connection.
+ * Start its AS exchange here, and let it progress while LDAP connects
+ * and reads the root DSE. Anything unusual is left to the usual path.
+ */
+static void
+begin_early_login (adcli_conn *conn,
+                   const char *domain_controller,
+                   const char *canonical_host)
+{
+	adcli_login_type type;
+
+	if (conn->k5 != NULL || conn->login_ccache_name != NULL)
+		return;
+
+	/* Nobody gets prompted before the controller has answered */
+	if (conn->logins_allowed & ADCLI_LOGIN_COMPUTER_ACCOUNT) {
+		if (conn->login_keytab_name == NULL && conn->computer_password == NULL &&
+		    conn->password_func && conn->logins_allowed == ADCLI_LOGIN_COMPUTER_ACCOUNT)
+			return;
+		type = ADCLI_LOGIN_COMPUTER_ACCOUNT;
+	} else if (conn->user_password != NULL) {
+		if (prepare_user_login (conn) != ADCLI_SUCCESS)
+			return;
+		type = ADCLI_LOGIN_USER_ACCOUNT;
+	} else {
+		return;
+	}
+
+	if (init_krb5_context (conn, domain_controller, canonical_host) != ADCLI_SUCCESS ||
+	    open_login_keytab (conn) != ADCLI_SUCCESS) {
+		abandon_early_login (conn);
+		return;
+	}
+
+	conn->early_login = calloc (1, sizeof (early_login));
+	return_if_fail (conn->early_login != NULL);
+
+	conn->early_login->type = type;
+	conn->early_login->use_default = (conn->computer_password == NULL);
+
+	if (init_early_login (conn, conn->early_login, domain_controller) != 0) {
+		abandon_early_login (conn);
+		return;
+	}
+
+	_adcli_info ("Started Kerberos login on %s alongside the LDAP connection",
+	             domain_controller);
+}
+
+/* Let the login progress until the LDAP connection has something to read */
+static void
+pump_early_login (adcli_conn *conn,
+                  LDAP *ldap)
+{
+	struct pollfd pfd[2];
+	int fd;
+
+	if (ldap_get_option (ldap, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS || fd < 0)
+		return;
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+
+	while (conn->early_login && !_adcli_krb5_as_process (conn->early_login->as)) {
+		pfd[0].revents = 0;
+		pfd[1].fd = _adcli_krb5_as_fd (conn->early_login->as, &pfd[1].events);
+		/* Wake up now and then, so the login can time out */
+		if (poll (pfd, 2, 1000) < 0 && errno != EINTR)
+			break;
+		if (pfd[0].revents != 0)
+			break;
+	}
+}
+
+static adcli_result
+finish_early_login (adcli_conn *conn,
+                    krb5_ccache *ccache,
+                    int *tried)
+{
+	early_login *login;
+	krb5_error_code code;
+	adcli_result res;
+
+	login = conn->early_login;
+	conn->early_login = NULL;
+
+	code = _adcli_krb5_as_wait (login->as);
+	_adcli_krb5_trace (conn->k5, "as-req", conn->domain_controller,
+	                   login->principal, code, login->started);
+
+	/* Couldn't talk to the KDC ourselves, let the library try */
+	if (code == KRB5_KDC_UNREACH) {
+		_adcli_info ("Couldn't complete early Kerberos login, trying again");
+		free_early_login (conn, login);
+		return ADCLI_ERR_FAIL;
+	}
+
+	*tried = login->type;
+	if (login->type == ADCLI_LOGIN_COMPUTER_ACCOUNT) {
+		if (code == 0 && login->new_password) {
+			_adcli_password_free (conn->computer_password);
+			conn->computer_password = login->new_password;
+			login->new_password = NULL;
+		}
+		res = computer_login_result (conn, code, login->use_default);
+	} else {
+		res = user_login_result (conn, code);
+	}
+
+	if (res == ADCLI_SUCCESS) {
+		*ccache = login->ccache;
+		login->ccache = NULL;
+	}
+
+	free_early_login (conn, login);
+	return res;
+}
+
+#define PREFETCH_MAX 2
+
+/*
+ * Fetch the service tickets this connection is going to need right after
+ * the login, all at the same time, instead of one after the other when
+ * the SASL bind and a password change get around to asking for them.
+ * They stay in the login ccache for the life of the connection. Anything
+ * that fails here is fetched again later the usual way.
+ */
+static void
+prefetch_service_tickets (adcli_conn *conn,
+                          krb5_ccache ccache)
+{
+	krb5_tkt_creds_context tcc[PREFETCH_MAX] = { NULL, };
+	krb5_principal server[PREFETCH_MAX] = { NULL, };
+	_adcli_krb5_as *as[PREFETCH_MAX] = { NULL, };
+	struct pollfd pfd[PREFETCH_MAX];
+	krb5_principal client = NULL;
+	krb5_error_code code;
+	krb5_creds creds;
+	double started;
+	int count = 0;
+	int pending;
+	int i;
+
+	if (conn->domain_controller == NULL || conn->domain_realm == NULL)
+		return;
+
+	if (krb5_cc_get_principal (conn->k5, ccache, &client) != 0)
+		return;
+
+	/* For the SASL bind, named the way GSSAPI names the service */
+	if (krb5_sname_to_principal (conn->k5, conn->canonical_host ? conn->canonical_host
+	                                                            : conn->domain_controller,
+	                             "ldap", KRB5_NT_SRV_HST, &server[count]) == 0)
+		count++;
+
+	/* For password changes done with the user's credentials */
+	if (conn->login_type == ADCLI_LOGIN_USER_ACCOUNT && conn->changepw_planned &&
+	    krb5_build_principal (conn->k5, &server[count], strlen (conn->domain_realm),
+	                          conn->domain_realm, "kadmin", "changepw", NULL) == 0)
+		count++;
+
+	started = _adcli_trace_clock ();
+	for (i = 0; i < count; i++) {
+		memset (&creds, 0, sizeof (creds));
+		creds.client = client;
+		creds.server = server[i];
+
+		code = krb5_tkt_creds_init (conn->k5, ccache, &creds, 0, &tcc[i]);
+		if (code == 0)
+			code = _adcli_krb5_tgs_start (conn->k5, tcc[i], conn->domain_controller,
+			                              conn->domain_realm, &as[i]);
+		if (code != 0)
+			_adcli_krb5_trace (conn->k5, "tgs-req", conn->domain_controller,
+			                   server[i], code, started);
+	}
+
+	for (;;) {
+		pending = 0;
+		for (i = 0; i < count; i++) {
+			if (as[i] == NULL || _adcli_krb5_as_process (as[i]))
+				continue;
+			pfd[pending].fd = _adcli_krb5_as_fd (as[i], &pfd[pending].events);
+			pending++;
+		}
+
+		if (pending == 0)
+			break;
+
+		/* Wake up now and then, so the requests can time out */
+		if (poll (pfd, pending, 1000) < 0 && errno != EINTR)
+			break;
 	}
 
-	return handle_kinit_krb5_code (conn, ADCLI_LOGIN_USER_ACCOUNT, conn->user_name, code);
+	for (i = 0; i < count; i++) {
+		if (as[i] != NULL) {
+			/* Completed exchanges have stored their ticket in the ccache */
+			code = _adcli_krb5_as_wait (as[i]);
+			_adcli_krb5_trace (conn->k5, "tgs-req", conn->domain_controller,
+			                   server[i], code, started);
+			if (code != 0)
+				_adcli_info ("Couldn't fetch service ticket ahead of time: %s",
+				             krb5_get_error_message (conn->k5, code));
+			_adcli_krb5_as_free (as[i]);
+		}
+		if (tcc[i] != NULL)
+			krb5_tkt_creds_free (conn->k5, tcc[i]);
+		krb5_free_principal (conn->k5, server[i]);
+	}
+
+	krb5_free_principal (conn->k5, client);
 }
 
 static adcli_result
@@ -686,6 +1150,7 @@ prep_kerberos_and_kinit (adcli_conn *conn)
 	int logged_in = 0;
 	krb5_ccache ccache;
 	adcli_result res;
+	int tried = 0;
 
 	if (conn->login_ccache_name != NULL) {
 		if (!conn->ccache) {
@@ -722,29 +1187,22 @@ prep_kerberos_and_kinit (adcli_conn *conn)
 		return ADCLI_SUCCESS;
 	}
 
-	if (conn->login_keytab_name != NULL) {
-		if (!conn->keytab) {
-			res = _adcli_krb5_open_keytab (conn->k5, conn->login_keytab_name, &conn->keytab);
-			if (res != ADCLI_SUCCESS) {
-				if (res == ADCLI_ERR_FAIL)
-					res = ADCLI_ERR_CONFIG;
-				return res;
-			}
+	res = open_login_keytab (conn);
+	if (res != ADCLI_SUCCESS)
+		return res;
 
-			if (strcmp (conn->login_keytab_name, "") == 0) {
-				free (conn->login_keytab_name);
-				conn->login_keytab_name = malloc (MAX_KEYTAB_NAME_LEN);
-				code = krb5_kt_get_name (conn->k5, conn->keytab,
-				                         conn->login_keytab_name, MAX_KEYTAB_NAME_LEN);
-				conn->login_keytab_name_is_krb5 = 1;
-				return_unexpected_if_fail (code == 0);
-			}
-		}
+	/* A login may already be under way, see begin_early_login() */
+	ccache = NULL;
+	if (conn->early_login) {
+		res = finish_early_login (conn, &ccache, &tried);
+		logged_in = (res == ADCLI_SUCCESS);
 	}
 
 	/* Initialize the credential cache */
-	code = krb5_cc_new_unique (conn->k5, "MEMORY", NULL, &ccache);
-	return_unexpected_if_fail (code == 0);
+	if (ccache == NULL) {
+		code = krb5_cc_new_unique (conn->k5, "MEMORY", NULL, &ccache);
+		return_unexpected_if_fail (code == 0);
+	}
 
 	/*
 	 * Should we try to connect with computer account default password?
@@ -753,13 +1211,15 @@ prep_kerberos_and_kinit (adcli_conn *conn)
 	 * go straight to that.
 	 */
 
-	if (conn->logins_allowed & ADCLI_LOGIN_COMPUTER_ACCOUNT) {
+	if (!logged_in && !(tried & ADCLI_LOGIN_COMPUTER_ACCOUNT) &&
+	    (conn->logins_allowed & ADCLI_LOGIN_COMPUTER_ACCOUNT)) {
 		res = kinit_with_computer_credentials (conn, ccache);
 		logged_in = (res == ADCLI_SUCCESS);
 	}
 
 	/* Use login credentials */
-	if (!logged_in && (conn->logins_allowed & ADCLI_LOGIN_USER_ACCOUNT)) {
+	if (!logged_in && !(tried & ADCLI_LOGIN_USER_ACCOUNT) &&
+	    (conn->logins_allowed & ADCLI_LOGIN_USER_ACCOUNT)) {
 		res = kinit_with_user_credentials (conn, ccache);
 		logged_in = (res == ADCLI_SUCCESS);
 	}
@@ -769,8 +1229,11 @@ prep_kerberos_and_kinit (adcli_conn *conn)
 		                              &conn->login_ccache_name);
 		return_unexpected_if_fail (code == 0);
 
+		prefetch_service_tickets (conn, ccache);
+
 		conn->ccache = ccache;
 		conn->login_ccache_name_is_krb5 = 1;
+		conn->own_login = true;
 		ccache = NULL;
 		res = ADCLI_SUCCESS;
 	} else {
@@ -786,30 +1249,115 @@ prep_kerberos_and_kinit (adcli_conn *conn)
 /* Not included in ldap.h but documented */
 int ldap_init_fd (ber_socket_t fd, int proto, LDAP_CONST char *url, struct ldap **ldp);
 
+/*
+ * Notice a domain controller that went away while the connection was
+ * idle well before the kernel defaults would, which take hours.
+ */
+#define KEEPALIVE_IDLE     300
+#define KEEPALIVE_INTERVAL 30
+#define KEEPALIVE_COUNT    4
+
+static void
+set_keepalive (int sock)
+{
+	int value;
+
+	value = 1;
+	if (setsockopt (sock, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof (value)) < 0)
+		return;
+
+#ifdef TCP_KEEPIDLE
+	value = KEEPALIVE_IDLE;
+	setsockopt (sock, IPPROTO_TCP, TCP_KEEPIDLE, &value, sizeof (value));
+#endif
+#ifdef TCP_KEEPINTVL
+	value = KEEPALIVE_INTERVAL;
+	setsockopt (sock, IPPROTO_TCP, TCP_KEEPINTVL, &value, sizeof (value));
+#endif
+#ifdef TCP_KEEPCNT
+	value = KEEPALIVE_COUNT;
+	setsockopt (sock, IPPROTO_TCP, TCP_KEEPCNT, &value, sizeof (value));
+#endif
+}
+
+/* Sets up LDAP, and TLS if requested, on a connected socket */
 static LDAP *
-connect_to_address (const char *host,
-                    const char *canonical_host,
-                    bool use_ldaps)
+ldap_on_socket (int sock,
+                const char *host,
+                const char *canonical_host,
+                bool use_ldaps)
 {
-	struct addrinfo *res = NULL;
-	struct addrinfo *ai;
-	struct addrinfo hints;
+	const char *errmsg = NULL;
 	LDAP *ldap = NULL;
-	int error = 0;
+	double started;
 	char *url;
-	int sock;
-	int rc;
 	int opt_rc;
-	const char *port = "389";
-	const char *proto = "ldap";
-	const char *errmsg = NULL;
+	int rc;
 
-	if (use_ldaps) {
-		port = "636";
-		proto = "ldaps";
-		_adcli_info ("Using LDAPS to connect to %s", host);
+	set_keepalive (sock);
+
+	if (asprintf (&url, "%s://%s", use_ldaps ? "ldaps" : "ldap", canonical_host) < 0)
+		return_val_if_reached (NULL);
+	rc = ldap_init_fd (sock, 1, url, &ldap);
+	free (url);
+
+	if (rc != LDAP_SUCCESS) {
+		_adcli_err ("Couldn't initialize LDAP connection: %s:",
+		            ldap_err2string (rc));
+		close (sock);
+		return NULL;
 	}
 
+	if (use_ldaps) {
+		_adcli_ldap_resume_tls (ldap);
+		started = _adcli_trace_clock ();
+		rc = ldap_install_tls (ldap);
+		_adcli_trace ("tls", "handshake", host, started,
+		              "result", ldap_err2string (rc), NULL);
+		if (rc != LDAP_SUCCESS) {
+			opt_rc = ldap_get_option (ldap,
+			                          LDAP_OPT_DIAGNOSTIC_MESSAGE,
+			                          (void *) &errmsg);
+			if (opt_rc != LDAP_SUCCESS) {
+				errmsg = NULL;
+			}
+			_adcli_err ("Couldn't initialize TLS [%s]: %s",
+			            ldap_err2string (rc),
+			            errmsg == NULL ? "- no details -"
+			                           : errmsg);
+			ldap_unbind_ext_s (ldap, NULL, NULL);
+			return NULL;
+		}
+	}
+
+	return ldap;
+}
+
+static LDAP *
+connect_to_address (const char *host,
+                    const char *canonical_host,
+                    bool use_ldaps,
+                    bool global_catalog)
+{
+	struct addrinfo *res = NULL;
+	struct addrinfo *ai;
+	struct addrinfo hints;
+	LDAP *ldap = NULL;
+	int error = 0;
+	int sock;
+	int rc;
+	const char *port = "389";
+	char address[NI_MAXHOST];
+	double started;
+
+	if (use_ldaps) {
+		port = "636";
+		_adcli_info ("Using LDAPS to connect to %s", host);
+	}
+
+	if (global_catalog)
+		port = use_ldaps ? "3269" : "3268";
+
 	memset (&hints, '\0', sizeof(hints));
 #ifdef AI_ADDRCONFIG
 	hints.ai_flags |= AI_ADDRCONFIG;
@@ -820,14 +1368,24 @@ connect_to_address (const char *host,
 	if (!canonical_host)
 		canonical_host = host;
 
+	started = _adcli_trace_clock ();
 	rc = getaddrinfo (host, port, &hints, &res);
+	_adcli_trace ("dns", "addrinfo", host, started,
+	              "name", host,
+	              "result", rc == 0 ? "Success" : gai_strerror (rc),
+	              NULL);
 	if (rc != 0) {
 		_adcli_err ("Couldn't resolve host name: %s: %s", host, gai_strerror (rc));
 		return NULL;
 	}
 
 	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if (getnameinfo (ai->ai_addr, ai->ai_addrlen, address, sizeof (address),
+		                 NULL, 0, NI_NUMERICHOST) != 0)
+			address[0] = '\0';
+
 		/* coverity[overwrite_var] */
+		started = _adcli_trace_clock ();
 		sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 		if (sock < 0) {
 			error = errno;
@@ -836,35 +1394,18 @@ connect_to_address (const char *host,
 			close (sock);
 		} else {
 			error = 0;
-			if (asprintf (&url, "%s://%s", proto, canonical_host) < 0)
-				return_val_if_reached (NULL);
-			rc = ldap_init_fd (sock, 1, url, &ldap);
-			free (url);
-
-			if (rc != LDAP_SUCCESS) {
-				_adcli_err ("Couldn't initialize LDAP connection: %s:",
-				            ldap_err2string (rc));
-				break;
-			}
+		}
 
-			if (use_ldaps) {
-				rc = ldap_install_tls (ldap);
-				if (rc != LDAP_SUCCESS) {
-					opt_rc = ldap_get_option (ldap,
-					                          LDAP_OPT_DIAGNOSTIC_MESSAGE,
-					                          (void *) &errmsg);
-					if (opt_rc != LDAP_SUCCESS) {
-						errmsg = NULL;
-					}
-					_adcli_err ("Couldn't initialize TLS [%s]: %s",
-					            ldap_err2string (rc),
-					            errmsg == NULL ? "- no details -"
-					                           : errmsg);
-					ldap_unbind_ext_s (ldap, NULL, NULL);
-					ldap = NULL;
-					break;
-				}
-			}
+		_adcli_trace ("tcp", "connect", host, started,
+		              "address", address,
+		              "port", port,
+		              "result", error ? strerror (error) : "Success",
+		              NULL);
+
+		if (sock >= 0 && error == 0) {
+			ldap = ldap_on_socket (sock, host, canonical_host, use_ldaps);
+			if (ldap == NULL)
+				break;
 		}
 	}
 
@@ -876,81 +1417,396 @@ connect_to_address (const char *host,
 	return ldap;
 }
 
-static adcli_result
-connect_and_lookup_naming (adcli_conn *conn,
-                           adcli_disco *disco)
+/* Capabilities and mechanisms that are checked for get a bit each, see adcli_cap_bit */
+static const char *known_capabilities[] = {
+	ADCLI_CAP_OID,
+	ADCLI_CAP_LDAP_INTEG_OID,
+	ADCLI_CAP_V51_OID,
+	ADCLI_CAP_ADAM_DIGEST,
+	ADCLI_CAP_ADAM_OID,
+	ADCLI_CAP_PARTIAL_SECRETS_OID,
+	ADCLI_CAP_V60_OID,
+	ADCLI_CAP_V61_R2_OID,
+	ADCLI_CAP_W8_OID,
+	NULL
+};
+
+static const char *known_sasl_mechs[] = {
+	"GSSAPI",
+	"GSS-SPNEGO",
+	"EXTERNAL",
+	"DIGEST-MD5",
+	NULL
+};
+
+static unsigned int
+known_bit (const char **known,
+           const char *value,
+           bool case_sensitive)
 {
-	char *canonical_host;
-	LDAPMessage *results;
-	adcli_result res;
-	LDAP *ldap;
-	int ret;
-	int ver;
+	int i;
 
-	char *attrs[] = {
-		"defaultNamingContext",
-		"configurationNamingContext",
-		"supportedCapabilities",
-		"supportedSASLMechanisms",
-		NULL
-	};
+	for (i = 0; known[i] != NULL; i++) {
+		if (case_sensitive ? strcmp (known[i], value) == 0
+		                   : strcasecmp (known[i], value) == 0)
+			return 1U << i;
+	}
 
-	assert (conn->ldap == NULL);
+	return 0;
+}
 
-	canonical_host = disco->host_name;
-	if (!canonical_host)
-		canonical_host = disco->host_addr;
+static unsigned int
+known_bits (const char **known,
+            char **values,
+            bool case_sensitive)
+{
+	unsigned int bits = 0;
+	int i;
 
-	ldap = connect_to_address (disco->host_addr, canonical_host,
-	                           adcli_conn_get_use_ldaps (conn));
-	if (ldap == NULL)
-		return ADCLI_ERR_DIRECTORY;
+	for (i = 0; values && values[i] != NULL; i++)
+		bits |= known_bit (known, values[i], case_sensitive);
+	return bits;
+}
 
-	ver = LDAP_VERSION3;
-	if (ldap_set_option (ldap, LDAP_OPT_PROTOCOL_VERSION, &ver) != 0)
-		return_unexpected_if_reached ();
+/*
+ * The root DSE of a domain controller hardly ever changes, so it is
+ * remembered for each controller, in this process and on disk for later
+ * runs. Further connections to the same controller skip reading it.
+ */
+#define ROOT_DSE_CACHE_TTL 3600
 
-	if (ldap_set_option (ldap, LDAP_OPT_REFERRALS, LDAP_OPT_OFF) != 0)
-		return_unexpected_if_reached ();
+typedef struct _root_dse {
+	char *host;
+	time_t fetched;
+	char *default_naming_context;
+	char *configuration_naming_context;
+	char *root_domain_naming_context;
+	bool is_global_catalog;
+	char **capabilities;
+	char **sasl_mechs;
+	struct _root_dse *next;
+} root_dse;
 
-	/* Don't force GSSAPI to use reverse DNS */
-	if (ldap_set_option (ldap, LDAP_OPT_X_SASL_NOCANON, LDAP_OPT_ON) != 0)
-		return_unexpected_if_reached ();
+static root_dse *root_dse_cache = NULL;
 
-	/*
-	 * We perform this lookup whether or not we want to lookup the
-	 * naming context, as it also connects to the LDAP server.
-	 */
-	ret = ldap_search_ext_s (ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)",
-	                         attrs, 0, NULL, NULL, NULL, -1, &results);
-	if (ret != LDAP_SUCCESS) {
-		res = _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
-		                                  "Couldn't connect to LDAP server: %s", disco->host_addr);
-		ldap_unbind_ext_s (ldap, NULL, NULL);
-		return res;
+static void
+root_dse_free (root_dse *dse)
+{
+	free (dse->host);
+	free (dse->default_naming_context);
+	free (dse->configuration_naming_context);
+	free (dse->root_domain_naming_context);
+	_adcli_strv_free (dse->capabilities);
+	_adcli_strv_free (dse->sasl_mechs);
+	free (dse);
+}
+
+static void
+forget_root_dse (const char *host)
+{
+	root_dse **at;
+	root_dse *dse;
+
+	for (at = &root_dse_cache; *at != NULL; ) {
+		dse = *at;
+		if (host == NULL || strcmp (dse->host, host) == 0) {
+			*at = dse->next;
+			root_dse_free (dse);
+		} else {
+			at = &dse->next;
+		}
 	}
+}
 
-	if (conn->default_naming_context == NULL) {
-		conn->default_naming_context = _adcli_ldap_parse_value (ldap, results,
-		                                                        "defaultNamingContext");
+static root_dse *
+remember_root_dse (root_dse *dse)
+{
+	/* Only something usable is worth remembering */
+	if (dse->host == NULL || dse->default_naming_context == NULL) {
+		root_dse_free (dse);
+		return NULL;
 	}
 
-	if (conn->configuration_naming_context == NULL) {
-		conn->configuration_naming_context = _adcli_ldap_parse_value (ldap, results,
-		                                                              "configurationNamingContext");
+	forget_root_dse (dse->host);
+	dse->next = root_dse_cache;
+	root_dse_cache = dse;
+	return dse;
+}
+
+static char *
+root_dse_state (const char *host)
+{
+	char *name;
+
+	if (asprintf (&name, "root-dse.%s", host) < 0)
+		return_val_if_reached (NULL);
+
+	_adcli_str_down (name);
+	return name;
+}
+
+static char **
+root_dse_line (char **lines,
+               int *length,
+               const char *attr,
+               const char *value)
+{
+	char *line;
+
+	/* One line per value, none of these values has a newline */
+	if (value == NULL || strchr (value, '\n') != NULL)
+		return lines;
+
+	if (asprintf (&line, "%s: %s", attr, value) < 0)
+		return_val_if_reached (lines);
+
+	return _adcli_strv_add (lines, line, length);
+}
+
+static void
+save_root_dse (root_dse *dse)
+{
+	char **lines = NULL;
+	char fetched[32];
+	int length = 0;
+	char *name;
+	char *data;
+	int i;
+
+	snprintf (fetched, sizeof (fetched), "%lld", (long long)dse->fetched);
+	lines = root_dse_line (lines, &length, "fetched", fetched);
+	lines = root_dse_line (lines, &length, "defaultNamingContext",
+	                       dse->default_naming_context);
+	lines = root_dse_line (lines, &length, "configurationNamingContext",
+	                       dse->configuration_naming_context);
+	lines = root_dse_line (lines, &length, "rootDomainNamingContext",
+	                       dse->root_domain_naming_context);
+	lines = root_dse_line (lines, &length, "isGlobalCatalogReady",
+	                       dse->is_global_catalog ? "TRUE" : "FALSE");
+	for (i = 0; dse->capabilities && dse->capabilities[i]; i++)
+		lines = root_dse_line (lines, &length, "supportedCapabilities",
+		                       dse->capabilities[i]);
+	for (i = 0; dse->sasl_mechs && dse->sasl_mechs[i]; i++)
+		lines = root_dse_line (lines, &length, "supportedSASLMechanisms",
+		                       dse->sasl_mechs[i]);
+	lines = root_dse_line (lines, &length, "", "");
+
+	data = _adcli_strv_join (lines, "\n");
+	name = root_dse_state (dse->host);
+	if (data != NULL && name != NULL)
+		_adcli_state_write (name, data, strlen (data));
+
+	_adcli_strv_free (lines);
+	free (data);
+	free (name);
+}
+
+static root_dse *
+load_root_dse (const char *host)
+{
+	root_dse *dse;
+	char *value;
+	char *line;
+	char *next;
+	char *data;
+	char *name;
+
+	name = root_dse_state (host);
+	if (name == NULL)
+		return NULL;
+
+	data = _adcli_state_read (name, ROOT_DSE_CACHE_TTL, NULL);
+	free (name);
+	if (data == NULL)
+		return NULL;
+
+	dse = calloc (1, sizeof (root_dse));
+	return_val_if_fail (dse != NULL, NULL);
+	dse->host = strdup (host);
+
+	for (line = data; line != NULL; line = next) {
+		next = strchr (line, '\n');
+		if (next != NULL)
+			*(next++) = '\0';
+		value = strstr (line, ": ");
+		if (value == NULL)
+			continue;
+		*value = '\0';
+		value += 2;
+
+		if (strcmp (line, "fetched") == 0) {
+			dse->fetched = strtoll (value, NULL, 10);
+		} else if (strcmp (line, "defaultNamingContext") == 0) {
+			_adcli_str_set (&dse->default_naming_context, value);
+		} else if (strcmp (line, "configurationNamingContext") == 0) {
+			_adcli_str_set (&dse->configuration_naming_context, value);
+		} else if (strcmp (line, "rootDomainNamingContext") == 0) {
+			_adcli_str_set (&dse->root_domain_naming_context, value);
+		} else if (strcmp (line, "isGlobalCatalogReady") == 0) {
+			dse->is_global_catalog = strcasecmp (value, "TRUE") == 0;
+		} else if (strcmp (line, "supportedCapabilities") == 0) {
+			dse->capabilities = _adcli_strv_add (dse->capabilities, strdup (value), NULL);
+		} else if (strcmp (line, "supportedSASLMechanisms") == 0) {
+			dse->sasl_mechs = _adcli_strv_add (dse->sasl_mechs, strdup (value), NULL);
+		}
+	}
+
+	free (data);
+
+	/* Another process may have written it a while after reading it */
+	if (dse->fetched + ROOT_DSE_CACHE_TTL < time (NULL)) {
+		root_dse_free (dse);
+		return NULL;
 	}
 
-	if (conn->supported_capabilities == NULL) {
-		conn->supported_capabilities = _adcli_ldap_parse_values (ldap, results,
-		                                                         "supportedCapabilities");
+	return remember_root_dse (dse);
+}
+
+static root_dse *
+lookup_root_dse (const char *host)
+{
+	root_dse *dse;
+
+	for (dse = root_dse_cache; dse != NULL; dse = dse->next) {
+		if (strcmp (dse->host, host) == 0)
+			break;
 	}
 
-	if (conn->supported_sasl_mechs == NULL) {
-		conn->supported_sasl_mechs = _adcli_ldap_parse_values (ldap, results,
-		                                                       "supportedSASLMechanisms");
+	if (dse && dse->fetched + ROOT_DSE_CACHE_TTL < time (NULL)) {
+		forget_root_dse (host);
+		dse = NULL;
 	}
 
-	ldap_msgfree (results);
+	if (dse == NULL)
+		dse = load_root_dse (host);
+
+	return dse;
+}
+
+/* Read again next time, in case it changed */
+static void
+drop_root_dse (const char *host)
+{
+	char *name;
+
+	forget_root_dse (host);
+
+	name = root_dse_state (host);
+	if (name != NULL)
+		_adcli_state_remove (name);
+	free (name);
+}
+
+static root_dse *
+store_root_dse (const char *host,
+                LDAP *ldap,
+                LDAPMessage *results)
+{
+	root_dse *dse;
+	char *value;
+
+	dse = calloc (1, sizeof (root_dse));
+	return_val_if_fail (dse != NULL, NULL);
+
+	dse->host = strdup (host);
+	dse->fetched = time (NULL);
+	dse->default_naming_context = _adcli_ldap_parse_value (ldap, results,
+	                                                       "defaultNamingContext");
+	dse->configuration_naming_context = _adcli_ldap_parse_value (ldap, results,
+	                                                             "configurationNamingContext");
+	dse->root_domain_naming_context = _adcli_ldap_parse_value (ldap, results,
+	                                                           "rootDomainNamingContext");
+	value = _adcli_ldap_parse_value (ldap, results, "isGlobalCatalogReady");
+	dse->is_global_catalog = value && strcasecmp (value, "TRUE") == 0;
+	free (value);
+	dse->capabilities = _adcli_ldap_parse_values (ldap, results, "supportedCapabilities");
+	dse->sasl_mechs = _adcli_ldap_parse_values (ldap, results, "supportedSASLMechanisms");
+
+	dse = remember_root_dse (dse);
+	if (dse != NULL)
+		save_root_dse (dse);
+	return dse;
+}
+
+static void
+apply_root_dse (adcli_conn *conn,
+                root_dse *dse)
+{
+	if (conn->default_naming_context == NULL)
+		conn->default_naming_context = dse->default_naming_context ?
+		                               strdup (dse->default_naming_context) : NULL;
+
+	if (conn->configuration_naming_context == NULL)
+		conn->configuration_naming_context = dse->configuration_naming_context ?
+		                                     strdup (dse->configuration_naming_context) : NULL;
+
+	if (conn->root_domain_naming_context == NULL)
+		conn->root_domain_naming_context = dse->root_domain_naming_context ?
+		                                   strdup (dse->root_domain_naming_context) : NULL;
+
+	conn->is_global_catalog = dse->is_global_catalog;
+
+	if (conn->supported_capabilities == NULL)
+		conn->supported_capabilities = _adcli_strv_dup (dse->capabilities);
+
+	if (conn->supported_sasl_mechs == NULL)
+		conn->supported_sasl_mechs = _adcli_strv_dup (dse->sasl_mechs);
+
+	conn->capability_bits = known_bits (known_capabilities, conn->supported_capabilities, true);
+	conn->sasl_mech_bits = known_bits (known_sasl_mechs, conn->supported_sasl_mechs, false);
+}
+
+static int
+search_root_dse (adcli_conn *conn,
+                 LDAP *ldap,
+                 char **attrs,
+                 LDAPMessage **results)
+{
+	double started;
+	int msgid;
+	int ret;
+
+	*results = NULL;
+	started = _adcli_trace_clock ();
+
+	ret = ldap_search_ext (ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+	                       attrs, 0, NULL, NULL, NULL, -1, &msgid);
+	if (ret != LDAP_SUCCESS)
+		return ret;
+
+	pump_early_login (conn, ldap);
+	return _adcli_ldap_wait_for_result (ldap, "search", "", msgid, NULL, results, started);
+}
+
+static adcli_result
+prepare_ldap_options (LDAP *ldap)
+{
+	int ver;
+
+	ver = LDAP_VERSION3;
+	if (ldap_set_option (ldap, LDAP_OPT_PROTOCOL_VERSION, &ver) != 0)
+		return_unexpected_if_reached ();
+
+	if (ldap_set_option (ldap, LDAP_OPT_REFERRALS, LDAP_OPT_OFF) != 0)
+		return_unexpected_if_reached ();
+
+	/* Don't force GSSAPI to use reverse DNS */
+	if (ldap_set_option (ldap, LDAP_OPT_X_SASL_NOCANON, LDAP_OPT_ON) != 0)
+		return_unexpected_if_reached ();
+
+	return ADCLI_SUCCESS;
+}
+
+/* Takes over the connection once the root DSE has been read */
+static adcli_result
+use_directory (adcli_conn *conn,
+               adcli_disco *disco,
+               const char *canonical_host,
+               LDAP *ldap,
+               root_dse *dse)
+{
+	if (dse != NULL)
+		apply_root_dse (conn, dse);
 
 	if (conn->default_naming_context == NULL) {
 		_adcli_err ("No valid LDAP naming context on domain controller: %s", disco->host_addr);
@@ -970,11 +1826,82 @@ connect_and_lookup_naming (adcli_conn *conn,
 	conn->canonical_host = strdup (canonical_host);
 	return_unexpected_if_fail (conn->canonical_host != NULL);
 
-	adcli_conn_set_domain_controller (conn, disco->host_addr);
+	/* The other controllers found are kept around for reconnecting */
+	_adcli_str_set (&conn->domain_controller, disco->host_addr);
+	conn->last_checked = time (NULL);
 
 	return ADCLI_SUCCESS;
 }
 
+static char *root_dse_attrs[] = {
+	"defaultNamingContext",
+	"configurationNamingContext",
+	"rootDomainNamingContext",
+	"isGlobalCatalogReady",
+	"supportedCapabilities",
+	"supportedSASLMechanisms",
+	NULL
+};
+
+static adcli_result
+connect_and_lookup_naming (adcli_conn *conn,
+                           adcli_disco *disco)
+{
+	char *canonical_host;
+	LDAPMessage *results;
+	_adcli_phase phase;
+	adcli_result res;
+	root_dse *dse;
+	LDAP *ldap;
+	int ret;
+
+	assert (conn->ldap == NULL);
+
+	canonical_host = disco->host_name;
+	if (!canonical_host)
+		canonical_host = disco->host_addr;
+
+	begin_early_login (conn, disco->host_addr, canonical_host);
+
+	_adcli_phase_begin (&phase, "connect", disco->host_addr);
+	ldap = connect_to_address (disco->host_addr, canonical_host,
+	                           adcli_conn_get_use_ldaps (conn), false);
+	if (ldap == NULL)
+		return _adcli_phase_end (&phase, ADCLI_ERR_DIRECTORY);
+	_adcli_phase_end (&phase, ADCLI_SUCCESS);
+
+	res = prepare_ldap_options (ldap);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	/*
+	 * We perform this lookup whether or not we want to lookup the
+	 * naming context, as it also connects to the LDAP server. When
+	 * the controller's answer is remembered, the bind checks the
+	 * connection instead.
+	 */
+	dse = lookup_root_dse (disco->host_addr);
+	if (dse != NULL) {
+		_adcli_info ("Using remembered root DSE of %s", disco->host_addr);
+
+	} else {
+		_adcli_phase_begin (&phase, "rootdse", disco->host_addr);
+		ret = search_root_dse (conn, ldap, root_dse_attrs, &results);
+		if (ret != LDAP_SUCCESS) {
+			res = _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
+			                                  "Couldn't connect to LDAP server: %s", disco->host_addr);
+			ldap_unbind_ext_s (ldap, NULL, NULL);
+			return _adcli_phase_end (&phase, res);
+		}
+		_adcli_phase_end (&phase, ADCLI_SUCCESS);
+
+		dse = store_root_dse (disco->host_addr, ldap, results);
+		ldap_msgfree (results);
+	}
+
+	return use_directory (conn, disco, canonical_host, ldap, dse);
+}
+
 static int
 sasl_interact (LDAP *ld,
                unsigned flags,
@@ -1057,6 +1984,7 @@ connect_to_directory (adcli_conn *conn)
 		res = connect_and_lookup_naming (conn, disco);
 		if (res == ADCLI_SUCCESS || res == ADCLI_ERR_UNEXPECTED)
 			return res;
+		abandon_early_login (conn);
 		had_any = 1;
 	}
 
@@ -1068,54 +1996,53 @@ connect_to_directory (adcli_conn *conn)
 	return res;
 }
 
-static adcli_result
-authenticate_to_directory (adcli_conn *conn)
+/* Sets up the security layer, and returns the SASL mechanism to bind with */
+static const char *
+prepare_bind (adcli_conn *conn,
+              LDAP *ldap)
 {
-	OM_uint32 status;
-	OM_uint32 minor;
+	const char *mech = "GSSAPI";
 	ber_len_t ssf;
 	int ret;
-	const char *mech = "GSSAPI";
-
-	if (conn->ldap_authenticated)
-		return ADCLI_SUCCESS;
 
-	assert (conn->ldap);
+	assert (ldap);
 	assert (conn->login_ccache_name != NULL);
 
-	/* Sets the credential cache GSSAPI to use (for this thread) */
-	status = gss_krb5_ccache_name (&minor, conn->login_ccache_name, NULL);
-	return_unexpected_if_fail (status == 0);
-
 	if (adcli_conn_get_use_ldaps (conn)) {
 		/* do not use SASL encryption on LDAPS connection */
 		ssf = 0;
-		ret = ldap_set_option (conn->ldap, LDAP_OPT_X_SASL_SSF_MIN, &ssf);
-		return_unexpected_if_fail (ret == 0);
-		ret = ldap_set_option (conn->ldap, LDAP_OPT_X_SASL_SSF_MAX, &ssf);
-		return_unexpected_if_fail (ret == 0);
+		ret = ldap_set_option (ldap, LDAP_OPT_X_SASL_SSF_MIN, &ssf);
+		return_val_if_fail (ret == 0, NULL);
+		ret = ldap_set_option (ldap, LDAP_OPT_X_SASL_SSF_MAX, &ssf);
+		return_val_if_fail (ret == 0, NULL);
 	} else {
 		/* Clumsily tell ldap + cyrus-sasl that we want encryption */
 		ssf = 1;
-		ret = ldap_set_option (conn->ldap, LDAP_OPT_X_SASL_SSF_MIN, &ssf);
-		return_unexpected_if_fail (ret == 0);
+		ret = ldap_set_option (ldap, LDAP_OPT_X_SASL_SSF_MIN, &ssf);
+		return_val_if_fail (ret == 0, NULL);
 	}
 
 	/* There are issues with cryrus-sasl and GSS-SPNEGO with TLS even if
 	 * ssf_max is set to 0. To be on the safe side GSS-SPNEGO is only used
 	 * without LDAPS. */
-	if (adcli_conn_server_has_sasl_mech (conn, "GSS-SPNEGO")
+	if (_adcli_conn_has_sasl_mech (conn, SASL_BIT_GSS_SPNEGO)
 	                     && !adcli_conn_get_use_ldaps (conn)) {
 		mech =  "GSS-SPNEGO";
 	}
 	_adcli_info ("Using %s for SASL bind", mech);
+	return mech;
+}
 
-	ret = ldap_sasl_interactive_bind_s (conn->ldap, NULL, mech, NULL, NULL,
-	                                    LDAP_SASL_QUIET, sasl_interact, NULL);
-
-	/* Clear the credential cache GSSAPI to use (for this thread) */
-	status = gss_krb5_ccache_name (&minor, NULL, NULL);
-	return_unexpected_if_fail (status == 0);
+static adcli_result
+bind_result (adcli_conn *conn,
+             const char *mech,
+             int ret,
+             double started)
+{
+	_adcli_trace ("ldap", "bind", conn->domain_controller, started,
+	              "mechanism", mech,
+	              "result", ldap_err2string (ret),
+	              NULL);
 
 	if (ret != 0) {
 		return _adcli_ldap_handle_failure (conn->ldap, ADCLI_ERR_CREDENTIALS,
@@ -1126,12 +2053,42 @@ authenticate_to_directory (adcli_conn *conn)
 	return ADCLI_SUCCESS;
 }
 
-static void
-lookup_short_name (adcli_conn *conn)
+static adcli_result
+authenticate_to_directory (adcli_conn *conn)
 {
-	char *attrs[] = { "nETBIOSName", NULL, };
-	LDAPMessage *results;
-	char *partition_dn;
+	OM_uint32 status;
+	OM_uint32 minor;
+	const char *mech;
+	double started;
+	int ret;
+
+	if (conn->ldap_authenticated)
+		return ADCLI_SUCCESS;
+
+	mech = prepare_bind (conn, conn->ldap);
+	return_unexpected_if_fail (mech != NULL);
+
+	/* Sets the credential cache GSSAPI to use (for this thread) */
+	status = gss_krb5_ccache_name (&minor, conn->login_ccache_name, NULL);
+	return_unexpected_if_fail (status == 0);
+
+	started = _adcli_trace_clock ();
+	ret = ldap_sasl_interactive_bind_s (conn->ldap, NULL, mech, NULL, NULL,
+	                                    LDAP_SASL_QUIET, sasl_interact, NULL);
+
+	/* Clear the credential cache GSSAPI to use (for this thread) */
+	status = gss_krb5_ccache_name (&minor, NULL, NULL);
+	return_unexpected_if_fail (status == 0);
+
+	return bind_result (conn, mech, ret, started);
+}
+
+static void
+lookup_short_name (adcli_conn *conn)
+{
+	char *attrs[] = { "nETBIOSName", NULL, };
+	LDAPMessage *results;
+	char *partition_dn;
 	char *value;
 	char *filter;
 	int ret;
@@ -1148,8 +2105,8 @@ lookup_short_name (adcli_conn *conn)
 	if (asprintf (&filter, "(&(nCName=%s)(nETBIOSName=*))", value) < 0)
 		return_if_reached ();
 
-	ret = ldap_search_ext_s (conn->ldap, partition_dn, LDAP_SCOPE_ONELEVEL,
-	                         filter, attrs, 0, NULL, NULL, NULL, -1, &results);
+	ret = _adcli_ldap_search_ext_s (conn->ldap, partition_dn, LDAP_SCOPE_ONELEVEL,
+	                                filter, attrs, 0, NULL, NULL, NULL, -1, &results);
 
 	free (partition_dn);
 	free (filter);
@@ -1159,145 +2116,1128 @@ lookup_short_name (adcli_conn *conn)
 		conn->domain_short = _adcli_ldap_parse_value (conn->ldap, results, "nETBIOSName");
 		ldap_msgfree (results);
 
-		if (conn->domain_short)
-			_adcli_info ("Looked up short domain name: %s", conn->domain_short);
-		else
-			_adcli_err ("No short domain name found");
-	} else {
-		_adcli_ldap_handle_failure (conn->ldap, ADCLI_ERR_DIRECTORY,
-		                            "Couldn't lookup domain short name");
+		if (conn->domain_short)
+			_adcli_info ("Looked up short domain name: %s", conn->domain_short);
+		else
+			_adcli_err ("No short domain name found");
+	} else {
+		_adcli_ldap_handle_failure (conn->ldap, ADCLI_ERR_DIRECTORY,
+		                            "Couldn't lookup domain short name");
+	}
+}
+
+static void
+lookup_domain_sid (adcli_conn *conn)
+{
+	char *attrs[] = { "objectSid", NULL, };
+	LDAPMessage *results;
+	int ret;
+
+	free (conn->domain_sid);
+	conn->domain_sid = NULL;
+
+	ret = _adcli_ldap_search_ext_s (conn->ldap, conn->default_naming_context, LDAP_SCOPE_BASE,
+	                                NULL, attrs, 0, NULL, NULL, NULL, -1, &results);
+	if (ret == LDAP_SUCCESS) {
+		conn->domain_sid = _adcli_ldap_parse_sid (conn->ldap, results, "objectSid");
+		ldap_msgfree (results);
+
+		if (conn->domain_sid)
+			_adcli_info ("Looked up domain SID: %s", conn->domain_sid);
+		else
+			_adcli_err ("No domain SID found");
+	} else {
+		_adcli_ldap_handle_failure (conn->ldap, ADCLI_ERR_DIRECTORY,
+		                            "Couldn't lookup domain SID");
+	}
+}
+
+static void
+lookup_is_writeable (adcli_conn *conn)
+{
+	char *attrs[] = { "NetLogon", NULL };
+	LDAPMessage *results;
+	int ret;
+
+	ret = _adcli_ldap_search_ext_s (conn->ldap, "", LDAP_SCOPE_BASE,
+	                                "(&(NtVer=\\06\\00\\00\\00)(AAC=\\00\\00\\00\\00))",
+	                                attrs, 0, NULL, NULL, NULL, -1, &results);
+	if (ret == LDAP_SUCCESS) {
+		conn->is_writeable = disco_get_writeable (conn->ldap, results);
+		ldap_msgfree (results);
+	} else {
+		_adcli_ldap_handle_failure (conn->ldap, ADCLI_ERR_DIRECTORY,
+		                            "Couldn't lookup writeable state");
+		conn->is_writeable = IS_UNKNOWN;
+	}
+}
+
+static void
+lookup_domain_details (adcli_conn *conn)
+{
+	lookup_short_name (conn);
+	lookup_domain_sid (conn);
+	lookup_is_writeable (conn);
+}
+
+/*
+ * The global catalog holds a partial copy of every domain in the forest
+ * and answers on port 3268, or 3269 for LDAPS. It is connected to on
+ * first use, with the login of the domain connection.
+ */
+static adcli_result
+open_global_catalog (adcli_conn *conn,
+                     const char *host,
+                     const char *canonical_host)
+{
+	OM_uint32 status;
+	OM_uint32 minor;
+	_adcli_phase phase;
+	adcli_result res;
+	const char *mech;
+	double started;
+	LDAP *ldap;
+	int ret;
+
+	_adcli_phase_begin (&phase, "gc-connect", host);
+	ldap = connect_to_address (host, canonical_host,
+	                           adcli_conn_get_use_ldaps (conn), true);
+	if (ldap == NULL)
+		return _adcli_phase_end (&phase, ADCLI_ERR_DIRECTORY);
+
+	res = prepare_ldap_options (ldap);
+	if (res != ADCLI_SUCCESS) {
+		ldap_unbind_ext_s (ldap, NULL, NULL);
+		return _adcli_phase_end (&phase, res);
+	}
+
+	mech = prepare_bind (conn, ldap);
+	if (mech == NULL) {
+		ldap_unbind_ext_s (ldap, NULL, NULL);
+		return _adcli_phase_end (&phase, ADCLI_ERR_UNEXPECTED);
+	}
+
+	status = gss_krb5_ccache_name (&minor, conn->login_ccache_name, NULL);
+	return_unexpected_if_fail (status == 0);
+
+	started = _adcli_trace_clock ();
+	ret = ldap_sasl_interactive_bind_s (ldap, NULL, mech, NULL, NULL,
+	                                    LDAP_SASL_QUIET, sasl_interact, NULL);
+	_adcli_trace ("ldap", "bind", host, started,
+	              "mechanism", mech,
+	              "result", ldap_err2string (ret),
+	              NULL);
+
+	status = gss_krb5_ccache_name (&minor, NULL, NULL);
+	return_unexpected_if_fail (status == 0);
+
+	if (ret != 0) {
+		res = _adcli_ldap_handle_failure (ldap, ADCLI_ERR_CREDENTIALS,
+		                                  "Couldn't authenticate to global catalog: %s", host);
+		ldap_unbind_ext_s (ldap, NULL, NULL);
+		return _adcli_phase_end (&phase, res);
+	}
+
+	_adcli_info ("Using global catalog on %s", host);
+	conn->gc_ldap = ldap;
+	return _adcli_phase_end (&phase, ADCLI_SUCCESS);
+}
+
+static adcli_result
+connect_to_global_catalog (adcli_conn *conn)
+{
+	adcli_result res = ADCLI_ERR_DIRECTORY;
+	char **hosts;
+	char *rrname;
+	char *forest;
+	int i;
+
+	if (conn->gc_ldap)
+		return ADCLI_SUCCESS;
+
+	/* The domain controller already in use is often a catalog as well */
+	if (conn->is_global_catalog) {
+		res = open_global_catalog (conn, conn->domain_controller,
+		                           conn->canonical_host);
+		if (res == ADCLI_SUCCESS || res == ADCLI_ERR_UNEXPECTED)
+			return res;
+	}
+
+	forest = _adcli_ldap_dn_to_domain (conn->root_domain_naming_context ?
+	                                   conn->root_domain_naming_context :
+	                                   conn->default_naming_context);
+	if (forest == NULL) {
+		_adcli_err ("Couldn't tell which forest the domain belongs to");
+		return ADCLI_ERR_DIRECTORY;
+	}
+
+	if (asprintf (&rrname, "_gc._tcp.%s", forest) < 0)
+		return_unexpected_if_reached ();
+	free (forest);
+
+	_adcli_info ("Discovering global catalogs: %s", rrname);
+	hosts = _adcli_disco_srv_hosts (rrname);
+	free (rrname);
+
+	for (i = 0; hosts != NULL && hosts[i] != NULL; i++) {
+		res = open_global_catalog (conn, hosts[i], hosts[i]);
+		if (res == ADCLI_SUCCESS || res == ADCLI_ERR_UNEXPECTED)
+			break;
+	}
+
+	if (hosts == NULL)
+		_adcli_err ("Couldn't find a global catalog to connect to");
+	_adcli_strv_free (hosts);
+	return res;
+}
+
+static void
+async_free (async_connect *async)
+{
+	if (async == NULL)
+		return;
+	if (async->sock >= 0)
+		close (async->sock);
+	if (async->ldap)
+		ldap_unbind_ext_s (async->ldap, NULL, NULL);
+	if (async->addrs)
+		freeaddrinfo (async->addrs);
+	free (async);
+}
+
+static void
+conn_clear_state (adcli_conn *conn)
+{
+	conn->ldap_authenticated = 0;
+
+	async_free (conn->async);
+	conn->async = NULL;
+
+	if (conn->ldap)
+		ldap_unbind_ext_s (conn->ldap, NULL, NULL);
+	conn->ldap = NULL;
+
+	if (conn->gc_ldap)
+		ldap_unbind_ext_s (conn->gc_ldap, NULL, NULL);
+	conn->gc_ldap = NULL;
+
+	free (conn->canonical_host);
+	conn->canonical_host = NULL;
+
+	if (conn->ccache)
+		krb5_cc_close (conn->k5, conn->ccache);
+	conn->ccache = NULL;
+
+	if (conn->keytab)
+		krb5_kt_close (conn->k5, conn->keytab);
+	conn->keytab = NULL;
+
+	if (conn->early_login)
+		free_early_login (conn, conn->early_login);
+	conn->early_login = NULL;
+
+	if (conn->k5)
+		krb5_free_context (conn->k5);
+	conn->k5 = NULL;
+}
+
+adcli_result
+adcli_conn_discover (adcli_conn *conn)
+{
+	adcli_result res = ADCLI_SUCCESS;
+	_adcli_phase phase;
+
+	return_unexpected_if_fail (conn != NULL);
+
+	adcli_clear_last_error ();
+	_adcli_phase_begin (&phase, "discover", NULL);
+
+	/* Basic discovery and figuring out conn params */
+	res = ensure_host_fqdn (res, conn);
+	res = ensure_domain_and_host (res, conn);
+	res = ensure_computer_name (res, conn);
+	res = ensure_domain_realm (res, conn);
+
+	/* The domain is usually only known once discovery is done */
+	phase.detail = conn->domain_name;
+	return _adcli_phase_end (&phase, res);
+}
+
+static bool
+conn_is_alive (adcli_conn *conn)
+{
+	struct pollfd pfd = { -1, POLLIN, 0 };
+
+	if (ldap_get_option (conn->ldap, LDAP_OPT_DESC, &pfd.fd) != LDAP_OPT_SUCCESS ||
+	    pfd.fd < 0)
+		return false;
+
+	/*
+	 * No operation is outstanding between calls, so anything readable
+	 * here is a notice of disconnection or the server closing the socket.
+	 */
+	return poll (&pfd, 1, 0) == 0;
+}
+
+/*
+ * AD drops LDAP sessions that are idle for 15 minutes by default. A
+ * connection that hasn't been checked in a while gets a quick root DSE
+ * read before it is reused, which also counts as activity.
+ */
+#define PROBE_AFTER   60
+#define PROBE_TIMEOUT 5
+
+static bool
+probe_connection (adcli_conn *conn)
+{
+	struct timeval timeout = { PROBE_TIMEOUT, 0 };
+	char *attrs[] = { "currentTime", NULL };
+	LDAPMessage *results = NULL;
+	int ret;
+
+	ret = _adcli_ldap_search_ext_s (conn->ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+	                                attrs, 0, NULL, NULL, &timeout, -1, &results);
+	ldap_msgfree (results);
+
+	if (ret != LDAP_SUCCESS)
+		return false;
+
+	conn->last_checked = time (NULL);
+	return true;
+}
+
+static bool
+conn_is_usable (adcli_conn *conn)
+{
+	if (!conn->ldap_authenticated || !conn_is_alive (conn))
+		return false;
+	if (time (NULL) - conn->last_checked < PROBE_AFTER)
+		return true;
+	return probe_connection (conn);
+}
+
+/* Logins are made again this long before they run out */
+#define LOGIN_MARGIN 300
+
+static bool
+login_still_valid (adcli_conn *conn)
+{
+	krb5_principal server = NULL;
+	krb5_creds mcreds;
+	krb5_creds creds;
+	bool valid = false;
+
+	if (conn->k5 == NULL || conn->ccache == NULL || conn->domain_realm == NULL)
+		return false;
+
+	memset (&mcreds, 0, sizeof (mcreds));
+	memset (&creds, 0, sizeof (creds));
+
+	if (krb5_cc_get_principal (conn->k5, conn->ccache, &mcreds.client) != 0)
+		return false;
+
+	if (krb5_build_principal (conn->k5, &server, strlen (conn->domain_realm),
+	                          conn->domain_realm, KRB5_TGS_NAME,
+	                          conn->domain_realm, NULL) == 0) {
+		mcreds.server = server;
+		if (krb5_cc_retrieve_cred (conn->k5, conn->ccache, 0, &mcreds, &creds) == 0) {
+			valid = (creds.times.endtime > time (NULL) + LOGIN_MARGIN);
+			krb5_free_cred_contents (conn->k5, &creds);
+		}
+	}
+
+	krb5_free_principal (conn->k5, server);
+	krb5_free_principal (conn->k5, mcreds.client);
+	return valid;
+}
+
+/* Try the controller that went away only after the others */
+static void
+demote_controller (adcli_conn *conn,
+                   const char *host)
+{
+	adcli_disco **at;
+	adcli_disco *disco;
+
+	if (host == NULL)
+		return;
+
+	for (at = &conn->domain_disco; *at != NULL; at = &(*at)->next) {
+		if (strcmp ((*at)->host_addr, host) == 0)
+			break;
+	}
+
+	if (*at == NULL || (*at)->next == NULL)
+		return;
+
+	disco = *at;
+	*at = disco->next;
+	while (*at != NULL)
+		at = &(*at)->next;
+	*at = disco;
+	disco->next = NULL;
+}
+
+/*
+ * Tears down a connection that went away. The Kerberos login made for it
+ * is kept while still valid, the next connect picks its ccache up again.
+ */
+static void
+conn_drop_connection (adcli_conn *conn)
+{
+	_adcli_info ("Connection to %s is no longer usable, reconnecting",
+	             conn->domain_controller);
+
+	if (conn->own_login && !login_still_valid (conn)) {
+		_adcli_info ("Kerberos login is about to expire, logging in again");
+		if (conn->ccache) {
+			krb5_cc_destroy (conn->k5, conn->ccache);
+			conn->ccache = NULL;
+		}
+		adcli_conn_set_login_ccache_name (conn, NULL);
+	}
+
+	demote_controller (conn, conn->domain_controller);
+
+	/* The snippet pins the KDC and kpasswd to the controller that went away */
+	clear_krb5_conf_snippet (conn);
+	conn_clear_state (conn);
+}
+
+/* Only failures of the connection itself are worth another go */
+static bool
+connection_failed (adcli_conn *conn,
+                   adcli_result res)
+{
+	int code = LDAP_SUCCESS;
+
+	if (res != ADCLI_ERR_DIRECTORY || conn->ldap == NULL)
+		return false;
+
+	if (ldap_get_option (conn->ldap, LDAP_OPT_RESULT_CODE, &code) != 0)
+		code = LDAP_SUCCESS;
+
+	if (code == LDAP_SERVER_DOWN || code == LDAP_UNAVAILABLE ||
+	    code == LDAP_CONNECT_ERROR || code == LDAP_TIMEOUT)
+		return true;
+
+	return !conn_is_alive (conn);
+}
+
+bool
+_adcli_conn_retry (adcli_conn *conn,
+                   adcli_result res)
+{
+	if (!connection_failed (conn, res))
+		return false;
+
+	conn_drop_connection (conn);
+	_adcli_info ("Trying again after reconnecting");
+	return adcli_conn_connect (conn) == ADCLI_SUCCESS;
+}
+
+adcli_result
+adcli_conn_probe (adcli_conn *conn)
+{
+	return_unexpected_if_fail (conn != NULL);
+
+	if (conn->ldap == NULL || !conn->ldap_authenticated)
+		return ADCLI_ERR_DIRECTORY;
+
+	if (!conn_is_alive (conn) || !probe_connection (conn))
+		return ADCLI_ERR_DIRECTORY;
+
+	return ADCLI_SUCCESS;
+}
+
+adcli_result
+adcli_conn_locate_in_forest (adcli_conn *conn,
+                             const char *filter,
+                             char **dn,
+                             char **domain)
+{
+	char *attrs[] = { "1.1", NULL };
+	LDAPMessage *results = NULL;
+	LDAPMessage *entry;
+	adcli_result res;
+	char *value;
+	int ret;
+
+	return_unexpected_if_fail (conn != NULL);
+	return_unexpected_if_fail (filter != NULL);
+	return_unexpected_if_fail (dn != NULL);
+
+	*dn = NULL;
+	if (domain)
+		*domain = NULL;
+
+	res = adcli_conn_connect (conn);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	res = connect_to_global_catalog (conn);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	/* An empty base covers every domain in the catalog, two is enough to see a clash */
+	ret = _adcli_ldap_search_ext_s (conn->gc_ldap, "", LDAP_SCOPE_SUB, filter, attrs,
+	                                0, NULL, NULL, NULL, 2, &results);
+	if (ret != LDAP_SUCCESS && ret != LDAP_SIZELIMIT_EXCEEDED) {
+		ldap_msgfree (results);
+		return _adcli_ldap_handle_failure (conn->gc_ldap, ADCLI_ERR_DIRECTORY,
+		                                   "Couldn't search global catalog");
+	}
+
+	entry = ldap_first_entry (conn->gc_ldap, results);
+	if (entry == NULL) {
+		_adcli_info ("Nothing in the global catalog matches: %s", filter);
+		ldap_msgfree (results);
+		return ADCLI_SUCCESS;
+	}
+
+	if (ldap_next_entry (conn->gc_ldap, entry) != NULL) {
+		_adcli_err ("More than one entry in the forest matches: %s", filter);
+		ldap_msgfree (results);
+		return ADCLI_ERR_CONFIG;
+	}
+
+	value = ldap_get_dn (conn->gc_ldap, entry);
+	ldap_msgfree (results);
+	return_unexpected_if_fail (value != NULL);
+
+	*dn = strdup (value);
+	ldap_memfree (value);
+	return_unexpected_if_fail (*dn != NULL);
+
+	if (domain) {
+		*domain = _adcli_ldap_dn_to_domain (*dn);
+		if (*domain == NULL) {
+			_adcli_err ("Couldn't tell which domain holds: %s", *dn);
+			free (*dn);
+			*dn = NULL;
+			return ADCLI_ERR_DIRECTORY;
+		}
+	}
+
+	_adcli_info ("Found %s in the global catalog", *dn);
+	return ADCLI_SUCCESS;
+}
+
+adcli_result
+adcli_conn_move_to_domain (adcli_conn *conn,
+                           const char *domain)
+{
+	return_unexpected_if_fail (conn != NULL);
+	return_unexpected_if_fail (domain != NULL);
+
+	if (conn->domain_name && strcasecmp (conn->domain_name, domain) == 0)
+		return adcli_conn_connect (conn);
+
+	_adcli_info ("Moving to domain %s", domain);
+
+	/* The login stays, it is good across the trusts within the forest */
+	conn_clear_state (conn);
+	no_more_disco (conn);
+
+	_adcli_str_set (&conn->domain_name, domain);
+	_adcli_str_set (&conn->domain_realm, NULL);
+	_adcli_str_set (&conn->domain_controller, NULL);
+	_adcli_str_set (&conn->domain_short, NULL);
+	_adcli_str_set (&conn->domain_sid, NULL);
+	_adcli_str_set (&conn->default_naming_context, NULL);
+	_adcli_str_set (&conn->configuration_naming_context, NULL);
+	_adcli_strv_free (conn->supported_capabilities);
+	conn->supported_capabilities = NULL;
+	_adcli_strv_free (conn->supported_sasl_mechs);
+	conn->supported_sasl_mechs = NULL;
+	conn->is_writeable = IS_UNKNOWN;
+
+	return adcli_conn_connect (conn);
+}
+
+adcli_result
+adcli_conn_connect (adcli_conn *conn)
+{
+	adcli_result res = ADCLI_SUCCESS;
+	_adcli_phase phase;
+
+	return_unexpected_if_fail (conn != NULL);
+
+	/* Connecting again reuses a live session, or reconnects */
+	if (conn->ldap) {
+		if (conn_is_usable (conn))
+			return ADCLI_SUCCESS;
+		conn_drop_connection (conn);
+	}
+
+	res = adcli_conn_discover (conn);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	/* - Connect to LDAP server */
+	res = connect_to_directory (conn);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	/* Already set up if the login was started alongside the connect */
+	if (conn->k5 == NULL) {
+		res = init_krb5_context (conn, conn->domain_controller, conn->canonical_host);
+		if (res != ADCLI_SUCCESS)
+			return res;
+	}
+
+	/* Login with admin credentials now, setup login ccache */
+	_adcli_phase_begin (&phase, "kinit", conn->domain_realm);
+	res = _adcli_phase_end (&phase, prep_kerberos_and_kinit (conn));
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	/* - And finally authenticate */
+	_adcli_phase_begin (&phase, "sasl-bind", conn->domain_controller);
+	res = _adcli_phase_end (&phase, authenticate_to_directory (conn));
+	if (res != ADCLI_SUCCESS) {
+		/* The root DSE is read again next time, in case it changed */
+		drop_root_dse (conn->domain_controller);
+		return res;
+	}
+
+	lookup_domain_details (conn);
+	return ADCLI_SUCCESS;
+}
+
+/*
+ * The non-blocking connect below goes through the same steps as
+ * adcli_conn_connect(), but returns to the caller whenever it would wait
+ * on the network: for the TCP connect, the root DSE, the AS exchange of
+ * the first login and each round of the SASL bind.
+ *
+ * Discovery still happens inside adcli_conn_connect_start(), and the TLS
+ * handshake, logins that need the Kerberos library's own KDC lookup and
+ * the domain lookups after the bind happen inside a step.
+ */
+
+static adcli_result async_next_controller (adcli_conn *conn,
+                                           bool failed);
+
+static const char *
+async_canonical_host (adcli_disco *disco)
+{
+	return disco->host_name ? disco->host_name : disco->host_addr;
+}
+
+static adcli_result
+async_bind_round (adcli_conn *conn,
+                  LDAPMessage *message)
+{
+	async_connect *async = conn->async;
+	OM_uint32 status;
+	OM_uint32 minor;
+	adcli_result res;
+	int ret;
+
+	/* Sets the credential cache GSSAPI to use (for this thread) */
+	status = gss_krb5_ccache_name (&minor, conn->login_ccache_name, NULL);
+	return_unexpected_if_fail (status == 0);
+
+	ret = ldap_sasl_interactive_bind (conn->ldap, NULL, async->mech, NULL, NULL,
+	                                  LDAP_SASL_QUIET, sasl_interact, NULL,
+	                                  message, &async->rmech, &async->msgid);
+
+	/* Clear the credential cache GSSAPI to use (for this thread) */
+	status = gss_krb5_ccache_name (&minor, NULL, NULL);
+	return_unexpected_if_fail (status == 0);
+
+	if (ret == LDAP_SASL_BIND_IN_PROGRESS) {
+		async->state = ASYNC_BIND;
+		return ADCLI_IN_PROGRESS;
+	}
+
+	res = _adcli_phase_end (&async->phase, bind_result (conn, async->mech, ret, async->started));
+	if (res != ADCLI_SUCCESS) {
+		/* The root DSE is read again next time, in case it changed */
+		drop_root_dse (conn->domain_controller);
+		return res;
+	}
+
+	lookup_domain_details (conn);
+	return ADCLI_SUCCESS;
+}
+
+static adcli_result
+async_begin_bind (adcli_conn *conn)
+{
+	async_connect *async = conn->async;
+	_adcli_phase phase;
+	adcli_result res;
+
+	if (conn->k5 == NULL) {
+		res = init_krb5_context (conn, conn->domain_controller, conn->canonical_host);
+		if (res != ADCLI_SUCCESS)
+			return res;
+	}
+
+	_adcli_phase_begin (&phase, "kinit", conn->domain_realm);
+	res = _adcli_phase_end (&phase, prep_kerberos_and_kinit (conn));
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	async->mech = prepare_bind (conn, conn->ldap);
+	return_unexpected_if_fail (async->mech != NULL);
+
+	_adcli_phase_begin (&async->phase, "sasl-bind", conn->domain_controller);
+	async->started = _adcli_trace_clock ();
+	async->rmech = NULL;
+	return async_bind_round (conn, NULL);
+}
+
+static adcli_result
+async_use_root_dse (adcli_conn *conn,
+                    root_dse *dse)
+{
+	async_connect *async = conn->async;
+	adcli_result res;
+	LDAP *ldap;
+
+	ldap = async->ldap;
+	async->ldap = NULL;
+
+	res = use_directory (conn, async->disco, async_canonical_host (async->disco), ldap, dse);
+	if (res == ADCLI_ERR_UNEXPECTED)
+		return res;
+	if (res != ADCLI_SUCCESS)
+		return async_next_controller (conn, true);
+
+	/* Wait for the login started alongside the connection */
+	if (conn->early_login && !_adcli_krb5_as_process (conn->early_login->as)) {
+		async->state = ASYNC_LOGIN;
+		return ADCLI_IN_PROGRESS;
+	}
+
+	return async_begin_bind (conn);
+}
+
+static adcli_result
+async_root_dse_failed (adcli_conn *conn)
+{
+	async_connect *async = conn->async;
+	adcli_result res;
+
+	res = _adcli_ldap_handle_failure (async->ldap, ADCLI_ERR_DIRECTORY,
+	                                  "Couldn't connect to LDAP server: %s",
+	                                  async->disco->host_addr);
+	_adcli_phase_end (&async->phase, res);
+	ldap_unbind_ext_s (async->ldap, NULL, NULL);
+	async->ldap = NULL;
+	return async_next_controller (conn, true);
+}
+
+static adcli_result
+async_root_dse_step (adcli_conn *conn)
+{
+	async_connect *async = conn->async;
+	LDAPMessage *results = NULL;
+	root_dse *dse;
+	bool done;
+	int ret;
+
+	ret = _adcli_ldap_check_result (async->ldap, "search", "", async->msgid,
+	                                &results, async->started, &done);
+	if (!done)
+		return ADCLI_IN_PROGRESS;
+
+	if (ret != LDAP_SUCCESS) {
+		ldap_msgfree (results);
+		return async_root_dse_failed (conn);
+	}
+
+	_adcli_phase_end (&async->phase, ADCLI_SUCCESS);
+	dse = store_root_dse (async->disco->host_addr, async->ldap, results);
+	ldap_msgfree (results);
+	return async_use_root_dse (conn, dse);
+}
+
+static adcli_result
+async_connected (adcli_conn *conn)
+{
+	async_connect *async = conn->async;
+	adcli_disco *disco = async->disco;
+	adcli_result res;
+	root_dse *dse;
+	int flags;
+	int sock;
+	int ret;
+
+	/* The rest of libldap expects a blocking socket */
+	sock = async->sock;
+	async->sock = -1;
+	flags = fcntl (sock, F_GETFL);
+	if (flags >= 0)
+		fcntl (sock, F_SETFL, flags & ~O_NONBLOCK);
+
+	async->ldap = ldap_on_socket (sock, disco->host_addr, async_canonical_host (disco),
+	                              adcli_conn_get_use_ldaps (conn));
+	if (async->ldap == NULL) {
+		_adcli_phase_end (&async->phase, ADCLI_ERR_DIRECTORY);
+		return async_next_controller (conn, true);
+	}
+	_adcli_phase_end (&async->phase, ADCLI_SUCCESS);
+
+	res = prepare_ldap_options (async->ldap);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	dse = lookup_root_dse (disco->host_addr);
+	if (dse != NULL) {
+		_adcli_info ("Using remembered root DSE of %s", disco->host_addr);
+		return async_use_root_dse (conn, dse);
 	}
+
+	_adcli_phase_begin (&async->phase, "rootdse", disco->host_addr);
+	async->started = _adcli_trace_clock ();
+	ret = ldap_search_ext (async->ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+	                       root_dse_attrs, 0, NULL, NULL, NULL, -1, &async->msgid);
+	if (ret != LDAP_SUCCESS)
+		return async_root_dse_failed (conn);
+
+	async->state = ASYNC_ROOT_DSE;
+	return ADCLI_IN_PROGRESS;
 }
 
 static void
-lookup_domain_sid (adcli_conn *conn)
+async_trace_tcp (adcli_conn *conn,
+                 int error)
 {
-	char *attrs[] = { "objectSid", NULL, };
-	LDAPMessage *results;
-	int ret;
+	async_connect *async = conn->async;
+	char address[NI_MAXHOST];
 
-	free (conn->domain_sid);
-	conn->domain_sid = NULL;
+	if (getnameinfo (async->addr->ai_addr, async->addr->ai_addrlen, address,
+	                 sizeof (address), NULL, 0, NI_NUMERICHOST) != 0)
+		address[0] = '\0';
 
-	ret = ldap_search_ext_s (conn->ldap, conn->default_naming_context, LDAP_SCOPE_BASE,
-	                         NULL, attrs, 0, NULL, NULL, NULL, -1, &results);
-	if (ret == LDAP_SUCCESS) {
-		conn->domain_sid = _adcli_ldap_parse_sid (conn->ldap, results, "objectSid");
-		ldap_msgfree (results);
+	_adcli_trace ("tcp", "connect", async->disco->host_addr, async->started,
+	              "address", address,
+	              "port", adcli_conn_get_use_ldaps (conn) ? "636" : "389",
+	              "result", error ? strerror (error) : "Success",
+	              NULL);
+}
 
-		if (conn->domain_sid)
-			_adcli_info ("Looked up domain SID: %s", conn->domain_sid);
-		else
-			_adcli_err ("No domain SID found");
-	} else {
-		_adcli_ldap_handle_failure (conn->ldap, ADCLI_ERR_DIRECTORY,
-		                            "Couldn't lookup domain SID");
+static adcli_result
+async_try_address (adcli_conn *conn)
+{
+	async_connect *async = conn->async;
+	struct addrinfo *ai;
+	int sock;
+
+	for (; async->addr != NULL; async->addr = async->addr->ai_next) {
+		ai = async->addr;
+		async->started = _adcli_trace_clock ();
+		sock = socket (ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		               ai->ai_protocol);
+		if (sock < 0) {
+			async->error = errno;
+			async_trace_tcp (conn, async->error);
+			continue;
+		}
+
+		if (connect (sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+			async_trace_tcp (conn, 0);
+			async->sock = sock;
+			return async_connected (conn);
+		}
+
+		if (errno == EINPROGRESS) {
+			async->sock = sock;
+			async->deadline = adcli_phase_clock () + CONNECT_TIMEOUT;
+			async->state = ASYNC_TCP;
+			return ADCLI_IN_PROGRESS;
+		}
+
+		async->error = errno;
+		async_trace_tcp (conn, async->error);
+		close (sock);
 	}
+
+	_adcli_err ("Couldn't connect to host: %s: %s", async->disco->host_addr,
+	            strerror (async->error ? async->error : ECONNREFUSED));
+	_adcli_phase_end (&async->phase, ADCLI_ERR_DIRECTORY);
+	return async_next_controller (conn, true);
 }
 
-static void
-lookup_is_writeable (adcli_conn *conn)
+static adcli_result
+async_tcp_step (adcli_conn *conn)
 {
-	char *attrs[] = { "NetLogon", NULL };
-	LDAPMessage *results;
-	int ret;
+	async_connect *async = conn->async;
+	struct pollfd pfd = { async->sock, POLLOUT, 0 };
+	socklen_t len;
+	int error = 0;
 
-	ret = ldap_search_ext_s (conn->ldap, "", LDAP_SCOPE_BASE,
-	                         "(&(NtVer=\\06\\00\\00\\00)(AAC=\\00\\00\\00\\00))",
-	                         attrs, 0, NULL, NULL, NULL, -1, &results);
-	if (ret == LDAP_SUCCESS) {
-		conn->is_writeable = disco_get_writeable (conn->ldap, results);
-		ldap_msgfree (results);
+	if (poll (&pfd, 1, 0) == 0) {
+		if (adcli_phase_clock () < async->deadline)
+			return ADCLI_IN_PROGRESS;
+		error = ETIMEDOUT;
 	} else {
-		_adcli_ldap_handle_failure (conn->ldap, ADCLI_ERR_DIRECTORY,
-		                            "Couldn't lookup writeable state");
-		conn->is_writeable = IS_UNKNOWN;
+		len = sizeof (error);
+		if (getsockopt (async->sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+			error = errno;
 	}
+
+	async_trace_tcp (conn, error);
+	async->deadline = 0;
+
+	if (error == 0)
+		return async_connected (conn);
+
+	async->error = error;
+	close (async->sock);
+	async->sock = -1;
+	async->addr = async->addr->ai_next;
+	return async_try_address (conn);
 }
 
-static void
-conn_clear_state (adcli_conn *conn)
+static adcli_result
+async_next_controller (adcli_conn *conn,
+                       bool failed)
 {
-	conn->ldap_authenticated = 0;
+	async_connect *async = conn->async;
+	struct addrinfo hints;
+	adcli_disco *disco;
+	const char *port;
+	int rc;
 
-	if (conn->ldap)
-		ldap_unbind_ext_s (conn->ldap, NULL, NULL);
-	conn->ldap = NULL;
+	if (async->addrs)
+		freeaddrinfo (async->addrs);
+	async->addrs = async->addr = NULL;
 
-	free (conn->canonical_host);
-	conn->canonical_host = NULL;
+	if (failed) {
+		abandon_early_login (conn);
+		async->had_any = true;
+		async->disco = async->disco->next;
+	}
 
-	if (conn->ccache)
-		krb5_cc_close (conn->k5, conn->ccache);
-	conn->ccache = NULL;
+	while (async->disco && !adcli_disco_usable (async->disco))
+		async->disco = async->disco->next;
 
-	if (conn->keytab)
-		krb5_kt_close (conn->k5, conn->keytab);
-	conn->keytab = NULL;
+	if (async->disco == NULL) {
+		if (async->had_any)
+			return ADCLI_ERR_DIRECTORY;
+		_adcli_err ("Couldn't find usable domain controller to connect to");
+		return ADCLI_ERR_CONFIG;
+	}
 
-	if (conn->k5)
-		krb5_free_context (conn->k5);
-	conn->k5 = NULL;
-}
+	disco = async->disco;
+	begin_early_login (conn, disco->host_addr, async_canonical_host (disco));
 
-adcli_result
-adcli_conn_discover (adcli_conn *conn)
-{
-	adcli_result res = ADCLI_SUCCESS;
+	_adcli_phase_begin (&async->phase, "connect", disco->host_addr);
 
-	return_unexpected_if_fail (conn != NULL);
+	port = "389";
+	if (adcli_conn_get_use_ldaps (conn)) {
+		port = "636";
+		_adcli_info ("Using LDAPS to connect to %s", disco->host_addr);
+	}
 
-	adcli_clear_last_error ();
+	memset (&hints, 0, sizeof (hints));
+#ifdef AI_ADDRCONFIG
+	hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
 
-	/* Basic discovery and figuring out conn params */
-	res = ensure_host_fqdn (res, conn);
-	res = ensure_domain_and_host (res, conn);
-	res = ensure_computer_name (res, conn);
-	res = ensure_domain_realm (res, conn);
+	rc = getaddrinfo (disco->host_addr, port, &hints, &async->addrs);
+	if (rc != 0) {
+		async->addrs = NULL;
+		_adcli_err ("Couldn't resolve host name: %s: %s", disco->host_addr, gai_strerror (rc));
+		_adcli_phase_end (&async->phase, ADCLI_ERR_DIRECTORY);
+		return async_next_controller (conn, true);
+	}
 
+	async->addr = async->addrs;
+	async->error = 0;
+	return async_try_address (conn);
+}
+
+/* Called with every result, and lets go of anything not needed when done */
+static adcli_result
+async_settle (adcli_conn *conn,
+              adcli_result res)
+{
+	async_connect *async = conn->async;
+
+	if (res == ADCLI_IN_PROGRESS || async == NULL)
+		return res;
+
+	if (async->sock >= 0)
+		close (async->sock);
+	async->sock = -1;
+	if (async->ldap)
+		ldap_unbind_ext_s (async->ldap, NULL, NULL);
+	async->ldap = NULL;
+	if (async->addrs)
+		freeaddrinfo (async->addrs);
+	async->addrs = async->addr = NULL;
+
+	async->state = ASYNC_DONE;
+	async->result = res;
 	return res;
 }
 
 adcli_result
-adcli_conn_connect (adcli_conn *conn)
+adcli_conn_connect_start (adcli_conn *conn)
 {
-	adcli_result res = ADCLI_SUCCESS;
+	adcli_result res;
 
 	return_unexpected_if_fail (conn != NULL);
 
+	async_free (conn->async);
+	conn->async = NULL;
+
+	/* Connecting again reuses a live session, or reconnects */
+	if (conn->ldap) {
+		if (conn_is_usable (conn))
+			return ADCLI_SUCCESS;
+		conn_drop_connection (conn);
+	}
+
 	res = adcli_conn_discover (conn);
 	if (res != ADCLI_SUCCESS)
 		return res;
 
-	/* - Connect to LDAP server */
-	res = connect_to_directory (conn);
-	if (res != ADCLI_SUCCESS)
-		return res;
+	disco_dance_if_necessary (conn);
 
-	/* Guarantee consistency and communication with one dc */
-	res = setup_krb5_conf_snippet (conn);
-	if (res != ADCLI_SUCCESS)
-		return res;
+	if (!conn->domain_disco)
+		conn->domain_disco = desperate_for_disco (conn);
 
-	return_unexpected_if_fail (conn->k5 == NULL);
-	res = _adcli_krb5_init_context (&conn->k5);
-	if (res != ADCLI_SUCCESS)
-		return res;
+	conn->async = calloc (1, sizeof (async_connect));
+	return_unexpected_if_fail (conn->async != NULL);
+	conn->async->sock = -1;
+	conn->async->disco = conn->domain_disco;
 
-	/* Login with admin credentials now, setup login ccache */
-	res = prep_kerberos_and_kinit (conn);
-	if (res != ADCLI_SUCCESS)
-		return res;
+	return async_settle (conn, async_next_controller (conn, false));
+}
 
-	/* - And finally authenticate */
-	res = authenticate_to_directory (conn);
-	if (res != ADCLI_SUCCESS)
-		return res;
+int
+adcli_conn_connect_fds (adcli_conn *conn,
+                        struct pollfd *fds,
+                        int n_fds,
+                        int *timeout)
+{
+	async_connect *async;
+	double remaining;
+	short events = 0;
+	int count = 0;
+	int fd = -1;
+	int msecs;
+
+	return_val_if_fail (conn != NULL, -1);
+	return_val_if_fail (fds != NULL || n_fds == 0, -1);
+	return_val_if_fail (timeout != NULL, -1);
+
+	*timeout = -1;
+	async = conn->async;
+	if (async == NULL || async->state == ASYNC_DONE) {
+		*timeout = 0;
+		return 0;
+	}
 
-	lookup_short_name (conn);
-	lookup_domain_sid (conn);
-	lookup_is_writeable (conn);
-	return ADCLI_SUCCESS;
+	switch (async->state) {
+	case ASYNC_TCP:
+		fd = async->sock;
+		events = POLLOUT;
+		break;
+	case ASYNC_ROOT_DSE:
+	case ASYNC_BIND:
+		if (ldap_get_option (async->ldap ? async->ldap : conn->ldap,
+		                     LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS)
+			fd = -1;
+		events = POLLIN;
+		break;
+	case ASYNC_LOGIN:
+	case ASYNC_DONE:
+		break;
+	}
+
+	if (fd >= 0 && count < n_fds) {
+		fds[count].fd = fd;
+		fds[count].events = events;
+		fds[count].revents = 0;
+		count++;
+	}
+
+	/* The first login progresses while the connection is set up */
+	if (conn->early_login && count < n_fds) {
+		fd = _adcli_krb5_as_fd (conn->early_login->as, &events);
+		if (fd >= 0) {
+			fds[count].fd = fd;
+			fds[count].events = events;
+			fds[count].revents = 0;
+			count++;
+
+			/* Wake up now and then, so the login can time out */
+			*timeout = 1000;
+		}
+	}
+
+	if (async->deadline > 0) {
+		remaining = async->deadline - adcli_phase_clock ();
+		msecs = remaining > 0 ? remaining * 1000 + 1 : 0;
+		if (*timeout < 0 || msecs < *timeout)
+			*timeout = msecs;
+	}
+
+	return count;
+}
+
+adcli_result
+adcli_conn_connect_step (adcli_conn *conn)
+{
+	adcli_result res = ADCLI_ERR_UNEXPECTED;
+	struct timeval zero = { 0, 0 };
+	LDAPMessage *message = NULL;
+	async_connect *async;
+	int code;
+	int ret;
+
+	return_unexpected_if_fail (conn != NULL);
+
+	async = conn->async;
+	return_unexpected_if_fail (async != NULL);
+
+	if (conn->early_login)
+		_adcli_krb5_as_process (conn->early_login->as);
+
+	switch (async->state) {
+	case ASYNC_TCP:
+		res = async_tcp_step (conn);
+		break;
+	case ASYNC_ROOT_DSE:
+		res = async_root_dse_step (conn);
+		break;
+	case ASYNC_LOGIN:
+		if (conn->early_login && !_adcli_krb5_as_process (conn->early_login->as))
+			res = ADCLI_IN_PROGRESS;
+		else
+			res = async_begin_bind (conn);
+		break;
+	case ASYNC_BIND:
+		ret = ldap_result (conn->ldap, async->msgid, LDAP_MSG_ALL, &zero, &message);
+		if (ret == 0) {
+			res = ADCLI_IN_PROGRESS;
+		} else if (ret < 0) {
+			if (ldap_get_option (conn->ldap, LDAP_OPT_RESULT_CODE, &code) != 0 ||
+			    code == LDAP_SUCCESS)
+				code = LDAP_SERVER_DOWN;
+			res = _adcli_phase_end (&async->phase,
+			                        bind_result (conn, async->mech, code, async->started));
+			forget_root_dse (conn->domain_controller);
+		} else {
+			res = async_bind_round (conn, message);
+			ldap_msgfree (message);
+		}
+		break;
+	case ASYNC_DONE:
+		return async->result;
+	}
+
+	return async_settle (conn, res);
 }
 
 adcli_conn *
@@ -1324,6 +3264,7 @@ conn_free (adcli_conn *conn)
 	free (conn->domain_short);
 	free (conn->default_naming_context);
 	free (conn->configuration_naming_context);
+	free (conn->root_domain_naming_context);
 	_adcli_strv_free (conn->supported_capabilities);
 	_adcli_strv_free (conn->supported_sasl_mechs);
 
@@ -1343,6 +3284,7 @@ conn_free (adcli_conn *conn)
 
 	conn_clear_state (conn);
 	no_more_disco (conn);
+	_adcli_arena_free (&conn->arena);
 
 	free (conn);
 }
@@ -1652,6 +3594,7 @@ adcli_conn_set_login_ccache_name (adcli_conn *conn,
 
 	conn->login_ccache_name = newval;
 	conn->login_ccache_name_is_krb5 = 0;
+	conn->own_login = false;
 }
 
 const char *
@@ -1711,15 +3654,59 @@ adcli_conn_set_krb5_conf_dir (adcli_conn *conn,
 	_adcli_str_set (&conn->krb5_conf_dir, value);
 }
 
+bool
+adcli_conn_get_krb5_conf_in_memory (adcli_conn *conn)
+{
+	return_val_if_fail (conn != NULL, false);
+	return conn->krb5_conf_in_memory;
+}
+
+void
+adcli_conn_set_krb5_conf_in_memory (adcli_conn *conn,
+                                    bool value)
+{
+	return_if_fail (conn != NULL);
+	conn->krb5_conf_in_memory = value;
+}
+
+void
+_adcli_conn_set_changepw_planned (adcli_conn *conn,
+                                  bool value)
+{
+	return_if_fail (conn != NULL);
+	conn->changepw_planned = value;
+}
+
+bool
+_adcli_conn_has_cap (adcli_conn *conn,
+                     adcli_cap_bit cap)
+{
+	return_val_if_fail (conn != NULL, false);
+	return (conn->capability_bits & cap) != 0;
+}
+
+bool
+_adcli_conn_has_sasl_mech (adcli_conn *conn,
+                           adcli_sasl_bit mech)
+{
+	return_val_if_fail (conn != NULL, false);
+	return (conn->sasl_mech_bits & mech) != 0;
+}
+
 int
 adcli_conn_server_has_capability (adcli_conn *conn,
                                   const char *capability)
 {
+	unsigned int bit;
 	int i;
 
 	return_val_if_fail (conn != NULL, 0);
 	return_val_if_fail (capability != NULL, 0);
 
+	bit = known_bit (known_capabilities, capability, true);
+	if (bit != 0)
+		return _adcli_conn_has_cap (conn, bit) ? 1 : 0;
+
 	if (!conn->supported_capabilities)
 		return 0;
 
@@ -1735,11 +3722,16 @@ bool
 adcli_conn_server_has_sasl_mech (adcli_conn *conn,
                                  const char *mech)
 {
+	unsigned int bit;
 	int i;
 
 	return_val_if_fail (conn != NULL, false);
 	return_val_if_fail (mech != NULL, false);
 
+	bit = known_bit (known_sasl_mechs, mech, false);
+	if (bit != 0)
+		return _adcli_conn_has_sasl_mech (conn, bit);
+
 	if (!conn->supported_sasl_mechs)
 		return false;
 
@@ -1759,3 +3751,144 @@ bool adcli_conn_is_writeable (adcli_conn *conn)
 
 	return (conn->is_writeable == IS_WRITEABLE);
 }
+
+#ifdef CONN_TESTS
+
+#include "test.h"
+
+#include <signal.h>
+
+static adcli_disco *
+test_disco (const char *host,
+            adcli_disco *next)
+{
+	adcli_disco *disco;
+
+	disco = calloc (1, sizeof (adcli_disco));
+	assert (disco != NULL);
+	disco->host_addr = strdup (host);
+	disco->next = next;
+	return disco;
+}
+
+static void
+assert_disco_order (adcli_conn *conn,
+                    const char *order)
+{
+	adcli_disco *disco;
+	char buffer[64] = { 0, };
+
+	for (disco = conn->domain_disco; disco != NULL; disco = disco->next)
+		strncat (buffer, disco->host_addr, sizeof (buffer) - strlen (buffer) - 1);
+	assert_str_eq (buffer, order);
+}
+
+static void
+test_demote_controller (void)
+{
+	adcli_conn *conn;
+
+	conn = adcli_conn_new ("example.com");
+	assert (conn != NULL);
+	conn->domain_disco = test_disco ("a", test_disco ("b", test_disco ("c", NULL)));
+
+	demote_controller (conn, "a");
+	assert_disco_order (conn, "bca");
+
+	demote_controller (conn, "c");
+	assert_disco_order (conn, "bac");
+
+	/* The last one, unknown ones and none at all stay put */
+	demote_controller (conn, "c");
+	assert_disco_order (conn, "bac");
+	demote_controller (conn, "z");
+	assert_disco_order (conn, "bac");
+	demote_controller (conn, NULL);
+	assert_disco_order (conn, "bac");
+
+	adcli_conn_unref (conn);
+}
+
+static void
+set_result_code (adcli_conn *conn,
+                 int code)
+{
+	assert_num_eq (ldap_set_option (conn->ldap, LDAP_OPT_RESULT_CODE, &code), 0);
+}
+
+static void
+test_connection_failed (void)
+{
+	adcli_conn *conn;
+	int fds[2];
+
+	conn = adcli_conn_new ("example.com");
+	assert (conn != NULL);
+
+	/* No connection, nothing to retry */
+	assert (!connection_failed (conn, ADCLI_ERR_DIRECTORY));
+
+	assert_num_eq (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	assert_num_eq (ldap_init_fd (fds[0], 1, "ldap://dc.example.com", &conn->ldap), 0);
+
+	/* Other failures, and problems the directory answered with, are final */
+	set_result_code (conn, LDAP_SERVER_DOWN);
+	assert (!connection_failed (conn, ADCLI_ERR_CREDENTIALS));
+	set_result_code (conn, LDAP_NO_SUCH_OBJECT);
+	assert (!connection_failed (conn, ADCLI_ERR_DIRECTORY));
+
+	set_result_code (conn, LDAP_SERVER_DOWN);
+	assert (connection_failed (conn, ADCLI_ERR_DIRECTORY));
+	set_result_code (conn, LDAP_TIMEOUT);
+	assert (connection_failed (conn, ADCLI_ERR_DIRECTORY));
+
+	/* Once the server hung up any failure is worth another go */
+	signal (SIGPIPE, SIG_IGN);
+	close (fds[1]);
+	set_result_code (conn, LDAP_NO_SUCH_OBJECT);
+	assert (connection_failed (conn, ADCLI_ERR_DIRECTORY));
+
+	adcli_conn_unref (conn);
+}
+
+static void
+test_drop_clears_snippet (void)
+{
+	char directory[] = "/tmp/adcli-test-XXXXXX";
+	adcli_conn *conn;
+	char *snippet;
+
+	assert (mkdtemp (directory) != NULL);
+
+	conn = adcli_conn_new ("example.com");
+	assert (conn != NULL);
+	conn->krb5_conf_dir = strdup (directory);
+	conn->domain_realm = strdup ("EXAMPLE.COM");
+	conn->domain_controller = strdup ("dc1.example.com");
+
+	assert_num_eq (setup_krb5_conf_snippet (conn, "dc1.example.com", "dc1.example.com"),
+	               ADCLI_SUCCESS);
+	assert (conn->krb5_conf_snippet != NULL);
+	snippet = strdup (conn->krb5_conf_snippet);
+
+	/* Reconnecting elsewhere must not keep the old controller pinned */
+	conn_drop_connection (conn);
+	assert (conn->krb5_conf_snippet == NULL);
+	assert (access (snippet, F_OK) < 0);
+
+	free (snippet);
+	adcli_conn_unref (conn);
+	rmdir (directory);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	test_func (test_demote_controller, "/conn/demote_controller");
+	test_func (test_connection_failed, "/conn/connection_failed");
+	test_func (test_drop_clears_snippet, "/conn/drop_clears_snippet");
+	return test_run (argc, argv);
+}
+
+#endif /* CONN_TESTS */
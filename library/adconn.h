@@ -28,6 +28,7 @@
 
 #include <krb5/krb5.h>
 #include <ldap.h>
+#include <poll.h>
 
 typedef enum {
 	ADCLI_LOGIN_UNKNOWN = 0,
@@ -65,6 +66,25 @@ adcli_result        adcli_conn_discover              (adcli_conn *conn);
 
 adcli_result        adcli_conn_connect               (adcli_conn *conn);
 
+adcli_result        adcli_conn_connect_start         (adcli_conn *conn);
+
+int                 adcli_conn_connect_fds           (adcli_conn *conn,
+                                                      struct pollfd *fds,
+                                                      int n_fds,
+                                                      int *timeout);
+
+adcli_result        adcli_conn_connect_step          (adcli_conn *conn);
+
+adcli_result        adcli_conn_probe                 (adcli_conn *conn);
+
+adcli_result        adcli_conn_locate_in_forest      (adcli_conn *conn,
+                                                      const char *filter,
+                                                      char **dn,
+                                                      char **domain);
+
+adcli_result        adcli_conn_move_to_domain        (adcli_conn *conn,
+                                                      const char *domain);
+
 adcli_conn *        adcli_conn_new                   (const char *domain);
 
 adcli_conn *        adcli_conn_ref                   (adcli_conn *conn);
@@ -162,6 +182,11 @@ const char *        adcli_conn_get_krb5_conf_dir     (adcli_conn *conn);
 void                adcli_conn_set_krb5_conf_dir     (adcli_conn *conn,
                                                       const char *value);
 
+bool                adcli_conn_get_krb5_conf_in_memory (adcli_conn *conn);
+
+void                adcli_conn_set_krb5_conf_in_memory (adcli_conn *conn,
+                                                        bool value);
+
 int                 adcli_conn_server_has_capability (adcli_conn *conn,
                                                       const char *capability);
 
@@ -289,15 +289,29 @@ getsrvinfo (const char *rrname,
             srvinfo **res)
 {
 	unsigned char *answer;
+	char records[16];
+	double started;
+	srvinfo *srv;
 	int length;
+	int count;
 	int ret;
 
+	started = _adcli_trace_clock ();
+
 	ret = perform_query (rrname, &answer, &length);
-	if (ret != 0)
-		return ret;
+	if (ret == 0) {
+		ret = parse_answer (answer, length, res);
+		free (answer);
+	}
 
-	ret = parse_answer (answer, length, res);
-	free (answer);
+	for (count = 0, srv = (ret == 0) ? *res : NULL; srv != NULL; srv = srv->next)
+		count++;
+	snprintf (records, sizeof (records), "%d", count);
+	_adcli_trace ("dns", "srv", NULL, started,
+	              "name", rrname,
+	              "result", ret == 0 ? "Success" : gai_strerror (ret),
+	              "records", records,
+	              NULL);
 
 	return ret;
 }
@@ -488,11 +502,21 @@ enum conn_is_writeable disco_get_writeable (LDAP *ldap, LDAPMessage *message)
 	}
 }
 
+static void
+end_ping (_adcli_phase *ping,
+          adcli_result result)
+{
+	_adcli_trace ("cldap", "netlogon-ping", ping->detail, ping->started,
+	              "result", adcli_result_to_string (result), NULL);
+	_adcli_phase_end (ping, result);
+}
+
 static int
 ldap_disco_poller (LDAP **ldap,
                    LDAPMessage **message,
                    adcli_disco **results,
-                   const char **addrs)
+                   const char **addrs,
+                   _adcli_phase *ping)
 {
 	int found = ADCLI_DISCO_UNUSABLE;
 	int close_ldap;
@@ -526,6 +550,8 @@ ldap_disco_poller (LDAP **ldap,
 
 	/* Done with this connection */
 	if (close_ldap) {
+		end_ping (ping, found == ADCLI_DISCO_UNUSABLE ?
+		                ADCLI_ERR_DIRECTORY : ADCLI_SUCCESS);
 		ldap_unbind_ext_s (*ldap, NULL, NULL);
 		*ldap = NULL;
 	}
@@ -543,6 +569,7 @@ ldaps_disco (const char *domain,
 	const char *addrs[DISCO_COUNT];
 	int found = ADCLI_DISCO_UNUSABLE;
 	LDAPMessage *message;
+	_adcli_phase ping;
 	char buffer[1024];
 	struct addrinfo hints;
 	struct addrinfo *res;
@@ -618,6 +645,7 @@ ldaps_disco (const char *domain,
 			version = LDAP_VERSION3;
 			ldap_set_option (ldap[num], LDAP_OPT_PROTOCOL_VERSION, &version);
 			ldap_set_option (ldap[num], LDAP_OPT_REFERRALS , 0);
+			_adcli_ldap_resume_tls (ldap[num]);
 			addrs[num] = srv->hostname;
 
 		} else {
@@ -628,14 +656,15 @@ ldaps_disco (const char *domain,
 		free (url);
 
 		_adcli_info ("Sending LDAPS NetLogon ping to domain controller: %s", addrs[num]);
+		_adcli_phase_begin (&ping, "cldap-ping", addrs[num]);
 
 		ret = ldap_search_ext (ldap[num], "", LDAP_SCOPE_BASE,
 		                       filter, attrs, 0, NULL, NULL, NULL,
 		                       -1, &msgidp);
 
 		if (ret != LDAP_SUCCESS) {
-			_adcli_ldap_handle_failure (ldap[num], ADCLI_ERR_CONFIG,
-			                            "Couldn't perform discovery search");
+			end_ping (&ping, _adcli_ldap_handle_failure (ldap[num], ADCLI_ERR_CONFIG,
+			                                            "Couldn't perform discovery search"));
 			ldap_unbind_ext_s (ldap[num], NULL, NULL);
 			ldap[num] = NULL;
 			continue;
@@ -654,8 +683,9 @@ ldaps_disco (const char *domain,
 		}
 		select (0, NULL, NULL, NULL, &interval);
 
-		parsed = ldap_disco_poller (&(ldap[num]), &message, results, &(addrs[num]));
+		parsed = ldap_disco_poller (&(ldap[num]), &message, results, &(addrs[num]), &ping);
 		if (ldap[num] != NULL) {
+			end_ping (&ping, ADCLI_ERR_DIRECTORY);
 			ldap_unbind_ext_s (ldap[num], NULL, NULL);
 		}
 		if (parsed > found) {
@@ -676,6 +706,7 @@ ldap_disco (const char *domain,
 	char *attrs[] = { "NetLogon", NULL };
 	LDAP *ldap[DISCO_COUNT];
 	const char *addrs[DISCO_COUNT];
+	_adcli_phase pings[DISCO_COUNT];
 	int found = ADCLI_DISCO_UNUSABLE;
 	LDAPMessage *message;
 	char buffer[1024];
@@ -708,6 +739,7 @@ ldap_disco (const char *domain,
 
 	memset (addrs, 0, sizeof (addrs));
 	memset (ldap, 0, sizeof (ldap));
+	memset (pings, 0, sizeof (pings));
 
 	/* Make sure cldap is supported, it's not always built into openldap */
 	if (ldap_is_ldap_url (DISCO_SCHEME "://hostname"))
@@ -782,14 +814,15 @@ ldap_disco (const char *domain,
 
 		have_any = 1;
 		_adcli_info ("Sending NetLogon ping to domain controller: %s", addrs[i]);
+		_adcli_phase_begin (pings + i, "cldap-ping", addrs[i]);
 
 		ret = ldap_search_ext (ldap[i], "", LDAP_SCOPE_BASE,
 		                       filter, attrs, 0, NULL, NULL, NULL,
 		                       -1, &msgidp);
 
 		if (ret != LDAP_SUCCESS) {
-			_adcli_ldap_handle_failure (ldap[i], ADCLI_ERR_CONFIG,
-			                            "Couldn't perform discovery search");
+			end_ping (pings + i, _adcli_ldap_handle_failure (ldap[i], ADCLI_ERR_CONFIG,
+			                                                "Couldn't perform discovery search"));
 			ldap_unbind_ext_s (ldap[i], NULL, NULL);
 			ldap[i] = NULL;
 			continue;
@@ -808,7 +841,7 @@ ldap_disco (const char *domain,
 		}
 		select (0, NULL, NULL, NULL, &interval);
 
-		parsed = ldap_disco_poller (&(ldap[i]), &message, results, &(addrs[i]));
+		parsed = ldap_disco_poller (&(ldap[i]), &message, results, &(addrs[i]), pings + i);
 		if (parsed > found)
 			found = parsed;
 	}
@@ -829,15 +862,18 @@ ldap_disco (const char *domain,
 
 			have_any = 1;
 
-			parsed = ldap_disco_poller (&(ldap[i]), &message, results, &(addrs[i]));
+			parsed = ldap_disco_poller (&(ldap[i]), &message, results, &(addrs[i]), pings + i);
 			if (parsed > found)
 				found = parsed;
 		}
 	}
 
+	/* Whatever is still open never answered, or wasn't needed */
 	for (i = 0; i < num; i++) {
-		if (ldap[i] != NULL)
+		if (ldap[i] != NULL) {
+			end_ping (pings + i, ADCLI_ERR_DIRECTORY);
 			ldap_unbind_ext_s (ldap[i], NULL, NULL);
+		}
 	}
 
 	free (filter);
@@ -876,6 +912,8 @@ static int
 site_disco (adcli_disco *disco, bool use_ldaps,
             adcli_disco **results)
 {
+	_adcli_phase phase;
+	_adcli_phase lookup;
 	srvinfo *srv;
 	char *rrname;
 	int found;
@@ -889,8 +927,11 @@ site_disco (adcli_disco *disco, bool use_ldaps,
 		return_val_if_reached (ADCLI_DISCO_UNUSABLE);
 
 	_adcli_info ("Discovering site domain controllers: %s", rrname);
+	_adcli_phase_begin (&phase, "site-discovery", disco->client_site);
 
+	_adcli_phase_begin (&lookup, "dns-srv", rrname);
 	ret = getsrvinfo (rrname, &srv);
+	_adcli_phase_end (&lookup, ret == 0 ? ADCLI_SUCCESS : ADCLI_ERR_DIRECTORY);
 	switch (ret) {
 	case 0:
 		break;
@@ -909,8 +950,10 @@ site_disco (adcli_disco *disco, bool use_ldaps,
 
 	free (rrname);
 
-	if (ret != 0)
+	if (ret != 0) {
+		_adcli_phase_end (&phase, ADCLI_ERR_DIRECTORY);
 		return ADCLI_DISCO_MAYBE;
+	}
 
 	/*
 	 * Now that we have discovered the site domain controllers do a
@@ -923,6 +966,8 @@ site_disco (adcli_disco *disco, bool use_ldaps,
 
 	freesrvinfo (srv);
 
+	_adcli_phase_end (&phase, found == ADCLI_DISCO_UNUSABLE ?
+	                          ADCLI_ERR_DIRECTORY : ADCLI_SUCCESS);
 	return found;
 }
 
@@ -930,6 +975,7 @@ int
 adcli_disco_domain (const char *domain, bool use_ldaps,
                     adcli_disco **results)
 {
+	_adcli_phase lookup;
 	char *rrname;
 	srvinfo *srv;
 	int found;
@@ -945,7 +991,9 @@ adcli_disco_domain (const char *domain, bool use_ldaps,
 
 	_adcli_info ("Discovering domain controllers: %s", rrname);
 
+	_adcli_phase_begin (&lookup, "dns-srv", rrname);
 	ret = getsrvinfo (rrname, &srv);
+	_adcli_phase_end (&lookup, ret == 0 ? ADCLI_SUCCESS : ADCLI_ERR_DIRECTORY);
 	switch (ret) {
 	case 0:
 		break;
@@ -995,6 +1043,34 @@ adcli_disco_host (const char *host, bool use_ldaps,
 	return ldap_disco (NULL, &srv, use_ldaps, results);
 }
 
+/* Host names in an SRV record, such as the global catalogs of a forest */
+char **
+_adcli_disco_srv_hosts (const char *rrname)
+{
+	char **hosts = NULL;
+	int length = 0;
+	srvinfo *srv;
+	srvinfo *at;
+	int ret;
+
+	return_val_if_fail (rrname != NULL, NULL);
+
+	ret = getsrvinfo (rrname, &srv);
+	if (ret != 0) {
+		_adcli_err ("Couldn't resolve SRV record: %s: %s",
+		            rrname, gai_strerror (ret));
+		return NULL;
+	}
+
+	for (at = srv; at != NULL; at = at->next) {
+		if (strcmp (at->hostname, ".") != 0)
+			hosts = _adcli_strv_add (hosts, strdup (at->hostname), &length);
+	}
+
+	freesrvinfo (srv);
+	return hosts;
+}
+
 void
 adcli_disco_free (adcli_disco *disco)
 {
@@ -1030,3 +1106,81 @@ adcli_disco_usable (adcli_disco *disco)
 
 	return ADCLI_DISCO_MAYBE;
 }
+
+#ifdef DISCO_BENCH
+
+#include "bench.h"
+
+/* An SRV response for _ldap._tcp.ad.example.com with four DCs */
+static unsigned char bench_srv_answer[] = {
+	0x12, 0x34, 0x85, 0x80, 0x00, 0x01, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
+	0x05, 0x5f, 0x6c, 0x64, 0x61, 0x70, 0x04, 0x5f, 0x74, 0x63, 0x70, 0x02,
+	0x61, 0x64, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63,
+	0x6f, 0x6d, 0x00, 0x00, 0x21, 0x00, 0x01, 0xc0, 0x0c, 0x00, 0x21, 0x00,
+	0x01, 0x00, 0x00, 0x02, 0x58, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x64, 0x01,
+	0x85, 0x03, 0x64, 0x63, 0x31, 0xc0, 0x17, 0xc0, 0x0c, 0x00, 0x21, 0x00,
+	0x01, 0x00, 0x00, 0x02, 0x58, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x64, 0x01,
+	0x85, 0x03, 0x64, 0x63, 0x32, 0xc0, 0x17, 0xc0, 0x0c, 0x00, 0x21, 0x00,
+	0x01, 0x00, 0x00, 0x02, 0x58, 0x00, 0x0c, 0x00, 0x0a, 0x00, 0x00, 0x01,
+	0x85, 0x03, 0x64, 0x63, 0x33, 0xc0, 0x17, 0xc0, 0x0c, 0x00, 0x21, 0x00,
+	0x01, 0x00, 0x00, 0x02, 0x58, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x32, 0x01,
+	0x85, 0x03, 0x64, 0x63, 0x34, 0xc0, 0x17,
+};
+
+/* A NETLOGON_SAM_LOGON_RESPONSE_EX from dc1.ad.example.com */
+static unsigned char bench_netlogon[] = {
+	0x17, 0x00, 0x00, 0x00, 0xfd, 0xf3, 0x03, 0x00, 0x10, 0x11, 0x12, 0x13,
+	0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+	0x02, 0x61, 0x64, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x03,
+	0x63, 0x6f, 0x6d, 0x00, 0xc0, 0x18, 0x03, 0x64, 0x63, 0x31, 0xc0, 0x18,
+	0x02, 0x41, 0x44, 0x00, 0x03, 0x44, 0x43, 0x31, 0x00, 0x00, 0x17, 0x44,
+	0x65, 0x66, 0x61, 0x75, 0x6c, 0x74, 0x2d, 0x46, 0x69, 0x72, 0x73, 0x74,
+	0x2d, 0x53, 0x69, 0x74, 0x65, 0x2d, 0x4e, 0x61, 0x6d, 0x65, 0x00, 0xc0,
+	0x3a, 0x05, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+};
+
+static void
+bench_parse_answer (unsigned long iterations)
+{
+	srvinfo *res, *srv;
+	unsigned long i;
+	int count;
+
+	for (i = 0; i < iterations; i++) {
+		res = NULL;
+		if (parse_answer (bench_srv_answer, sizeof (bench_srv_answer), &res) != 0)
+			bench_fail ("couldn't parse SRV answer");
+		for (count = 0, srv = res; srv != NULL; srv = srv->next)
+			count++;
+		if (count != 4)
+			bench_fail ("unexpected SRV record count %d", count);
+		freesrvinfo (res);
+	}
+}
+
+static void
+bench_parse_disco_data (unsigned long iterations)
+{
+	struct berval bv = { sizeof (bench_netlogon), (char *)bench_netlogon };
+	adcli_disco *disco;
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++) {
+		disco = parse_disco_data (&bv);
+		if (disco == NULL || strcmp (disco->host_name, "dc1.ad.example.com") != 0 ||
+		    strcmp (disco->client_site, "Default-First-Site-Name") != 0)
+			bench_fail ("couldn't parse NetLogon data");
+		adcli_disco_free (disco);
+	}
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	bench_func (bench_parse_answer, "/disco/parse_answer");
+	bench_func (bench_parse_disco_data, "/disco/parse_disco_data");
+	return bench_run (argc, argv);
+}
+
+#endif /* DISCO_BENCH */
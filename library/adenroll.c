@@ -118,10 +118,10 @@ struct _adcli_enroll {
 	int domain_ou_explicit;
 	char *computer_dn;
 	char *computer_container;
-	LDAPMessage *computer_attributes;
+	_adcli_ldap_attrs *computer_attributes;
 
 	char **service_names;
-	char **service_principals;
+	_adcli_strset service_principals;
 	int service_principals_explicit;
 
 	char **service_principals_to_add;
@@ -146,6 +146,7 @@ struct _adcli_enroll {
 	int keytab_enctypes_explicit;
 	unsigned int computer_password_lifetime;
 	int computer_password_lifetime_explicit;
+	unsigned int rotation_window;
 	char *samba_data_tool;
 	bool trusted_for_delegation;
 	int trusted_for_delegation_explicit;
@@ -405,7 +406,7 @@ ensure_service_names (adcli_result res,
 	if (res != ADCLI_SUCCESS)
 		return res;
 
-	if (enroll->service_names || enroll->service_principals)
+	if (enroll->service_names || enroll->service_principals.strv)
 		return ADCLI_SUCCESS;
 
 	return ensure_default_service_names (enroll);
@@ -415,24 +416,17 @@ static adcli_result
 add_service_names_to_service_principals (adcli_enroll *enroll)
 {
 	char *name;
-	int length = 0;
 	int i;
 
-	if (enroll->service_principals != NULL) {
-		length = seq_count (enroll->service_principals);
-	}
-
 	for (i = 0; enroll->service_names[i] != NULL; i++) {
 		if (asprintf (&name, "%s/%s", enroll->service_names[i], enroll->netbios_computer_name) < 0)
 			return_unexpected_if_reached ();
-		enroll->service_principals = _adcli_strv_add_unique (enroll->service_principals,
-		                                                     name, &length, false);
+		_adcli_strset_add_unique (&enroll->service_principals, name, false);
 
 		if (enroll->host_fqdn) {
 			if (asprintf (&name, "%s/%s", enroll->service_names[i], enroll->host_fqdn) < 0)
 				return_unexpected_if_reached ();
-			enroll->service_principals = _adcli_strv_add_unique (enroll->service_principals,
-			                                                     name, &length, false);
+			_adcli_strset_add_unique (&enroll->service_principals, name, false);
 		}
 	}
 
@@ -442,21 +436,14 @@ add_service_names_to_service_principals (adcli_enroll *enroll)
 static adcli_result
 add_and_remove_service_principals (adcli_enroll *enroll)
 {
-	int length = 0;
 	size_t c;
 	const char **list;
 
-	if (enroll->service_principals != NULL) {
-		length = seq_count (enroll->service_principals);
-	}
-
 	list = adcli_enroll_get_service_principals_to_add (enroll);
 	if (list != NULL) {
 		for (c = 0; list[c] != NULL; c++) {
-			enroll->service_principals = _adcli_strv_add_unique (enroll->service_principals,
-			                                                     strdup (list[c]),
-			                                                     &length, false);
-			if (enroll->service_principals == NULL) {
+			if (!_adcli_strset_has (&enroll->service_principals, list[c], false) &&
+			    !_adcli_strset_add (&enroll->service_principals, strdup (list[c]))) {
 				return ADCLI_ERR_UNEXPECTED;
 			}
 		}
@@ -468,8 +455,7 @@ add_and_remove_service_principals (adcli_enroll *enroll)
 			/* enroll->service_principals typically refects the
 			 * order of the principal in the keytabm so it is not
 			 * ordered. */
-			_adcli_strv_remove_unsorted (enroll->service_principals,
-			                             list[c], &length);
+			_adcli_strset_remove (&enroll->service_principals, list[c]);
 		}
 	}
 
@@ -485,7 +471,7 @@ ensure_service_principals (adcli_result res,
 
 	assert (enroll->keytab_principals == NULL);
 
-	if (!enroll->service_principals) {
+	if (!enroll->service_principals.strv) {
 		assert (enroll->service_names != NULL);
 		res = add_service_names_to_service_principals (enroll);
 	}
@@ -528,8 +514,8 @@ ensure_keytab_principals (adcli_result res,
 	/* Prepare the principals we're going to add to the keytab */
 
 	if (!enroll->is_service) {
-		return_unexpected_if_fail (enroll->service_principals);
-		count = _adcli_strv_len (enroll->service_principals);
+		return_unexpected_if_fail (enroll->service_principals.strv);
+		count = enroll->service_principals.length;
 	}
 
 	k5 = adcli_conn_get_krb5_context (enroll->conn);
@@ -562,12 +548,12 @@ ensure_keytab_principals (adcli_result res,
 	/* Now add the principals for all the various services */
 
 	for (i = 0; i < count; i++) {
-		code = _adcli_krb5_build_principal (k5, enroll->service_principals[i],
+		code = _adcli_krb5_build_principal (k5, enroll->service_principals.strv[i],
 		                                    adcli_conn_get_domain_realm (enroll->conn),
 		                                    &enroll->keytab_principals[at++]);
 		if (code != 0) {
 			_adcli_err ("Couldn't parse kerberos service principal: %s: %s",
-			            enroll->service_principals[i],
+			            enroll->service_principals.strv[i],
 			            krb5_get_error_message (k5, code));
 			return ADCLI_ERR_CONFIG;
 		}
@@ -630,9 +616,9 @@ lookup_computer_container (adcli_enroll *enroll,
 		base = adcli_conn_get_default_naming_context (enroll->conn);
 	assert (base != NULL);
 
-	ret = ldap_search_ext_s (ldap, base, LDAP_SCOPE_BASE,
-	                         "(objectClass=*)", attrs, 0, NULL, NULL,
-	                         NULL, -1, &results);
+	ret = _adcli_ldap_search_ext_s (ldap, base, LDAP_SCOPE_BASE,
+	                                "(objectClass=*)", attrs, 0, NULL, NULL,
+	                                NULL, -1, &results);
 
 	if (ret == LDAP_NO_SUCH_OBJECT && enroll->domain_ou) {
 		_adcli_err ("The organizational unit does not exist: %s", enroll->domain_ou);
@@ -662,8 +648,8 @@ lookup_computer_container (adcli_enroll *enroll,
 
 	/* Try harder */
 	if (!enroll->computer_container) {
-		ret = ldap_search_ext_s (ldap, base, LDAP_SCOPE_BASE, filter,
-		                         attrs, 0, NULL, NULL, NULL, -1, &results);
+		ret = _adcli_ldap_search_ext_s (ldap, base, LDAP_SCOPE_BASE, filter,
+		                                attrs, 0, NULL, NULL, NULL, -1, &results);
 		if (ret == LDAP_SUCCESS) {
 			enroll->computer_container = _adcli_ldap_parse_dn (ldap, results);
 			if (enroll->computer_container) {
@@ -722,7 +708,8 @@ calculate_computer_account (adcli_enroll *enroll,
 static adcli_result
 calculate_enctypes (adcli_enroll *enroll, char **enctype)
 {
-	char *value = NULL;
+	const char *value = NULL;
+	char *default_value = NULL;
 	krb5_enctype *read_enctypes;
 	krb5_enctype *new_enctypes;
 	char *new_value = NULL;
@@ -748,11 +735,11 @@ calculate_enctypes (adcli_enroll *enroll, char **enctype)
 	ldap = adcli_conn_get_ldap_connection (enroll->conn);
 	return_unexpected_if_fail (ldap != NULL);
 
-	is_2008_or_later = adcli_conn_server_has_capability (enroll->conn, ADCLI_CAP_V60_OID);
+	is_2008_or_later = _adcli_conn_has_cap (enroll->conn, CAP_BIT_V60);
 
 	/* In 2008 or later, use the msDS-supportedEncryptionTypes attribute */
 	if (is_2008_or_later && enroll->computer_attributes != NULL) {
-		value = _adcli_ldap_parse_value (ldap, enroll->computer_attributes,
+		value = _adcli_ldap_attrs_value (enroll->computer_attributes,
 		                                 "msDS-supportedEncryptionTypes");
 
 		if (!enroll->keytab_enctypes_explicit && value != NULL) {
@@ -768,7 +755,7 @@ calculate_enctypes (adcli_enroll *enroll, char **enctype)
 
 	/* In 2003 or earlier, standard set of enc types */
 	} else {
-		value = _adcli_krb5_format_enctypes (v51_earlier_enctypes);
+		value = default_value = _adcli_krb5_format_enctypes (v51_earlier_enctypes);
 	}
 
 	new_enctypes = adcli_enroll_get_permitted_keytab_enctypes (enroll);
@@ -780,18 +767,18 @@ calculate_enctypes (adcli_enroll *enroll, char **enctype)
 	new_value = _adcli_krb5_format_enctypes (new_enctypes);
 	krb5_free_enctypes (adcli_conn_get_krb5_context (enroll->conn), new_enctypes);
 	if (new_value == NULL) {
-		free (value);
+		free (default_value);
 		_adcli_warn ("The encryption types desired are not available in active directory");
 		return ADCLI_ERR_CONFIG;
 	}
 
 	/* If we already have this value, then don't need to update */
 	if (value && strcmp (new_value, value) == 0) {
-		free (value);
+		free (default_value);
 		free (new_value);
 		return ADCLI_SUCCESS;
 	}
-	free (value);
+	free (default_value);
 
 	if (!is_2008_or_later) {
 		free (new_value);
@@ -973,7 +960,7 @@ create_computer_account (adcli_enroll *enroll,
 	LDAPMod operatingSystemServicePack = { LDAP_MOD_ADD, "operatingSystemServicePack", { vals_operatingSystemServicePack, } };
 	char *vals_userPrincipalName[] = { enroll->user_principal, NULL };
 	LDAPMod userPrincipalName = { LDAP_MOD_ADD, "userPrincipalName", { vals_userPrincipalName, }, };
-	LDAPMod servicePrincipalName = { LDAP_MOD_ADD, "servicePrincipalName", { enroll->service_principals, } };
+	LDAPMod servicePrincipalName = { LDAP_MOD_ADD, "servicePrincipalName", { enroll->service_principals.strv, } };
 	char *vals_description[] = { enroll->description, NULL };
 	LDAPMod description = { LDAP_MOD_ADD, "description", { vals_description, }, };
 	struct berval *vals_unicodePwd[] = { NULL, NULL };
@@ -1064,7 +1051,14 @@ create_computer_account (adcli_enroll *enroll,
 	}
 	mods[m] = NULL;
 
-	ret = ldap_add_ext_s (ldap, enroll->computer_dn, mods, NULL, NULL);
+	ret = _adcli_ldap_add_ext_s (ldap, enroll->computer_dn, mods, NULL, NULL);
+
+	/* Nothing was created, so plan the later steps against the new entry */
+	if (ret == LDAP_SUCCESS && _adcli_planning ()) {
+		_adcli_ldap_attrs_free (enroll->computer_attributes);
+		enroll->computer_attributes = _adcli_ldap_attrs_from_mods (enroll->computer_dn, mods);
+	}
+
 	ber_bvfree (vals_unicodePwd[0]);
 	ldap_mods_free (extra_mods, 1);
 	free (mods);
@@ -1106,7 +1100,7 @@ create_computer_account (adcli_enroll *enroll,
 static int
 filter_for_necessary_updates (adcli_enroll *enroll,
                               LDAP *ldap,
-                              LDAPMessage *entry,
+                              _adcli_ldap_attrs *attrs,
                               LDAPMod **mods)
 {
 	struct berval **vals;
@@ -1122,12 +1116,10 @@ filter_for_necessary_updates (adcli_enroll *enroll,
 			continue;
 
 		/* If no entry, then no filtering */
-		if (entry != NULL) {
-			vals = ldap_get_values_len (ldap, entry, mods[in]->mod_type);
-			if (vals != NULL) {
+		if (attrs != NULL) {
+			vals = _adcli_ldap_attrs_bvals (attrs, mods[in]->mod_type);
+			if (vals != NULL)
 				match = _adcli_ldap_have_in_mod (mods[in], vals);
-				ldap_value_free_len (vals);
-			}
 		}
 
 		if (!match)
@@ -1166,12 +1158,31 @@ validate_computer_account (adcli_enroll *enroll,
 
 static adcli_result
 delete_computer_account (adcli_enroll *enroll,
-                         LDAP *ldap)
+                         LDAP *ldap,
+                         bool recursive)
 {
+	LDAPControl control = { LDAP_CONTROL_X_TREE_DELETE, { 0, NULL }, 1 };
+	LDAPControl *controls[] = { &control, NULL };
 	int ret;
 
-	ret = ldap_delete_ext_s (ldap, enroll->computer_dn, NULL, NULL);
-	if (ret == LDAP_INSUFFICIENT_ACCESS) {
+	ret = _adcli_ldap_delete_ext_s (ldap, enroll->computer_dn, NULL, NULL);
+
+	/*
+	 * Accounts with child objects can only be deleted as a whole tree,
+	 * which also removes things like BitLocker recovery information.
+	 * So only when asked for.
+	 */
+	if (ret == LDAP_NOT_ALLOWED_ON_NONLEAF && recursive) {
+		_adcli_warn ("Deleting %s account together with its child objects",
+		             s_or_c (enroll));
+		ret = _adcli_ldap_delete_ext_s (ldap, enroll->computer_dn, controls, NULL);
+	}
+	if (ret == LDAP_NOT_ALLOWED_ON_NONLEAF) {
+		_adcli_err ("The %s account has child objects and was not deleted: %s",
+		            s_or_c (enroll), enroll->computer_dn);
+		return ADCLI_ERR_CONFIG;
+
+	} else if (ret == LDAP_INSUFFICIENT_ACCESS) {
 		return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_CREDENTIALS,
 		                                   "Insufficient permissions to delete computer account: %s",
 		                                   enroll->computer_dn);
@@ -1198,36 +1209,37 @@ locate_computer_account (adcli_enroll *enroll,
 	char *attrs[] = { "objectClass", "CN", NULL };
 	LDAPMessage *results = NULL;
 	LDAPMessage *entry = NULL;
+	_adcli_arena *arena;
+	_adcli_arena_mark mark;
 	const char *base;
 	char *value;
 	char *filter;
 	char *dn;
 	int ret = 0;
 
-	/* If we don't yet know our computer dn, then try and find it */
-	if (use_fqdn) {
+	if (use_fqdn)
 		return_unexpected_if_fail (enroll->host_fqdn != NULL);
-		value = _adcli_ldap_escape_filter (enroll->host_fqdn);
-		return_unexpected_if_fail (value != NULL);
-		if (asprintf (&filter, "(&(objectClass=%s)(dNSHostName=%s))",
-		              enroll->is_service ? "msDS-ManagedServiceAccount" : "computer",
-		              value) < 0)
-			return_unexpected_if_reached ();
-	} else {
-		value = _adcli_ldap_escape_filter (enroll->computer_sam);
-		return_unexpected_if_fail (value != NULL);
-		if (asprintf (&filter, "(&(objectClass=%s)(sAMAccountName=%s))",
-		              enroll->is_service ? "msDS-ManagedServiceAccount" : "computer",
-		              value) < 0)
-			return_unexpected_if_reached ();
+
+	arena = _adcli_conn_get_arena (enroll->conn);
+	_adcli_arena_get_mark (arena, &mark);
+
+	/* If we don't yet know our computer dn, then try and find it */
+	value = _adcli_ldap_escape_filter_in (arena, use_fqdn ? enroll->host_fqdn
+	                                                       : enroll->computer_sam);
+	filter = value ? _adcli_arena_printf (arena, "(&(objectClass=%s)(%s=%s))",
+	                                      enroll->is_service ? "msDS-ManagedServiceAccount" : "computer",
+	                                      use_fqdn ? "dNSHostName" : "sAMAccountName",
+	                                      value) : NULL;
+	if (filter == NULL) {
+		_adcli_arena_release (arena, &mark);
+		return_unexpected_if_reached ();
 	}
-	free (value);
 
 	base = adcli_conn_get_default_naming_context (enroll->conn);
-	ret = ldap_search_ext_s (ldap, base, LDAP_SCOPE_SUB, filter, attrs, 0,
-	                         NULL, NULL, NULL, 1, &results);
+	ret = _adcli_ldap_search_ext_s (ldap, base, LDAP_SCOPE_SUB, filter, attrs, 0,
+	                                NULL, NULL, NULL, 1, &results);
 
-	free (filter);
+	_adcli_arena_release (arena, &mark);
 
 	/* ldap_search_ext_s() can return results *and* an error. */
 	if (ret == LDAP_SUCCESS) {
@@ -1288,9 +1300,9 @@ load_computer_account (adcli_enroll *enroll,
 	LDAPMessage *entry = NULL;
 	int ret;
 
-	ret = ldap_search_ext_s (ldap, enroll->computer_dn, LDAP_SCOPE_BASE,
-	                         "(objectClass=computer)", attrs, 0,
-	                         NULL, NULL, NULL, -1, &results);
+	ret = _adcli_ldap_search_ext_s (ldap, enroll->computer_dn, LDAP_SCOPE_BASE,
+	                                "(objectClass=computer)", attrs, 0,
+	                                NULL, NULL, NULL, -1, &results);
 
 	if (ret == LDAP_SUCCESS) {
 		entry = ldap_first_entry (ldap, results);
@@ -1381,6 +1393,7 @@ locate_or_create_computer_account (adcli_enroll *enroll,
 {
 	LDAPMessage *results = NULL;
 	LDAPMessage *entry = NULL;
+	_adcli_phase phase;
 	adcli_result res;
 	int searched = 0;
 	LDAP *ldap;
@@ -1388,12 +1401,14 @@ locate_or_create_computer_account (adcli_enroll *enroll,
 	ldap = adcli_conn_get_ldap_connection (enroll->conn);
 	assert (ldap != NULL);
 
+	_adcli_phase_begin (&phase, "locate", NULL);
+
 	/* Try to find the computer account */
 	if (!enroll->computer_dn) {
 		res = locate_computer_account (enroll, ldap, false,
 		                               &results, &entry);
 		if (res != ADCLI_SUCCESS)
-			return res;
+			return _adcli_phase_end (&phase, res);
 		searched = 1;
 	}
 
@@ -1403,14 +1418,14 @@ locate_or_create_computer_account (adcli_enroll *enroll,
 		res = locate_computer_account (enroll, ldap, true,
 		                               &results, &entry);
 		if (res != ADCLI_SUCCESS)
-			return res;
+			return _adcli_phase_end (&phase, res);
 		searched = 1;
 
 		if (results != NULL) {
 			res = get_service_account_name_from_ldap (enroll,
 			                                          results);
 			if (res != ADCLI_SUCCESS) {
-				return res;
+				return _adcli_phase_end (&phase, res);
 			}
 		}
 	}
@@ -1420,12 +1435,12 @@ locate_or_create_computer_account (adcli_enroll *enroll,
 		if (enroll->is_service && !enroll->netbios_computer_name_explicit) {
 			res = calculate_random_service_account_name (enroll);
 			if (res != ADCLI_SUCCESS) {
-				return res;
+				return _adcli_phase_end (&phase, res);
 			}
 		}
 		res = calculate_computer_account (enroll, ldap);
 		if (res != ADCLI_SUCCESS)
-			return res;
+			return _adcli_phase_end (&phase, res);
 	}
 
 	assert (enroll->computer_dn != NULL);
@@ -1434,12 +1449,17 @@ locate_or_create_computer_account (adcli_enroll *enroll,
 	if (!searched) {
 		res = load_computer_account (enroll, ldap, &results, &entry);
 		if (res != ADCLI_SUCCESS)
-			return res;
+			return _adcli_phase_end (&phase, res);
 	}
 
+	phase.detail = enroll->computer_dn;
+	_adcli_phase_end (&phase, ADCLI_SUCCESS);
+
 	res = validate_computer_account (enroll, allow_overwrite, entry != NULL);
-	if (res == ADCLI_SUCCESS && entry == NULL)
-		res = create_computer_account (enroll, ldap, ldap_passwd);
+	if (res == ADCLI_SUCCESS && entry == NULL) {
+		_adcli_phase_begin (&phase, "create", enroll->computer_dn);
+		res = _adcli_phase_end (&phase, create_computer_account (enroll, ldap, ldap_passwd));
+	}
 
 	/* Service account already exists, just continue and update the
 	 * password */
@@ -1475,7 +1495,7 @@ set_password_with_ldap (adcli_enroll *enroll)
 
 	_adcli_info ("Trying to set %s password with LDAP", s_or_c (enroll));
 
-	ret = ldap_modify_ext_s (ldap, enroll->computer_dn, all_mods, NULL, NULL);
+	ret = _adcli_ldap_modify_ext_s (ldap, enroll->computer_dn, all_mods, NULL, NULL);
 	ber_bvfree (vals_unicodePwd[0]);
 
 	if (ret == LDAP_INSUFFICIENT_ACCESS || ret == LDAP_OBJECT_CLASS_VIOLATION ||
@@ -1505,6 +1525,7 @@ set_password_with_user_creds (adcli_enroll *enroll)
 	adcli_result res;
 	int result_code;
 	char *message;
+	double started;
 
 	assert (enroll->computer_password != NULL);
 	assert (enroll->computer_principal != NULL);
@@ -1515,14 +1536,22 @@ set_password_with_user_creds (adcli_enroll *enroll)
 	ccache = adcli_conn_get_login_ccache (enroll->conn);
 	return_unexpected_if_fail (ccache != NULL);
 
+	/* A ticket for kadmin/changepw, then the kpasswd exchange */
+	if (_adcli_plan ("kpasswd", enroll->computer_sam, 2,
+	                 "set %s password with Kerberos", s_or_c (enroll)))
+		return ADCLI_SUCCESS;
+
 	memset (&result_string, 0, sizeof (result_string));
 	memset (&result_code_string, 0, sizeof (result_code_string));
 
 	_adcli_info ("Trying to set %s password with Kerberos", s_or_c (enroll));
 
+	started = _adcli_trace_clock ();
 	code = krb5_set_password_using_ccache (k5, ccache, enroll->computer_password,
 	                                       enroll->computer_principal, &result_code,
 	                                       &result_code_string, &result_string);
+	_adcli_krb5_trace (k5, "kpasswd", adcli_conn_get_domain_controller (enroll->conn),
+	                   enroll->computer_principal, code, started);
 
 	if (code != 0) {
 		_adcli_err ("Couldn't set password for %s account: %s: %s",
@@ -1576,12 +1605,18 @@ set_password_with_computer_creds (adcli_enroll *enroll)
 	int result_code;
 	adcli_result res;
 	char *message;
+	double started;
 
 	memset (&creds, 0, sizeof (creds));
 
 	k5 = adcli_conn_get_krb5_context (enroll->conn);
 	return_unexpected_if_fail (k5 != NULL);
 
+	/* Pre-authenticated AS exchange for kadmin/changepw, then kpasswd */
+	if (_adcli_plan ("kpasswd", enroll->computer_sam, 3,
+	                 "change %s password with Kerberos", s_or_c (enroll)))
+		return ADCLI_SUCCESS;
+
 	_adcli_info ("Trying to change %s password with Kerberos", s_or_c (enroll));
 
 	code = _adcli_kinit_computer_creds (enroll->conn, "kadmin/changepw", NULL, &creds);
@@ -1592,8 +1627,11 @@ set_password_with_computer_creds (adcli_enroll *enroll)
 		return ADCLI_ERR_DIRECTORY;
 	}
 
+	started = _adcli_trace_clock ();
 	code = krb5_change_password (k5, &creds, enroll->computer_password,
 	                             &result_code, &result_code_string, &result_string);
+	_adcli_krb5_trace (k5, "kpasswd", adcli_conn_get_domain_controller (enroll->conn),
+	                   creds.client, code, started);
 
 	krb5_free_cred_contents (k5, &creds);
 
@@ -1638,24 +1676,163 @@ set_password_with_computer_creds (adcli_enroll *enroll)
 }
 
 static adcli_result
-set_computer_password (adcli_enroll *enroll, int ldap_passwd)
+set_password_with_kerberos (adcli_enroll *enroll)
 {
-	if (ldap_passwd) {
-		return set_password_with_ldap (enroll);
-	}
-
 	if (adcli_conn_get_login_type (enroll->conn) == ADCLI_LOGIN_COMPUTER_ACCOUNT)
 		return set_password_with_computer_creds (enroll);
 	else
 		return set_password_with_user_creds (enroll);
 }
 
+typedef enum {
+	PASSWORD_PATH_LDAP = 1,
+	PASSWORD_PATH_KERBEROS,
+} password_path;
+
+/* How long the way of setting the password that last worked is kept */
+#define PASSWORD_PATH_TTL (30 * 24 * 60 * 60)
+
+static char *
+password_path_state (const char *domain)
+{
+	char *name;
+
+	if (asprintf (&name, "password-path.%s", domain) < 0)
+		return_val_if_reached (NULL);
+
+	_adcli_str_down (name);
+	return name;
+}
+
+static password_path
+lookup_password_path (const char *domain)
+{
+	password_path path = 0;
+	char *name;
+	char *data;
+
+	name = password_path_state (domain);
+	if (name == NULL)
+		return 0;
+
+	data = _adcli_state_read (name, PASSWORD_PATH_TTL, NULL);
+	if (data == NULL)
+		path = 0;
+	else if (strcmp (data, "ldap\n") == 0)
+		path = PASSWORD_PATH_LDAP;
+	else if (strcmp (data, "kerberos\n") == 0)
+		path = PASSWORD_PATH_KERBEROS;
+
+	free (data);
+	free (name);
+	return path;
+}
+
+/* Remembered per domain, so that later runs go straight to it */
+static void
+learn_password_path (const char *domain,
+                     password_path path)
+{
+	const char *data;
+	char *name;
+
+	name = password_path_state (domain);
+	if (name == NULL)
+		return;
+
+	data = (path == PASSWORD_PATH_LDAP) ? "ldap\n" : "kerberos\n";
+	if (!_adcli_state_write (name, data, strlen (data)))
+		_adcli_info ("Couldn't remember how the password was set for %s", domain);
+
+	free (name);
+}
+
+/*
+ * The LDAP way reuses the connection that is already open, while
+ * kpasswd needs a ticket and a connection of its own. So try LDAP
+ * first when the connection allows it, unless it has failed for this
+ * domain before.
+ */
+static bool
+prefer_password_with_ldap (const char *domain,
+                           bool sealed)
+{
+	return sealed && lookup_password_path (domain) != PASSWORD_PATH_KERBEROS;
+}
+
+/*
+ * AD only accepts unicodePwd over an encrypted connection, either LDAPS
+ * or a SASL bind with a security layer that seals rather than just signs.
+ */
+static int
+ldap_session_is_sealed (adcli_enroll *enroll)
+{
+	ber_len_t ssf = 0;
+	LDAP *ldap;
+
+	if (adcli_conn_get_use_ldaps (enroll->conn))
+		return 1;
+
+	ldap = adcli_conn_get_ldap_connection (enroll->conn);
+	if (ldap == NULL ||
+	    ldap_get_option (ldap, LDAP_OPT_X_SASL_SSF, &ssf) != LDAP_OPT_SUCCESS)
+		return 0;
+
+	return ssf > 1;
+}
+
+static adcli_result
+set_password_automatically (adcli_enroll *enroll)
+{
+	bool ldap_failed = false;
+	const char *domain;
+	adcli_result res;
+
+	domain = adcli_conn_get_domain_name (enroll->conn);
+	return_unexpected_if_fail (domain != NULL);
+
+	if (prefer_password_with_ldap (domain, ldap_session_is_sealed (enroll))) {
+		res = set_password_with_ldap (enroll);
+		if (res == ADCLI_SUCCESS) {
+			learn_password_path (domain, PASSWORD_PATH_LDAP);
+			return res;
+		}
+
+		if (res != ADCLI_ERR_CREDENTIALS && res != ADCLI_ERR_DIRECTORY)
+			return res;
+
+		_adcli_info ("Couldn't set %s password with LDAP, trying Kerberos",
+		             s_or_c (enroll));
+		ldap_failed = true;
+	}
+
+	/* Only a failed LDAP attempt says anything about the domain */
+	res = set_password_with_kerberos (enroll);
+	if (res == ADCLI_SUCCESS && ldap_failed)
+		learn_password_path (domain, PASSWORD_PATH_KERBEROS);
+	return res;
+}
+
+static adcli_result
+set_computer_password (adcli_enroll *enroll,
+                       adcli_enroll_flags flags)
+{
+	if (flags & ADCLI_ENROLL_LDAP_PASSWD)
+		return set_password_with_ldap (enroll);
+
+	if (flags & ADCLI_ENROLL_AUTO_PASSWD)
+		return set_password_automatically (enroll);
+
+	return set_password_with_kerberos (enroll);
+}
+
 static adcli_result
 retrieve_computer_account (adcli_enroll *enroll)
 {
 	adcli_result res = ADCLI_SUCCESS;
+	LDAPMessage *results = NULL;
 	unsigned long kvno;
-	char *value;
+	const char *value;
 	LDAP *ldap;
 	char *end;
 	int ret;
@@ -1666,21 +1843,31 @@ retrieve_computer_account (adcli_enroll *enroll)
 	ldap = adcli_conn_get_ldap_connection (enroll->conn);
 	assert (ldap != NULL);
 
-	ret = ldap_search_ext_s (ldap, enroll->computer_dn, LDAP_SCOPE_BASE,
-	                         "(objectClass=*)", default_ad_ldap_attrs,
-	                         0, NULL, NULL, NULL, -1,
-	                         &enroll->computer_attributes);
+	ret = _adcli_ldap_search_ext_s (ldap, enroll->computer_dn, LDAP_SCOPE_BASE,
+	                                "(objectClass=*)", default_ad_ldap_attrs,
+	                                0, NULL, NULL, NULL, -1,
+	                                &results);
 
 	if (ret != LDAP_SUCCESS) {
+		ldap_msgfree (results);
 		return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
 		                                   "Couldn't retrieve %s account info: %s",
 		                                   s_or_c (enroll),
 		                                   enroll->computer_dn);
 	}
 
+	/* Decode the attributes once, everything else reads from the index */
+	enroll->computer_attributes = _adcli_ldap_attrs_parse (ldap, results);
+	ldap_msgfree (results);
+	if (enroll->computer_attributes == NULL) {
+		_adcli_err ("Couldn't retrieve %s account info: %s",
+		            s_or_c (enroll), enroll->computer_dn);
+		return ADCLI_ERR_DIRECTORY;
+	}
+
 	/* Update the kvno */
 	if (enroll->kvno == 0) {
-		value = _adcli_ldap_parse_value (ldap, enroll->computer_attributes, "msDS-KeyVersionNumber");
+		value = _adcli_ldap_attrs_value (enroll->computer_attributes, "msDS-KeyVersionNumber");
 		if (value != NULL) {
 			kvno = strtoul (value, &end, 10);
 			if (end == NULL || *end != '\0') {
@@ -1695,8 +1882,6 @@ retrieve_computer_account (adcli_enroll *enroll)
 				             value, s_or_c (enroll), enroll->computer_dn);
 			}
 
-			free (value);
-
 		} else {
 			/* Apparently old AD didn't have this attribute, use zero */
 			enroll->kvno = 0;
@@ -1737,7 +1922,7 @@ update_and_calculate_enctypes (adcli_enroll *enroll)
 	if (filter_for_necessary_updates (enroll, ldap, enroll->computer_attributes, mods) == 0)
 		ret = 0;
 	else
-		ret = ldap_modify_ext_s (ldap, enroll->computer_dn, mods, NULL, NULL);
+		ret = _adcli_ldap_modify_ext_s (ldap, enroll->computer_dn, mods, NULL, NULL);
 
 	free (new_value);
 
@@ -1763,21 +1948,26 @@ update_computer_attribute (adcli_enroll *enroll,
                            LDAPMod **mods)
 {
 	adcli_result res = ADCLI_SUCCESS;
-	char *string;
+	char *string = NULL;
 	int ret;
 
 	/* See if there are any changes to be made? */
 	if (filter_for_necessary_updates (enroll, ldap, enroll->computer_attributes, mods) == 0)
 		return ADCLI_SUCCESS;
 
-	string = _adcli_ldap_mods_to_string (mods);
-	return_unexpected_if_fail (string != NULL);
-
-	_adcli_info ("Modifying %s account: %s", s_or_c (enroll), string);
+	/* The changes are only described when someone is listening, or on failure */
+	if (_adcli_log_enabled (ADCLI_LOG_INFO)) {
+		string = _adcli_ldap_mods_to_string (mods);
+		return_unexpected_if_fail (string != NULL);
+		_adcli_info ("Modifying %s account: %s", s_or_c (enroll), string);
+	}
 
-	ret = ldap_modify_ext_s (ldap, enroll->computer_dn, mods, NULL, NULL);
+	ret = _adcli_ldap_modify_ext_s (ldap, enroll->computer_dn, mods, NULL, NULL);
 
 	if (ret != LDAP_SUCCESS) {
+		if (string == NULL)
+			string = _adcli_ldap_mods_to_string (mods);
+		return_unexpected_if_fail (string != NULL);
 		_adcli_warn ("Couldn't set %s on %s account: %s: %s",
 		             string, s_or_c (enroll), enroll->computer_dn,
 		             ldap_err2string (ret));
@@ -1792,24 +1982,20 @@ static char *get_user_account_control (adcli_enroll *enroll)
 {
 	uint32_t uac = 0;
 	unsigned long attr_val;
+	const char *value;
 	char *uac_str;
-	LDAP *ldap;
 	char *end;
 
-	ldap = adcli_conn_get_ldap_connection (enroll->conn);
-	return_val_if_fail (ldap != NULL, NULL);
-
-	uac_str = _adcli_ldap_parse_value (ldap, enroll->computer_attributes, "userAccountControl");
-	if (uac_str != NULL) {
+	value = _adcli_ldap_attrs_value (enroll->computer_attributes, "userAccountControl");
+	if (value != NULL) {
 
-		attr_val = strtoul (uac_str, &end, 10);
+		attr_val = strtoul (value, &end, 10);
 		if (*end != '\0' || attr_val > UINT32_MAX) {
 			_adcli_warn ("Invalid userAccountControl '%s' for %s account in directory: %s, assuming 0",
-			            uac_str, s_or_c (enroll), enroll->computer_dn);
+			            value, s_or_c (enroll), enroll->computer_dn);
 		} else {
 			uac = attr_val;
 		}
-		free (uac_str);
 	}
 
 	if (uac == 0) {
@@ -1852,7 +2038,7 @@ update_computer_account (adcli_enroll *enroll)
 {
 	int res = 0;
 	LDAP *ldap;
-	char *value = NULL;
+	const char *value;
 
 	/* No updates for service accounts */
 	if (enroll->is_service) {
@@ -1867,11 +2053,8 @@ update_computer_account (adcli_enroll *enroll)
 	 * must be always called with the same set of options to make sure
 	 * existing attributes are not deleted or overwritten with different
 	 * values. */
-	if (enroll->computer_attributes != NULL) {
-		value = _adcli_ldap_parse_value (ldap,
-		                                 enroll->computer_attributes,
-		                                 "dNSHostName");
-	}
+	value = _adcli_ldap_attrs_value (enroll->computer_attributes,
+	                                 "dNSHostName");
 	if (enroll->host_fqdn_explicit || value == NULL ) {
 		char *vals_dNSHostName[] = { enroll->host_fqdn, NULL };
 		LDAPMod dNSHostName = { LDAP_MOD_REPLACE, "dNSHostName", { vals_dNSHostName, } };
@@ -1879,7 +2062,6 @@ update_computer_account (adcli_enroll *enroll)
 
 		res |= update_computer_attribute (enroll, ldap, mods);
 	}
-	free (value);
 
 	if (res == ADCLI_SUCCESS && (enroll->trusted_for_delegation_explicit ||
 	                             enroll->dont_expire_password_explicit ||
@@ -1960,7 +2142,7 @@ update_computer_account (adcli_enroll *enroll)
 static adcli_result
 update_service_principals (adcli_enroll *enroll)
 {
-	LDAPMod servicePrincipalName = { LDAP_MOD_REPLACE, "servicePrincipalName", { enroll->service_principals, } };
+	LDAPMod servicePrincipalName = { LDAP_MOD_REPLACE, "servicePrincipalName", { enroll->service_principals.strv, } };
 	LDAPMod *mods[] = { &servicePrincipalName, NULL, };
 	LDAP *ldap;
 	int ret;
@@ -1977,7 +2159,7 @@ update_service_principals (adcli_enroll *enroll)
 	if (filter_for_necessary_updates (enroll, ldap, enroll->computer_attributes, mods) == 0)
 		return ADCLI_SUCCESS;
 
-	ret = ldap_modify_ext_s (ldap, enroll->computer_dn, mods, NULL, NULL);
+	ret = _adcli_ldap_modify_ext_s (ldap, enroll->computer_dn, mods, NULL, NULL);
 	if (ret == LDAP_INSUFFICIENT_ACCESS) {
 		return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_CREDENTIALS,
 		                                   "Insufficient permissions to set service principals on computer account: %s",
@@ -2068,11 +2250,11 @@ load_keytab_entry (krb5_context k5,
 	len = strlen (name);
 
 	if (!enroll->service_principals_explicit) {
-		if (!_adcli_strv_has (enroll->service_principals, name) && strchr (name, '/')) {
+		if (strchr (name, '/') && !_adcli_strset_has (&enroll->service_principals, name, true)) {
 			value = strdup (name);
 			return_val_if_fail (value != NULL, FALSE);
 			_adcli_info ("Found service principal in keytab: %s", value);
-			enroll->service_principals = _adcli_strv_add_unique (enroll->service_principals, value, NULL, false);
+			_adcli_strset_add (&enroll->service_principals, value);
 		}
 	}
 
@@ -2333,6 +2515,33 @@ add_principal_to_keytab (adcli_enroll *enroll,
 	return ADCLI_SUCCESS;
 }
 
+static void
+plan_keytab_for_principals (adcli_enroll *enroll,
+                            krb5_context k5,
+                            adcli_enroll_flags flags)
+{
+	int round_trips;
+	char *name;
+	int i;
+
+	/* Discovering the salt authenticates once with the new password */
+	round_trips = (flags & ADCLI_ENROLL_PASSWORD_VALID) ? 0 : 1;
+
+	for (i = 0; enroll->keytab_principals[i] != 0; i++) {
+		if (krb5_unparse_name (k5, enroll->keytab_principals[i], &name) != 0)
+			continue;
+		_adcli_plan ("keytab-add", enroll->keytab_name, round_trips, "%s", name);
+		krb5_free_unparsed_name (k5, name);
+		round_trips = 0;
+	}
+
+	for (i = 0; enroll->service_principals_to_remove &&
+	            enroll->service_principals_to_remove[i] != NULL; i++) {
+		_adcli_plan ("keytab-remove", enroll->keytab_name, 0, "%s",
+		             enroll->service_principals_to_remove[i]);
+	}
+}
+
 static adcli_result
 update_keytab_for_principals (adcli_enroll *enroll,
                               adcli_enroll_flags flags)
@@ -2348,6 +2557,11 @@ update_keytab_for_principals (adcli_enroll *enroll,
 	k5 = adcli_conn_get_krb5_context (enroll->conn);
 	return_unexpected_if_fail (k5 != NULL);
 
+	if (_adcli_planning ()) {
+		plan_keytab_for_principals (enroll, k5, flags);
+		return ADCLI_SUCCESS;
+	}
+
 	for (i = 0; enroll->keytab_principals[i] != 0; i++) {
 		if (krb5_unparse_name (k5, enroll->keytab_principals[i], &name) != 0)
 			name = "";
@@ -2387,6 +2601,9 @@ update_samba_data (adcli_enroll *enroll)
 	}
 	argv_sid[0] = argv_pw[0];
 
+	if (_adcli_plan ("samba", argv_pw[0], 0, "set domain SID and machine password"))
+		return ADCLI_SUCCESS;
+
 	argv_sid[2] = (char *) adcli_conn_get_domain_sid (enroll->conn);
 	if (argv_sid[2] == NULL) {
 		_adcli_err ("Domain SID not available.");
@@ -2448,8 +2665,7 @@ enroll_clear_state (adcli_enroll *enroll)
 	enroll->computer_container = NULL;
 
 	if (!enroll->service_principals_explicit) {
-		_adcli_strv_free (enroll->service_principals);
-		enroll->service_principals = NULL;
+		_adcli_strset_clear (&enroll->service_principals);
 	}
 
 	if (enroll->user_princpal_generate) {
@@ -2459,10 +2675,8 @@ enroll_clear_state (adcli_enroll *enroll)
 
 	enroll->kvno = 0;
 
-	if (enroll->computer_attributes) {
-		ldap_msgfree (enroll->computer_attributes);
-		enroll->computer_attributes = NULL;
-	}
+	_adcli_ldap_attrs_free (enroll->computer_attributes);
+	enroll->computer_attributes = NULL;
 
 	if (!enroll->domain_ou_explicit) {
 		free (enroll->domain_ou);
@@ -2508,36 +2722,27 @@ adcli_enroll_prepare (adcli_enroll *enroll,
 static adcli_result
 add_server_side_service_principals (adcli_enroll *enroll)
 {
-	char **spn_list;
-	LDAP *ldap;
+	struct berval **spn_list;
+	const char *spn;
 	size_t c;
-	int length = 0;
 	adcli_result res;
 
-	ldap = adcli_conn_get_ldap_connection (enroll->conn);
-	assert (ldap != NULL);
-
-	spn_list = _adcli_ldap_parse_values (ldap, enroll->computer_attributes,
-	                                     "servicePrincipalName");
+	spn_list = _adcli_ldap_attrs_bvals (enroll->computer_attributes,
+	                                    "servicePrincipalName");
 	if (spn_list == NULL) {
 		return ADCLI_SUCCESS;
 	}
 
-	if (enroll->service_principals != NULL) {
-		length = seq_count (enroll->service_principals);
-	}
-
 	for (c = 0; spn_list[c] != NULL; c++) {
-		_adcli_info ("Checking %s", spn_list[c]);
-		if (!_adcli_strv_has_ex (enroll->service_principals_to_remove, spn_list[c], strcasecmp)) {
-			enroll->service_principals = _adcli_strv_add_unique (enroll->service_principals,
-			                                                     strdup (spn_list[c]),
-			                                                     &length, false);
-			assert (enroll->service_principals != NULL);
-			_adcli_info ("   Added %s", spn_list[c]);
+		spn = spn_list[c]->bv_val;
+		_adcli_info ("Checking %s", spn);
+		if (!_adcli_strv_has_ex (enroll->service_principals_to_remove, spn, strcasecmp)) {
+			_adcli_strset_add_unique (&enroll->service_principals,
+			                          strdup (spn), false);
+			assert (enroll->service_principals.strv != NULL);
+			_adcli_info ("   Added %s", spn);
 		}
 	}
-	_adcli_strv_free (spn_list);
 
 	res = ensure_keytab_principals (ADCLI_SUCCESS, enroll);
 	if (res != ADCLI_SUCCESS) {
@@ -2553,6 +2758,7 @@ enroll_join_or_update_tasks (adcli_enroll *enroll,
 {
 	adcli_result res;
 	krb5_kvno old_kvno = -1;
+	_adcli_phase phase;
 
 	if (!(flags & ADCLI_ENROLL_PASSWORD_VALID)) {
 
@@ -2571,13 +2777,14 @@ enroll_join_or_update_tasks (adcli_enroll *enroll,
 			old_kvno = adcli_enroll_get_kvno (enroll);
 			_adcli_info ("Found old kvno '%d'", old_kvno);
 
-			ldap_msgfree (enroll->computer_attributes);
+			_adcli_ldap_attrs_free (enroll->computer_attributes);
 			enroll->computer_attributes = NULL;
 			adcli_enroll_set_kvno (enroll, 0);
 		}
 
-		res = set_computer_password (enroll, flags & ADCLI_ENROLL_LDAP_PASSWD);
-		if (res != ADCLI_SUCCESS)
+		_adcli_phase_begin (&phase, "set-password", enroll->computer_dn);
+		res = set_computer_password (enroll, flags);
+		if (_adcli_phase_end (&phase, res) != ADCLI_SUCCESS)
 			return res;
 	}
 
@@ -2587,8 +2794,9 @@ enroll_join_or_update_tasks (adcli_enroll *enroll,
 
 	/* Get information about the computer account if needed */
 	if (enroll->computer_attributes == NULL) {
+		_adcli_phase_begin (&phase, "retrieve", enroll->computer_dn);
 		res = retrieve_computer_account (enroll);
-		if (res != ADCLI_SUCCESS)
+		if (_adcli_phase_end (&phase, res) != ADCLI_SUCCESS)
 			return res;
 	}
 
@@ -2601,13 +2809,15 @@ enroll_join_or_update_tasks (adcli_enroll *enroll,
 		             "will be incremented by 1 to '%d'", enroll->kvno);
 	}
 
+	_adcli_phase_begin (&phase, "update-attributes", enroll->computer_dn);
+
 	/* We ignore failures of setting these fields */
 	update_and_calculate_enctypes (enroll);
 	update_computer_account (enroll);
 
 	res = add_server_side_service_principals (enroll);
 	if (res != ADCLI_SUCCESS) {
-		return res;
+		return _adcli_phase_end (&phase, res);
 	}
 
 	/* service_names is only set from input on the command line, so no
@@ -2615,11 +2825,11 @@ enroll_join_or_update_tasks (adcli_enroll *enroll,
 	if (enroll->service_names != NULL) {
 		res = add_service_names_to_service_principals (enroll);
 		if (res != ADCLI_SUCCESS) {
-			return res;
+			return _adcli_phase_end (&phase, res);
 		}
 		res = ensure_keytab_principals (res, enroll);
 		if (res != ADCLI_SUCCESS) {
-			return res;
+			return _adcli_phase_end (&phase, res);
 		}
 	}
 
@@ -2634,6 +2844,8 @@ enroll_join_or_update_tasks (adcli_enroll *enroll,
 		}
 	}
 
+	_adcli_phase_end (&phase, ADCLI_SUCCESS);
+
 	if (flags & ADCLI_ENROLL_NO_KEYTAB)
 		return ADCLI_SUCCESS;
 
@@ -2642,7 +2854,8 @@ enroll_join_or_update_tasks (adcli_enroll *enroll,
 	 * that we use for salting.
 	 */
 
-	return update_keytab_for_principals (enroll, flags);
+	_adcli_phase_begin (&phase, "write-keytab", enroll->keytab_name);
+	return _adcli_phase_end (&phase, update_keytab_for_principals (enroll, flags));
 }
 
 static adcli_result
@@ -2755,31 +2968,72 @@ adcli_enroll_load (adcli_enroll *enroll)
 		enroll->full_computer_name_explicit = 1;
 	if (enroll->host_fqdn)
 		enroll->host_fqdn_explicit = 1;
-	if (enroll->service_principals)
+	if (enroll->service_principals.strv)
 		enroll->service_principals_explicit = 1;
 
 	return ADCLI_SUCCESS;
 }
 
-adcli_result
-adcli_enroll_read_computer_account (adcli_enroll *enroll,
-		                    adcli_enroll_flags flags)
+/*
+ * Looks the account up across the forest in the global catalog, and
+ * moves the connection to the domain holding it, where it can be changed.
+ */
+static adcli_result
+locate_computer_in_forest (adcli_enroll *enroll)
 {
-	adcli_result res = ADCLI_SUCCESS;
-	LDAP *ldap;
+	_adcli_arena *arena;
+	_adcli_arena_mark mark;
+	adcli_result res;
+	char *domain;
+	char *filter;
+	char *value;
+	char *dn;
 
-	return_unexpected_if_fail (enroll != NULL);
+	arena = _adcli_conn_get_arena (enroll->conn);
+	_adcli_arena_get_mark (arena, &mark);
 
-	adcli_clear_last_error ();
-	enroll_clear_state (enroll);
+	value = _adcli_ldap_escape_filter_in (arena, enroll->computer_sam);
+	filter = value ? _adcli_arena_printf (arena, "(&(objectClass=%s)(sAMAccountName=%s))",
+	                                      enroll->is_service ? "msDS-ManagedServiceAccount" : "computer",
+	                                      value) : NULL;
+	if (filter == NULL) {
+		_adcli_arena_release (arena, &mark);
+		return_unexpected_if_reached ();
+	}
 
-	res = adcli_conn_discover (enroll->conn);
-	if (res != ADCLI_SUCCESS)
+	res = adcli_conn_locate_in_forest (enroll->conn, filter, &dn, &domain);
+	_adcli_arena_release (arena, &mark);
+
+	if (res != ADCLI_SUCCESS || dn == NULL)
 		return res;
 
-	res = adcli_enroll_prepare (enroll, flags);
-	if (res != ADCLI_SUCCESS)
+	if (strcasecmp (domain, adcli_conn_get_domain_name (enroll->conn)) != 0) {
+		_adcli_info ("The %s account for %s is in domain: %s",
+		             s_or_c (enroll), enroll->computer_sam, domain);
+		res = adcli_conn_move_to_domain (enroll->conn, domain);
+
+		/* The principal names the realm of the other domain */
+		res = ensure_computer_sam (res, enroll);
+	}
+
+	free (domain);
+
+	if (res != ADCLI_SUCCESS) {
+		free (dn);
 		return res;
+	}
+
+	free (enroll->computer_dn);
+	enroll->computer_dn = dn;
+	return ADCLI_SUCCESS;
+}
+
+static adcli_result
+read_computer_account (adcli_enroll *enroll,
+                       adcli_enroll_flags flags)
+{
+	adcli_result res;
+	LDAP *ldap;
 
 	ldap = adcli_conn_get_ldap_connection (enroll->conn);
 	assert (ldap != NULL);
@@ -2787,6 +3041,9 @@ adcli_enroll_read_computer_account (adcli_enroll *enroll,
 	/* Find the computer dn */
 	if (!enroll->computer_dn) {
 		res = locate_computer_account (enroll, ldap, false, NULL, NULL);
+		if (res == ADCLI_SUCCESS && !enroll->computer_dn &&
+		    (flags & ADCLI_ENROLL_GLOBAL_CATALOG))
+			res = locate_computer_in_forest (enroll);
 		if (res != ADCLI_SUCCESS)
 			return res;
 		if (!enroll->computer_dn) {
@@ -2800,27 +3057,74 @@ adcli_enroll_read_computer_account (adcli_enroll *enroll,
 	return retrieve_computer_account (enroll);
 }
 
+adcli_result
+adcli_enroll_read_computer_account (adcli_enroll *enroll,
+		                    adcli_enroll_flags flags)
+{
+	adcli_result res = ADCLI_SUCCESS;
+
+	return_unexpected_if_fail (enroll != NULL);
+
+	adcli_clear_last_error ();
+	enroll_clear_state (enroll);
+
+	res = adcli_conn_discover (enroll->conn);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	res = adcli_enroll_prepare (enroll, flags);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	/* Only reads, so it can run again if the connection went away */
+	res = read_computer_account (enroll, flags);
+	if (_adcli_conn_retry (enroll->conn, res)) {
+		_adcli_ldap_attrs_free (enroll->computer_attributes);
+		enroll->computer_attributes = NULL;
+		res = read_computer_account (enroll, flags);
+	}
+
+	return res;
+}
+
+static bool
+rotation_not_due (adcli_enroll *enroll)
+{
+	char buf[64];
+	time_t when;
+	struct tm tm;
+
+	when = adcli_enroll_get_rotation_time (enroll);
+	if (when <= time (NULL))
+		return false;
+
+	if (localtime_r (&when, &tm) && strftime (buf, sizeof (buf), "%Y-%m-%d %H:%M:%S", &tm))
+		_adcli_info ("Password rotation is not due until %s", buf);
+	return true;
+}
+
 adcli_result
 adcli_enroll_update (adcli_enroll *enroll,
 		     adcli_enroll_flags flags)
 {
 	adcli_result res = ADCLI_SUCCESS;
-	LDAP *ldap;
-	char *value;
+	const char *value;
+	bool valid;
 
 	res = adcli_enroll_read_computer_account (enroll, flags);
 	if (res != ADCLI_SUCCESS)
 		return res;
 
-	ldap = adcli_conn_get_ldap_connection (enroll->conn);
-	assert (ldap != NULL);
-
-	value = _adcli_ldap_parse_value (ldap,
-	                                 enroll->computer_attributes,
+	value = _adcli_ldap_attrs_value (enroll->computer_attributes,
 	                                 "pwdLastSet");
 
-	if (_adcli_check_nt_time_string_lifetime (value,
-	                adcli_enroll_get_computer_password_lifetime (enroll))) {
+	if (enroll->rotation_window > 0)
+		valid = rotation_not_due (enroll);
+	else
+		valid = _adcli_check_nt_time_string_lifetime (value,
+		                adcli_enroll_get_computer_password_lifetime (enroll));
+
+	if (valid) {
 		/* Do not update keytab if neither new service principals have
                  * to be added or deleted nor the user principal has to be changed. */
 		if (enroll->service_names == NULL
@@ -2831,7 +3135,6 @@ adcli_enroll_update (adcli_enroll *enroll,
 		}
 		flags |= ADCLI_ENROLL_PASSWORD_VALID;
 	}
-	free (value);
 
 	/* We only support password changes for service accounts */
 	if (enroll->is_service && (flags & ADCLI_ENROLL_PASSWORD_VALID)) {
@@ -2841,37 +3144,250 @@ adcli_enroll_update (adcli_enroll *enroll,
 	return enroll_join_or_update_tasks (enroll, flags);
 }
 
-adcli_result
-adcli_enroll_show_computer_attribute (adcli_enroll *enroll)
+static void
+print_computer_attributes (_adcli_ldap_attrs *attrs)
 {
-	LDAP *ldap;
+	struct berval **vals;
 	size_t c;
-	char **vals;
 	size_t v;
 
-	ldap = adcli_conn_get_ldap_connection (enroll->conn);
-	assert (ldap != NULL);
-
 	for (c = 0; default_ad_ldap_attrs[c] != NULL; c++) {
-		vals = _adcli_ldap_parse_values (ldap,
-		                                 enroll->computer_attributes,
-		                                 default_ad_ldap_attrs[c]);
+		vals = _adcli_ldap_attrs_bvals (attrs, default_ad_ldap_attrs[c]);
 		printf ("%s:\n", default_ad_ldap_attrs[c]);
 		if (vals == NULL) {
 			printf (" - not set -\n");
 		} else {
 			for (v = 0; vals[v] != NULL; v++) {
-				printf (" %s\n", vals[v]);
+				printf (" %s\n", vals[v]->bv_val);
 			}
 		}
-		_adcli_strv_free (vals);
 	}
-
-	return ADCLI_SUCCESS;
 }
 
 adcli_result
-adcli_enroll_delete (adcli_enroll *enroll,
+adcli_enroll_show_computer_attribute (adcli_enroll *enroll)
+{
+	print_computer_attributes (enroll->computer_attributes);
+	return ADCLI_SUCCESS;
+}
+
+typedef struct {
+	const char *sam;
+	const char *name;
+	int index;
+	bool found;
+} show_host;
+
+static int
+compare_show_host (const void *one,
+                   const void *two)
+{
+	return strcasecmp (((const show_host *)one)->sam,
+	                   ((const show_host *)two)->sam);
+}
+
+static int
+compare_show_sam (const void *sam,
+                  const void *host)
+{
+	return strcasecmp (sam, ((const show_host *)host)->sam);
+}
+
+typedef struct {
+	show_host *hosts;
+	int n_hosts;
+} show_search;
+
+static adcli_result
+show_computer_found (LDAP *ldap,
+                     LDAPMessage *entry,
+                     void *data)
+{
+	show_search *search = data;
+	_adcli_ldap_attrs *attrs;
+	show_host *host;
+	const char *sam;
+	int i;
+
+	attrs = _adcli_ldap_attrs_parse (ldap, entry);
+	return_unexpected_if_fail (attrs != NULL);
+
+	/* The same account may have been asked for under several names */
+	sam = _adcli_ldap_attrs_value (attrs, "sAMAccountName");
+	host = sam ? bsearch (sam, search->hosts, search->n_hosts,
+	                      sizeof (show_host), compare_show_sam) : NULL;
+	if (host != NULL) {
+		i = host - search->hosts;
+		while (i > 0 && compare_show_sam (sam, search->hosts + i - 1) == 0)
+			i--;
+		while (i < search->n_hosts && compare_show_sam (sam, search->hosts + i) == 0)
+			search->hosts[i++].found = true;
+	}
+
+	printf ("dn: %s\n", _adcli_ldap_attrs_dn (attrs));
+	print_computer_attributes (attrs);
+	printf ("\n");
+
+	_adcli_ldap_attrs_free (attrs);
+	return ADCLI_SUCCESS;
+}
+
+/*
+ * All accounts are fetched with one subtree search, built in one buffer
+ * since there may be thousands of names in the filter. AD refuses an
+ * empty (|) so when no name is usable there is no filter, and no search.
+ */
+static adcli_result
+show_computers_filter (adcli_enroll *enroll,
+                       _adcli_arena *arena,
+                       show_search *search,
+                       char **filter)
+{
+	char *value;
+	size_t len;
+	size_t off;
+	int n_wanted;
+	int i;
+
+	*filter = NULL;
+
+	len = 64;
+	n_wanted = 0;
+	for (i = 0; i < search->n_hosts; i++) {
+		if (search->hosts[i].sam[0] == '\0')
+			continue;
+		len += strlen (search->hosts[i].sam) * 3 + 20;
+		n_wanted++;
+	}
+
+	if (n_wanted == 0)
+		return ADCLI_SUCCESS;
+
+	*filter = _adcli_arena_alloc (arena, len);
+	return_unexpected_if_fail (*filter != NULL);
+
+	off = snprintf (*filter, len, "(&(objectClass=%s)(|",
+	                enroll->is_service ? "msDS-ManagedServiceAccount" : "computer");
+	for (i = 0; i < search->n_hosts; i++) {
+		if (search->hosts[i].sam[0] == '\0' ||
+		    (i > 0 && compare_show_host (search->hosts + i - 1, search->hosts + i) == 0))
+			continue;
+		value = _adcli_ldap_escape_filter_in (arena, search->hosts[i].sam);
+		return_unexpected_if_fail (value != NULL);
+		off += snprintf (*filter + off, len - off, "(sAMAccountName=%s)", value);
+	}
+	snprintf (*filter + off, len - off, "))");
+
+	return ADCLI_SUCCESS;
+}
+
+adcli_result
+adcli_enroll_show_computers (adcli_enroll *enroll,
+                             const char **names,
+                             adcli_enroll_bulk_func func,
+                             void *data)
+{
+	show_search search = { NULL, 0 };
+	adcli_result failed = ADCLI_SUCCESS;
+	show_host **order;
+	adcli_result res = ADCLI_SUCCESS;
+	_adcli_arena *arena;
+	_adcli_arena_mark mark;
+	char *netbios_name;
+	char *full_name;
+	const char *base;
+	char *message;
+	char *filter;
+	LDAP *ldap;
+	int i;
+
+	return_unexpected_if_fail (enroll != NULL);
+	return_unexpected_if_fail (names != NULL);
+
+	adcli_clear_last_error ();
+
+	res = adcli_conn_discover (enroll->conn);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	ldap = adcli_conn_get_ldap_connection (enroll->conn);
+	return_unexpected_if_fail (ldap != NULL);
+
+	search.n_hosts = seq_count ((seq_voidp)names);
+	search.hosts = calloc (search.n_hosts + 1, sizeof (show_host));
+	return_unexpected_if_fail (search.hosts != NULL);
+
+	/* Account names, the filter and messages all live until we return */
+	arena = _adcli_conn_get_arena (enroll->conn);
+	_adcli_arena_get_mark (arena, &mark);
+
+	/* Same account name rules as for a single host name or fqdn */
+	for (i = 0; i < search.n_hosts; i++) {
+		netbios_name = full_name = NULL;
+		_adcli_calc_netbios_name (names[i], &netbios_name, &full_name);
+		free (full_name);
+
+		/* An unusable name is looked up as nothing, and reported missing */
+		if (netbios_name == NULL)
+			search.hosts[i].sam = "";
+		else
+			search.hosts[i].sam = _adcli_arena_printf (arena, "%s$", netbios_name);
+		free (netbios_name);
+		if (search.hosts[i].sam == NULL) {
+			res = ADCLI_ERR_UNEXPECTED;
+			goto out;
+		}
+
+		search.hosts[i].name = names[i];
+		search.hosts[i].index = i;
+	}
+
+	qsort (search.hosts, search.n_hosts, sizeof (show_host), compare_show_host);
+
+	res = show_computers_filter (enroll, arena, &search, &filter);
+	if (res == ADCLI_SUCCESS && filter != NULL) {
+		base = adcli_conn_get_default_naming_context (enroll->conn);
+		res = _adcli_ldap_search_paged (ldap, base, LDAP_SCOPE_SUBTREE, filter,
+		                                default_ad_ldap_attrs, 500, NULL,
+		                                show_computer_found, &search);
+	}
+
+	/* Report the names without an account in the order they were given */
+	if (res == ADCLI_SUCCESS) {
+		order = calloc (search.n_hosts + 1, sizeof (show_host *));
+		if (order == NULL) {
+			res = ADCLI_ERR_UNEXPECTED;
+			goto out;
+		}
+		for (i = 0; i < search.n_hosts; i++)
+			order[search.hosts[i].index] = search.hosts + i;
+
+		for (i = 0; i < search.n_hosts; i++) {
+			if (order[i]->found)
+				continue;
+			message = _adcli_arena_printf (arena, "No %s account for %s exists",
+			                               s_or_c (enroll), order[i]->name);
+			if (message == NULL) {
+				res = ADCLI_ERR_UNEXPECTED;
+				break;
+			}
+			_adcli_err ("%s", message);
+			if (func != NULL)
+				(func) (order[i]->name, NULL, ADCLI_ERR_CONFIG, message, data);
+			failed = ADCLI_ERR_CONFIG;
+		}
+
+		free (order);
+	}
+
+out:
+	_adcli_arena_release (arena, &mark);
+	free (search.hosts);
+	return res == ADCLI_SUCCESS ? failed : res;
+}
+
+adcli_result
+adcli_enroll_delete (adcli_enroll *enroll,
                      adcli_enroll_flags delete_flags)
 {
 	adcli_result res = ADCLI_SUCCESS;
@@ -2900,6 +3416,11 @@ adcli_enroll_delete (adcli_enroll *enroll,
 	/* Find the computer dn */
 	if (!enroll->computer_dn) {
 		res = locate_computer_account (enroll, ldap, false, NULL, NULL);
+		if (res == ADCLI_SUCCESS && !enroll->computer_dn &&
+		    (delete_flags & ADCLI_ENROLL_GLOBAL_CATALOG)) {
+			res = locate_computer_in_forest (enroll);
+			ldap = adcli_conn_get_ldap_connection (enroll->conn);
+		}
 		if (res != ADCLI_SUCCESS)
 			return res;
 		if (!enroll->computer_dn) {
@@ -2910,7 +3431,237 @@ adcli_enroll_delete (adcli_enroll *enroll,
 		}
 	}
 
-	return delete_computer_account (enroll, ldap);
+	return delete_computer_account (enroll, ldap,
+	                                delete_flags & ADCLI_ENROLL_RECURSIVE_DELETE);
+}
+
+#define STALE_PAGE_SIZE  500
+#define STALE_WINDOW     32
+
+typedef struct {
+	char *dn;
+	char *sam;
+	time_t last_used;
+	char uac[24];
+	char *uac_values[2];
+	LDAPMod mod;
+	LDAPMod *mods[2];
+} stale_account;
+
+typedef struct {
+	adcli_stale_flags flags;
+	stale_account **accounts;
+	int n_accounts;
+	_adcli_ldap_op *ops;
+	adcli_stale_func func;
+	void *data;
+} stale_search;
+
+static time_t
+parse_nt_time (const char *value)
+{
+	unsigned long long int nt_time;
+	char *endptr;
+
+	if (value == NULL)
+		return 0;
+
+	errno = 0;
+	nt_time = strtoull (value, &endptr, 10);
+	if (errno != 0 || *endptr != '\0' || endptr == value)
+		return 0;
+
+	/* NT timestamps start at 1601-01-01 and use a 100ns base */
+	nt_time /= 1000 * 1000 * 10;
+	if (nt_time <= AD_TO_UNIX_TIME_CONST)
+		return 0;
+	return nt_time - AD_TO_UNIX_TIME_CONST;
+}
+
+static void
+stale_account_free (void *data)
+{
+	stale_account *account = data;
+
+	if (account) {
+		free (account->dn);
+		free (account->sam);
+		free (account);
+	}
+}
+
+static adcli_result
+stale_account_found (LDAP *ldap,
+                     LDAPMessage *entry,
+                     void *data)
+{
+	stale_search *search = data;
+	stale_account *account;
+	_adcli_ldap_attrs *attrs;
+	const char *value;
+	unsigned long uac;
+	time_t last_logon;
+
+	attrs = _adcli_ldap_attrs_parse (ldap, entry);
+	return_unexpected_if_fail (attrs != NULL);
+
+	account = calloc (1, sizeof (stale_account));
+	return_unexpected_if_fail (account != NULL);
+	account->dn = strdup (_adcli_ldap_attrs_dn (attrs));
+	return_unexpected_if_fail (account->dn != NULL);
+
+	value = _adcli_ldap_attrs_value (attrs, "sAMAccountName");
+	account->sam = value ? strdup (value) : NULL;
+
+	account->last_used = parse_nt_time (_adcli_ldap_attrs_value (attrs, "pwdLastSet"));
+	last_logon = parse_nt_time (_adcli_ldap_attrs_value (attrs, "lastLogonTimestamp"));
+	if (last_logon > account->last_used)
+		account->last_used = last_logon;
+
+	value = _adcli_ldap_attrs_value (attrs, "userAccountControl");
+	uac = value ? strtoul (value, NULL, 10) : 0;
+	_adcli_ldap_attrs_free (attrs);
+
+	/* A plain report needs nothing more, so don't hold on to it */
+	if (!(search->flags & (ADCLI_STALE_DISABLE | ADCLI_STALE_DELETE)) ||
+	    search->flags & ADCLI_STALE_DRY_RUN) {
+		(search->func) (account->dn, account->sam, account->last_used,
+		                ADCLI_SUCCESS, search->data);
+		stale_account_free (account);
+		return ADCLI_SUCCESS;
+	}
+
+	if (search->flags & ADCLI_STALE_DISABLE) {
+		snprintf (account->uac, sizeof (account->uac), "%lu",
+		          uac | UAC_ACCOUNTDISABLE);
+		account->uac_values[0] = account->uac;
+		account->mod.mod_op = LDAP_MOD_REPLACE;
+		account->mod.mod_type = "userAccountControl";
+		account->mod.mod_vals.modv_strvals = account->uac_values;
+		account->mods[0] = &account->mod;
+	}
+
+	search->accounts = seq_push (search->accounts, &search->n_accounts, account);
+	return_unexpected_if_fail (search->accounts != NULL);
+	return ADCLI_SUCCESS;
+}
+
+static adcli_result
+stale_account_done (LDAP *ldap,
+                    _adcli_ldap_op *op,
+                    void *data)
+{
+	stale_search *search = data;
+	stale_account *account;
+	const char *verb;
+	const char *info;
+	adcli_result res;
+
+	account = search->accounts[op - search->ops];
+
+	verb = search->flags & ADCLI_STALE_DELETE ? "delete" : "disable";
+	info = op->diagnostic && op->diagnostic[0] ? op->diagnostic : ldap_err2string (op->code);
+
+	if (op->code == LDAP_INSUFFICIENT_ACCESS) {
+		_adcli_err ("Insufficient permissions to %s computer account: %s: %s",
+		            verb, account->dn, info);
+		res = ADCLI_ERR_CREDENTIALS;
+
+	} else if (op->code != LDAP_SUCCESS) {
+		_adcli_err ("Couldn't %s computer account: %s: %s",
+		            verb, account->dn, info);
+		res = ADCLI_ERR_DIRECTORY;
+
+	} else {
+		_adcli_log (ADCLI_LOG_INFO, "stale",
+		            search->flags & ADCLI_STALE_DELETE ? "Deleted computer account"
+		                                               : "Disabled computer account",
+		            "dn", account->dn, NULL);
+		res = ADCLI_SUCCESS;
+	}
+
+	(search->func) (account->dn, account->sam, account->last_used, res, search->data);
+	return res;
+}
+
+adcli_result
+adcli_enroll_stale_accounts (adcli_enroll *enroll,
+                             unsigned int max_age,
+                             adcli_stale_flags flags,
+                             adcli_stale_func func,
+                             void *data)
+{
+	char *attrs[] = { "sAMAccountName", "pwdLastSet", "lastLogonTimestamp",
+	                  "userAccountControl", NULL };
+	stale_search search = { flags, NULL, 0, NULL, func, data };
+	unsigned long long int threshold;
+	adcli_result res;
+	time_t cutoff;
+	const char *base;
+	char *filter;
+	LDAP *ldap;
+	int i;
+
+	return_unexpected_if_fail (enroll != NULL);
+	return_unexpected_if_fail (func != NULL);
+	return_unexpected_if_fail (!(flags & ADCLI_STALE_DISABLE) || !(flags & ADCLI_STALE_DELETE));
+	return_unexpected_if_fail (max_age > 0);
+
+	adcli_clear_last_error ();
+
+	ldap = adcli_conn_get_ldap_connection (enroll->conn);
+	return_unexpected_if_fail (ldap != NULL);
+
+	base = enroll->domain_ou;
+	if (base == NULL)
+		base = adcli_conn_get_default_naming_context (enroll->conn);
+	return_unexpected_if_fail (base != NULL);
+
+	/*
+	 * Let the domain controller do the age comparison, so that only the
+	 * stale accounts come back over the wire. Both attributes are in NT
+	 * time. lastLogonTimestamp is missing on accounts that never logged
+	 * on, and it is only replicated every couple of weeks, so callers
+	 * should not use a very short max_age. Domain controllers, including
+	 * read-only ones, are never considered stale.
+	 */
+	cutoff = time (NULL) - (time_t)max_age * 24 * 60 * 60;
+	if (cutoff < 0)
+		cutoff = 0;
+	threshold = (cutoff + AD_TO_UNIX_TIME_CONST) * 1000ULL * 1000 * 10;
+	if (asprintf (&filter, "(&(objectCategory=computer)"
+	                        "(!(userAccountControl:1.2.840.113556.1.4.804:=%u))"
+	                        "%s"
+	                        "(pwdLastSet<=%llu)"
+	                        "(|(!(lastLogonTimestamp=*))(lastLogonTimestamp<=%llu)))",
+	              UAC_SERVER_TRUST_ACCOUNT | UAC_PARTIAL_SECRETS_ACCOUNT,
+	              flags & ADCLI_STALE_DISABLE ?
+	                      "(!(userAccountControl:1.2.840.113556.1.4.803:=2))" : "",
+	              threshold, threshold) < 0)
+		return_unexpected_if_reached ();
+
+	res = _adcli_ldap_search_paged (ldap, base, LDAP_SCOPE_SUBTREE, filter, attrs,
+	                                STALE_PAGE_SIZE, NULL, stale_account_found, &search);
+	free (filter);
+
+	/* Only modify the directory once the search is complete */
+	if (res == ADCLI_SUCCESS && search.n_accounts > 0) {
+		search.ops = calloc (search.n_accounts, sizeof (_adcli_ldap_op));
+		return_unexpected_if_fail (search.ops != NULL);
+
+		for (i = 0; i < search.n_accounts; i++) {
+			search.ops[i].dn = search.accounts[i]->dn;
+			if (flags & ADCLI_STALE_DISABLE)
+				search.ops[i].mods = search.accounts[i]->mods;
+		}
+
+		res = _adcli_ldap_pipeline (ldap, search.ops, search.n_accounts, STALE_WINDOW,
+		                            stale_account_done, &search);
+		free (search.ops);
+	}
+
+	seq_free (search.accounts, stale_account_free);
+	return res;
 }
 
 adcli_result
@@ -2956,6 +3707,364 @@ adcli_enroll_password (adcli_enroll *enroll)
 	return set_computer_password (enroll, 0);
 }
 
+#define BULK_SEARCH_BATCH  64
+#define BULK_WINDOW        32
+
+typedef struct {
+	const char *name;
+	char *sam;
+	char *dn;
+	adcli_result res;
+	char *message;
+	int tree_delete;
+	struct berval *pwd_values[2];
+	LDAPMod mod;
+	LDAPMod *mods[2];
+} bulk_host;
+
+typedef struct {
+	bool reset;
+	bool recursive;
+	bulk_host *hosts;
+	_adcli_ldap_op *ops;
+	int *indexes;
+} bulk_request;
+
+static void
+bulk_host_failed (bulk_host *host,
+                  adcli_result res,
+                  const char *format,
+                  ...) GNUC_PRINTF(3, 4);
+
+static void
+bulk_host_failed (bulk_host *host,
+                  adcli_result res,
+                  const char *format,
+                  ...)
+{
+	va_list va;
+
+	free (host->message);
+	va_start (va, format);
+	if (vasprintf (&host->message, format, va) < 0)
+		host->message = NULL;
+	va_end (va);
+
+	host->res = res;
+	_adcli_err ("%s", host->message ? host->message : "Out of memory");
+}
+
+static adcli_result
+bulk_resolve_batch (adcli_enroll *enroll,
+                    LDAP *ldap,
+                    bulk_host *hosts,
+                    int n_hosts)
+{
+	char *attrs[] = { "sAMAccountName", NULL };
+	LDAPMessage *results = NULL;
+	LDAPMessage *entry;
+	_adcli_arena *arena;
+	_adcli_arena_mark mark;
+	const char *base;
+	char *filter;
+	char *value;
+	char *sam;
+	char *dn;
+	size_t len;
+	size_t off;
+	int n_wanted;
+	int ret;
+	int i;
+
+	len = 64;
+	n_wanted = 0;
+	for (i = 0; i < n_hosts; i++) {
+		if (hosts[i].sam != NULL) {
+			len += strlen (hosts[i].sam) * 3 + 20;
+			n_wanted++;
+		}
+	}
+
+	/* AD refuses an empty (|), and there's nothing to look up anyway */
+	if (n_wanted == 0)
+		return ADCLI_SUCCESS;
+
+	arena = _adcli_conn_get_arena (enroll->conn);
+	_adcli_arena_get_mark (arena, &mark);
+
+	/* One search with an OR filter for the whole batch of accounts */
+	filter = _adcli_arena_alloc (arena, len);
+	if (filter == NULL) {
+		_adcli_arena_release (arena, &mark);
+		return_unexpected_if_reached ();
+	}
+	off = snprintf (filter, len, "(&(objectClass=computer)(|");
+
+	for (i = 0; i < n_hosts; i++) {
+		if (hosts[i].sam == NULL)
+			continue;
+		value = _adcli_ldap_escape_filter_in (arena, hosts[i].sam);
+		if (value == NULL) {
+			_adcli_arena_release (arena, &mark);
+			return_unexpected_if_reached ();
+		}
+		off += snprintf (filter + off, len - off, "(sAMAccountName=%s)", value);
+	}
+	snprintf (filter + off, len - off, "))");
+
+	base = adcli_conn_get_default_naming_context (enroll->conn);
+	ret = _adcli_ldap_search_ext_s (ldap, base, LDAP_SCOPE_SUB, filter, attrs, 0,
+	                                NULL, NULL, NULL, -1, &results);
+
+	_adcli_arena_release (arena, &mark);
+
+	if (ret != LDAP_SUCCESS) {
+		ldap_msgfree (results);
+		return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
+		                                   "Couldn't lookup computer accounts");
+	}
+
+	for (entry = ldap_first_entry (ldap, results); entry != NULL;
+	     entry = ldap_next_entry (ldap, entry)) {
+		sam = _adcli_ldap_parse_value (ldap, entry, "sAMAccountName");
+		dn = ldap_get_dn (ldap, entry);
+		for (i = 0; sam && dn && i < n_hosts; i++) {
+			if (hosts[i].sam && !hosts[i].dn &&
+			    strcasecmp (hosts[i].sam, sam) == 0) {
+				hosts[i].dn = strdup (dn);
+				return_unexpected_if_fail (hosts[i].dn != NULL);
+			}
+		}
+		ldap_memfree (dn);
+		free (sam);
+	}
+
+	ldap_msgfree (results);
+	return ADCLI_SUCCESS;
+}
+
+static adcli_result
+bulk_host_done (LDAP *ldap,
+                _adcli_ldap_op *op,
+                void *data)
+{
+	bulk_request *request = data;
+	bulk_host *host;
+	const char *info;
+
+	host = request->hosts + request->indexes[op - request->ops];
+	info = op->diagnostic && op->diagnostic[0] ? op->diagnostic : ldap_err2string (op->code);
+
+	if (op->code == LDAP_SUCCESS) {
+		host->res = ADCLI_SUCCESS;
+		_adcli_log (ADCLI_LOG_INFO, "bulk",
+		            request->reset ? "Reset computer account" : "Deleted computer account",
+		            "dn", host->dn, NULL);
+
+	/* Accounts with child objects are deleted again as a whole tree */
+	} else if (!request->reset && request->recursive && !host->tree_delete &&
+	           op->code == LDAP_NOT_ALLOWED_ON_NONLEAF) {
+		host->tree_delete = 1;
+
+	} else if (!request->reset && op->code == LDAP_NOT_ALLOWED_ON_NONLEAF) {
+		bulk_host_failed (host, ADCLI_ERR_CONFIG,
+		                  "The computer account has child objects and was not deleted: %s",
+		                  host->dn);
+
+	} else if (request->reset &&
+	           (op->code == LDAP_INSUFFICIENT_ACCESS || op->code == LDAP_OBJECT_CLASS_VIOLATION ||
+	            op->code == LDAP_UNWILLING_TO_PERFORM || op->code == LDAP_CONSTRAINT_VIOLATION)) {
+		bulk_host_failed (host, ADCLI_ERR_CREDENTIALS,
+		                  "Insufficient permissions to set password for: %s: %s",
+		                  host->dn, info);
+
+	} else if (request->reset) {
+		bulk_host_failed (host, ADCLI_ERR_DIRECTORY,
+		                  "Couldn't set password for: %s: %s", host->dn, info);
+
+	} else if (op->code == LDAP_INSUFFICIENT_ACCESS) {
+		bulk_host_failed (host, ADCLI_ERR_CREDENTIALS,
+		                  "Insufficient permissions to delete computer account: %s: %s",
+		                  host->dn, info);
+
+	} else {
+		bulk_host_failed (host, ADCLI_ERR_DIRECTORY,
+		                  "Couldn't delete computer account: %s: %s", host->dn, info);
+	}
+
+	return ADCLI_SUCCESS;
+}
+
+static adcli_result
+bulk_modify_hosts (LDAP *ldap,
+                   bulk_request *request,
+                   int n_hosts,
+                   int tree_delete)
+{
+	LDAPControl control = { LDAP_CONTROL_X_TREE_DELETE, { 0, NULL }, 1 };
+	LDAPControl *controls[] = { &control, NULL };
+	bulk_host *host;
+	int n_ops = 0;
+	int i;
+
+	for (i = 0; i < n_hosts; i++) {
+		host = request->hosts + i;
+		if (host->dn == NULL || host->res != ADCLI_SUCCESS ||
+		    host->tree_delete != tree_delete)
+			continue;
+
+		request->indexes[n_ops] = i;
+		request->ops[n_ops].dn = host->dn;
+		request->ops[n_ops].mods = request->reset ? host->mods : NULL;
+		request->ops[n_ops].controls = tree_delete ? controls : NULL;
+		n_ops++;
+	}
+
+	if (n_ops == 0)
+		return ADCLI_SUCCESS;
+
+	return _adcli_ldap_pipeline (ldap, request->ops, n_ops, BULK_WINDOW,
+	                             bulk_host_done, request);
+}
+
+static adcli_result
+enroll_bulk (adcli_enroll *enroll,
+             const char **names,
+             bool reset,
+             bool recursive,
+             adcli_enroll_bulk_func func,
+             void *data)
+{
+	bulk_request request = { reset, recursive, NULL, NULL, NULL };
+	adcli_result failed = ADCLI_SUCCESS;
+	adcli_result res = ADCLI_SUCCESS;
+	char *netbios_name;
+	char *full_name;
+	char *password;
+	bulk_host *host;
+	int n_hosts;
+	LDAP *ldap;
+	int i;
+
+	return_unexpected_if_fail (enroll != NULL);
+	return_unexpected_if_fail (names != NULL);
+
+	adcli_clear_last_error ();
+
+	res = adcli_conn_discover (enroll->conn);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	ldap = adcli_conn_get_ldap_connection (enroll->conn);
+	return_unexpected_if_fail (ldap != NULL);
+
+	n_hosts = seq_count ((seq_voidp)names);
+	if (n_hosts == 0)
+		return ADCLI_SUCCESS;
+
+	request.hosts = calloc (n_hosts, sizeof (bulk_host));
+	request.ops = calloc (n_hosts, sizeof (_adcli_ldap_op));
+	request.indexes = calloc (n_hosts, sizeof (int));
+	return_unexpected_if_fail (request.hosts && request.ops && request.indexes);
+
+	/* Same account name rules as for a single host name or fqdn */
+	for (i = 0; i < n_hosts; i++) {
+		host = request.hosts + i;
+		host->name = names[i];
+
+		netbios_name = full_name = NULL;
+		_adcli_calc_netbios_name (names[i], &netbios_name, &full_name);
+		if (netbios_name == NULL) {
+			bulk_host_failed (host, ADCLI_ERR_CONFIG,
+			                  "Couldn't determine the computer account name from host name: %s",
+			                  names[i]);
+			free (full_name);
+			continue;
+		}
+
+		if (asprintf (&host->sam, "%s$", netbios_name) < 0)
+			return_unexpected_if_reached ();
+
+		if (reset) {
+			password = _adcli_calc_reset_password (netbios_name);
+			return_unexpected_if_fail (password != NULL);
+			host->pwd_values[0] = get_unicode_pwd (password);
+			_adcli_password_free (password);
+			return_unexpected_if_fail (host->pwd_values[0] != NULL);
+			host->mod.mod_op = LDAP_MOD_REPLACE | LDAP_MOD_BVALUES;
+			host->mod.mod_type = "unicodePwd";
+			host->mod.mod_vals.modv_bvals = host->pwd_values;
+			host->mods[0] = &host->mod;
+		}
+
+		free (netbios_name);
+		free (full_name);
+	}
+
+	for (i = 0; res == ADCLI_SUCCESS && i < n_hosts; i += BULK_SEARCH_BATCH) {
+		res = bulk_resolve_batch (enroll, ldap, request.hosts + i,
+		                          n_hosts - i < BULK_SEARCH_BATCH ? n_hosts - i : BULK_SEARCH_BATCH);
+	}
+
+	if (res == ADCLI_SUCCESS) {
+		for (i = 0; i < n_hosts; i++) {
+			host = request.hosts + i;
+			if (host->sam && !host->dn) {
+				bulk_host_failed (host, ADCLI_ERR_CONFIG,
+				                  "No computer account for %s exists", host->sam);
+			}
+		}
+
+		res = bulk_modify_hosts (ldap, &request, n_hosts, 0);
+		if (res == ADCLI_SUCCESS && recursive)
+			res = bulk_modify_hosts (ldap, &request, n_hosts, 1);
+	}
+
+	/* Report in the order the names were given, the first failure wins */
+	for (i = 0; i < n_hosts; i++) {
+		host = request.hosts + i;
+		if (res == ADCLI_SUCCESS) {
+			if (func != NULL)
+				(func) (host->name, host->dn, host->res, host->message, data);
+			if (failed == ADCLI_SUCCESS)
+				failed = host->res;
+		}
+		free (host->sam);
+		free (host->dn);
+		free (host->message);
+		if (host->pwd_values[0]) {
+			memset (host->pwd_values[0]->bv_val, 0, host->pwd_values[0]->bv_len);
+			ber_bvfree (host->pwd_values[0]);
+		}
+	}
+
+	free (request.hosts);
+	free (request.ops);
+	free (request.indexes);
+	return res == ADCLI_SUCCESS ? failed : res;
+}
+
+adcli_result
+adcli_enroll_delete_many (adcli_enroll *enroll,
+                          const char **names,
+                          adcli_enroll_flags delete_flags,
+                          adcli_enroll_bulk_func func,
+                          void *data)
+{
+	return enroll_bulk (enroll, names, false,
+	                    delete_flags & ADCLI_ENROLL_RECURSIVE_DELETE,
+	                    func, data);
+}
+
+adcli_result
+adcli_enroll_reset_many (adcli_enroll *enroll,
+                         const char **names,
+                         adcli_enroll_bulk_func func,
+                         void *data)
+{
+	return enroll_bulk (enroll, names, true, false, func, data);
+}
+
 adcli_enroll *
 adcli_enroll_new (adcli_conn *conn)
 {
@@ -3013,7 +4122,7 @@ enroll_free (adcli_enroll *enroll)
 
 	free (enroll->user_principal);
 	_adcli_strv_free (enroll->service_names);
-	_adcli_strv_free (enroll->service_principals);
+	_adcli_strset_clear (&enroll->service_principals);
 	_adcli_strv_free (enroll->setattr);
 	_adcli_password_free (enroll->computer_password);
 
@@ -3189,7 +4298,7 @@ const char **
 adcli_enroll_get_service_principals  (adcli_enroll *enroll)
 {
 	return_val_if_fail (enroll != NULL, NULL);
-	return (const char **)enroll->service_principals;
+	return (const char **)enroll->service_principals.strv;
 }
 
 void
@@ -3197,7 +4306,7 @@ adcli_enroll_set_service_principals (adcli_enroll *enroll,
                                      const char **value)
 {
 	return_if_fail (enroll != NULL);
-	_adcli_strv_set (&enroll->service_principals, value);
+	_adcli_strset_set (&enroll->service_principals, value);
 	enroll->service_principals_explicit = (value != NULL);
 }
 
@@ -3294,7 +4403,7 @@ adcli_enroll_get_keytab_enctypes (adcli_enroll *enroll)
 	if (enroll->keytab_enctypes)
 		return enroll->keytab_enctypes;
 
-	if (adcli_conn_server_has_capability (enroll->conn, ADCLI_CAP_V60_OID))
+	if (_adcli_conn_has_cap (enroll->conn, CAP_BIT_V60))
 		if (adcli_fips_enabled ()) {
 			return v60_later_enctypes_fips;
 		} else {
@@ -3472,6 +4581,39 @@ adcli_enroll_set_computer_password_lifetime (adcli_enroll *enroll,
 	enroll->computer_password_lifetime_explicit = 1;
 }
 
+unsigned int
+adcli_enroll_get_rotation_window (adcli_enroll *enroll)
+{
+	return_val_if_fail (enroll != NULL, 0);
+	return enroll->rotation_window;
+}
+
+void
+adcli_enroll_set_rotation_window (adcli_enroll *enroll,
+                                  unsigned int days)
+{
+	return_if_fail (enroll != NULL);
+	enroll->rotation_window = days;
+}
+
+time_t
+adcli_enroll_get_rotation_time (adcli_enroll *enroll)
+{
+	time_t last_set;
+
+	return_val_if_fail (enroll != NULL, 0);
+
+	/* An unknown pwdLastSet means the password is due now */
+	last_set = parse_nt_time (_adcli_ldap_attrs_value (enroll->computer_attributes,
+	                                                   "pwdLastSet"));
+	if (last_set == 0)
+		return 0;
+
+	return _adcli_rotation_time (last_set,
+	                             adcli_enroll_get_computer_password_lifetime (enroll),
+	                             enroll->rotation_window, enroll->computer_sam);
+}
+
 void
 adcli_enroll_set_samba_data_tool (adcli_enroll *enroll, const char *value)
 {
@@ -3573,6 +4715,21 @@ adcli_enroll_get_is_service (adcli_enroll *enroll)
 	return enroll->is_service;
 }
 
+/*
+ * Called before connecting, with the flags the password will be set
+ * with, so that the login can fetch the ticket for it up front.
+ */
+void
+adcli_enroll_plan_password (adcli_enroll *enroll,
+                            adcli_enroll_flags flags)
+{
+	return_if_fail (enroll != NULL);
+
+	_adcli_conn_set_changepw_planned (enroll->conn,
+	                                  !(flags & (ADCLI_ENROLL_LDAP_PASSWD |
+	                                             ADCLI_ENROLL_PASSWORD_VALID)));
+}
+
 const char **
 adcli_enroll_get_service_principals_to_add (adcli_enroll *enroll)
 {
@@ -3794,6 +4951,54 @@ test_comp_attr_name (void)
 	assert_num_eq (0, comp_attr_name ("abc=xyz", "abc=123"));
 }
 
+static void
+test_parse_nt_time (void)
+{
+	assert_num_eq (0, parse_nt_time (NULL));
+	assert_num_eq (0, parse_nt_time (""));
+	assert_num_eq (0, parse_nt_time ("abc"));
+	assert_num_eq (0, parse_nt_time ("0"));
+	assert_num_eq (0, parse_nt_time ("116444736000000000"));
+	assert_num_eq (1, parse_nt_time ("116444736010000000"));
+	assert_num_eq (1600000000, parse_nt_time ("132444736000000000"));
+}
+
+static void
+test_prefer_password_with_ldap (void)
+{
+	char directory[] = "/tmp/adcli-test-XXXXXX";
+	char *path;
+
+	assert (mkdtemp (directory) != NULL);
+	setenv ("ADCLI_STATE_DIR", directory, 1);
+
+	/* Nothing learned yet, only the connection counts */
+	assert (prefer_password_with_ldap ("path.dom", true));
+	assert (!prefer_password_with_ldap ("path.dom", false));
+
+	learn_password_path ("path.dom", PASSWORD_PATH_LDAP);
+	assert (prefer_password_with_ldap ("path.dom", true));
+	assert (!prefer_password_with_ldap ("path.dom", false));
+
+	/* After LDAP failed the domain goes straight to Kerberos */
+	learn_password_path ("PATH.DOM", PASSWORD_PATH_KERBEROS);
+	assert_num_eq (lookup_password_path ("path.dom"), PASSWORD_PATH_KERBEROS);
+	assert (!prefer_password_with_ldap ("path.dom", true));
+
+	/* Other domains are not affected */
+	assert_num_eq (lookup_password_path ("other.dom"), 0);
+	assert (prefer_password_with_ldap ("other.dom", true));
+
+	/* What was learned is kept on disk, only for the owner */
+	assert (asprintf (&path, "%s/password-path.path.dom", directory) >= 0);
+	assert_num_eq (access (path, R_OK), 0);
+
+	unlink (path);
+	free (path);
+	rmdir (directory);
+	unsetenv ("ADCLI_STATE_DIR");
+}
+
 int
 main (int argc,
       char *argv[])
@@ -3801,6 +5006,8 @@ main (int argc,
 	test_func (test_adcli_enroll_get_permitted_keytab_enctypes,
 	           "/attrs/adcli_enroll_get_permitted_keytab_enctypes");
 	test_func (test_comp_attr_name, "/attrs/comp_attr_name");
+	test_func (test_parse_nt_time, "/attrs/parse_nt_time");
+	test_func (test_prefer_password_with_ldap, "/attrs/prefer_password_with_ldap");
 	return test_run (argc, argv);
 }
 
@@ -26,16 +26,39 @@
 
 #include "adconn.h"
 
+#include <time.h>
+
 typedef enum {
 	ADCLI_ENROLL_NO_KEYTAB = 1 << 1,
 	ADCLI_ENROLL_ALLOW_OVERWRITE = 1 << 2,
 	ADCLI_ENROLL_PASSWORD_VALID = 1 << 3,
 	ADCLI_ENROLL_ADD_SAMBA_DATA = 1 << 4,
 	ADCLI_ENROLL_LDAP_PASSWD = 1 << 5,
+	ADCLI_ENROLL_AUTO_PASSWD = 1 << 6,
+	ADCLI_ENROLL_GLOBAL_CATALOG = 1 << 7,
+	ADCLI_ENROLL_RECURSIVE_DELETE = 1 << 8,
 } adcli_enroll_flags;
 
 typedef struct _adcli_enroll adcli_enroll;
 
+typedef enum {
+	ADCLI_STALE_DISABLE = 1 << 0,
+	ADCLI_STALE_DELETE = 1 << 1,
+	ADCLI_STALE_DRY_RUN = 1 << 2,
+} adcli_stale_flags;
+
+typedef void       (* adcli_enroll_bulk_func)           (const char *name,
+                                                         const char *computer_dn,
+                                                         adcli_result result,
+                                                         const char *message,
+                                                         void *data);
+
+typedef void       (* adcli_stale_func)                 (const char *computer_dn,
+                                                         const char *computer_sam,
+                                                         time_t last_used,
+                                                         adcli_result result,
+                                                         void *data);
+
 adcli_result       adcli_enroll_prepare                 (adcli_enroll *enroll,
                                                          adcli_enroll_flags flags);
 
@@ -52,11 +75,36 @@ adcli_result       adcli_enroll_read_computer_account   (adcli_enroll *enroll,
 
 adcli_result       adcli_enroll_show_computer_attribute (adcli_enroll *enroll);
 
+adcli_result       adcli_enroll_show_computers          (adcli_enroll *enroll,
+                                                         const char **names,
+                                                         adcli_enroll_bulk_func func,
+                                                         void *data);
+
 adcli_result       adcli_enroll_delete                  (adcli_enroll *enroll,
                                                          adcli_enroll_flags delete_flags);
 
+adcli_result       adcli_enroll_delete_many             (adcli_enroll *enroll,
+                                                         const char **names,
+                                                         adcli_enroll_flags delete_flags,
+                                                         adcli_enroll_bulk_func func,
+                                                         void *data);
+
+adcli_result       adcli_enroll_reset_many              (adcli_enroll *enroll,
+                                                         const char **names,
+                                                         adcli_enroll_bulk_func func,
+                                                         void *data);
+
+adcli_result       adcli_enroll_stale_accounts          (adcli_enroll *enroll,
+                                                         unsigned int max_age,
+                                                         adcli_stale_flags flags,
+                                                         adcli_stale_func func,
+                                                         void *data);
+
 adcli_result       adcli_enroll_password                (adcli_enroll *enroll);
 
+void               adcli_enroll_plan_password           (adcli_enroll *enroll,
+                                                         adcli_enroll_flags flags);
+
 adcli_enroll *     adcli_enroll_new                     (adcli_conn *conn);
 
 adcli_enroll *     adcli_enroll_ref                     (adcli_enroll *enroll);
@@ -127,6 +175,12 @@ unsigned int       adcli_enroll_get_computer_password_lifetime (adcli_enroll *en
 void               adcli_enroll_set_computer_password_lifetime (adcli_enroll *enroll,
                                                          unsigned int lifetime);
 
+unsigned int       adcli_enroll_get_rotation_window     (adcli_enroll *enroll);
+void               adcli_enroll_set_rotation_window     (adcli_enroll *enroll,
+                                                         unsigned int days);
+
+time_t             adcli_enroll_get_rotation_time       (adcli_enroll *enroll);
+
 bool               adcli_enroll_get_trusted_for_delegation (adcli_enroll *enroll);
 void               adcli_enroll_set_trusted_for_delegation (adcli_enroll *enroll,
                                                             bool value);
@@ -42,7 +42,7 @@ struct _adcli_entry {
 	char *entry_dn;
 	char *domain_ou;
 	char *entry_container;
-	LDAPMessage *entry_attrs;
+	_adcli_ldap_attrs *entry_attrs;
 };
 
 static adcli_entry *
@@ -84,7 +84,7 @@ entry_free (adcli_entry *entry)
 	free (entry->entry_container);
 	free (entry->entry_dn);
 	free (entry->domain_ou);
-	ldap_msgfree (entry->entry_attrs);
+	_adcli_ldap_attrs_free (entry->entry_attrs);
 	adcli_conn_unref (entry->conn);
 	free (entry);
 }
@@ -108,23 +108,29 @@ update_entry_from_domain (adcli_entry *entry,
 	const char *attrs[] = { "userAccountControl", NULL };
 	LDAPMessage *results;
 	LDAPMessage *first;
+	_adcli_arena *arena;
+	_adcli_arena_mark mark;
 	const char *base;
 	char *filter;
 	char *value;
 	int ret;
 
-	value = _adcli_ldap_escape_filter (entry->sam_name);
-	return_unexpected_if_fail (value != NULL);
+	arena = _adcli_conn_get_arena (entry->conn);
+	_adcli_arena_get_mark (arena, &mark);
 
-	if (asprintf (&filter, "(&(objectClass=%s)(sAMAccountName=%s))", entry->object_class, value) < 0)
+	value = _adcli_ldap_escape_filter_in (arena, entry->sam_name);
+	filter = value ? _adcli_arena_printf (arena, "(&(objectClass=%s)(sAMAccountName=%s))",
+	                                      entry->object_class, value) : NULL;
+	if (filter == NULL) {
+		_adcli_arena_release (arena, &mark);
 		return_unexpected_if_reached ();
+	}
 
 	base = adcli_conn_get_default_naming_context (entry->conn);
-	ret = ldap_search_ext_s (ldap, base, LDAP_SCOPE_SUB, filter, (char **)attrs,
-	                         0, NULL, NULL, NULL, -1, &results);
+	ret = _adcli_ldap_search_ext_s (ldap, base, LDAP_SCOPE_SUB, filter, (char **)attrs,
+	                                0, NULL, NULL, NULL, -1, &results);
 
-	free (filter);
-	free (value);
+	_adcli_arena_release (arena, &mark);
 
 	if (ret != LDAP_SUCCESS) {
 		return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
@@ -142,20 +148,31 @@ update_entry_from_domain (adcli_entry *entry,
 		return_unexpected_if_fail (entry->entry_dn != NULL);
 	}
 
-	ldap_msgfree (entry->entry_attrs);
-	entry->entry_attrs = results;
+	_adcli_ldap_attrs_free (entry->entry_attrs);
+	entry->entry_attrs = _adcli_ldap_attrs_parse (ldap, results);
+	ldap_msgfree (results);
 	return ADCLI_SUCCESS;
 }
 
 adcli_result
 adcli_entry_load (adcli_entry *entry)
 {
+	adcli_result res;
 	LDAP *ldap;
 
 	ldap = adcli_conn_get_ldap_connection (entry->conn);
 	return_unexpected_if_fail (ldap != NULL);
 
-	return update_entry_from_domain (entry, ldap);
+	res = update_entry_from_domain (entry, ldap);
+
+	/* Only reads, so it can run again if the connection went away */
+	if (_adcli_conn_retry (entry->conn, res)) {
+		ldap = adcli_conn_get_ldap_connection (entry->conn);
+		return_unexpected_if_fail (ldap != NULL);
+		res = update_entry_from_domain (entry, ldap);
+	}
+
+	return res;
 }
 
 static adcli_result
@@ -179,9 +196,9 @@ lookup_entry_container (adcli_entry *entry,
 		base = adcli_conn_get_default_naming_context (entry->conn);
 	assert (base != NULL);
 
-	ret = ldap_search_ext_s (ldap, base, LDAP_SCOPE_BASE,
-	                         "(objectClass=*)", attrs, 0, NULL, NULL,
-	                         NULL, -1, &results);
+	ret = _adcli_ldap_search_ext_s (ldap, base, LDAP_SCOPE_BASE,
+	                                "(objectClass=*)", attrs, 0, NULL, NULL,
+	                                NULL, -1, &results);
 
 	if (ret == LDAP_NO_SUCH_OBJECT && entry->domain_ou) {
 		_adcli_err ("The organizational unit does not exist: %s", entry->domain_ou);
@@ -211,9 +228,9 @@ lookup_entry_container (adcli_entry *entry,
 
 	/* Try harder */
 	if (!entry->entry_container) {
-		ret = ldap_search_ext_s (ldap, base, LDAP_SCOPE_BASE,
-		                         "(&(objectClass=container)(cn=Users))",
-		                         attrs, 0, NULL, NULL, NULL, -1, &results);
+		ret = _adcli_ldap_search_ext_s (ldap, base, LDAP_SCOPE_BASE,
+		                                "(&(objectClass=container)(cn=Users))",
+		                                attrs, 0, NULL, NULL, NULL, -1, &results);
 		if (ret == LDAP_SUCCESS) {
 			entry->entry_container = _adcli_ldap_parse_dn (ldap, results);
 			if (entry->entry_container) {
@@ -303,15 +320,18 @@ adcli_entry_create (adcli_entry *entry,
 	if (res != ADCLI_SUCCESS)
 		return res;
 
-	string = _adcli_ldap_mods_to_string (attrs->mods);
-	_adcli_info ("Creating %s with attributes: %s", entry->object_class, string);
-	free (string);
+	/* Describing the attributes is only worth it when someone is listening */
+	if (_adcli_log_enabled (ADCLI_LOG_INFO)) {
+		string = _adcli_ldap_mods_to_string (attrs->mods);
+		_adcli_info ("Creating %s with attributes: %s", entry->object_class, string);
+		free (string);
+	}
 
 	/* Fill in the work attributes */
 	seq_filter (attrs->mods, &attrs->len, NULL,
 	            _adcli_ldap_filter_for_add, _adcli_ldap_mod_free);
 
-	ret = ldap_add_ext_s (ldap, entry->entry_dn, attrs->mods, NULL, NULL);
+	ret = _adcli_ldap_add_ext_s (ldap, entry->entry_dn, attrs->mods, NULL, NULL);
 
 	if (ret == LDAP_INSUFFICIENT_ACCESS) {
 		return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_CREDENTIALS,
@@ -351,11 +371,13 @@ adcli_entry_modify (adcli_entry *entry,
 		return ADCLI_ERR_CONFIG;
 	}
 
-	string = _adcli_ldap_mods_to_string (attrs->mods);
-	_adcli_info ("Modifying %s entry attributes: %s", entry->object_class, string);
-	free (string);
+	if (_adcli_log_enabled (ADCLI_LOG_INFO)) {
+		string = _adcli_ldap_mods_to_string (attrs->mods);
+		_adcli_info ("Modifying %s entry attributes: %s", entry->object_class, string);
+		free (string);
+	}
 
-	ret = ldap_modify_ext_s (ldap, entry->entry_dn, attrs->mods, NULL, NULL);
+	ret = _adcli_ldap_modify_ext_s (ldap, entry->entry_dn, attrs->mods, NULL, NULL);
 
 	if (ret == LDAP_INSUFFICIENT_ACCESS) {
 		return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_CREDENTIALS,
@@ -393,7 +415,7 @@ adcli_entry_delete (adcli_entry *entry)
 		return ADCLI_ERR_CONFIG;
 	}
 
-	ret = ldap_delete_ext_s (ldap, entry->entry_dn, NULL, NULL);
+	ret = _adcli_ldap_delete_ext_s (ldap, entry->entry_dn, NULL, NULL);
 
 	if (ret == LDAP_INSUFFICIENT_ACCESS) {
 		return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_CREDENTIALS,
@@ -409,6 +431,283 @@ adcli_entry_delete (adcli_entry *entry)
 	return ADCLI_SUCCESS;
 }
 
+/*
+ * AD refuses modify requests with too many values (adminLimitExceeded),
+ * so group membership changes are sent in batches of this size.
+ */
+#define MEMBERS_PER_MODIFY 1000
+
+/*
+ * A case insensitive hash set of member DNs. Group memberships can have
+ * hundreds of thousands of values, so linear lookups are not an option.
+ */
+typedef struct {
+	char **values;
+	unsigned int size;
+	unsigned int count;
+} member_set;
+
+static char **
+member_set_slot (char **values,
+                 unsigned int size,
+                 const char *dn)
+{
+	unsigned int i;
+
+	/* Open addressing with linear probing, size is a power of two */
+	for (i = _adcli_str_case_hash (dn) & (size - 1);
+	     values[i] != NULL && strcasecmp (values[i], dn) != 0;
+	     i = (i + 1) & (size - 1));
+
+	return values + i;
+}
+
+static int
+member_set_has (member_set *set,
+                const char *dn)
+{
+	if (set->count == 0)
+		return 0;
+	return *member_set_slot (set->values, set->size, dn) != NULL;
+}
+
+static int
+member_set_add (member_set *set,
+                char *dn)
+{
+	char **values;
+	char **slot;
+	unsigned int size;
+	unsigned int i;
+
+	return_val_if_fail (dn != NULL, 0);
+
+	/* Keep the load factor below one half */
+	if ((set->count + 1) * 2 > set->size) {
+		size = set->size ? set->size * 2 : 64;
+		values = calloc (size, sizeof (char *));
+		return_val_if_fail (values != NULL, 0);
+
+		for (i = 0; i < set->size; i++) {
+			if (set->values[i] != NULL)
+				*member_set_slot (values, size, set->values[i]) = set->values[i];
+		}
+
+		free (set->values);
+		set->values = values;
+		set->size = size;
+	}
+
+	slot = member_set_slot (set->values, set->size, dn);
+	if (*slot != NULL) {
+		free (dn);
+		return 0;
+	}
+
+	*slot = dn;
+	set->count++;
+	return 1;
+}
+
+static void
+member_set_clear (member_set *set)
+{
+	unsigned int i;
+
+	for (i = 0; i < set->size; i++)
+		free (set->values[i]);
+	free (set->values);
+	memset (set, 0, sizeof (member_set));
+}
+
+static adcli_result
+load_entry_members (adcli_entry *entry,
+                    LDAP *ldap,
+                    member_set *members)
+{
+	char *attrs[] = { NULL, NULL };
+	LDAPMessage *results;
+	LDAPMessage *first;
+	struct berval **bvs;
+	BerElement *ber;
+	char *attr;
+	int start = 0;
+	int low, high;
+	int more;
+	int ret;
+	int i;
+
+	/*
+	 * AD only returns MaxValRange values of a multi-valued attribute at
+	 * once, and we have to ask for the rest with member;range=N-*
+	 */
+	do {
+		more = 0;
+
+		if (asprintf (&attrs[0], "member;range=%d-*", start) < 0)
+			return_unexpected_if_reached ();
+
+		results = NULL;
+		ret = _adcli_ldap_search_ext_s (ldap, entry->entry_dn, LDAP_SCOPE_BASE,
+		                                "(objectClass=*)", attrs, 0, NULL, NULL,
+		                                NULL, -1, &results);
+
+		free (attrs[0]);
+
+		if (ret != LDAP_SUCCESS) {
+			ldap_msgfree (results);
+			return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
+			                                   "Couldn't read members of %s entry: %s",
+			                                   entry->object_class, entry->entry_dn);
+		}
+
+		first = ldap_first_entry (ldap, results);
+		ber = NULL;
+
+		for (attr = first ? ldap_first_attribute (ldap, first, &ber) : NULL;
+		     attr != NULL; attr = ldap_next_attribute (ldap, first, ber)) {
+
+			/* Small groups come back without a range */
+			if (strcasecmp (attr, "member") != 0) {
+				if (!_adcli_ldap_parse_range (attr, "member", &low, &high) ||
+				    low != start) {
+					ldap_memfree (attr);
+					continue;
+				}
+
+				if (high >= start) {
+					start = high + 1;
+					more = 1;
+				}
+			}
+
+			bvs = ldap_get_values_len (ldap, first, attr);
+			for (i = 0; bvs != NULL && bvs[i] != NULL; i++)
+				member_set_add (members, _adcli_str_dupn (bvs[i]->bv_val, bvs[i]->bv_len));
+			ldap_value_free_len (bvs);
+			ldap_memfree (attr);
+		}
+
+		if (ber != NULL)
+			ber_free (ber, 0);
+		ldap_msgfree (results);
+	} while (more);
+
+	_adcli_info ("Found %u members of %s entry: %s", members->count,
+	             entry->object_class, entry->entry_dn);
+	return ADCLI_SUCCESS;
+}
+
+static adcli_result
+modify_entry_members (adcli_entry *entry,
+                      LDAP *ldap,
+                      int mod_op,
+                      char **dns,
+                      int count)
+{
+	LDAPMod mod = { mod_op, "member", };
+	LDAPMod *mods[] = { &mod, NULL };
+	char *saved;
+	int chunk;
+	int off;
+	int ret;
+
+	for (off = 0; off < count; off += chunk) {
+		chunk = count - off;
+		if (chunk > MEMBERS_PER_MODIFY)
+			chunk = MEMBERS_PER_MODIFY;
+
+		/* Temporarily terminate this batch in place */
+		saved = dns[off + chunk];
+		dns[off + chunk] = NULL;
+		mod.mod_vals.modv_strvals = dns + off;
+
+		ret = _adcli_ldap_modify_ext_s (ldap, entry->entry_dn, mods, NULL, NULL);
+
+		dns[off + chunk] = saved;
+
+		if (ret == LDAP_INSUFFICIENT_ACCESS) {
+			return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_CREDENTIALS,
+			                                   "Insufficient permissions to modify members of %s entry: %s",
+			                                   entry->object_class, entry->entry_dn);
+
+		} else if (ret != LDAP_SUCCESS) {
+			return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
+			                                   "Couldn't %s members of %s entry: %s",
+			                                   mod_op == LDAP_MOD_ADD ? "add" : "remove",
+			                                   entry->object_class, entry->entry_dn);
+		}
+	}
+
+	return ADCLI_SUCCESS;
+}
+
+adcli_result
+adcli_entry_sync_members (adcli_entry *entry,
+                          const char **member_dns)
+{
+	member_set current = { NULL, };
+	member_set wanted = { NULL, };
+	char **remove = NULL;
+	char **add = NULL;
+	int remove_len = 0;
+	int add_len = 0;
+	adcli_result res;
+	unsigned int i;
+	LDAP *ldap;
+
+	return_unexpected_if_fail (entry != NULL);
+
+	ldap = adcli_conn_get_ldap_connection (entry->conn);
+	return_unexpected_if_fail (ldap != NULL);
+
+	/* Find the group */
+	res = update_entry_from_domain (entry, ldap);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	if (!entry->entry_dn) {
+		_adcli_err ("Cannot find the %s entry %s in the domain",
+		            entry->object_class, entry->sam_name);
+		return ADCLI_ERR_CONFIG;
+	}
+
+	for (i = 0; member_dns && member_dns[i] != NULL; i++)
+		member_set_add (&wanted, strdup (member_dns[i]));
+
+	res = load_entry_members (entry, ldap, &current);
+
+	if (res == ADCLI_SUCCESS) {
+		/* The arrays below borrow the strings owned by the sets */
+		for (i = 0; i < current.size; i++) {
+			if (current.values[i] && !member_set_has (&wanted, current.values[i]))
+				remove = seq_push (remove, &remove_len, current.values[i]);
+		}
+		for (i = 0; i < wanted.size; i++) {
+			if (wanted.values[i] && !member_set_has (&current, wanted.values[i]))
+				add = seq_push (add, &add_len, wanted.values[i]);
+		}
+
+		_adcli_info ("Removing %d and adding %d members of %s entry: %s",
+		             remove_len, add_len, entry->object_class, entry->entry_dn);
+
+		res = modify_entry_members (entry, ldap, LDAP_MOD_DELETE, remove, remove_len);
+		if (res == ADCLI_SUCCESS)
+			res = modify_entry_members (entry, ldap, LDAP_MOD_ADD, add, add_len);
+	}
+
+	if (res == ADCLI_SUCCESS) {
+		_adcli_info ("Synchronized members of %s entry: %s",
+		             entry->object_class, entry->entry_dn);
+	}
+
+	seq_free (remove, NULL);
+	seq_free (add, NULL);
+	member_set_clear (&current);
+	member_set_clear (&wanted);
+	return res;
+}
+
 static adcli_result
 adcli_entry_ensure_enabled (adcli_entry *entry)
 {
@@ -416,6 +715,7 @@ adcli_entry_ensure_enabled (adcli_entry *entry)
 	LDAP *ldap;
 	adcli_attrs *attrs;
 	uint32_t uac = 0;
+	const char *value;
 	char *uac_str;
 	unsigned long attr_val;
 	char *end;
@@ -425,17 +725,16 @@ adcli_entry_ensure_enabled (adcli_entry *entry)
 	ldap = adcli_conn_get_ldap_connection (entry->conn);
 	return_unexpected_if_fail (ldap != NULL);
 
-	uac_str = _adcli_ldap_parse_value (ldap, entry->entry_attrs,
-	                                   "userAccountControl");
-	if (uac_str != NULL) {
-		attr_val = strtoul (uac_str, &end, 10);
+	value = _adcli_ldap_attrs_value (entry->entry_attrs,
+	                                 "userAccountControl");
+	if (value != NULL) {
+		attr_val = strtoul (value, &end, 10);
 		if (*end != '\0' || attr_val > UINT32_MAX) {
 			_adcli_warn ("Invalid userAccountControl '%s' for %s account in directory: %s, assuming 0",
-			            uac_str, entry->object_class, entry->entry_dn);
+			            value, entry->object_class, entry->entry_dn);
 		} else {
 			uac = attr_val;
 		}
-		free (uac_str);
 	}
 	if (uac & UAC_ACCOUNTDISABLE) {
 		uac &= ~(UAC_ACCOUNTDISABLE);
@@ -479,6 +778,7 @@ adcli_entry_set_passwd (adcli_entry *entry, const char *user_pwd)
 	int result_code;
 	char *message;
 	krb5_principal user_principal;
+	double started;
 
 	ldap = adcli_conn_get_ldap_connection (entry->conn);
 	return_unexpected_if_fail (ldap != NULL);
@@ -494,6 +794,11 @@ adcli_entry_set_passwd (adcli_entry *entry, const char *user_pwd)
 		return ADCLI_ERR_CONFIG;
 	}
 
+	/* A ticket for kadmin/changepw, then the kpasswd exchange */
+	if (_adcli_plan ("kpasswd", entry->sam_name, 2, "set %s password with Kerberos",
+	                 entry->object_class))
+		return ADCLI_SUCCESS;
+
 	k5 = adcli_conn_get_krb5_context (entry->conn);
 	return_unexpected_if_fail (k5 != NULL);
 
@@ -508,9 +813,12 @@ adcli_entry_set_passwd (adcli_entry *entry, const char *user_pwd)
 	memset (&result_string, 0, sizeof (result_string));
 	memset (&result_code_string, 0, sizeof (result_code_string));
 
+	started = _adcli_trace_clock ();
 	code = krb5_set_password_using_ccache (k5, ccache, user_pwd,
 	                                       user_principal, &result_code,
 	                                       &result_code_string, &result_string);
+	_adcli_krb5_trace (k5, "kpasswd", adcli_conn_get_domain_controller (entry->conn),
+	                   user_principal, code, started);
 
 	if (code != 0) {
 		_adcli_err ("Couldn't set password for %s account: %s: %s",
@@ -554,6 +862,14 @@ adcli_entry_get_sam_name (adcli_entry *entry)
 	return entry->sam_name;
 }
 
+/* Called before connecting, when adcli_entry_set_passwd() will follow */
+void
+adcli_entry_plan_passwd (adcli_entry *entry)
+{
+	return_if_fail (entry != NULL);
+	_adcli_conn_set_changepw_planned (entry->conn, true);
+}
+
 const char *
 adcli_entry_get_dn (adcli_entry *entry)
 {
@@ -648,8 +964,8 @@ adcli_get_nis_domain (adcli_entry *entry,
 		return_unexpected_if_reached ();
 	}
 
-	ret = ldap_search_ext_s (ldap, base, LDAP_SCOPE_SUB, filter, (char **)ldap_attrs,
-	                         0, NULL, NULL, NULL, -1, &results);
+	ret = _adcli_ldap_search_ext_s (ldap, base, LDAP_SCOPE_SUB, filter, (char **)ldap_attrs,
+	                                0, NULL, NULL, NULL, -1, &results);
 
 	free (base);
 
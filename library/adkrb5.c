@@ -28,11 +28,18 @@
 
 #include <gssapi/gssapi_krb5.h>
 #include <krb5/krb5.h>
+#include <profile.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
+#include <unistd.h>
 
 krb5_error_code
 _adcli_krb5_build_principal (krb5_context k5,
@@ -181,6 +188,587 @@ _adcli_krb5_init_context (krb5_context *k5)
 	return ADCLI_SUCCESS;
 }
 
+/*
+ * A profile which answers the KDC and domain_realm lookups for one
+ * realm from memory, and passes everything else through to the
+ * profile loaded from the usual krb5.conf files. This is shared
+ * between the copies krb5 makes of it, hence the reference count.
+ */
+typedef struct {
+	int refs;
+	profile_t base;
+	char *realm;
+	char *kdc;
+	char *kpasswd;
+	char **hosts;
+} pinned_profile;
+
+static void
+pinned_profile_cleanup (void *cbdata)
+{
+	pinned_profile *pinned = cbdata;
+
+	if (--pinned->refs > 0)
+		return;
+
+	if (pinned->base)
+		profile_abandon (pinned->base);
+	free (pinned->realm);
+	free (pinned->kdc);
+	free (pinned->kpasswd);
+	_adcli_strv_free (pinned->hosts);
+	free (pinned);
+}
+
+static long
+pinned_profile_copy (void *cbdata,
+                     void **ret_cbdata)
+{
+	pinned_profile *pinned = cbdata;
+
+	pinned->refs++;
+	*ret_cbdata = pinned;
+	return 0;
+}
+
+static const char *
+pinned_profile_lookup (pinned_profile *pinned,
+                       const char *const *names)
+{
+	if (!names[0] || !names[1])
+		return NULL;
+
+	if (strcmp (names[0], "realms") == 0) {
+		if (!names[2] || names[3] || strcmp (names[1], pinned->realm) != 0)
+			return NULL;
+		if (strcmp (names[2], "kdc") == 0 || strcmp (names[2], "master_kdc") == 0)
+			return pinned->kdc;
+		if (strcmp (names[2], "kpasswd_server") == 0)
+			return pinned->kpasswd;
+
+	} else if (strcmp (names[0], "domain_realm") == 0) {
+		if (!names[2] && _adcli_strv_has_ex (pinned->hosts, names[1], strcasecmp) == 1)
+			return pinned->realm;
+	}
+
+	return NULL;
+}
+
+static long
+pinned_profile_get_values (void *cbdata,
+                           const char *const *names,
+                           char ***ret_values)
+{
+	pinned_profile *pinned = cbdata;
+	const char *value;
+	char **values;
+
+	value = pinned_profile_lookup (pinned, names);
+	if (value == NULL) {
+		if (!pinned->base)
+			return PROF_NO_RELATION;
+		return profile_get_values (pinned->base, names, ret_values);
+	}
+
+	values = calloc (2, sizeof (char *));
+	if (values == NULL)
+		return ENOMEM;
+	values[0] = strdup (value);
+	if (values[0] == NULL) {
+		free (values);
+		return ENOMEM;
+	}
+
+	*ret_values = values;
+	return 0;
+}
+
+static void
+pinned_profile_free_values (void *cbdata,
+                            char **values)
+{
+	profile_free_list (values);
+}
+
+/*
+ * The base profile frees its iterator when it reaches the end, and
+ * clears the pointer it was given. Keep that pointer in a struct of our
+ * own, so we can tell when it's gone and krb5 frees ours later.
+ */
+typedef struct {
+	void *base;
+} pinned_profile_iter;
+
+static long
+pinned_profile_iterator_create (void *cbdata,
+                                const char *const *names,
+                                int flags,
+                                void **ret_iter)
+{
+	pinned_profile *pinned = cbdata;
+	pinned_profile_iter *iter;
+	long code;
+
+	if (!pinned->base)
+		return PROF_NO_SECTION;
+
+	iter = calloc (1, sizeof (pinned_profile_iter));
+	if (iter == NULL)
+		return ENOMEM;
+
+	code = profile_iterator_create (pinned->base, names, flags, &iter->base);
+	if (code != 0) {
+		free (iter);
+		return code;
+	}
+
+	*ret_iter = iter;
+	return 0;
+}
+
+static long
+pinned_profile_iterator (void *cbdata,
+                         void *iter,
+                         char **ret_name,
+                         char **ret_value)
+{
+	pinned_profile_iter *pinned_iter = iter;
+
+	/* Already at the end */
+	if (pinned_iter->base == NULL) {
+		if (ret_name)
+			*ret_name = NULL;
+		if (ret_value)
+			*ret_value = NULL;
+		return 0;
+	}
+
+	return profile_iterator (&pinned_iter->base, ret_name, ret_value);
+}
+
+static void
+pinned_profile_iterator_free (void *cbdata,
+                              void *iter)
+{
+	pinned_profile_iter *pinned_iter = iter;
+
+	if (pinned_iter->base)
+		profile_iterator_free (&pinned_iter->base);
+	free (pinned_iter);
+}
+
+static void
+pinned_profile_free_string (void *cbdata,
+                            char *string)
+{
+	profile_release_string (string);
+}
+
+static struct profile_vtable pinned_profile_vtable = {
+	1,
+	pinned_profile_get_values,
+	pinned_profile_free_values,
+	pinned_profile_cleanup,
+	pinned_profile_copy,
+	pinned_profile_iterator_create,
+	pinned_profile_iterator,
+	pinned_profile_iterator_free,
+	pinned_profile_free_string,
+};
+
+adcli_result
+_adcli_krb5_init_context_pinned (krb5_context *k5,
+                                 const char *realm,
+                                 const char *controller,
+                                 const char **hosts)
+{
+	pinned_profile *pinned;
+	krb5_error_code code;
+	krb5_context base;
+	profile_t profile;
+	adcli_result res;
+
+	return_unexpected_if_fail (realm != NULL);
+	return_unexpected_if_fail (controller != NULL);
+
+	/* Reads the usual krb5.conf files, but writes nothing out */
+	res = _adcli_krb5_init_context (&base);
+	if (res != ADCLI_SUCCESS)
+		return res;
+
+	pinned = calloc (1, sizeof (pinned_profile));
+	return_unexpected_if_fail (pinned != NULL);
+	pinned->refs = 1;
+
+	code = krb5_get_profile (base, &pinned->base);
+	krb5_free_context (base);
+	if (code != 0)
+		pinned->base = NULL;
+
+	pinned->realm = strdup (realm);
+	if (strchr (controller, ':')) {
+		if (asprintf (&pinned->kpasswd, "[%s]", controller) < 0)
+			pinned->kpasswd = NULL;
+	} else {
+		pinned->kpasswd = strdup (controller);
+	}
+	if (pinned->kpasswd && asprintf (&pinned->kdc, "%s:88", pinned->kpasswd) < 0)
+		pinned->kdc = NULL;
+	pinned->hosts = _adcli_strv_dup ((char **)hosts);
+
+	if (!pinned->realm || !pinned->kdc || !pinned->kpasswd || (hosts && !pinned->hosts)) {
+		pinned_profile_cleanup (pinned);
+		return_unexpected_if_reached ();
+	}
+
+	_adcli_info ("Using in-memory kerberos configuration for %s with kdc %s",
+	             realm, pinned->kdc);
+
+	code = profile_init_vtable (&pinned_profile_vtable, pinned, &profile);
+	if (code != 0) {
+		pinned_profile_cleanup (pinned);
+		return_unexpected_if_reached ();
+	}
+
+	/* The context holds its own reference to the profile */
+	code = krb5_init_context_profile (profile, 0, k5);
+	profile_release (profile);
+
+	if (code == ENOMEM) {
+		return_unexpected_if_reached ();
+
+	} else if (code != 0) {
+		_adcli_err ("Failed to create kerberos context: %s",
+		            krb5_get_error_message (NULL, code));
+		return ADCLI_ERR_UNEXPECTED;
+	}
+
+	return ADCLI_SUCCESS;
+}
+
+void
+_adcli_krb5_trace (krb5_context k5,
+                   const char *name,
+                   const char *server,
+                   krb5_const_principal principal,
+                   krb5_error_code code,
+                   double started)
+{
+	const char *message = NULL;
+	char *princ = NULL;
+
+	if (started == 0)
+		return;
+
+	if (principal && krb5_unparse_name (k5, principal, &princ) != 0)
+		princ = NULL;
+	if (code != 0)
+		message = krb5_get_error_message (k5, code);
+
+	_adcli_trace ("krb5", name, server, started,
+	              "principal", princ ? princ : "",
+	              "result", message ? message : "Success",
+	              NULL);
+
+	if (message)
+		krb5_free_error_message (k5, message);
+	krb5_free_unparsed_name (k5, princ);
+}
+
+/* How long a single request to the KDC may take */
+#define AS_TIMEOUT 10.0
+
+/* Larger replies than this are not tickets */
+#define AS_MAX_REPLY (1024 * 1024)
+
+/*
+ * An AS exchange driven with krb5_init_creds_step(), or a TGS exchange
+ * driven with krb5_tkt_creds_step(), so that the caller can poll it
+ * alongside other sockets. Each request goes over its own TCP connection
+ * to a single KDC, as AD replies with tickets are usually too large for
+ * UDP anyway.
+ */
+struct _adcli_krb5_as {
+	krb5_context k5;
+	krb5_init_creds_context icc;
+	krb5_tkt_creds_context tcc;
+	char *kdc;
+	char *realm;
+	int fd;
+	unsigned char *buffer;
+	size_t length;
+	size_t offset;
+	bool reading;
+	bool have_length;
+	double deadline;
+	krb5_error_code code;
+	bool done;
+};
+
+static void
+as_finish (_adcli_krb5_as *as,
+           krb5_error_code code)
+{
+	if (as->fd >= 0)
+		close (as->fd);
+	as->fd = -1;
+	as->code = code;
+	as->done = true;
+}
+
+static krb5_error_code
+as_send (_adcli_krb5_as *as,
+         const krb5_data *request)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	int fd;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	if (getaddrinfo (as->kdc, "88", &hints, &res) != 0)
+		return KRB5_KDC_UNREACH;
+
+	fd = socket (res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	             res->ai_protocol);
+	if (fd >= 0 && connect (fd, res->ai_addr, res->ai_addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+		close (fd);
+		fd = -1;
+	}
+	freeaddrinfo (res);
+
+	if (fd < 0)
+		return KRB5_KDC_UNREACH;
+
+	/* Kerberos over TCP puts the length in front of each message */
+	free (as->buffer);
+	as->buffer = malloc (request->length + 4);
+	if (as->buffer == NULL) {
+		close (fd);
+		return ENOMEM;
+	}
+
+	as->buffer[0] = (request->length >> 24) & 0xff;
+	as->buffer[1] = (request->length >> 16) & 0xff;
+	as->buffer[2] = (request->length >> 8) & 0xff;
+	as->buffer[3] = request->length & 0xff;
+	memcpy (as->buffer + 4, request->data, request->length);
+
+	if (as->fd >= 0)
+		close (as->fd);
+	as->fd = fd;
+	as->length = request->length + 4;
+	as->offset = 0;
+	as->reading = false;
+	as->have_length = false;
+	as->deadline = adcli_phase_clock () + AS_TIMEOUT;
+	return 0;
+}
+
+static krb5_error_code
+as_step (_adcli_krb5_as *as,
+         krb5_data *reply,
+         bool *more)
+{
+	krb5_data request = { 0, };
+	krb5_data realm = { 0, };
+	unsigned int flags = 0;
+	krb5_error_code code;
+
+	if (as->tcc) {
+		code = krb5_tkt_creds_step (as->k5, as->tcc, reply, &request, &realm, &flags);
+		*more = (code == 0 && (flags & KRB5_TKT_CREDS_STEP_FLAG_CONTINUE));
+	} else {
+		code = krb5_init_creds_step (as->k5, as->icc, reply, &request, &realm, &flags);
+		*more = (code == 0 && (flags & KRB5_INIT_CREDS_STEP_FLAG_CONTINUE));
+	}
+
+	if (*more) {
+		/* Referrals to other realms are left to the library */
+		if (realm.length != strlen (as->realm) ||
+		    memcmp (realm.data, as->realm, realm.length) != 0)
+			code = KRB5_KDC_UNREACH;
+		else
+			code = as_send (as, &request);
+	}
+
+	krb5_free_data_contents (as->k5, &request);
+	krb5_free_data_contents (as->k5, &realm);
+	return code;
+}
+
+static krb5_error_code
+as_start (krb5_context k5,
+          krb5_init_creds_context icc,
+          krb5_tkt_creds_context tcc,
+          const char *kdc,
+          const char *realm,
+          _adcli_krb5_as **result)
+{
+	krb5_data empty = { 0, };
+	krb5_error_code code;
+	_adcli_krb5_as *as;
+	bool more = false;
+
+	as = calloc (1, sizeof (_adcli_krb5_as));
+	return_val_if_fail (as != NULL, ENOMEM);
+
+	as->k5 = k5;
+	as->icc = icc;
+	as->tcc = tcc;
+	as->fd = -1;
+	as->kdc = strdup (kdc);
+	as->realm = strdup (realm);
+
+	if (as->kdc == NULL || as->realm == NULL)
+		code = ENOMEM;
+	else
+		code = as_step (as, &empty, &more);
+
+	/* A ticket already in the cache needs no KDC at all */
+	if (code == 0 && !more) {
+		if (tcc)
+			as_finish (as, 0);
+		else
+			code = KRB5_KDC_UNREACH;
+	}
+
+	if (code != 0) {
+		_adcli_krb5_as_free (as);
+		return code;
+	}
+
+	*result = as;
+	return 0;
+}
+
+krb5_error_code
+_adcli_krb5_as_start (krb5_context k5,
+                      krb5_init_creds_context icc,
+                      const char *kdc,
+                      const char *realm,
+                      _adcli_krb5_as **result)
+{
+	return as_start (k5, icc, NULL, kdc, realm, result);
+}
+
+krb5_error_code
+_adcli_krb5_tgs_start (krb5_context k5,
+                       krb5_tkt_creds_context tcc,
+                       const char *kdc,
+                       const char *realm,
+                       _adcli_krb5_as **result)
+{
+	return as_start (k5, NULL, tcc, kdc, realm, result);
+}
+
+int
+_adcli_krb5_as_fd (_adcli_krb5_as *as,
+                   short *events)
+{
+	*events = as->reading ? POLLIN : POLLOUT;
+	return as->done ? -1 : as->fd;
+}
+
+bool
+_adcli_krb5_as_process (_adcli_krb5_as *as)
+{
+	krb5_error_code code;
+	krb5_data reply;
+	unsigned char *buffer;
+	size_t length;
+	ssize_t ret;
+	bool more;
+
+	while (!as->done) {
+		if (adcli_phase_clock () > as->deadline) {
+			as_finish (as, KRB5_KDC_UNREACH);
+			break;
+		}
+
+		if (as->reading)
+			ret = recv (as->fd, as->buffer + as->offset, as->length - as->offset, 0);
+		else
+			ret = send (as->fd, as->buffer + as->offset, as->length - as->offset, MSG_NOSIGNAL);
+
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (ret <= 0) {
+			as_finish (as, KRB5_KDC_UNREACH);
+			break;
+		}
+
+		as->offset += ret;
+		if (as->offset < as->length)
+			continue;
+
+		/* Request written, read the length of the reply */
+		if (!as->reading) {
+			as->reading = true;
+			as->length = 4;
+			as->offset = 0;
+
+		/* Length read, now read the reply itself */
+		} else if (!as->have_length) {
+			length = ((size_t)as->buffer[0] << 24) | (as->buffer[1] << 16) |
+			         (as->buffer[2] << 8) | as->buffer[3];
+			buffer = length > 0 && length <= AS_MAX_REPLY ? realloc (as->buffer, length) : NULL;
+			if (buffer == NULL) {
+				as_finish (as, KRB5_KDC_UNREACH);
+				break;
+			}
+			as->buffer = buffer;
+			as->have_length = true;
+			as->length = length;
+			as->offset = 0;
+
+		} else {
+			reply.magic = 0;
+			reply.data = (char *)as->buffer;
+			reply.length = as->length;
+			code = as_step (as, &reply, &more);
+			if (code != 0 || !more)
+				as_finish (as, code);
+		}
+	}
+
+	return as->done;
+}
+
+krb5_error_code
+_adcli_krb5_as_wait (_adcli_krb5_as *as)
+{
+	struct pollfd pfd;
+	double remaining;
+
+	while (!_adcli_krb5_as_process (as)) {
+		pfd.fd = _adcli_krb5_as_fd (as, &pfd.events);
+		remaining = as->deadline - adcli_phase_clock ();
+		if (poll (&pfd, 1, remaining > 0 ? remaining * 1000 + 1 : 0) < 0 &&
+		    errno != EINTR)
+			as_finish (as, KRB5_KDC_UNREACH);
+	}
+
+	return as->code;
+}
+
+void
+_adcli_krb5_as_free (_adcli_krb5_as *as)
+{
+	if (as == NULL)
+		return;
+	if (as->fd >= 0)
+		close (as->fd);
+	free (as->buffer);
+	free (as->kdc);
+	free (as->realm);
+	free (as);
+}
+
 adcli_result
 _adcli_krb5_open_keytab (krb5_context k5,
                          const char *keytab_name,
@@ -367,6 +955,7 @@ _adcli_krb5_keytab_test_salt (krb5_context k5,
 {
 	krb5_error_code code;
 	krb5_creds creds;
+	double started;
 
 	code = _adcli_krb5_keytab_clear_all (k5, scratch);
 	return_val_if_fail (code == 0, code);
@@ -376,7 +965,9 @@ _adcli_krb5_keytab_test_salt (krb5_context k5,
 	return_val_if_fail (code == 0, code);
 
 	memset(&creds, 0, sizeof (creds));
+	started = _adcli_trace_clock ();
 	code = krb5_get_init_creds_keytab (k5, &creds, principal, scratch, 0, NULL, NULL);
+	_adcli_krb5_trace (k5, "as-req", NULL, principal, code, started);
 
 	krb5_free_cred_contents (k5, &creds);
 
@@ -570,3 +1161,127 @@ _adcli_krb5_format_enctypes (krb5_enctype *enctypes)
 
 	return value;
 }
+
+#ifdef KRB5_BENCH
+
+#include "bench.h"
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define BENCH_KEYTAB_ENTRIES 256
+
+static krb5_context bench_k5;
+
+static void
+bench_fill_keytab (krb5_keytab keytab)
+{
+	krb5_keytab_entry entry;
+	unsigned char contents[32];
+	char name[128];
+	int i;
+
+	memset (contents, 0x5a, sizeof (contents));
+
+	for (i = 0; i < BENCH_KEYTAB_ENTRIES; i++) {
+		memset (&entry, 0, sizeof (entry));
+		snprintf (name, sizeof (name), "host/host-%04d.ad.example.com@AD.EXAMPLE.COM", i);
+		if (krb5_parse_name (bench_k5, name, &entry.principal) != 0)
+			bench_fail ("couldn't parse principal %s", name);
+		entry.vno = 1 + (i % 3);
+		entry.key.enctype = ENCTYPE_AES256_CTS_HMAC_SHA1_96;
+		entry.key.length = sizeof (contents);
+		entry.key.contents = contents;
+		if (krb5_kt_add_entry (bench_k5, keytab, &entry) != 0)
+			bench_fail ("couldn't add keytab entry");
+		krb5_free_principal (bench_k5, entry.principal);
+	}
+}
+
+static void
+bench_keytab_clear (unsigned long iterations,
+                    void *data)
+{
+	const char *name = data;
+	krb5_keytab keytab;
+	unsigned long i;
+
+	if (krb5_kt_resolve (bench_k5, name, &keytab) != 0)
+		bench_fail ("couldn't resolve keytab %s", name);
+
+	/* One op clears a keytab of BENCH_KEYTAB_ENTRIES entries */
+	for (i = 0; i < iterations; i++) {
+		bench_stop ();
+		bench_fill_keytab (keytab);
+		bench_start ();
+
+		if (_adcli_krb5_keytab_clear_all (bench_k5, keytab) != 0)
+			bench_fail ("couldn't clear keytab %s", name);
+	}
+
+	bench_stop ();
+	krb5_kt_close (bench_k5, keytab);
+}
+
+static void
+bench_string_to_key (unsigned long iterations,
+                     void *data)
+{
+	krb5_enctype enctype = (krb5_enctype)(intptr_t)data;
+	krb5_keyblock key;
+	krb5_data password;
+	krb5_data salt;
+	unsigned long i;
+
+	/* A machine account password as generated by adcli */
+	password.data = "#Q3p!z7[wLk0ru8.S&cV2_fm9h+N4x^eTj1Ya6bD(oG5)iKv=yXsJ-lM~dAgQ3p!"
+	                "z7[wLk0ru8.S&cV2_fm9h+N4x^eTj1Ya6bD(oG5)iKv=yXsJ-lM~dAgQ3";
+	password.length = strlen (password.data);
+	salt.data = "AD.EXAMPLE.COMhosthost-0042.ad.example.com";
+	salt.length = strlen (salt.data);
+
+	for (i = 0; i < iterations; i++) {
+		if (krb5_c_string_to_key (bench_k5, enctype, &password, &salt, &key) != 0)
+			bench_fail ("couldn't derive key for enctype %d", (int)enctype);
+		krb5_free_keyblock_contents (bench_k5, &key);
+	}
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	krb5_enctype *enctypes;
+	char directory[] = "/tmp/adcli-bench.XXXXXX";
+	char *file_keytab;
+	int ret;
+	int i;
+
+	if (krb5_init_context (&bench_k5) != 0)
+		bench_fail ("couldn't initialize kerberos");
+	if (mkdtemp (directory) == NULL)
+		bench_fail ("couldn't create temporary directory");
+	if (asprintf (&file_keytab, "FILE:%s/krb5.keytab", directory) < 0)
+		bench_fail ("out of memory");
+
+	bench_funcx (bench_keytab_clear, "MEMORY:adcli-bench", "/krb5/keytab_clear_memory");
+	bench_funcx (bench_keytab_clear, file_keytab, "/krb5/keytab_clear_file");
+
+	if (krb5_get_permitted_enctypes (bench_k5, &enctypes) != 0)
+		bench_fail ("couldn't get permitted enctypes");
+	for (i = 0; enctypes[i] != 0; i++) {
+		bench_funcx (bench_string_to_key, (void *)(intptr_t)enctypes[i],
+		             "/krb5/string_to_key/%d", (int)enctypes[i]);
+	}
+
+	ret = bench_run (argc, argv);
+
+	krb5_free_enctypes (bench_k5, enctypes);
+	unlink (file_keytab + strlen ("FILE:"));
+	rmdir (directory);
+	free (file_keytab);
+	krb5_free_context (bench_k5);
+	return ret;
+}
+
+#endif /* KRB5_BENCH */
@@ -31,6 +31,10 @@
 #include <ldap.h>
 #include <sasl/sasl.h>
 
+#ifdef HAVE_OPENSSL_SSL_H
+#include <openssl/ssl.h>
+#endif
+
 #include <assert.h>
 #include <ctype.h>
 
@@ -67,6 +71,300 @@ _adcli_ldap_handle_failure (LDAP *ldap,
 	return defres;
 }
 
+static void
+trace_ldap (LDAP *ldap,
+            const char *operation,
+            const char *dn,
+            int msgid,
+            int code,
+            LDAPMessage *results,
+            double started)
+{
+	char msgid_str[16];
+	char entries_str[16];
+	char elapsed_str[32];
+	char *host = NULL;
+
+	if (started == 0)
+		return;
+
+	if (ldap_get_option (ldap, LDAP_OPT_HOST_NAME, &host) != 0)
+		host = NULL;
+	snprintf (msgid_str, sizeof (msgid_str), "%d", msgid);
+	snprintf (entries_str, sizeof (entries_str), "%d",
+	          results ? ldap_count_entries (ldap, results) : 0);
+
+	_adcli_trace ("ldap", operation, host, started,
+	              "dn", dn ? dn : "",
+	              "msgid", msgid_str,
+	              "result", ldap_err2string (code),
+	              results ? "entries" : NULL, entries_str,
+	              NULL);
+
+	if (_adcli_log_enabled (ADCLI_LOG_DEBUG)) {
+		snprintf (elapsed_str, sizeof (elapsed_str), "%.6f",
+		          adcli_phase_clock () - started);
+		_adcli_log (ADCLI_LOG_DEBUG, "ldap", operation,
+		            "server", host ? host : "",
+		            "dn", dn ? dn : "",
+		            "msgid", msgid_str,
+		            "result", ldap_err2string (code),
+		            "elapsed", elapsed_str,
+		            results ? "entries" : NULL, entries_str,
+		            NULL);
+	}
+
+	ldap_memfree (host);
+}
+
+/*
+ * Wait for the outcome of a single operation. This is what the
+ * libldap synchronous calls do internally, but we get to see the
+ * message id for tracing.
+ */
+static int
+collect_result (LDAP *ldap,
+                int ret,
+                LDAPMessage *message,
+                const char *operation,
+                const char *dn,
+                int msgid,
+                LDAPMessage **results,
+                double started)
+{
+	int code;
+
+	if (ret == 0) {
+		code = LDAP_TIMEOUT;
+		ldap_set_option (ldap, LDAP_OPT_RESULT_CODE, &code);
+	} else if (ret < 0) {
+		if (ldap_get_option (ldap, LDAP_OPT_RESULT_CODE, &code) != 0 ||
+		    code == LDAP_SUCCESS)
+			code = LDAP_SERVER_DOWN;
+	} else {
+		ret = ldap_parse_result (ldap, message, &code, NULL, NULL, NULL, NULL, 0);
+		if (ret != LDAP_SUCCESS)
+			code = ret;
+	}
+
+	trace_ldap (ldap, operation, dn, msgid, code, results ? message : NULL, started);
+
+	if (results)
+		*results = message;
+	else
+		ldap_msgfree (message);
+	return code;
+}
+
+int
+_adcli_ldap_wait_for_result (LDAP *ldap,
+                             const char *operation,
+                             const char *dn,
+                             int msgid,
+                             struct timeval *timeout,
+                             LDAPMessage **results,
+                             double started)
+{
+	LDAPMessage *message = NULL;
+	int ret;
+
+	ret = ldap_result (ldap, msgid, LDAP_MSG_ALL, timeout, &message);
+	return collect_result (ldap, ret, message, operation, dn, msgid, results, started);
+}
+
+/* Only collects a result that has already arrived, and never waits */
+int
+_adcli_ldap_check_result (LDAP *ldap,
+                          const char *operation,
+                          const char *dn,
+                          int msgid,
+                          LDAPMessage **results,
+                          double started,
+                          bool *done)
+{
+	struct timeval zero = { 0, 0 };
+	LDAPMessage *message = NULL;
+	int ret;
+
+	ret = ldap_result (ldap, msgid, LDAP_MSG_ALL, &zero, &message);
+	*done = (ret != 0);
+	if (!*done)
+		return LDAP_SUCCESS;
+
+	return collect_result (ldap, ret, message, operation, dn, msgid, results, started);
+}
+
+int
+_adcli_ldap_search_ext_s (LDAP *ldap,
+                          const char *base,
+                          int scope,
+                          const char *filter,
+                          char **attrs,
+                          int attrsonly,
+                          LDAPControl **serverctrls,
+                          LDAPControl **clientctrls,
+                          struct timeval *timeout,
+                          int sizelimit,
+                          LDAPMessage **results)
+{
+	double started;
+	int msgid;
+	int ret;
+
+	*results = NULL;
+	started = _adcli_trace_clock ();
+
+	ret = ldap_search_ext (ldap, base, scope, filter, attrs, attrsonly,
+	                       serverctrls, clientctrls, timeout, sizelimit, &msgid);
+	if (ret != LDAP_SUCCESS)
+		return ret;
+
+	return _adcli_ldap_wait_for_result (ldap, "search", base, msgid, timeout, results, started);
+}
+
+static bool
+is_secret_attribute (const char *name)
+{
+	return strcasecmp (name, "unicodePwd") == 0 ||
+	       strcasecmp (name, "userPassword") == 0;
+}
+
+/* Describe modifications for a plan, without giving away passwords */
+static char *
+mods_to_plan_string (LDAPMod **mods)
+{
+	char **parts = NULL;
+	int parts_len = 0;
+	char *values;
+	char *part;
+	const char *op;
+	int count;
+	int i;
+
+	for (i = 0; mods[i] != NULL; i++) {
+		switch (mods[i]->mod_op & ~LDAP_MOD_BVALUES) {
+		case LDAP_MOD_ADD:
+			op = "add";
+			break;
+		case LDAP_MOD_DELETE:
+			op = "delete";
+			break;
+		default:
+			op = "replace";
+			break;
+		}
+
+		/* A delete without values removes the whole attribute */
+		values = NULL;
+		if (mods[i]->mod_vals.modv_strvals != NULL) {
+			if (is_secret_attribute (mods[i]->mod_type)) {
+				values = strdup ("(hidden)");
+			} else if (mods[i]->mod_op & LDAP_MOD_BVALUES) {
+				for (count = 0; mods[i]->mod_vals.modv_bvals[count] != NULL; count++);
+				if (asprintf (&values, "(%d binary values)", count) < 0)
+					values = NULL;
+			} else {
+				values = _adcli_strv_join (mods[i]->mod_vals.modv_strvals, ",");
+			}
+		}
+
+		if (asprintf (&part, "%s %s%s%s", op, mods[i]->mod_type,
+		              values ? "=" : "", values ? values : "") < 0)
+			part = NULL;
+		free (values);
+
+		if (part != NULL)
+			parts = _adcli_strv_add (parts, part, &parts_len);
+	}
+
+	part = _adcli_strv_join (parts, "; ");
+	_adcli_strv_free (parts);
+	return part;
+}
+
+int
+_adcli_ldap_add_ext_s (LDAP *ldap,
+                       const char *dn,
+                       LDAPMod **attrs,
+                       LDAPControl **serverctrls,
+                       LDAPControl **clientctrls)
+{
+	char *detail;
+	double started;
+	int msgid;
+	int ret;
+
+	if (_adcli_planning ()) {
+		detail = mods_to_plan_string (attrs);
+		_adcli_plan ("ldap-add", dn, 1, "%s", detail ? detail : "");
+		free (detail);
+		return LDAP_SUCCESS;
+	}
+
+	started = _adcli_trace_clock ();
+
+	ret = ldap_add_ext (ldap, dn, attrs, serverctrls, clientctrls, &msgid);
+	if (ret != LDAP_SUCCESS)
+		return ret;
+
+	return _adcli_ldap_wait_for_result (ldap, "add", dn, msgid, NULL, NULL, started);
+}
+
+int
+_adcli_ldap_modify_ext_s (LDAP *ldap,
+                          const char *dn,
+                          LDAPMod **mods,
+                          LDAPControl **serverctrls,
+                          LDAPControl **clientctrls)
+{
+	char *detail;
+	double started;
+	int msgid;
+	int ret;
+
+	if (_adcli_planning ()) {
+		detail = mods_to_plan_string (mods);
+		_adcli_plan ("ldap-modify", dn, 1, "%s", detail ? detail : "");
+		free (detail);
+		return LDAP_SUCCESS;
+	}
+
+	started = _adcli_trace_clock ();
+
+	ret = ldap_modify_ext (ldap, dn, mods, serverctrls, clientctrls, &msgid);
+	if (ret != LDAP_SUCCESS)
+		return ret;
+
+	return _adcli_ldap_wait_for_result (ldap, "modify", dn, msgid, NULL, NULL, started);
+}
+
+int
+_adcli_ldap_delete_ext_s (LDAP *ldap,
+                          const char *dn,
+                          LDAPControl **serverctrls,
+                          LDAPControl **clientctrls)
+{
+	double started;
+	int msgid;
+	int ret;
+
+	if (serverctrls && serverctrls[0]) {
+		if (_adcli_plan ("ldap-delete", dn, 1, "with control %s", serverctrls[0]->ldctl_oid))
+			return LDAP_SUCCESS;
+	} else {
+		if (_adcli_plan ("ldap-delete", dn, 1, NULL))
+			return LDAP_SUCCESS;
+	}
+
+	started = _adcli_trace_clock ();
+
+	ret = ldap_delete_ext (ldap, dn, serverctrls, clientctrls, &msgid);
+	if (ret != LDAP_SUCCESS)
+		return ret;
+
+	return _adcli_ldap_wait_for_result (ldap, "delete", dn, msgid, NULL, NULL, started);
+}
+
 char *
 _adcli_ldap_parse_sid (LDAP *ldap,
                          LDAPMessage *results,
@@ -145,6 +443,515 @@ _adcli_ldap_parse_values (LDAP *ldap,
 	return vals;
 }
 
+struct _adcli_ldap_attrs {
+	char *dn;
+	int count;
+	char **names;
+	struct berval ***values;
+	int *index;
+	unsigned int size;
+};
+
+typedef struct {
+	struct berval name;
+	BerVarray vals;
+} raw_attr;
+
+static char *
+copy_berval (char **data,
+             const struct berval *bv)
+{
+	char *copy = *data;
+
+	memcpy (copy, bv->bv_val, bv->bv_len);
+	copy[bv->bv_len] = '\0';
+	*data += bv->bv_len + 1;
+	return copy;
+}
+
+static _adcli_ldap_attrs *
+build_attrs (const struct berval *dn,
+             raw_attr *raw,
+             int n_raw)
+{
+	_adcli_ldap_attrs *attrs;
+	struct berval **pointers;
+	struct berval *bervals;
+	unsigned int slot;
+	unsigned int size;
+	size_t n_bytes;
+	size_t n_vals;
+	char *data;
+	int i, j;
+
+	n_bytes = dn->bv_len + 1;
+	n_vals = 0;
+	for (i = 0; i < n_raw; i++) {
+		n_bytes += raw[i].name.bv_len + 1;
+		for (j = 0; raw[i].vals && raw[i].vals[j].bv_val != NULL; j++) {
+			n_bytes += raw[i].vals[j].bv_len + 1;
+			n_vals++;
+		}
+	}
+
+	/* Keep the table at most half full, so that probing stays short */
+	for (size = 8; size < (unsigned int)n_raw * 2; size *= 2);
+
+	/* Everything lives in one block, freed with the structure */
+	attrs = malloc (sizeof (_adcli_ldap_attrs) +
+	                n_raw * (sizeof (char *) + sizeof (struct berval **)) +
+	                (n_vals + n_raw) * sizeof (struct berval *) +
+	                n_vals * sizeof (struct berval) +
+	                size * sizeof (int) + n_bytes);
+	return_val_if_fail (attrs != NULL, NULL);
+
+	attrs->names = (char **)(attrs + 1);
+	attrs->values = (struct berval ***)(attrs->names + n_raw);
+	pointers = (struct berval **)(attrs->values + n_raw);
+	bervals = (struct berval *)(pointers + n_vals + n_raw);
+	attrs->index = (int *)(bervals + n_vals);
+	data = (char *)(attrs->index + size);
+	attrs->count = n_raw;
+	attrs->size = size;
+
+	for (slot = 0; slot < size; slot++)
+		attrs->index[slot] = -1;
+
+	attrs->dn = copy_berval (&data, dn);
+
+	for (i = 0; i < n_raw; i++) {
+		attrs->names[i] = copy_berval (&data, &raw[i].name);
+		attrs->values[i] = pointers;
+		for (j = 0; raw[i].vals && raw[i].vals[j].bv_val != NULL; j++) {
+			bervals->bv_len = raw[i].vals[j].bv_len;
+			bervals->bv_val = copy_berval (&data, &raw[i].vals[j]);
+			*(pointers++) = bervals++;
+		}
+		*(pointers++) = NULL;
+
+		for (slot = _adcli_str_case_hash (attrs->names[i]) & (size - 1);
+		     attrs->index[slot] != -1; slot = (slot + 1) & (size - 1));
+		attrs->index[slot] = i;
+	}
+
+	return attrs;
+}
+
+_adcli_ldap_attrs *
+_adcli_ldap_attrs_parse (LDAP *ldap,
+                         LDAPMessage *results)
+{
+	_adcli_ldap_attrs *attrs = NULL;
+	BerElement *ber = NULL;
+	LDAPMessage *entry;
+	struct berval dn;
+	raw_attr *raw = NULL;
+	raw_attr *tmp;
+	int n_raw = 0;
+	int alloc = 0;
+	int ret;
+	int i;
+
+	entry = ldap_first_entry (ldap, results);
+	if (entry == NULL)
+		return NULL;
+
+	ret = ldap_get_dn_ber (ldap, entry, &ber, &dn);
+	return_val_if_fail (ret == LDAP_SUCCESS, NULL);
+
+	/*
+	 * Walk the entry a single time. The names and values returned here
+	 * still point into the message, and are copied into the index.
+	 */
+	for (;;) {
+		if (n_raw == alloc) {
+			alloc = alloc ? alloc * 2 : 16;
+			tmp = realloc (raw, alloc * sizeof (raw_attr));
+			if (tmp == NULL)
+				goto out;
+			raw = tmp;
+		}
+
+		raw[n_raw].vals = NULL;
+		ret = ldap_get_attribute_ber (ldap, entry, ber, &raw[n_raw].name, &raw[n_raw].vals);
+		if (ret != LDAP_SUCCESS || raw[n_raw].name.bv_val == NULL) {
+			ber_memfree (raw[n_raw].vals);
+			break;
+		}
+
+		n_raw++;
+	}
+
+	attrs = build_attrs (&dn, raw, n_raw);
+
+out:
+	for (i = 0; i < n_raw; i++)
+		ber_memfree (raw[i].vals);
+	free (raw);
+	ber_free (ber, 0);
+
+	return_val_if_fail (attrs != NULL, NULL);
+	return attrs;
+}
+
+/* The entry that adding these modifications would create */
+_adcli_ldap_attrs *
+_adcli_ldap_attrs_from_mods (const char *dn,
+                             LDAPMod **mods)
+{
+	_adcli_ldap_attrs *attrs = NULL;
+	struct berval bdn;
+	raw_attr *raw;
+	int n_raw;
+	int i, j;
+
+	for (n_raw = 0; mods[n_raw] != NULL; n_raw++);
+	raw = calloc (n_raw + 1, sizeof (raw_attr));
+	return_val_if_fail (raw != NULL, NULL);
+
+	for (i = 0; i < n_raw; i++) {
+		raw[i].name.bv_val = mods[i]->mod_type;
+		raw[i].name.bv_len = strlen (mods[i]->mod_type);
+
+		for (j = 0; mods[i]->mod_vals.modv_strvals &&
+		            mods[i]->mod_vals.modv_strvals[j] != NULL; j++);
+		raw[i].vals = calloc (j + 1, sizeof (struct berval));
+		if (raw[i].vals == NULL)
+			goto out;
+
+		while (j-- > 0) {
+			if (mods[i]->mod_op & LDAP_MOD_BVALUES) {
+				raw[i].vals[j] = *(mods[i]->mod_vals.modv_bvals[j]);
+			} else {
+				raw[i].vals[j].bv_val = mods[i]->mod_vals.modv_strvals[j];
+				raw[i].vals[j].bv_len = strlen (raw[i].vals[j].bv_val);
+			}
+		}
+	}
+
+	bdn.bv_val = (char *)dn;
+	bdn.bv_len = strlen (dn);
+	attrs = build_attrs (&bdn, raw, n_raw);
+
+out:
+	for (i = 0; i < n_raw; i++)
+		free (raw[i].vals);
+	free (raw);
+
+	return_val_if_fail (attrs != NULL, NULL);
+	return attrs;
+}
+
+void
+_adcli_ldap_attrs_free (_adcli_ldap_attrs *attrs)
+{
+	free (attrs);
+}
+
+const char *
+_adcli_ldap_attrs_dn (_adcli_ldap_attrs *attrs)
+{
+	return_val_if_fail (attrs != NULL, NULL);
+	return attrs->dn;
+}
+
+struct berval **
+_adcli_ldap_attrs_bvals (_adcli_ldap_attrs *attrs,
+                         const char *attr_name)
+{
+	unsigned int slot;
+	int i;
+
+	if (attrs == NULL)
+		return NULL;
+
+	for (slot = _adcli_str_case_hash (attr_name) & (attrs->size - 1);
+	     (i = attrs->index[slot]) != -1; slot = (slot + 1) & (attrs->size - 1)) {
+		if (strcasecmp (attrs->names[i], attr_name) == 0)
+			return attrs->values[i][0] ? attrs->values[i] : NULL;
+	}
+
+	return NULL;
+}
+
+const char *
+_adcli_ldap_attrs_value (_adcli_ldap_attrs *attrs,
+                         const char *attr_name)
+{
+	struct berval **bvs;
+
+	bvs = _adcli_ldap_attrs_bvals (attrs, attr_name);
+	return bvs ? bvs[0]->bv_val : NULL;
+}
+
+static void
+trace_page (LDAP *ldap,
+            const char *base,
+            int msgid,
+            int code,
+            int entries,
+            double started)
+{
+	char msgid_str[16];
+	char entries_str[16];
+	char *host = NULL;
+
+	if (started == 0)
+		return;
+
+	if (ldap_get_option (ldap, LDAP_OPT_HOST_NAME, &host) != 0)
+		host = NULL;
+	snprintf (msgid_str, sizeof (msgid_str), "%d", msgid);
+	snprintf (entries_str, sizeof (entries_str), "%d", entries);
+
+	_adcli_trace ("ldap", "search-page", host, started,
+	              "dn", base ? base : "",
+	              "msgid", msgid_str,
+	              "result", ldap_err2string (code),
+	              "entries", entries_str,
+	              NULL);
+
+	ldap_memfree (host);
+}
+
+adcli_result
+_adcli_ldap_search_paged (LDAP *ldap,
+                          const char *base,
+                          int scope,
+                          const char *filter,
+                          char **attrs,
+                          int page_size,
+                          LDAPControl *sort_control,
+                          _adcli_ldap_entry_func func,
+                          void *data)
+{
+	struct berval cookie = { 0, NULL };
+	LDAPControl *controls[] = { NULL, NULL, NULL };
+	LDAPControl **returned = NULL;
+	LDAPControl *control;
+	LDAPMessage *message;
+	adcli_result res = ADCLI_SUCCESS;
+	ber_int_t count;
+	double started;
+	int entries;
+	int msgid;
+	int code;
+	int ret;
+
+	return_unexpected_if_fail (ldap != NULL);
+	return_unexpected_if_fail (func != NULL);
+
+	/*
+	 * Use the simple paged results control, and process each entry
+	 * as it arrives, so that memory use does not depend on the size
+	 * of the result.
+	 */
+	do {
+		ret = ldap_create_page_control (ldap, page_size, &cookie, 0, &controls[0]);
+		return_unexpected_if_fail (ret == LDAP_SUCCESS);
+		controls[1] = sort_control;
+
+		started = _adcli_trace_clock ();
+		entries = 0;
+		ret = ldap_search_ext (ldap, base, scope, filter, attrs, 0,
+		                       controls, NULL, NULL, -1, &msgid);
+
+		ldap_control_free (controls[0]);
+		ber_memfree (cookie.bv_val);
+		cookie.bv_val = NULL;
+		cookie.bv_len = 0;
+
+		if (ret != LDAP_SUCCESS) {
+			return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
+			                                   "Couldn't search for entries: %s", filter);
+		}
+
+		for (;;) {
+			ret = ldap_result (ldap, msgid, LDAP_MSG_ONE, NULL, &message);
+			if (ret == LDAP_RES_SEARCH_ENTRY) {
+				entries++;
+				res = (func) (ldap, message, data);
+				ldap_msgfree (message);
+				if (res != ADCLI_SUCCESS) {
+					ldap_abandon_ext (ldap, msgid, NULL, NULL);
+					return res;
+				}
+
+			} else if (ret == LDAP_RES_SEARCH_RESULT) {
+				ret = ldap_parse_result (ldap, message, &code, NULL, NULL,
+				                         NULL, &returned, 1);
+				trace_page (ldap, base, msgid, ret == LDAP_SUCCESS ? code : ret,
+				            entries, started);
+				if (ret != LDAP_SUCCESS || code != LDAP_SUCCESS) {
+					ldap_controls_free (returned);
+					return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
+					                                   "Couldn't search for entries: %s", filter);
+				}
+
+				/* An empty or missing cookie means this was the last page */
+				control = ldap_control_find (LDAP_CONTROL_PAGEDRESULTS, returned, NULL);
+				if (control != NULL)
+					ldap_parse_pageresponse_control (ldap, control, &count, &cookie);
+				ldap_controls_free (returned);
+				returned = NULL;
+				break;
+
+			} else if (ret == -1 || ret == 0) {
+				return _adcli_ldap_handle_failure (ldap, ADCLI_ERR_DIRECTORY,
+				                                   "Couldn't receive search results: %s", filter);
+
+			/* Ignore search references and anything else */
+			} else {
+				ldap_msgfree (message);
+			}
+		}
+	} while (cookie.bv_len > 0);
+
+	ber_memfree (cookie.bv_val);
+	return ADCLI_SUCCESS;
+}
+
+/* While planning, each operation is reported instead of being sent */
+static bool
+plan_pipelined_op (_adcli_ldap_op *op,
+                   int round_trips)
+{
+	char *detail;
+
+	if (!_adcli_planning ())
+		return false;
+
+	if (op->mods) {
+		detail = mods_to_plan_string (op->mods);
+		_adcli_plan ("ldap-modify", op->dn, round_trips, "%s", detail ? detail : "");
+		free (detail);
+	} else if (op->controls && op->controls[0]) {
+		_adcli_plan ("ldap-delete", op->dn, round_trips, "with control %s",
+		             op->controls[0]->ldctl_oid);
+	} else {
+		_adcli_plan ("ldap-delete", op->dn, round_trips, NULL);
+	}
+
+	return true;
+}
+
+adcli_result
+_adcli_ldap_pipeline (LDAP *ldap,
+                      _adcli_ldap_op *ops,
+                      int n_ops,
+                      int window,
+                      _adcli_ldap_op_func func,
+                      void *data)
+{
+	LDAPMessage *message;
+	adcli_result res = ADCLI_SUCCESS;
+	_adcli_ldap_op *op;
+	int reported = 0;
+	int pending = 0;
+	int next = 0;
+	int msgid;
+	int ret;
+	int i;
+
+	return_unexpected_if_fail (ldap != NULL);
+	return_unexpected_if_fail (ops != NULL || n_ops == 0);
+	return_unexpected_if_fail (window > 0);
+
+	for (i = 0; i < n_ops; i++) {
+		ops[i].msgid = -1;
+		ops[i].complete = 0;
+		ops[i].code = LDAP_SUCCESS;
+		ops[i].diagnostic = NULL;
+	}
+
+	/*
+	 * Keep up to @window operations outstanding on the connection, so
+	 * that we pay for a round trip per window rather than per entry.
+	 * Results are handed to @func in the order of @ops regardless of
+	 * the order in which the server answers.
+	 */
+	while (reported < n_ops) {
+		while (pending < window && next < n_ops) {
+			op = ops + next++;
+
+			/* A window of operations costs about one round trip */
+			if (plan_pipelined_op (op, (next - 1) % window == 0 ? 1 : 0)) {
+				op->started = 0;
+				op->complete = 1;
+				continue;
+			}
+
+			op->started = _adcli_trace_clock ();
+			if (op->mods)
+				ret = ldap_modify_ext (ldap, op->dn, op->mods, op->controls, NULL, &op->msgid);
+			else
+				ret = ldap_delete_ext (ldap, op->dn, op->controls, NULL, &op->msgid);
+			if (ret == LDAP_NO_MEMORY)
+				return_unexpected_if_reached ();
+			if (ret != LDAP_SUCCESS) {
+				op->code = ret;
+				op->complete = 1;
+			} else {
+				pending++;
+			}
+		}
+
+		while (reported < next && ops[reported].complete) {
+			op = ops + reported++;
+			trace_ldap (ldap, op->mods ? "modify" : "delete", op->dn,
+			            op->msgid, op->code, NULL, op->started);
+			if (func != NULL) {
+				ret = (func) (ldap, op, data);
+				if (res == ADCLI_SUCCESS)
+					res = ret;
+			}
+			ldap_memfree (op->diagnostic);
+			op->diagnostic = NULL;
+		}
+
+		if (pending == 0)
+			continue;
+
+		ret = ldap_result (ldap, LDAP_RES_ANY, LDAP_MSG_ALL, NULL, &message);
+		if (ret == -1 || ret == 0) {
+			/* The connection is gone, fail everything that was sent */
+			if (ldap_get_option (ldap, LDAP_OPT_RESULT_CODE, &ret) != 0 ||
+			    ret == LDAP_SUCCESS)
+				ret = LDAP_SERVER_DOWN;
+			for (i = reported; i < next; i++) {
+				if (!ops[i].complete) {
+					ops[i].code = ret;
+					ops[i].complete = 1;
+				}
+			}
+			pending = 0;
+			continue;
+		}
+
+		msgid = ldap_msgid (message);
+		for (op = NULL, i = reported; i < next; i++) {
+			if (ops[i].msgid == msgid && !ops[i].complete) {
+				op = ops + i;
+				break;
+			}
+		}
+
+		if (op == NULL) {
+			ldap_msgfree (message);
+			continue;
+		}
+
+		ret = ldap_parse_result (ldap, message, &op->code, NULL,
+		                         &op->diagnostic, NULL, NULL, 1);
+		if (ret != LDAP_SUCCESS)
+			op->code = ret;
+		op->complete = 1;
+		pending--;
+	}
+
+	return res;
+}
+
 char *
 _adcli_ldap_parse_dn (LDAP *ldap,
                       LDAPMessage *results)
@@ -165,6 +972,57 @@ _adcli_ldap_parse_dn (LDAP *ldap,
 	return ret;
 }
 
+int
+_adcli_ldap_parse_range (const char *attr_desc,
+                         const char *attr_name,
+                         int *low,
+                         int *high)
+{
+	const char *range = ";range=";
+	unsigned long value;
+	size_t len;
+	char *end;
+
+	assert (attr_desc != NULL);
+	assert (attr_name != NULL);
+
+	/* Looks like: member;range=0-1499 or member;range=1500-* */
+	len = strlen (attr_name);
+	if (strncasecmp (attr_desc, attr_name, len) != 0)
+		return 0;
+	attr_desc += len;
+
+	len = strlen (range);
+	if (strncasecmp (attr_desc, range, len) != 0)
+		return 0;
+	attr_desc += len;
+
+	if (!isdigit ((unsigned char)*attr_desc))
+		return 0;
+	value = strtoul (attr_desc, &end, 10);
+	if (*end != '-' || value > INT_MAX)
+		return 0;
+	if (low)
+		*low = value;
+	attr_desc = end + 1;
+
+	/* The last range is terminated with an asterisk */
+	if (strcmp (attr_desc, "*") == 0) {
+		if (high)
+			*high = -1;
+		return 1;
+	}
+
+	if (!isdigit ((unsigned char)*attr_desc))
+		return 0;
+	value = strtoul (attr_desc, &end, 10);
+	if (*end != '\0' || value > INT_MAX)
+		return 0;
+	if (high)
+		*high = value;
+	return 1;
+}
+
 int
 _adcli_ldap_ber_case_equal (struct berval *one,
                             struct berval *two)
@@ -280,19 +1138,13 @@ _adcli_ldap_filter_for_add (void *unused,
 #define LDAP_NO_ESCAPE "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-_0123456789"
 #define LDAP_HEX "0123456789abcdef"
 
-char *
-_adcli_ldap_escape_filter (const char *value)
+static void
+escape_filter (const char *value,
+               char *result)
 {
 	const char *in;
-	char *out, *result;
+	char *out;
 	size_t pos;
-	size_t len;
-
-	assert (value != NULL);
-
-	len = strlen (value);
-	result = malloc ((len * 3) + 1);
-	return_val_if_fail (result != NULL, NULL);
 
 	in = value;
 	out = result;
@@ -314,6 +1166,34 @@ _adcli_ldap_escape_filter (const char *value)
 	}
 
 	*out = 0;
+}
+
+char *
+_adcli_ldap_escape_filter (const char *value)
+{
+	char *result;
+
+	assert (value != NULL);
+
+	result = malloc ((strlen (value) * 3) + 1);
+	return_val_if_fail (result != NULL, NULL);
+
+	escape_filter (value, result);
+	return result;
+}
+
+char *
+_adcli_ldap_escape_filter_in (_adcli_arena *arena,
+                              const char *value)
+{
+	char *result;
+
+	assert (value != NULL);
+
+	result = _adcli_arena_alloc (arena, (strlen (value) * 3) + 1);
+	return_val_if_fail (result != NULL, NULL);
+
+	escape_filter (value, result);
 	return result;
 }
 
@@ -370,6 +1250,52 @@ _adcli_ldap_dn_has_ancestor (const char *dn,
 	return match;
 }
 
+/* The DNS domain named by the trailing DC= components of a DN */
+char *
+_adcli_ldap_dn_to_domain (const char *dn)
+{
+	LDAPDN ld_dn;
+	LDAPRDN rdn;
+	char *domain = NULL;
+	size_t len = 0;
+	int first;
+	int rc;
+	int i;
+
+	return_val_if_fail (dn != NULL, NULL);
+
+	rc = ldap_str2dn (dn, &ld_dn, LDAP_DN_FORMAT_LDAPV3);
+	if (rc != LDAP_SUCCESS)
+		return NULL;
+
+	/* Find where the run of DC= components at the end starts */
+	for (i = 0; ld_dn[i] != NULL; i++);
+	for (first = i; first > 0; first--) {
+		rdn = ld_dn[first - 1];
+		if (rdn[0] == NULL || rdn[1] != NULL ||
+		    rdn[0]->la_attr.bv_len != 2 ||
+		    strncasecmp (rdn[0]->la_attr.bv_val, "DC", 2) != 0)
+			break;
+		len += rdn[0]->la_value.bv_len + 1;
+	}
+
+	if (len > 0) {
+		domain = malloc (len);
+		return_val_if_fail (domain != NULL, NULL);
+		domain[0] = '\0';
+		for (i = first; ld_dn[i] != NULL; i++) {
+			if (i != first)
+				strcat (domain, ".");
+			strncat (domain, ld_dn[i][0]->la_value.bv_val,
+			         ld_dn[i][0]->la_value.bv_len);
+		}
+		_adcli_str_down (domain);
+	}
+
+	ldap_dnfree (ld_dn);
+	return domain;
+}
+
 int
 _adcli_ldap_mod_compar (void *match,
                         void *mod)
@@ -445,6 +1371,245 @@ _adcli_ldap_mods_to_string (LDAPMod **mods)
 	return string;
 }
 
+/*
+ * OpenLDAP hands the connect callback its TLS library's own objects, so
+ * resuming sessions is only possible when that library is OpenSSL and
+ * adcli was built against it too.
+ */
+#if defined (HAVE_LIBSSL) && defined (HAVE_OPENSSL_SSL_H) && \
+    defined (LDAP_OPT_X_TLS_CONNECT_CB) && defined (LDAP_OPT_X_TLS_PACKAGE)
+#define HAVE_TLS_RESUME 1
+#endif
+
+#ifdef HAVE_TLS_RESUME
+
+/* Longest time a TLS session to a domain controller is offered again */
+#define TLS_SESSION_TTL 3600
+
+typedef struct _tls_session {
+	char *host;
+	SSL_SESSION *session;
+	time_t expires;
+	struct _tls_session *next;
+} tls_session;
+
+static tls_session *tls_sessions = NULL;
+static int tls_host_index = -1;
+
+static tls_session **
+tls_session_find (const char *host)
+{
+	tls_session **at;
+
+	for (at = &tls_sessions; *at != NULL; at = &(*at)->next) {
+		if (strcmp ((*at)->host, host) == 0)
+			break;
+	}
+
+	return at;
+}
+
+static void
+tls_session_forget (tls_session **at)
+{
+	tls_session *ts = *at;
+
+	*at = ts->next;
+	SSL_SESSION_free (ts->session);
+	free (ts->host);
+	free (ts);
+}
+
+/* Takes over the reference to the session when it returns true */
+static bool
+tls_session_add (const char *host,
+                 SSL_SESSION *session)
+{
+	tls_session *ts;
+	long timeout;
+
+	ts = calloc (1, sizeof (tls_session));
+	return_val_if_fail (ts != NULL, false);
+
+	ts->host = strdup (host);
+	if (ts->host == NULL) {
+		free (ts);
+		return_val_if_reached (false);
+	}
+
+	timeout = SSL_SESSION_get_timeout (session);
+	if (timeout <= 0 || timeout > TLS_SESSION_TTL)
+		timeout = TLS_SESSION_TTL;
+
+	ts->expires = SSL_SESSION_get_time (session) + timeout;
+	ts->session = session;
+	ts->next = tls_sessions;
+	tls_sessions = ts;
+	return true;
+}
+
+static char *
+tls_session_state (const char *host)
+{
+	char *name;
+
+	if (asprintf (&name, "tls-session.%s", host) < 0)
+		return_val_if_reached (NULL);
+
+	_adcli_str_down (name);
+	return name;
+}
+
+/* Sessions are written out, so that later runs can resume them too */
+static void
+tls_session_save (const char *host,
+                  SSL_SESSION *session)
+{
+	unsigned char *der = NULL;
+	char *name;
+	int len;
+
+	len = i2d_SSL_SESSION (session, &der);
+	if (len <= 0)
+		return;
+
+	name = tls_session_state (host);
+	if (name != NULL)
+		_adcli_state_write (name, der, len);
+
+	OPENSSL_free (der);
+	free (name);
+}
+
+static SSL_SESSION *
+tls_session_load (const char *host)
+{
+	const unsigned char *at;
+	SSL_SESSION *session;
+	char *name;
+	char *data;
+	size_t len;
+
+	name = tls_session_state (host);
+	if (name == NULL)
+		return NULL;
+
+	data = _adcli_state_read (name, TLS_SESSION_TTL, &len);
+	free (name);
+	if (data == NULL)
+		return NULL;
+
+	at = (const unsigned char *)data;
+	session = d2i_SSL_SESSION (NULL, &at, len);
+	free (data);
+
+	return session;
+}
+
+/* Called when a server hands out a session, for TLS 1.3 after the handshake */
+static int
+tls_session_new_cb (SSL *ssl,
+                    SSL_SESSION *session)
+{
+	const char *host;
+	tls_session **at;
+
+	host = SSL_get_ex_data (ssl, tls_host_index);
+	if (host == NULL || !SSL_SESSION_is_resumable (session))
+		return 0;
+
+	at = tls_session_find (host);
+	if (*at != NULL)
+		tls_session_forget (at);
+
+	if (!tls_session_add (host, session))
+		return 0;
+
+	tls_session_save (host, session);
+
+	/* We keep the reference we were given */
+	return 1;
+}
+
+static void
+tls_host_free (void *parent,
+               void *ptr,
+               CRYPTO_EX_DATA *ad,
+               int idx,
+               long argl,
+               void *argp)
+{
+	free (ptr);
+}
+
+/* Called by libldap for each new TLS session, before the handshake */
+static int
+tls_connect_cb (LDAP *ldap,
+                void *ssl,
+                void *ctx,
+                void *arg)
+{
+	SSL_SESSION *session;
+	tls_session **at;
+	char *name = NULL;
+	char *host;
+
+	if (ldap_get_option (ldap, LDAP_OPT_HOST_NAME, &name) != LDAP_OPT_SUCCESS ||
+	    name == NULL)
+		return 0;
+	host = strdup (name);
+	ldap_memfree (name);
+	return_val_if_fail (host != NULL, 0);
+
+	SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_CLIENT |
+	                                     SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb (ctx, tls_session_new_cb);
+
+	at = tls_session_find (host);
+
+	/* Another run may have left a session behind */
+	if (*at == NULL) {
+		session = tls_session_load (host);
+		if (session != NULL && !tls_session_add (host, session))
+			SSL_SESSION_free (session);
+		at = tls_session_find (host);
+	}
+
+	if (*at != NULL && (*at)->expires < time (NULL))
+		tls_session_forget (at);
+	if (*at != NULL && SSL_set_session (ssl, (*at)->session) == 1)
+		_adcli_info ("Resuming TLS session with %s", host);
+
+	if (SSL_set_ex_data (ssl, tls_host_index, host) != 1)
+		free (host);
+	return 0;
+}
+
+#endif /* HAVE_TLS_RESUME */
+
+void
+_adcli_ldap_resume_tls (LDAP *ldap)
+{
+#ifdef HAVE_TLS_RESUME
+	char *package = NULL;
+	int openssl;
+
+	if (ldap_get_option (ldap, LDAP_OPT_X_TLS_PACKAGE, &package) != LDAP_OPT_SUCCESS)
+		return;
+	openssl = (package != NULL && strcmp (package, "OpenSSL") == 0);
+	ldap_memfree (package);
+	if (!openssl)
+		return;
+
+	if (tls_host_index < 0)
+		tls_host_index = SSL_get_ex_new_index (0, NULL, NULL, NULL, tls_host_free);
+	if (tls_host_index < 0)
+		return;
+
+	ldap_set_option (ldap, LDAP_OPT_X_TLS_CONNECT_CB, (void *)tls_connect_cb);
+#endif
+}
+
 #ifdef LDAP_TESTS
 
 #include "seq.h"
@@ -546,17 +1711,225 @@ test_to_string (void)
 	free (string);
 }
 
+static void
+test_parse_range (void)
+{
+	int low;
+	int high;
+
+	assert_num_eq (1, _adcli_ldap_parse_range ("member;range=0-1499", "member", &low, &high));
+	assert_num_eq (0, low);
+	assert_num_eq (1499, high);
+
+	assert_num_eq (1, _adcli_ldap_parse_range ("Member;Range=1500-*", "member", &low, &high));
+	assert_num_eq (1500, low);
+	assert_num_eq (-1, high);
+
+	assert_num_eq (0, _adcli_ldap_parse_range ("member", "member", &low, &high));
+	assert_num_eq (0, _adcli_ldap_parse_range ("memberOf;range=0-1499", "member", &low, &high));
+	assert_num_eq (0, _adcli_ldap_parse_range ("member;range=0-", "member", &low, &high));
+	assert_num_eq (0, _adcli_ldap_parse_range ("member;range=-1-*", "member", &low, &high));
+	assert_num_eq (0, _adcli_ldap_parse_range ("member;range=0-1499x", "member", &low, &high));
+}
+
+static void
+test_dn_to_domain (void)
+{
+	char *domain;
+
+	domain = _adcli_ldap_dn_to_domain ("CN=HOST,CN=Computers,DC=Child,DC=Example,DC=COM");
+	assert_str_eq ("child.example.com", domain);
+	free (domain);
+
+	domain = _adcli_ldap_dn_to_domain ("DC=example,DC=com");
+	assert_str_eq ("example.com", domain);
+	free (domain);
+
+	domain = _adcli_ldap_dn_to_domain ("CN=Configuration,DC=example,DC=com");
+	assert_str_eq ("example.com", domain);
+	free (domain);
+
+	/* Only the trailing run counts */
+	domain = _adcli_ldap_dn_to_domain ("DC=zone,CN=MicrosoftDNS,DC=example,DC=com");
+	assert_str_eq ("example.com", domain);
+	free (domain);
+
+	assert (_adcli_ldap_dn_to_domain ("CN=Users,O=Example") == NULL);
+	assert (_adcli_ldap_dn_to_domain ("not a dn") == NULL);
+}
+
+static void
+test_attrs_index (void)
+{
+	struct berval dn = { 8, "CN=Host1" };
+	struct berval spns[] = { { 9, "HOST/host" }, { 14, "HOST/host.test" }, { 0, NULL } };
+	struct berval uac[] = { { 4, "4096" }, { 0, NULL } };
+	struct berval empty[] = { { 0, NULL } };
+	raw_attr raw[] = {
+		{ { 20, "servicePrincipalName" }, spns },
+		{ { 18, "userAccountControl" }, uac },
+		{ { 11, "description" }, empty },
+	};
+	_adcli_ldap_attrs *attrs;
+	struct berval **vals;
+
+	attrs = build_attrs (&dn, raw, 3);
+	assert (attrs != NULL);
+
+	assert_str_eq (_adcli_ldap_attrs_dn (attrs), "CN=Host1");
+	assert_str_eq (_adcli_ldap_attrs_value (attrs, "USERaccountcontrol"), "4096");
+
+	vals = _adcli_ldap_attrs_bvals (attrs, "servicePrincipalName");
+	assert (vals != NULL);
+	assert_str_eq (vals[0]->bv_val, "HOST/host");
+	assert_num_eq (vals[1]->bv_len, 14);
+	assert_str_eq (vals[1]->bv_val, "HOST/host.test");
+	assert (vals[2] == NULL);
+
+	assert (_adcli_ldap_attrs_bvals (attrs, "description") == NULL);
+	assert (_adcli_ldap_attrs_value (attrs, "dNSHostName") == NULL);
+	assert (_adcli_ldap_attrs_value (NULL, "dNSHostName") == NULL);
+
+	_adcli_ldap_attrs_free (attrs);
+}
+
+static void
+test_plan_mods (void)
+{
+	char *spns[] = { "HOST/host", "HOST/host.test", NULL };
+	LDAPMod spn = { LDAP_MOD_ADD, "servicePrincipalName", { spns, } };
+	struct berval pwd = { 4, "\"\0x\0" };
+	struct berval *pwds[] = { &pwd, NULL };
+	LDAPMod unicodePwd = { LDAP_MOD_REPLACE | LDAP_MOD_BVALUES, "unicodePwd", { NULL, } };
+	LDAPMod description = { LDAP_MOD_DELETE, "description", { NULL, } };
+	LDAPMod *mods[] = { &spn, &unicodePwd, &description, NULL };
+	_adcli_ldap_attrs *attrs;
+	char *string;
+
+	unicodePwd.mod_vals.modv_bvals = pwds;
+
+	string = mods_to_plan_string (mods);
+	assert_str_eq (string, "add servicePrincipalName=HOST/host,HOST/host.test; "
+	                       "replace unicodePwd=(hidden); delete description");
+	free (string);
+
+	attrs = _adcli_ldap_attrs_from_mods ("CN=Host1", mods);
+	assert (attrs != NULL);
+	assert_str_eq (_adcli_ldap_attrs_dn (attrs), "CN=Host1");
+	assert_str_eq (_adcli_ldap_attrs_bvals (attrs, "servicePrincipalName")[1]->bv_val,
+	               "HOST/host.test");
+	assert_num_eq (_adcli_ldap_attrs_bvals (attrs, "unicodePwd")[0]->bv_len, 4);
+	assert (_adcli_ldap_attrs_value (attrs, "description") == NULL);
+	_adcli_ldap_attrs_free (attrs);
+}
+
+static int pipeline_planned = 0;
+static int pipeline_round_trips = 0;
+
+static void
+test_pipeline_plan_func (const char *operation,
+                         const char *target,
+                         const char *detail,
+                         int round_trips)
+{
+	assert (strcmp (operation, "ldap-delete") == 0 ||
+	        strcmp (operation, "ldap-modify") == 0);
+	pipeline_planned++;
+	pipeline_round_trips += round_trips;
+}
+
+static adcli_result
+test_pipeline_done (LDAP *ldap,
+                    _adcli_ldap_op *op,
+                    void *data)
+{
+	int *done = data;
+
+	assert_num_eq (op->code, LDAP_SUCCESS);
+	assert_num_eq (op->msgid, -1);
+	(*done)++;
+	return ADCLI_SUCCESS;
+}
+
+static void
+test_pipeline_plan (void)
+{
+	char *values[] = { "514", NULL };
+	LDAPMod uac = { LDAP_MOD_REPLACE, "userAccountControl", { values, } };
+	LDAPMod *mods[] = { &uac, NULL };
+	_adcli_ldap_op ops[3];
+	LDAP *ldap;
+	int done = 0;
+
+	memset (ops, 0, sizeof (ops));
+	ops[0].dn = "CN=One,DC=example,DC=com";
+	ops[1].dn = "CN=Two,DC=example,DC=com";
+	ops[1].mods = mods;
+	ops[2].dn = "CN=Three,DC=example,DC=com";
+
+	/* Nothing is sent while planning, so the server is never contacted */
+	assert_num_eq (ldap_initialize (&ldap, "ldap://127.0.0.1:1"), LDAP_SUCCESS);
+	adcli_set_plan_func (test_pipeline_plan_func);
+
+	assert_num_eq (_adcli_ldap_pipeline (ldap, ops, 3, 2, test_pipeline_done, &done),
+	               ADCLI_SUCCESS);
+	assert_num_eq (done, 3);
+	assert_num_eq (pipeline_planned, 3);
+	assert_num_eq (pipeline_round_trips, 2);
+
+	adcli_set_plan_func (NULL);
+	ldap_unbind_ext_s (ldap, NULL, NULL);
+}
+
 int
 main (int argc,
       char *argv[])
 {
 	test_func (test_compar, "/ldap/compar");
+	test_func (test_attrs_index, "/ldap/attrs_index");
+	test_func (test_plan_mods, "/ldap/plan_mods");
 	test_func (test_new_free, "/ldap/new_free");
 	test_func (test_new1, "/ldap/new1");
 	test_func (test_new_null, "/ldap/new_null");
 	test_func (test_free_null, "/ldap/free_null");
 	test_func (test_to_string, "/ldap/to_string");
+	test_func (test_parse_range, "/ldap/parse_range");
+	test_func (test_dn_to_domain, "/ldap/dn_to_domain");
+	test_func (test_pipeline_plan, "/ldap/pipeline_plan");
 	return test_run (argc, argv);
 }
 
 #endif /* LDAP_TESTS */
+
+#ifdef LDAP_BENCH
+
+#include "bench.h"
+
+static void
+bench_escape_filter (unsigned long iterations,
+                     void *data)
+{
+	const char *value = data;
+	unsigned long i;
+	char *escaped;
+
+	for (i = 0; i < iterations; i++) {
+		escaped = _adcli_ldap_escape_filter (value);
+		if (escaped == NULL)
+			bench_fail ("couldn't escape filter value");
+		free (escaped);
+	}
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	bench_funcx (bench_escape_filter, "HOST/workstation-0042.ad.example.com",
+	             "/ldap/escape_filter_plain");
+	bench_funcx (bench_escape_filter, "CN=Smith\\, John (*),OU=Staff,DC=ad,DC=example,DC=com",
+	             "/ldap/escape_filter_special");
+	return bench_run (argc, argv);
+}
+
+#endif /* LDAP_BENCH */
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <ldap.h>
 
@@ -44,8 +45,18 @@
  * for details. */
 #define UAC_ACCOUNTDISABLE             0x0002
 #define UAC_WORKSTATION_TRUST_ACCOUNT  0x1000
+#define UAC_SERVER_TRUST_ACCOUNT       0x2000
 #define UAC_DONT_EXPIRE_PASSWORD      0x10000
 #define UAC_TRUSTED_FOR_DELEGATION    0x80000
+#define UAC_PARTIAL_SECRETS_ACCOUNT 0x4000000
+
+/* Delete an entry together with all its child objects */
+#ifndef LDAP_CONTROL_X_TREE_DELETE
+#define LDAP_CONTROL_X_TREE_DELETE "1.2.840.113556.1.4.805"
+#endif
+
+/* Seconds between the NT time epoch 1601-01-01 and the Unix epoch */
+#define AD_TO_UNIX_TIME_CONST 11644473600LL
 
 /* Utilities */
 
@@ -113,6 +124,42 @@ void           _adcli_warn                   (const char *format,
 void           _adcli_info                   (const char *format,
                                              ...) GNUC_PRINTF(1, 2);
 
+bool           _adcli_log_enabled            (adcli_log_level level);
+
+void           _adcli_log                    (adcli_log_level level,
+                                              const char *category,
+                                              const char *message,
+                                              ...) GNUC_NULL_TERMINATED;
+
+typedef struct {
+	const char *name;
+	const char *detail;
+	double started;
+} _adcli_phase;
+
+void           _adcli_phase_begin            (_adcli_phase *phase,
+                                              const char *name,
+                                              const char *detail);
+
+adcli_result   _adcli_phase_end              (_adcli_phase *phase,
+                                              adcli_result result);
+
+double         _adcli_trace_clock            (void);
+
+void           _adcli_trace                  (const char *category,
+                                              const char *name,
+                                              const char *server,
+                                              double started,
+                                              ...) GNUC_NULL_TERMINATED;
+
+bool           _adcli_planning               (void);
+
+bool           _adcli_plan                   (const char *operation,
+                                              const char *target,
+                                              int round_trips,
+                                              const char *format,
+                                              ...) GNUC_PRINTF(4, 5);
+
 int            _adcli_strv_len               (char **strv);
 
 char **        _adcli_strv_add               (char **strv,
@@ -146,6 +193,8 @@ void           _adcli_str_up                 (char *str);
 
 void           _adcli_str_down               (char *str);
 
+unsigned int   _adcli_str_case_hash          (const char *str);
+
 int            _adcli_str_is_up              (const char *str);
 
 int            _adcli_str_has_prefix         (const char *str,
@@ -166,12 +215,90 @@ void           _adcli_str_set                (char **field,
 void           _adcli_strv_set               (char ***field,
                                               const char **value);
 
+/*
+ * A string vector that tracks its length and capacity, and keeps a case
+ * folded hash index once it grows past a few entries. The strv field is
+ * always NULL terminated (or NULL) and may be read directly. A zeroed
+ * structure is an empty set.
+ */
+typedef struct {
+	char **strv;
+	int length;
+	int capacity;
+	int *index;
+	int index_size;
+} _adcli_strset;
+
+bool           _adcli_strset_add             (_adcli_strset *set,
+                                              char *string);
+
+bool           _adcli_strset_add_unique      (_adcli_strset *set,
+                                              char *string,
+                                              bool case_sensitive);
+
+bool           _adcli_strset_has             (_adcli_strset *set,
+                                              const char *string,
+                                              bool case_sensitive);
+
+void           _adcli_strset_remove          (_adcli_strset *set,
+                                              const char *string);
+
+void           _adcli_strset_set             (_adcli_strset *set,
+                                              const char **value);
+
+void           _adcli_strset_clear           (_adcli_strset *set);
+
+/*
+ * A bump allocator for short lived strings such as filters and DNs. Everything
+ * allocated after a mark is released in one go, and the memory is reused.
+ * Never put passwords or other secrets in an arena, they are not cleared.
+ */
+typedef struct _adcli_arena_chunk _adcli_arena_chunk;
+
+typedef struct {
+	_adcli_arena_chunk *first;
+	_adcli_arena_chunk *current;
+} _adcli_arena;
+
+typedef struct {
+	_adcli_arena_chunk *chunk;
+	size_t used;
+} _adcli_arena_mark;
+
+void           _adcli_arena_get_mark         (_adcli_arena *arena,
+                                              _adcli_arena_mark *mark);
+
+void           _adcli_arena_release          (_adcli_arena *arena,
+                                              const _adcli_arena_mark *mark);
+
+void *         _adcli_arena_alloc            (_adcli_arena *arena,
+                                              size_t size);
+
+char *         _adcli_arena_strdup           (_adcli_arena *arena,
+                                              const char *string);
+
+char *         _adcli_arena_printf           (_adcli_arena *arena,
+                                              const char *format,
+                                              ...) GNUC_PRINTF(2, 3);
+
+void           _adcli_arena_free             (_adcli_arena *arena);
+
 int            _adcli_password_free          (char *password);
 
 int            _adcli_write_all              (int fd,
                                               const char *buf,
                                               int len);
 
+char *         _adcli_state_read             (const char *name,
+                                              time_t max_age,
+                                              size_t *length);
+
+bool           _adcli_state_write            (const char *name,
+                                              const void *data,
+                                              size_t length);
+
+void           _adcli_state_remove           (const char *name);
+
 /* Connection helpers */
 
 char *        _adcli_calc_reset_password     (const char *computer_name);
@@ -190,6 +317,43 @@ krb5_error_code  _adcli_kinit_user_creds          (adcli_conn *conn,
                                                    krb5_ccache ccache,
                                                    krb5_creds *creds);
 
+_adcli_arena *   _adcli_conn_get_arena            (adcli_conn *conn);
+
+bool             _adcli_conn_retry                (adcli_conn *conn,
+                                                   adcli_result res);
+
+/* Whether the login should also fetch a kadmin/changepw ticket */
+void             _adcli_conn_set_changepw_planned (adcli_conn *conn,
+                                                   bool value);
+
+/* In the same order as known_capabilities and known_sasl_mechs in adconn.c */
+typedef enum {
+	CAP_BIT_OID = 1 << 0,
+	CAP_BIT_LDAP_INTEG = 1 << 1,
+	CAP_BIT_V51 = 1 << 2,
+	CAP_BIT_ADAM_DIGEST = 1 << 3,
+	CAP_BIT_ADAM = 1 << 4,
+	CAP_BIT_PARTIAL_SECRETS = 1 << 5,
+	CAP_BIT_V60 = 1 << 6,
+	CAP_BIT_V61_R2 = 1 << 7,
+	CAP_BIT_W8 = 1 << 8,
+} adcli_cap_bit;
+
+typedef enum {
+	SASL_BIT_GSSAPI = 1 << 0,
+	SASL_BIT_GSS_SPNEGO = 1 << 1,
+	SASL_BIT_EXTERNAL = 1 << 2,
+	SASL_BIT_DIGEST_MD5 = 1 << 3,
+} adcli_sasl_bit;
+
+bool             _adcli_conn_has_cap              (adcli_conn *conn,
+                                                   adcli_cap_bit cap);
+
+bool             _adcli_conn_has_sasl_mech        (adcli_conn *conn,
+                                                   adcli_sasl_bit mech);
+
+char **          _adcli_disco_srv_hosts           (const char *rrname);
+
 /* LDAP helpers */
 
 adcli_result  _adcli_ldap_handle_failure     (LDAP *ldap,
@@ -197,6 +361,53 @@ adcli_result  _adcli_ldap_handle_failure     (LDAP *ldap,
                                               const char *desc,
                                               ...) GNUC_PRINTF(3, 4);
 
+int           _adcli_ldap_search_ext_s       (LDAP *ldap,
+                                              const char *base,
+                                              int scope,
+                                              const char *filter,
+                                              char **attrs,
+                                              int attrsonly,
+                                              LDAPControl **serverctrls,
+                                              LDAPControl **clientctrls,
+                                              struct timeval *timeout,
+                                              int sizelimit,
+                                              LDAPMessage **results);
+
+void          _adcli_ldap_resume_tls         (LDAP *ldap);
+
+int           _adcli_ldap_wait_for_result    (LDAP *ldap,
+                                              const char *operation,
+                                              const char *dn,
+                                              int msgid,
+                                              struct timeval *timeout,
+                                              LDAPMessage **results,
+                                              double started);
+
+int           _adcli_ldap_check_result       (LDAP *ldap,
+                                              const char *operation,
+                                              const char *dn,
+                                              int msgid,
+                                              LDAPMessage **results,
+                                              double started,
+                                              bool *done);
+
+int           _adcli_ldap_add_ext_s          (LDAP *ldap,
+                                              const char *dn,
+                                              LDAPMod **attrs,
+                                              LDAPControl **serverctrls,
+                                              LDAPControl **clientctrls);
+
+int           _adcli_ldap_modify_ext_s       (LDAP *ldap,
+                                              const char *dn,
+                                              LDAPMod **mods,
+                                              LDAPControl **serverctrls,
+                                              LDAPControl **clientctrls);
+
+int           _adcli_ldap_delete_ext_s       (LDAP *ldap,
+                                              const char *dn,
+                                              LDAPControl **serverctrls,
+                                              LDAPControl **clientctrls);
+
 char *         _adcli_ldap_parse_sid         (LDAP *ldap,
                                               LDAPMessage *results,
                                               const char *attr_name);
@@ -209,9 +420,68 @@ char **       _adcli_ldap_parse_values       (LDAP *ldap,
                                               LDAPMessage *results,
                                               const char *attr_name);
 
+typedef struct _adcli_ldap_attrs _adcli_ldap_attrs;
+
+_adcli_ldap_attrs *  _adcli_ldap_attrs_parse  (LDAP *ldap,
+                                              LDAPMessage *results);
+
+_adcli_ldap_attrs *  _adcli_ldap_attrs_from_mods (const char *dn,
+                                                 LDAPMod **mods);
+
+void          _adcli_ldap_attrs_free         (_adcli_ldap_attrs *attrs);
+
+const char *  _adcli_ldap_attrs_dn           (_adcli_ldap_attrs *attrs);
+
+struct berval ** _adcli_ldap_attrs_bvals     (_adcli_ldap_attrs *attrs,
+                                              const char *attr_name);
+
+const char *  _adcli_ldap_attrs_value        (_adcli_ldap_attrs *attrs,
+                                              const char *attr_name);
+
+typedef adcli_result (* _adcli_ldap_entry_func) (LDAP *ldap,
+                                                LDAPMessage *entry,
+                                                void *data);
+
+adcli_result  _adcli_ldap_search_paged       (LDAP *ldap,
+                                              const char *base,
+                                              int scope,
+                                              const char *filter,
+                                              char **attrs,
+                                              int page_size,
+                                              LDAPControl *sort_control,
+                                              _adcli_ldap_entry_func func,
+                                              void *data);
+
+typedef struct {
+	const char *dn;
+	LDAPMod **mods;               /* NULL for a delete */
+	LDAPControl **controls;
+	int msgid;
+	int complete;
+	int code;                     /* LDAP result code once complete */
+	char *diagnostic;
+	double started;
+} _adcli_ldap_op;
+
+typedef adcli_result (* _adcli_ldap_op_func)    (LDAP *ldap,
+                                                _adcli_ldap_op *op,
+                                                void *data);
+
+adcli_result  _adcli_ldap_pipeline           (LDAP *ldap,
+                                              _adcli_ldap_op *ops,
+                                              int n_ops,
+                                              int window,
+                                              _adcli_ldap_op_func func,
+                                              void *data);
+
 char *        _adcli_ldap_parse_dn           (LDAP *ldap,
                                               LDAPMessage *results);
 
+int           _adcli_ldap_parse_range        (const char *attr_desc,
+                                              const char *attr_name,
+                                              int *low,
+                                              int *high);
+
 int           _adcli_ldap_ber_case_equal     (struct berval *one,
                                               struct berval *two);
 
@@ -223,6 +493,11 @@ int           _adcli_ldap_have_in_mod        (LDAPMod *want,
 
 char *        _adcli_ldap_escape_filter      (const char *value);
 
+char *        _adcli_ldap_escape_filter_in   (_adcli_arena *arena,
+                                              const char *value);
+
+char *        _adcli_ldap_dn_to_domain       (const char *dn);
+
 int           _adcli_ldap_dn_has_ancestor    (const char *dn,
                                               const char *ancestor);
 
@@ -248,6 +523,41 @@ char *        _adcli_ldap_mods_to_string     (LDAPMod **mods);
 
 adcli_result     _adcli_krb5_init_context         (krb5_context *k5);
 
+adcli_result     _adcli_krb5_init_context_pinned  (krb5_context *k5,
+                                                   const char *realm,
+                                                   const char *controller,
+                                                   const char **hosts);
+
+void             _adcli_krb5_trace                (krb5_context k5,
+                                                   const char *name,
+                                                   const char *server,
+                                                   krb5_const_principal principal,
+                                                   krb5_error_code code,
+                                                   double started);
+
+typedef struct _adcli_krb5_as _adcli_krb5_as;
+
+krb5_error_code  _adcli_krb5_as_start             (krb5_context k5,
+                                                   krb5_init_creds_context icc,
+                                                   const char *kdc,
+                                                   const char *realm,
+                                                   _adcli_krb5_as **as);
+
+krb5_error_code  _adcli_krb5_tgs_start            (krb5_context k5,
+                                                   krb5_tkt_creds_context tcc,
+                                                   const char *kdc,
+                                                   const char *realm,
+                                                   _adcli_krb5_as **as);
+
+int              _adcli_krb5_as_fd                (_adcli_krb5_as *as,
+                                                   short *events);
+
+bool             _adcli_krb5_as_process           (_adcli_krb5_as *as);
+
+krb5_error_code  _adcli_krb5_as_wait              (_adcli_krb5_as *as);
+
+void             _adcli_krb5_as_free              (_adcli_krb5_as *as);
+
 adcli_result     _adcli_krb5_open_keytab          (krb5_context k5,
                                                    const char *keytab_name,
                                                    krb5_keytab *keytab);
@@ -318,6 +628,16 @@ struct _adcli_attrs {
 
 bool             _adcli_check_nt_time_string_lifetime (const char *nt_time_string, unsigned int lifetime);
 
+time_t           _adcli_rotation_time             (time_t last_set,
+                                                   unsigned int lifetime,
+                                                   unsigned int window,
+                                                   const char *seed);
+
+unsigned int     _adcli_backoff_delay             (unsigned int attempt,
+                                                   unsigned int base,
+                                                   unsigned int limit,
+                                                   const char *seed);
+
 adcli_result     _adcli_call_external_program     (const char *binary,
                                                    char * const *argv,
                                                    const char *stdin_data,
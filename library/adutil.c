@@ -31,15 +31,23 @@
 #include <ctype.h>
 #include <endian.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 static adcli_message_func message_func = NULL;
+static adcli_log_func log_func = NULL;
+static adcli_log_level log_level = ADCLI_LOG_INFO;
+static adcli_phase_func phase_func = NULL;
+static adcli_trace_func trace_func = NULL;
+static adcli_plan_func plan_func = NULL;
 static char last_error[2048] = { 0, };
 
 void
@@ -69,6 +77,8 @@ adcli_result_to_string (adcli_result res)
 	switch (res) {
 	case ADCLI_SUCCESS:
 		return "Success";
+	case ADCLI_IN_PROGRESS:
+		return "In progress";
 	case ADCLI_ERR_UNEXPECTED:
 		return "Unexpected or internal system error";
 	case ADCLI_ERR_DIRECTORY:
@@ -84,18 +94,34 @@ adcli_result_to_string (adcli_result res)
 	return_val_if_reached ("Unknown error");
 }
 
+/*
+ * Whether anyone would see a message at this level. Checked before
+ * anything is formatted, so that messages nobody listens to cost
+ * nothing but the call.
+ */
+bool
+_adcli_log_enabled (adcli_log_level level)
+{
+	if (log_func != NULL && level >= log_level)
+		return true;
+	return message_func != NULL && level >= ADCLI_LOG_INFO;
+}
+
 static void
 messagev (adcli_message_type type,
+          adcli_log_level level,
           const char *format,
           va_list va)
 {
 	char buffer[sizeof (last_error)];
 	char *where = buffer;
+	const char *fields[] = { NULL };
 	int ret;
 
+	/* Errors are always kept, for adcli_get_last_error() */
 	if (type == ADCLI_MESSAGE_ERROR)
 		where = last_error;
-	else if (message_func == NULL)
+	else if (!_adcli_log_enabled (level))
 		return;
 
 	ret = vsnprintf (where, sizeof (buffer), format, va);
@@ -103,6 +129,8 @@ messagev (adcli_message_type type,
 
 	if (message_func != NULL)
 		(message_func) (type, where);
+	if (log_func != NULL && level >= log_level)
+		(log_func) (level, "adcli", where, fields);
 }
 
 void
@@ -111,7 +139,7 @@ _adcli_err (const char *format,
 {
 	va_list va;
 	va_start (va, format);
-	messagev (ADCLI_MESSAGE_ERROR, format, va);
+	messagev (ADCLI_MESSAGE_ERROR, ADCLI_LOG_ERROR, format, va);
 	va_end (va);
 }
 
@@ -121,7 +149,7 @@ _adcli_warn (const char *format,
 {
 	va_list va;
 	va_start (va, format);
-	messagev (ADCLI_MESSAGE_ERROR, format, va);
+	messagev (ADCLI_MESSAGE_ERROR, ADCLI_LOG_WARNING, format, va);
 	va_end (va);
 }
 
@@ -131,8 +159,56 @@ _adcli_info (const char *format,
 {
 	va_list va;
 	va_start (va, format);
-	messagev (ADCLI_MESSAGE_INFO, format, va);
+	messagev (ADCLI_MESSAGE_INFO, ADCLI_LOG_INFO, format, va);
+	va_end (va);
+}
+
+#define LOG_MAX_FIELDS 8
+
+/*
+ * A structured message: the message is fixed text, and the details go
+ * in name and value pairs ending with a NULL. The message function
+ * sees them appended as name=value, the log function sees them apart.
+ */
+void
+_adcli_log (adcli_log_level level,
+            const char *category,
+            const char *message,
+            ...)
+{
+	const char *fields[LOG_MAX_FIELDS * 2 + 1];
+	char buffer[sizeof (last_error)];
+	const char *arg;
+	size_t len;
+	va_list va;
+	int n = 0;
+	int i;
+
+	if (!_adcli_log_enabled (level))
+		return;
+
+	va_start (va, message);
+	while (n < LOG_MAX_FIELDS * 2 && (arg = va_arg (va, const char *)) != NULL)
+		fields[n++] = arg;
 	va_end (va);
+	n &= ~1;
+	fields[n] = NULL;
+
+	if (log_func != NULL && level >= log_level)
+		(log_func) (level, category, message, fields);
+
+	/* The plain messages have no debug level */
+	if (message_func == NULL || level < ADCLI_LOG_INFO)
+		return;
+
+	len = snprintf (buffer, sizeof (buffer), "%s", message);
+	for (i = 0; i < n && len < sizeof (buffer); i += 2) {
+		len += snprintf (buffer + len, sizeof (buffer) - len, " %s=%s",
+		                 fields[i], fields[i + 1] ? fields[i + 1] : "");
+	}
+
+	(message_func) (level >= ADCLI_LOG_WARNING ? ADCLI_MESSAGE_ERROR
+	                                           : ADCLI_MESSAGE_INFO, buffer);
 }
 
 void
@@ -141,6 +217,163 @@ adcli_set_message_func (adcli_message_func func)
 	message_func = func;
 }
 
+void
+adcli_set_log_func (adcli_log_func func,
+                    adcli_log_level level)
+{
+	log_func = func;
+	log_level = level;
+}
+
+const char *
+adcli_log_level_to_string (adcli_log_level level)
+{
+	switch (level) {
+	case ADCLI_LOG_DEBUG:
+		return "debug";
+	case ADCLI_LOG_INFO:
+		return "info";
+	case ADCLI_LOG_WARNING:
+		return "warning";
+	case ADCLI_LOG_ERROR:
+		return "error";
+	}
+
+	return_val_if_reached ("unknown");
+}
+
+void
+adcli_set_phase_func (adcli_phase_func func)
+{
+	phase_func = func;
+}
+
+double
+adcli_phase_clock (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+void
+_adcli_phase_begin (_adcli_phase *phase,
+                    const char *name,
+                    const char *detail)
+{
+	phase->name = name;
+	phase->detail = detail;
+
+	/* Don't bother reading the clock if nobody is listening */
+	phase->started = (phase_func || trace_func) ? adcli_phase_clock () : 0;
+}
+
+adcli_result
+_adcli_phase_end (_adcli_phase *phase,
+                  adcli_result result)
+{
+	if (phase_func != NULL && phase->started != 0) {
+		(phase_func) (phase->name, phase->detail, result, phase->started,
+		              adcli_phase_clock () - phase->started);
+	}
+
+	if (phase->detail)
+		_adcli_trace ("phase", phase->name, NULL, phase->started,
+		              "result", adcli_result_to_string (result),
+		              "detail", phase->detail, NULL);
+	else
+		_adcli_trace ("phase", phase->name, NULL, phase->started,
+		              "result", adcli_result_to_string (result), NULL);
+
+	phase->started = 0;
+	return result;
+}
+
+void
+adcli_set_trace_func (adcli_trace_func func)
+{
+	trace_func = func;
+}
+
+double
+_adcli_trace_clock (void)
+{
+	/* Debug logging also reports how long each operation took */
+	return (trace_func || _adcli_log_enabled (ADCLI_LOG_DEBUG)) ? adcli_phase_clock () : 0;
+}
+
+#define TRACE_MAX_ARGS 8
+
+void
+_adcli_trace (const char *category,
+              const char *name,
+              const char *server,
+              double started,
+              ...)
+{
+	const char *args[TRACE_MAX_ARGS * 2 + 1];
+	const char *arg;
+	va_list va;
+	int n = 0;
+
+	/* Nothing to do, or the operation started before tracing did */
+	if (trace_func == NULL || started == 0)
+		return;
+
+	/* The arguments are name and value pairs, ending with a NULL */
+	va_start (va, started);
+	while (n < TRACE_MAX_ARGS * 2 && (arg = va_arg (va, const char *)) != NULL)
+		args[n++] = arg;
+	va_end (va);
+	args[n & ~1] = NULL;
+
+	(trace_func) (category, name, server, started,
+	              adcli_phase_clock () - started, args);
+}
+
+void
+adcli_set_plan_func (adcli_plan_func func)
+{
+	plan_func = func;
+}
+
+bool
+_adcli_planning (void)
+{
+	return plan_func != NULL;
+}
+
+/*
+ * While planning, changes are reported here instead of being made. The
+ * caller skips the change when this returns true.
+ */
+bool
+_adcli_plan (const char *operation,
+             const char *target,
+             int round_trips,
+             const char *format,
+             ...)
+{
+	char *detail = NULL;
+	va_list va;
+
+	if (plan_func == NULL)
+		return false;
+
+	if (format != NULL) {
+		va_start (va, format);
+		if (vasprintf (&detail, format, va) < 0)
+			detail = NULL;
+		va_end (va);
+	}
+
+	(plan_func) (operation, target, detail, round_trips);
+	free (detail);
+	return true;
+}
+
 const char *
 adcli_get_last_error (void)
 {
@@ -306,6 +539,18 @@ _adcli_str_down (char *str)
 	}
 }
 
+unsigned int
+_adcli_str_case_hash (const char *str)
+{
+	unsigned int hash = 5381;
+
+	/* djb2 over the lower case characters, for case insensitive tables */
+	for (; *str != '\0'; str++)
+		hash = (hash * 33) + tolower ((unsigned char)*str);
+
+	return hash;
+}
+
 void
 _adcli_str_set (char **field,
                 const char *value)
@@ -336,6 +581,325 @@ _adcli_strv_set (char ***field,
 	*field = newval;
 }
 
+/* Below this many entries a linear scan beats maintaining the index */
+#define STRSET_INDEX_MIN 8
+
+static void
+strset_index_insert (_adcli_strset *set,
+                     int position)
+{
+	unsigned int mask = set->index_size - 1;
+	unsigned int slot;
+
+	for (slot = _adcli_str_case_hash (set->strv[position]) & mask;
+	     set->index[slot] != 0; slot = (slot + 1) & mask);
+	set->index[slot] = position + 1;
+}
+
+static void
+strset_index_rebuild (_adcli_strset *set)
+{
+	int size;
+	int i;
+
+	/* Leave room to grow while staying at most half full */
+	for (size = 16; size < set->length * 4; size <<= 1);
+
+	free (set->index);
+	set->index = calloc (size, sizeof (int));
+	set->index_size = set->index ? size : 0;
+	return_if_fail (set->index != NULL);
+
+	for (i = 0; i < set->length; i++)
+		strset_index_insert (set, i);
+}
+
+static void
+strset_index_drop (_adcli_strset *set)
+{
+	free (set->index);
+	set->index = NULL;
+	set->index_size = 0;
+}
+
+bool
+_adcli_strset_add (_adcli_strset *set,
+                   char *string)
+{
+	char **strv;
+	int capacity;
+
+	return_val_if_fail (set != NULL, false);
+	return_val_if_fail (string != NULL, false);
+
+	/* Room for the new string and the NULL terminator */
+	if (set->length + 2 > set->capacity) {
+		capacity = set->capacity ? set->capacity * 2 : 8;
+		strv = realloc (set->strv, capacity * sizeof (char *));
+		return_val_if_fail (strv != NULL, false);
+		set->strv = strv;
+		set->capacity = capacity;
+	}
+
+	set->strv[set->length++] = string;
+	set->strv[set->length] = NULL;
+
+	/* A rebuild also indexes the new string */
+	if (set->index == NULL && set->length < STRSET_INDEX_MIN)
+		return true;
+	if (set->length * 2 > set->index_size)
+		strset_index_rebuild (set);
+	else
+		strset_index_insert (set, set->length - 1);
+
+	return true;
+}
+
+bool
+_adcli_strset_has (_adcli_strset *set,
+                   const char *string,
+                   bool case_sensitive)
+{
+	int (* compare) (const char *, const char *);
+	unsigned int mask;
+	unsigned int slot;
+	int i;
+
+	return_val_if_fail (set != NULL, false);
+	return_val_if_fail (string != NULL, false);
+
+	compare = case_sensitive ? strcmp : strcasecmp;
+
+	if (set->index == NULL) {
+		for (i = 0; i < set->length; i++) {
+			if (compare (set->strv[i], string) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	/* The index is case folded, so equal strings share a chain either way */
+	mask = set->index_size - 1;
+	for (slot = _adcli_str_case_hash (string) & mask;
+	     set->index[slot] != 0; slot = (slot + 1) & mask) {
+		if (compare (set->strv[set->index[slot] - 1], string) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+bool
+_adcli_strset_add_unique (_adcli_strset *set,
+                          char *string,
+                          bool case_sensitive)
+{
+	return_val_if_fail (string != NULL, false);
+
+	/* The set owns the string either way */
+	if (_adcli_strset_has (set, string, case_sensitive)) {
+		free (string);
+		return false;
+	}
+
+	return _adcli_strset_add (set, string);
+}
+
+void
+_adcli_strset_remove (_adcli_strset *set,
+                      const char *string)
+{
+	int i;
+
+	return_if_fail (set != NULL);
+	return_if_fail (string != NULL);
+
+	/* Like _adcli_strv_remove_unsorted(), matches case insensitively */
+	for (i = 0; i < set->length; ) {
+		if (strcasecmp (set->strv[i], string) == 0) {
+			free (set->strv[i]);
+			set->strv[i] = set->strv[--set->length];
+			set->strv[set->length] = NULL;
+		} else {
+			i++;
+		}
+	}
+
+	/* Positions have moved */
+	strset_index_drop (set);
+	if (set->length >= STRSET_INDEX_MIN)
+		strset_index_rebuild (set);
+}
+
+void
+_adcli_strset_clear (_adcli_strset *set)
+{
+	return_if_fail (set != NULL);
+
+	_adcli_strv_free (set->strv);
+	strset_index_drop (set);
+	memset (set, 0, sizeof (_adcli_strset));
+}
+
+void
+_adcli_strset_set (_adcli_strset *set,
+                   const char **value)
+{
+	char **strv;
+	int i;
+
+	return_if_fail (set != NULL);
+
+	_adcli_strset_clear (set);
+	if (value == NULL)
+		return;
+
+	/* An empty value still leaves a non-NULL strv */
+	strv = calloc (1, sizeof (char *));
+	return_if_fail (strv != NULL);
+	set->strv = strv;
+	set->capacity = 1;
+
+	for (i = 0; value[i] != NULL; i++)
+		_adcli_strset_add (set, strdup (value[i]));
+}
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN(n) (((n) + 15) & ~((size_t)15))
+
+struct _adcli_arena_chunk {
+	_adcli_arena_chunk *next;
+	size_t size;
+	size_t used;
+	union {
+		long double align;
+		char data[1];
+	} x;
+};
+
+void
+_adcli_arena_get_mark (_adcli_arena *arena,
+                       _adcli_arena_mark *mark)
+{
+	mark->chunk = arena->current;
+	mark->used = arena->current ? arena->current->used : 0;
+}
+
+void
+_adcli_arena_release (_adcli_arena *arena,
+                      const _adcli_arena_mark *mark)
+{
+	/* Chunks after the mark are kept and reused by later allocations */
+	if (mark->chunk) {
+		arena->current = mark->chunk;
+		arena->current->used = mark->used;
+	} else {
+		arena->current = arena->first;
+		if (arena->current)
+			arena->current->used = 0;
+	}
+}
+
+void *
+_adcli_arena_alloc (_adcli_arena *arena,
+                    size_t size)
+{
+	_adcli_arena_chunk *chunk;
+	size_t alloc;
+	void *ptr;
+
+	return_val_if_fail (arena != NULL, NULL);
+
+	size = ARENA_ALIGN (size ? size : 1);
+	chunk = arena->current;
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		if (chunk && chunk->next && chunk->next->size >= size) {
+			chunk = chunk->next;
+			chunk->used = 0;
+
+		} else {
+			/* Large allocations get a chunk of their own */
+			alloc = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+			chunk = malloc (offsetof (_adcli_arena_chunk, x) + alloc);
+			return_val_if_fail (chunk != NULL, NULL);
+			chunk->size = alloc;
+			chunk->used = 0;
+
+			if (arena->current) {
+				chunk->next = arena->current->next;
+				arena->current->next = chunk;
+			} else {
+				chunk->next = arena->first;
+				arena->first = chunk;
+			}
+		}
+
+		arena->current = chunk;
+	}
+
+	ptr = chunk->x.data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+char *
+_adcli_arena_strdup (_adcli_arena *arena,
+                     const char *string)
+{
+	size_t len;
+	char *copy;
+
+	return_val_if_fail (string != NULL, NULL);
+
+	len = strlen (string);
+	copy = _adcli_arena_alloc (arena, len + 1);
+	return_val_if_fail (copy != NULL, NULL);
+
+	memcpy (copy, string, len + 1);
+	return copy;
+}
+
+char *
+_adcli_arena_printf (_adcli_arena *arena,
+                     const char *format,
+                     ...)
+{
+	va_list va;
+	char *result;
+	int len;
+
+	va_start (va, format);
+	len = vsnprintf (NULL, 0, format, va);
+	va_end (va);
+	return_val_if_fail (len >= 0, NULL);
+
+	result = _adcli_arena_alloc (arena, len + 1);
+	return_val_if_fail (result != NULL, NULL);
+
+	va_start (va, format);
+	vsnprintf (result, len + 1, format, va);
+	va_end (va);
+
+	return result;
+}
+
+void
+_adcli_arena_free (_adcli_arena *arena)
+{
+	_adcli_arena_chunk *chunk;
+
+	return_if_fail (arena != NULL);
+
+	while (arena->first) {
+		chunk = arena->first;
+		arena->first = chunk->next;
+		free (chunk);
+	}
+
+	arena->current = NULL;
+}
+
 char *
 _adcli_bin_sid_to_str (const uint8_t *data,
                        size_t len)
@@ -509,7 +1073,179 @@ _adcli_write_all (int fd,
 	return 0;
 }
 
-#define AD_TO_UNIX_TIME_CONST 11644473600LL
+/*
+ * A few things learned about a domain are worth keeping between runs.
+ * Each lives in a small file in the state directory, only accessible by
+ * its owner, and is forgotten once older than the caller allows. The
+ * ADCLI_STATE_DIR environment variable points elsewhere, an empty value
+ * keeps nothing.
+ */
+#define STATE_MAX_SIZE (64 * 1024)
+
+static const char *
+state_directory (void)
+{
+	const char *dir;
+
+	dir = getenv ("ADCLI_STATE_DIR");
+	if (dir == NULL)
+		dir = ADCLI_STATE_DIR;
+	return dir;
+}
+
+static char *
+state_path (const char *name)
+{
+	const char *dir;
+	char *path;
+
+	/* Names are made from domain and host names, keep them in the directory */
+	if (name[0] == '\0' || name[0] == '.' || strchr (name, '/') != NULL)
+		return NULL;
+
+	dir = state_directory ();
+	if (dir[0] == '\0')
+		return NULL;
+
+	if (asprintf (&path, "%s/%s", dir, name) < 0)
+		return_val_if_reached (NULL);
+
+	return path;
+}
+
+char *
+_adcli_state_read (const char *name,
+                   time_t max_age,
+                   size_t *length)
+{
+	struct stat st;
+	char *data = NULL;
+	char *path;
+	size_t len = 0;
+	ssize_t ret;
+	int fd;
+
+	return_val_if_fail (name != NULL, NULL);
+
+	path = state_path (name);
+	if (path == NULL)
+		return NULL;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		free (path);
+		return NULL;
+	}
+
+	/* Only believe what nobody else could have written */
+	if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) ||
+	    st.st_uid != geteuid () || (st.st_mode & 077) != 0 ||
+	    st.st_size > STATE_MAX_SIZE)
+		goto out;
+
+	if (time (NULL) - st.st_mtime >= max_age) {
+		_adcli_info ("Forgetting state that has expired: %s", path);
+		unlink (path);
+		goto out;
+	}
+
+	data = malloc (st.st_size + 1);
+	if (data == NULL)
+		goto out;
+
+	while (len < (size_t)st.st_size) {
+		ret = read (fd, data + len, st.st_size - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+
+	if (len != (size_t)st.st_size) {
+		free (data);
+		data = NULL;
+		goto out;
+	}
+
+	data[len] = '\0';
+	if (length)
+		*length = len;
+
+out:
+	close (fd);
+	free (path);
+	return data;
+}
+
+bool
+_adcli_state_write (const char *name,
+                    const void *data,
+                    size_t length)
+{
+	const char *dir;
+	char *temp = NULL;
+	char *path;
+	bool ret = false;
+	int fd;
+
+	return_val_if_fail (name != NULL, false);
+	return_val_if_fail (length <= STATE_MAX_SIZE, false);
+
+	path = state_path (name);
+	if (path == NULL)
+		return false;
+
+	dir = state_directory ();
+	if (mkdir (dir, 0700) < 0 && errno != EEXIST) {
+		_adcli_info ("Couldn't create state directory: %s: %s", dir, strerror (errno));
+		goto out;
+	}
+
+	if (asprintf (&temp, "%s.XXXXXX", path) < 0) {
+		temp = NULL;
+		goto out;
+	}
+
+	/* Written aside and renamed into place, so readers never see half of it */
+	fd = mkstemp (temp);
+	if (fd < 0) {
+		_adcli_info ("Couldn't write state: %s: %s", path, strerror (errno));
+		goto out;
+	}
+
+	ret = _adcli_write_all (fd, data, length) == 0;
+	if (close (fd) < 0)
+		ret = false;
+	if (ret && rename (temp, path) < 0)
+		ret = false;
+	if (!ret) {
+		_adcli_info ("Couldn't write state: %s: %s", path, strerror (errno));
+		unlink (temp);
+	}
+
+out:
+	free (temp);
+	free (path);
+	return ret;
+}
+
+void
+_adcli_state_remove (const char *name)
+{
+	char *path;
+
+	return_if_fail (name != NULL);
+
+	path = state_path (name);
+	if (path == NULL)
+		return;
+
+	if (unlink (path) < 0 && errno != ENOENT)
+		_adcli_info ("Couldn't remove state: %s: %s", path, strerror (errno));
+
+	free (path);
+}
 
 bool
 _adcli_check_nt_time_string_lifetime (const char *nt_time_string,
@@ -549,6 +1285,64 @@ _adcli_check_nt_time_string_lifetime (const char *nt_time_string,
 	return false;
 }
 
+/* Spread the bits of a weak string hash, so similar names land far apart */
+static unsigned int
+mix_hash (unsigned int hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+time_t
+_adcli_rotation_time (time_t last_set,
+                      unsigned int lifetime,
+                      unsigned int window,
+                      const char *seed)
+{
+	time_t due;
+	uint64_t span;
+
+	due = last_set + (time_t)lifetime * 24 * 60 * 60;
+	if (window > lifetime)
+		window = lifetime;
+
+	/*
+	 * Each host picks the same point in the window before its password
+	 * expires every time, and hosts are spread evenly over the window.
+	 */
+	span = (uint64_t)window * 24 * 60 * 60;
+	if (span == 0 || seed == NULL)
+		return due;
+
+	return due - span + mix_hash (_adcli_str_case_hash (seed)) % span;
+}
+
+unsigned int
+_adcli_backoff_delay (unsigned int attempt,
+                      unsigned int base,
+                      unsigned int limit,
+                      const char *seed)
+{
+	unsigned int delay = base;
+	unsigned int half;
+	unsigned int i;
+
+	for (i = 0; i < attempt && delay < limit; i++)
+		delay *= 2;
+	if (delay > limit)
+		delay = limit;
+
+	/* Half of the delay is fixed, the other half differs per host */
+	half = delay / 2;
+	if (seed == NULL || half == 0)
+		return delay;
+	return delay - half + mix_hash (_adcli_str_case_hash (seed) + attempt) % (half + 1);
+}
+
 adcli_result
 _adcli_call_external_program (const char *binary, char * const *argv,
                               const char *stdin_data,
@@ -750,6 +1544,85 @@ test_strv_add_unique_free (void)
 	_adcli_strv_free (strv);
 }
 
+static void
+test_strset (void)
+{
+	_adcli_strset set = { NULL, };
+	const char *values[] = { "one", "two", NULL };
+	char name[32];
+	int i;
+
+	assert (_adcli_strset_add_unique (&set, strdup ("one"), false));
+	assert (!_adcli_strset_add_unique (&set, strdup ("ONE"), false));
+	assert (_adcli_strset_add_unique (&set, strdup ("ONE"), true));
+	assert_num_eq (set.length, 2);
+
+	/* Enough to switch over to the hash index */
+	for (i = 0; i < 100; i++) {
+		snprintf (name, sizeof (name), "HOST/host-%d", i);
+		assert (_adcli_strset_add_unique (&set, strdup (name), false));
+	}
+
+	assert_num_eq (set.length, 102);
+	assert_num_eq (_adcli_strv_len (set.strv), 102);
+	assert_str_eq (set.strv[0], "one");
+	assert_str_eq (set.strv[101], "HOST/host-99");
+	assert (set.index != NULL);
+
+	assert (_adcli_strset_has (&set, "host/HOST-42", false));
+	assert (!_adcli_strset_has (&set, "host/HOST-42", true));
+	assert (_adcli_strset_has (&set, "HOST/host-42", true));
+	assert (!_adcli_strset_has (&set, "HOST/host-100", false));
+	assert (!_adcli_strset_add_unique (&set, strdup ("host/host-7"), false));
+
+	_adcli_strset_remove (&set, "host/HOST-42");
+	assert_num_eq (set.length, 101);
+	assert (!_adcli_strset_has (&set, "HOST/host-42", false));
+	assert (_adcli_strset_has (&set, "HOST/host-43", false));
+	assert (set.strv[101] == NULL);
+
+	_adcli_strset_set (&set, values);
+	assert_num_eq (set.length, 2);
+	assert_str_eq (set.strv[1], "two");
+	assert (set.strv[2] == NULL);
+
+	_adcli_strset_clear (&set);
+	assert (set.strv == NULL);
+	assert_num_eq (set.length, 0);
+}
+
+static void
+test_arena (void)
+{
+	_adcli_arena arena = { NULL, };
+	_adcli_arena_mark mark;
+	char *first;
+	char *big;
+	char *str;
+
+	first = _adcli_arena_strdup (&arena, "first");
+	assert_str_eq (first, "first");
+
+	_adcli_arena_get_mark (&arena, &mark);
+	str = _adcli_arena_printf (&arena, "(sAMAccountName=%s)", "HOST$");
+	assert_str_eq (str, "(sAMAccountName=HOST$)");
+
+	/* Bigger than a chunk */
+	big = _adcli_arena_alloc (&arena, 10000);
+	assert (big != NULL);
+	memset (big, 'x', 10000);
+	assert_str_eq (first, "first");
+
+	/* Released memory is handed out again */
+	_adcli_arena_release (&arena, &mark);
+	assert (_adcli_arena_strdup (&arena, "again") == str);
+	assert_str_eq (first, "first");
+
+	_adcli_arena_get_mark (&arena, &mark);
+	_adcli_arena_release (&arena, &mark);
+	_adcli_arena_free (&arena);
+	assert (arena.first == NULL);
+}
 
 static void
 test_strv_dup (void)
@@ -809,6 +1682,70 @@ test_check_nt_time_string_lifetime (void)
 	assert (_adcli_check_nt_time_string_lifetime ("130645404000000000", 100000));
 }
 
+static void
+test_rotation_time (void)
+{
+	int buckets[10] = { 0, };
+	time_t last_set = 1700000000;
+	time_t due = last_set + 30 * 24 * 60 * 60;
+	time_t when;
+	char name[32];
+	int i;
+
+	/* No window, or no seed, is the plain expiry */
+	assert_num_eq (_adcli_rotation_time (last_set, 30, 0, "HOST1$"), due);
+	assert_num_eq (_adcli_rotation_time (last_set, 30, 10, NULL), due);
+	assert_num_eq (_adcli_rotation_time (last_set, 0, 10, "HOST1$"), last_set);
+
+	/* Always the same point in the window for the same host */
+	when = _adcli_rotation_time (last_set, 30, 10, "HOST1$");
+	assert_num_eq (when, _adcli_rotation_time (last_set, 30, 10, "host1$"));
+	assert (when >= due - 10 * 24 * 60 * 60 && when < due);
+
+	/* A window longer than the lifetime is clamped */
+	when = _adcli_rotation_time (last_set, 5, 10, "HOST1$");
+	assert (when >= last_set && when < last_set + 5 * 24 * 60 * 60);
+
+	/* Similar names are spread evenly across the window */
+	for (i = 0; i < 1000; i++) {
+		snprintf (name, sizeof (name), "HOST%03d$", i);
+		when = _adcli_rotation_time (last_set, 30, 10, name);
+		assert (when >= due - 10 * 24 * 60 * 60 && when < due);
+		buckets[(when - (due - 10 * 24 * 60 * 60)) / (24 * 60 * 60)]++;
+	}
+
+	for (i = 0; i < 10; i++)
+		assert (buckets[i] > 60 && buckets[i] < 140);
+}
+
+static void
+test_backoff_delay (void)
+{
+	unsigned int distinct;
+	unsigned int delay;
+	unsigned int i;
+
+	assert_num_eq (_adcli_backoff_delay (0, 60, 3600, NULL), 60);
+	assert_num_eq (_adcli_backoff_delay (3, 60, 3600, NULL), 480);
+	assert_num_eq (_adcli_backoff_delay (30, 60, 3600, NULL), 3600);
+
+	for (i = 0; i < 10; i++) {
+		delay = _adcli_backoff_delay (i, 60, 3600, "HOST1$");
+		assert_num_eq (delay, _adcli_backoff_delay (i, 60, 3600, "HOST1$"));
+		assert (delay >= _adcli_backoff_delay (i, 60, 3600, NULL) / 2);
+		assert (delay <= _adcli_backoff_delay (i, 60, 3600, NULL));
+	}
+
+	/* Once at the limit, the jitter still changes from one attempt to the next */
+	distinct = 0;
+	for (i = 10; i < 20; i++) {
+		if (_adcli_backoff_delay (i, 60, 3600, "HOST1$") !=
+		    _adcli_backoff_delay (i + 1, 60, 3600, "HOST1$"))
+			distinct++;
+	}
+	assert (distinct > 0);
+}
+
 static void
 test_bin_sid_to_str (void)
 {
@@ -898,18 +1835,345 @@ test_call_external_program (void)
 #endif
 }
 
+static int phase_calls = 0;
+
+static void
+test_phase_func (const char *phase,
+                 const char *detail,
+                 adcli_result result,
+                 double started,
+                 double elapsed)
+{
+	assert_str_eq (phase, "connect");
+	assert_str_eq (detail, "dc.example.com");
+	assert_num_eq (result, ADCLI_ERR_DIRECTORY);
+	assert (started > 0);
+	assert (elapsed >= 0);
+	phase_calls++;
+}
+
+static void
+test_phase (void)
+{
+	_adcli_phase phase;
+
+	/* Nothing reported without a listener */
+	_adcli_phase_begin (&phase, "connect", "dc.example.com");
+	assert_num_eq (_adcli_phase_end (&phase, ADCLI_SUCCESS), ADCLI_SUCCESS);
+
+	adcli_set_phase_func (test_phase_func);
+	_adcli_phase_begin (&phase, "connect", "dc.example.com");
+	assert_num_eq (_adcli_phase_end (&phase, ADCLI_ERR_DIRECTORY), ADCLI_ERR_DIRECTORY);
+	assert_num_eq (phase_calls, 1);
+
+	/* Ending twice only reports once */
+	_adcli_phase_end (&phase, ADCLI_ERR_DIRECTORY);
+	assert_num_eq (phase_calls, 1);
+
+	adcli_set_phase_func (NULL);
+}
+
+static int plan_round_trips = 0;
+
+static void
+test_plan_func (const char *operation,
+                const char *target,
+                const char *detail,
+                int round_trips)
+{
+	assert_str_eq (operation, "kpasswd");
+	assert_str_eq (target, "HOST$");
+	assert_str_eq (detail, "set computer password");
+	plan_round_trips += round_trips;
+}
+
+static void
+test_plan (void)
+{
+	/* Changes go ahead when nobody is planning */
+	assert (!_adcli_planning ());
+	assert (!_adcli_plan ("kpasswd", "HOST$", 2, "set %s password", "computer"));
+
+	adcli_set_plan_func (test_plan_func);
+	assert (_adcli_planning ());
+	assert (_adcli_plan ("kpasswd", "HOST$", 2, "set %s password", "computer"));
+	assert (_adcli_plan ("kpasswd", "HOST$", 3, "set %s password", "computer"));
+	assert_num_eq (plan_round_trips, 5);
+
+	adcli_set_plan_func (NULL);
+}
+
+static int log_calls = 0;
+static int message_calls = 0;
+
+static void
+test_log_func (adcli_log_level level,
+               const char *category,
+               const char *message,
+               const char **fields)
+{
+	assert_num_eq (level, ADCLI_LOG_INFO);
+	assert_str_eq (category, "ldap");
+	assert_str_eq (message, "Modified account");
+	assert_str_eq (fields[0], "dn");
+	assert_str_eq (fields[1], "CN=HOST,DC=example,DC=com");
+	assert (fields[2] == NULL);
+	log_calls++;
+}
+
+static void
+test_log_message_func (adcli_message_type type,
+                       const char *message)
+{
+	assert_num_eq (type, ADCLI_MESSAGE_INFO);
+	assert_str_eq (message, "Modified account dn=CN=HOST,DC=example,DC=com");
+	message_calls++;
+}
+
+static void
+test_log (void)
+{
+	/* Nobody listening, so nothing is enabled */
+	assert (!_adcli_log_enabled (ADCLI_LOG_INFO));
+	_adcli_log (ADCLI_LOG_INFO, "ldap", "Modified account",
+	            "dn", "CN=HOST,DC=example,DC=com", NULL);
+
+	adcli_set_log_func (test_log_func, ADCLI_LOG_INFO);
+	assert (!_adcli_log_enabled (ADCLI_LOG_DEBUG));
+	assert (_adcli_log_enabled (ADCLI_LOG_WARNING));
+
+	/* Below the level is dropped, and a dangling name is ignored */
+	_adcli_log (ADCLI_LOG_DEBUG, "ldap", "Searched", "dn", "", NULL);
+	_adcli_log (ADCLI_LOG_INFO, "ldap", "Modified account",
+	            "dn", "CN=HOST,DC=example,DC=com", "extra", NULL);
+	assert_num_eq (log_calls, 1);
+
+	adcli_set_log_func (NULL, ADCLI_LOG_INFO);
+	adcli_set_message_func (test_log_message_func);
+	assert (!_adcli_log_enabled (ADCLI_LOG_DEBUG));
+	_adcli_log (ADCLI_LOG_INFO, "ldap", "Modified account",
+	            "dn", "CN=HOST,DC=example,DC=com", NULL);
+	assert_num_eq (message_calls, 1);
+
+	adcli_set_message_func (NULL);
+	assert_str_eq (adcli_log_level_to_string (ADCLI_LOG_WARNING), "warning");
+}
+
+static void
+test_state (void)
+{
+	char directory[] = "/tmp/adcli-test-XXXXXX";
+	struct stat st;
+	char *state;
+	char *path;
+	char *data;
+	size_t length;
+
+	assert (mkdtemp (directory) != NULL);
+	assert (asprintf (&state, "%s/state", directory) >= 0);
+	assert (asprintf (&path, "%s/name", state) >= 0);
+	setenv ("ADCLI_STATE_DIR", state, 1);
+
+	assert (_adcli_state_read ("name", 60, NULL) == NULL);
+	assert (_adcli_state_write ("name", "value", 5));
+
+	data = _adcli_state_read ("name", 60, &length);
+	assert_str_eq (data, "value");
+	assert_num_eq (length, 5);
+	free (data);
+
+	assert_num_eq (stat (path, &st), 0);
+	assert_num_eq (st.st_mode & 0777, 0600);
+
+	/* Expired state is removed */
+	assert (_adcli_state_read ("name", 0, NULL) == NULL);
+	assert (access (path, F_OK) < 0);
+
+	assert (_adcli_state_write ("name", "value", 5));
+	_adcli_state_remove ("name");
+	assert (access (path, F_OK) < 0);
+	_adcli_state_remove ("name");
+
+	/* Names don't get out of the directory */
+	assert (!_adcli_state_write ("../name", "value", 5));
+	assert (!_adcli_state_write (".name", "value", 5));
+
+	rmdir (state);
+	rmdir (directory);
+	free (state);
+	free (path);
+	unsetenv ("ADCLI_STATE_DIR");
+}
+
 int
 main (int argc,
       char *argv[])
 {
 	test_func (test_strv_add_free, "/util/strv_add_free");
 	test_func (test_strv_add_unique_free, "/util/strv_add_unique_free");
+	test_func (test_strset, "/util/strset");
+	test_func (test_arena, "/util/arena");
 	test_func (test_strv_dup, "/util/strv_dup");
 	test_func (test_strv_count, "/util/strv_count");
 	test_func (test_check_nt_time_string_lifetime, "/util/check_nt_time_string_lifetime");
+	test_func (test_rotation_time, "/util/rotation_time");
+	test_func (test_backoff_delay, "/util/backoff_delay");
 	test_func (test_bin_sid_to_str, "/util/bin_sid_to_str");
 	test_func (test_call_external_program, "/util/call_external_program");
+	test_func (test_phase, "/util/phase");
+	test_func (test_plan, "/util/plan");
+	test_func (test_log, "/util/log");
+	test_func (test_state, "/util/state");
 	return test_run (argc, argv);
 }
 
 #endif /* UTIL_TESTS */
+
+#ifdef UTIL_BENCH
+
+#include "bench.h"
+
+#define BENCH_SPNS 1000
+
+static void
+bench_strv_add_unique_build (unsigned long iterations)
+{
+	char *spns[BENCH_SPNS];
+	char **strv;
+	unsigned long i;
+	int length;
+	int j;
+
+	/* One op builds a complete SPN list of BENCH_SPNS entries */
+	for (i = 0; i < iterations; i++) {
+		bench_stop ();
+		for (j = 0; j < BENCH_SPNS; j++) {
+			if (asprintf (&spns[j], "HOST/host-%04d.example.com", j) < 0)
+				bench_fail ("out of memory");
+		}
+		bench_start ();
+
+		strv = NULL;
+		length = 0;
+		for (j = 0; j < BENCH_SPNS; j++)
+			strv = _adcli_strv_add_unique (strv, spns[j], &length, false);
+
+		bench_stop ();
+		if (length != BENCH_SPNS)
+			bench_fail ("unexpected SPN count %d", length);
+		_adcli_strv_free (strv);
+		bench_start ();
+	}
+}
+
+static void
+bench_strv_add_unique_dup (unsigned long iterations)
+{
+	char name[64];
+	char **strv = NULL;
+	unsigned long i;
+	int length = 0;
+	int j;
+
+	for (j = 0; j < BENCH_SPNS; j++) {
+		snprintf (name, sizeof (name), "HOST/host-%04d.example.com", j);
+		strv = _adcli_strv_add (strv, strdup (name), &length);
+	}
+
+	/* One op is a case-insensitive duplicate hit in a large list */
+	snprintf (name, sizeof (name), "host/HOST-%04d.EXAMPLE.COM", BENCH_SPNS - 1);
+	bench_reset ();
+
+	for (i = 0; i < iterations; i++)
+		strv = _adcli_strv_add_unique (strv, name, &length, false);
+
+	bench_stop ();
+	if (length != BENCH_SPNS)
+		bench_fail ("unexpected SPN count %d", length);
+	_adcli_strv_free (strv);
+}
+
+static void
+bench_strset_add_unique_build (unsigned long iterations)
+{
+	_adcli_strset set = { NULL, };
+	char *spns[BENCH_SPNS];
+	unsigned long i;
+	int j;
+
+	/* The same workload as bench_strv_add_unique_build() */
+	for (i = 0; i < iterations; i++) {
+		bench_stop ();
+		for (j = 0; j < BENCH_SPNS; j++) {
+			if (asprintf (&spns[j], "HOST/host-%04d.example.com", j) < 0)
+				bench_fail ("out of memory");
+		}
+		bench_start ();
+
+		for (j = 0; j < BENCH_SPNS; j++)
+			_adcli_strset_add_unique (&set, spns[j], false);
+
+		bench_stop ();
+		if (set.length != BENCH_SPNS)
+			bench_fail ("unexpected SPN count %d", set.length);
+		_adcli_strset_clear (&set);
+		bench_start ();
+	}
+}
+
+static void
+bench_strset_has (unsigned long iterations)
+{
+	_adcli_strset set = { NULL, };
+	char name[64];
+	unsigned long i;
+	int j;
+
+	for (j = 0; j < BENCH_SPNS; j++) {
+		snprintf (name, sizeof (name), "HOST/host-%04d.example.com", j);
+		_adcli_strset_add (&set, strdup (name));
+	}
+
+	snprintf (name, sizeof (name), "host/HOST-%04d.EXAMPLE.COM", BENCH_SPNS - 1);
+	bench_reset ();
+
+	for (i = 0; i < iterations; i++) {
+		if (!_adcli_strset_has (&set, name, false))
+			bench_fail ("lookup of %s failed", name);
+	}
+
+	bench_stop ();
+	_adcli_strset_clear (&set);
+}
+
+static void
+bench_bin_sid_to_str (unsigned long iterations)
+{
+	uint8_t sid[] = { 0x01, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x05,
+	                  0x15, 0x00, 0x00, 0x00, 0xF8, 0x12, 0x13, 0xDC,
+	                  0x47, 0xF3, 0x1C, 0x76, 0x47, 0x2F, 0x2E, 0xD7,
+	                  0x51, 0x04, 0x00, 0x00 };
+	unsigned long i;
+	char *str;
+
+	for (i = 0; i < iterations; i++) {
+		str = _adcli_bin_sid_to_str (sid, sizeof (sid));
+		if (str == NULL)
+			bench_fail ("couldn't convert SID");
+		free (str);
+	}
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	bench_func (bench_strv_add_unique_build, "/util/strv_add_unique_build");
+	bench_func (bench_strv_add_unique_dup, "/util/strv_add_unique_dup");
+	bench_func (bench_strset_add_unique_build, "/util/strset_add_unique_build");
+	bench_func (bench_strset_has, "/util/strset_has");
+	bench_func (bench_bin_sid_to_str, "/util/bin_sid_to_str");
+	return bench_run (argc, argv);
+}
+
+#endif /* UTIL_BENCH */
@@ -31,6 +31,12 @@ typedef enum {
 	/* Successful completion */
 	ADCLI_SUCCESS = 0,
 
+	/*
+	 * Not done yet, call the matching step function once the file
+	 * descriptors it asks for are ready.
+	 */
+	ADCLI_IN_PROGRESS = 1,
+
 	/*
 	 * Invalid input or unexpected system behavior.
 	 *
@@ -87,6 +93,49 @@ typedef void      (* adcli_message_func)        (adcli_message_type type,
 
 void              adcli_set_message_func        (adcli_message_func message_func);
 
+typedef enum {
+	ADCLI_LOG_DEBUG,
+	ADCLI_LOG_INFO,
+	ADCLI_LOG_WARNING,
+	ADCLI_LOG_ERROR,
+} adcli_log_level;
+
+typedef void      (* adcli_log_func)            (adcli_log_level level,
+                                                 const char *category,
+                                                 const char *message,
+                                                 const char **fields);
+
+void              adcli_set_log_func            (adcli_log_func log_func,
+                                                 adcli_log_level level);
+
+const char *      adcli_log_level_to_string     (adcli_log_level level);
+
+typedef void      (* adcli_phase_func)          (const char *phase,
+                                                 const char *detail,
+                                                 adcli_result result,
+                                                 double started,
+                                                 double elapsed);
+
+void              adcli_set_phase_func          (adcli_phase_func phase_func);
+
+double            adcli_phase_clock             (void);
+
+typedef void      (* adcli_trace_func)          (const char *category,
+                                                 const char *name,
+                                                 const char *server,
+                                                 double started,
+                                                 double elapsed,
+                                                 const char **args);
+
+void              adcli_set_trace_func          (adcli_trace_func trace_func);
+
+typedef void      (* adcli_plan_func)           (const char *operation,
+                                                 const char *target,
+                                                 const char *detail,
+                                                 int round_trips);
+
+void              adcli_set_plan_func           (adcli_plan_func plan_func);
+
 void              adcli_clear_last_error        (void);
 
 const char *      adcli_get_last_error          (void);
@@ -0,0 +1,315 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "config.h"
+
+#include "bench.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* How much longer than the target a run may take with its setup */
+#define BENCH_WALL_FACTOR 10
+
+typedef void (*func_with_arg) (unsigned long, void *);
+
+typedef struct _bench_item {
+	char name[1024];
+	func_with_arg func;
+	void *argument;
+	struct _bench_item *next;
+} bench_item;
+
+struct {
+	bench_item *suite;
+	bench_item *last;
+	int running;
+	double started;
+	double elapsed;
+	unsigned long allocs;
+} gl = { NULL, NULL, 0, };
+
+#ifdef __GLIBC__
+
+/*
+ * Count allocations by interposing the allocator entry points and
+ * forwarding to the real glibc implementation. This also catches
+ * allocations made inside libkrb5, libldap and libresolv.
+ */
+
+#define BENCH_COUNTS_ALLOCS 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *
+malloc (size_t size)
+{
+	if (gl.running)
+		gl.allocs++;
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+        size_t size)
+{
+	if (gl.running)
+		gl.allocs++;
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr,
+         size_t size)
+{
+	if (gl.running)
+		gl.allocs++;
+	return __libc_realloc (ptr, size);
+}
+
+#endif /* __GLIBC__ */
+
+static double
+bench_clock (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+void
+bench_start (void)
+{
+	if (gl.running)
+		return;
+	gl.started = bench_clock ();
+	gl.running = 1;
+}
+
+void
+bench_stop (void)
+{
+	if (!gl.running)
+		return;
+	gl.elapsed += bench_clock () - gl.started;
+	gl.running = 0;
+}
+
+void
+bench_reset (void)
+{
+	gl.elapsed = 0;
+	gl.allocs = 0;
+	if (gl.running)
+		gl.started = bench_clock ();
+}
+
+void
+bench_fail (const char *message,
+            ...)
+{
+	va_list va;
+
+	gl.running = 0;
+	fprintf (stderr, "bench: ");
+	va_start (va, message);
+	vfprintf (stderr, message, va);
+	va_end (va);
+	fprintf (stderr, "\n");
+	exit (1);
+}
+
+static void
+bench_push (bench_item *it)
+{
+	bench_item *item;
+
+	item = calloc (1, sizeof (bench_item));
+	assert (item != NULL);
+	memcpy (item, it, sizeof (bench_item));
+
+	if (!gl.suite)
+		gl.suite = item;
+	if (gl.last)
+		gl.last->next = item;
+	gl.last = item;
+}
+
+void
+bench_func (void (* function) (unsigned long),
+            const char *name,
+            ...)
+{
+	bench_item item = { { 0, }, };
+	va_list va;
+
+	/* The argument is ignored by the function */
+	item.func = (func_with_arg)function;
+
+	va_start (va, name);
+	vsnprintf (item.name, sizeof (item.name), name, va);
+	va_end (va);
+
+	bench_push (&item);
+}
+
+void
+bench_funcx (void (* function) (unsigned long, void *),
+             void *argument,
+             const char *name,
+             ...)
+{
+	bench_item item = { { 0, }, };
+	va_list va;
+
+	item.func = function;
+	item.argument = argument;
+
+	va_start (va, name);
+	vsnprintf (item.name, sizeof (item.name), name, va);
+	va_end (va);
+
+	bench_push (&item);
+}
+
+static double
+bench_once (bench_item *item,
+            unsigned long iterations)
+{
+	double began;
+
+	gl.elapsed = 0;
+	gl.allocs = 0;
+
+	began = bench_clock ();
+	bench_start ();
+	(item->func) (iterations, item->argument);
+	bench_stop ();
+
+	/* Wall clock time, including any untimed setup */
+	return bench_clock () - began;
+}
+
+static int
+bench_selected (bench_item *item,
+                int argc,
+                char **argv)
+{
+	int i;
+
+	if (argc < 2)
+		return 1;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp (item->name, argv[i], strlen (argv[i])) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+int
+bench_run (int argc,
+           char **argv)
+{
+	unsigned long iterations;
+	unsigned long next;
+	unsigned long limit;
+	bench_item *item;
+	const char *env;
+	double target;
+	double wall;
+
+	/* Minimum measured time per benchmark, in seconds */
+	target = 0.5;
+	env = getenv ("ADCLI_BENCH_TIME");
+	if (env != NULL && atof (env) > 0)
+		target = atof (env);
+
+	for (item = gl.suite; item != NULL; item = item->next) {
+		if (!bench_selected (item, argc, argv))
+			continue;
+
+		/*
+		 * Grow the iteration count until one run takes long enough
+		 * to give a stable per-op figure. Untimed setup per iteration
+		 * also takes time, so a run is never allowed to take more
+		 * than BENCH_WALL_FACTOR times the target on the wall clock.
+		 */
+		iterations = 1;
+		for (;;) {
+			wall = bench_once (item, iterations);
+			if (gl.elapsed >= target || iterations >= 1000000000UL ||
+			    wall >= target * BENCH_WALL_FACTOR)
+				break;
+
+			if (gl.elapsed <= 0)
+				next = iterations * 100;
+			else
+				next = (unsigned long)(iterations * target * 1.2 / gl.elapsed);
+			if (next > iterations * 100)
+				next = iterations * 100;
+			if (wall > 0) {
+				limit = (unsigned long)(iterations * target * BENCH_WALL_FACTOR / wall);
+				if (next > limit)
+					next = limit;
+			}
+			if (next <= iterations)
+				next = iterations + 1;
+			iterations = next;
+		}
+
+		printf ("{\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.1f, ",
+		        item->name, iterations, gl.elapsed * 1000000000.0 / iterations);
+#ifdef BENCH_COUNTS_ALLOCS
+		printf ("\"allocs_per_op\": %.2f}\n", (double)gl.allocs / iterations);
+#else
+		printf ("\"allocs_per_op\": null}\n");
+#endif
+		fflush (stdout);
+	}
+
+	while (gl.suite != NULL) {
+		item = gl.suite->next;
+		free (gl.suite);
+		gl.suite = item;
+	}
+
+	gl.last = NULL;
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#if !defined(__cplusplus) && (__GNUC__ > 2)
+#define GNUC_PRINTF(x, y) __attribute__((__format__(__printf__, x, y)))
+#else
+#define GNUC_PRINTF(x, y)
+#endif
+
+/*
+ * A benchmark function is called with the number of iterations it
+ * should perform. Any setup done before the loop should be followed
+ * by bench_reset(), and per-iteration setup that should not be
+ * measured bracketed with bench_stop() and bench_start(). Such
+ * untimed setup still bounds the iteration count, so that a run
+ * doesn't take more than ten times the target time in total.
+ */
+
+void        bench_func              (void (* function) (unsigned long),
+                                     const char *name,
+                                     ...) GNUC_PRINTF(2, 3);
+
+void        bench_funcx             (void (* function) (unsigned long, void *),
+                                     void *argument,
+                                     const char *name,
+                                     ...) GNUC_PRINTF(3, 4);
+
+void        bench_reset             (void);
+
+void        bench_stop              (void);
+
+void        bench_start             (void);
+
+void        bench_fail              (const char *message,
+                                     ...) GNUC_PRINTF(1, 2);
+
+int         bench_run               (int argc,
+                                     char **argv);
+
+#endif /* BENCH_H_ */
@@ -777,3 +777,88 @@ main (int argc,
 }
 
 #endif /* SEQ_TESTS */
+
+#ifdef SEQ_BENCH
+
+#include "bench.h"
+
+#include <stdio.h>
+
+#define BENCH_KEYS 1000
+
+static char bench_keys[BENCH_KEYS][16];
+
+static void
+bench_setup_keys (void)
+{
+	unsigned int state = 1;
+	char tmp[16];
+	int i, j;
+
+	for (i = 0; i < BENCH_KEYS; i++)
+		snprintf (bench_keys[i], sizeof (bench_keys[i]), "key-%05d", i);
+
+	/* Deterministic shuffle so runs are repeatable */
+	for (i = BENCH_KEYS - 1; i > 0; i--) {
+		state = state * 1103515245 + 12345;
+		j = (state >> 16) % (i + 1);
+		memcpy (tmp, bench_keys[i], sizeof (tmp));
+		memcpy (bench_keys[i], bench_keys[j], sizeof (tmp));
+		memcpy (bench_keys[j], tmp, sizeof (tmp));
+	}
+}
+
+static void
+bench_insert (unsigned long iterations)
+{
+	void **seq = NULL;
+	int len = 0;
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++) {
+		if (len == BENCH_KEYS) {
+			bench_stop ();
+			seq_free (seq, NULL);
+			seq = NULL;
+			len = 0;
+			bench_start ();
+		}
+		seq = seq_insert (seq, &len, bench_keys[len], (seq_compar)strcmp, NULL);
+	}
+
+	bench_stop ();
+	seq_free (seq, NULL);
+}
+
+static void
+bench_lookup (unsigned long iterations)
+{
+	void **seq = NULL;
+	int len = 0;
+	unsigned long i;
+	int j;
+
+	for (j = 0; j < BENCH_KEYS; j++)
+		seq = seq_insert (seq, &len, bench_keys[j], (seq_compar)strcmp, NULL);
+	bench_reset ();
+
+	for (i = 0; i < iterations; i++) {
+		if (!seq_lookup (seq, &len, bench_keys[i % BENCH_KEYS], (seq_compar)strcmp))
+			bench_fail ("lookup of %s failed", bench_keys[i % BENCH_KEYS]);
+	}
+
+	bench_stop ();
+	seq_free (seq, NULL);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	bench_setup_keys ();
+	bench_func (bench_insert, "/seq/insert");
+	bench_func (bench_lookup, "/seq/lookup");
+	return bench_run (argc, argv);
+}
+
+#endif /* SEQ_BENCH */
@@ -0,0 +1,1108 @@
+/*
+ * adcli
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ *
+ */
+
+/*
+ * The adcli agent keeps authenticated connections to the domain warm,
+ * and runs commands on behalf of adcli clients connecting over a UNIX
+ * socket. A request is a length prefixed block of nul terminated
+ * strings: a protocol tag, the client's working directory, a few
+ * environment variables ended by an empty string, the global options
+ * given before the command ended by another empty string, and then
+ * the command line. The client's stdin, stdout and stderr are passed along
+ * with the request, so the command reads and writes them directly.
+ * The response is the exit status of the command.
+ */
+
+#include "config.h"
+
+#include "adcli.h"
+#include "adprivate.h"
+#include "tools.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <time.h>
+#include <unistd.h>
+
+#define AGENT_PROTOCOL       "adcli-agent/2"
+#define AGENT_MAX_REQUEST    (64 * 1024)
+#define AGENT_MAX_CONNS      8
+#define AGENT_MAX_CLIENTS    16
+#define AGENT_REQUEST_TIMEOUT 10
+#define AGENT_DEFAULT_MAX_AGE 3600
+
+/* Well inside the 15 minutes after which AD drops idle LDAP sessions */
+#define AGENT_PROBE_INTERVAL 300
+
+static const char *agent_environ[] = {
+	"KRB5CCNAME",
+	"KRB5_KTNAME",
+	NULL,
+};
+
+/*
+ * Commands the agent runs. Commands of the same class log in the same
+ * way, and so can share a connection when their options match.
+ */
+static const struct {
+	const char *name;
+	int (*function) (adcli_conn *, int, char *[]);
+	const char *class;
+} agent_commands[] = {
+	{ "join", adcli_tool_computer_join, "user" },
+	{ "update", adcli_tool_computer_update, "computer" },
+	{ "testjoin", adcli_tool_computer_testjoin, "computer" },
+	{ "show-computer", adcli_tool_computer_show, "show" },
+	{ "create-user", adcli_tool_user_create, "user" },
+	{ "delete-user", adcli_tool_user_delete, "user" },
+	{ "passwd-user", adcli_tool_user_passwd, "user" },
+	{ "create-group", adcli_tool_group_create, "user" },
+	{ "delete-group", adcli_tool_group_delete, "user" },
+	{ "add-member", adcli_tool_member_add, "user" },
+	{ "remove-member", adcli_tool_member_remove, "user" },
+	{ "sync-members", adcli_tool_member_sync, "user" },
+	{ "search", adcli_tool_entry_search, "user" },
+	{ NULL, }
+};
+
+/* Options that change which domain controller or identity is used */
+static const char *connection_options[] = {
+	"--domain", "--domain-realm", "--domain-controller", "--use-ldaps",
+	"--login-user", "--login-ccache", "--login-type", "--host-keytab",
+	"--host-fqdn", "--computer-name", "--one-time-password", "--no-password",
+	NULL
+};
+
+static const char connection_shorts[] = "DRSUKHN";
+
+/* Options which keep a command running, these are never passed to the agent */
+static const char *local_options[] = {
+	"--schedule",
+	NULL
+};
+
+typedef struct {
+	char *key;
+	adcli_conn *conn;
+	time_t created;
+	time_t used;
+	time_t probed;
+} agent_conn;
+
+/* A client that is still sending its request */
+typedef struct {
+	int fd;
+	time_t deadline;
+	uint32_t header;
+	char *data;
+	size_t length;
+	size_t received;
+	int fds[3];
+} agent_client;
+
+static agent_conn agent_conns[AGENT_MAX_CONNS];
+static volatile sig_atomic_t agent_quit = 0;
+
+static int
+find_agent_command (const char *name)
+{
+	int i;
+
+	for (i = 0; agent_commands[i].name != NULL; i++) {
+		if (strcmp (agent_commands[i].name, name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static const char *
+agent_socket_path (void)
+{
+	const char *path;
+
+	path = getenv ("ADCLI_AGENT_SOCKET");
+	if (path == NULL)
+		path = AGENT_SOCKET;
+	return path;
+}
+
+static int
+read_exact (int fd,
+            void *data,
+            size_t len)
+{
+	unsigned char *at = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read (fd, at, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (ret == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		at += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static bool
+is_connection_option (const char *arg)
+{
+	size_t len;
+	int i;
+
+	len = strcspn (arg, "=");
+	for (i = 0; connection_options[i] != NULL; i++) {
+		if (strlen (connection_options[i]) == len &&
+		    strncmp (connection_options[i], arg, len) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * The key of a connection is the command class followed by every
+ * option which affects the connection, along with the environment
+ * that the kerberos library would otherwise read.
+ */
+static char *
+build_connection_key (const char *class,
+                      int argc,
+                      char *argv[],
+                      char **env)
+{
+	char **parts = NULL;
+	int length = 0;
+	char *key;
+	int i;
+
+	parts = _adcli_strv_add (parts, strdup (class), &length);
+	for (i = 0; env && env[i] != NULL; i++)
+		parts = _adcli_strv_add (parts, strdup (env[i]), &length);
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "--") == 0)
+			break;
+
+		if (strncmp (argv[i], "--", 2) == 0) {
+			if (!is_connection_option (argv[i]))
+				continue;
+			parts = _adcli_strv_add (parts, strdup (argv[i]), &length);
+
+			/* The value may follow as the next argument */
+			if (!strchr (argv[i], '=') && i + 1 < argc && argv[i + 1][0] != '-' &&
+			    strcmp (argv[i], "--use-ldaps") != 0 &&
+			    strcmp (argv[i], "--no-password") != 0 &&
+			    strcmp (argv[i], "--login-ccache") != 0)
+				parts = _adcli_strv_add (parts, strdup (argv[++i]), &length);
+
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			if (!strchr (connection_shorts, argv[i][1])) {
+				if (argv[i][1] == 'C')
+					parts = _adcli_strv_add (parts, strdup ("-C"), &length);
+				continue;
+			}
+			parts = _adcli_strv_add (parts, strdup (argv[i]), &length);
+			if (argv[i][2] == '\0' && i + 1 < argc)
+				parts = _adcli_strv_add (parts, strdup (argv[++i]), &length);
+		}
+	}
+
+	key = _adcli_strv_join (parts, "\n");
+	_adcli_strv_free (parts);
+	return key;
+}
+
+static void
+agent_conn_clear (agent_conn *ac)
+{
+	if (ac->conn)
+		adcli_conn_unref (ac->conn);
+	free (ac->key);
+	memset (ac, 0, sizeof (agent_conn));
+}
+
+/*
+ * Find a warm connection for this key, or set up a new one in the
+ * least recently used slot.
+ */
+static agent_conn *
+lookup_agent_conn (const char *key,
+                   int max_age,
+                   bool *reused)
+{
+	agent_conn *ac = NULL;
+	time_t now;
+	int i;
+
+	now = time (NULL);
+	*reused = false;
+
+	for (i = 0; i < AGENT_MAX_CONNS; i++) {
+		if (agent_conns[i].key && strcmp (agent_conns[i].key, key) == 0) {
+			ac = agent_conns + i;
+			break;
+		}
+	}
+
+	/* Drop connections before the tickets they were made with expire */
+	if (ac && now - ac->created >= max_age)
+		agent_conn_clear (ac);
+	else if (ac)
+		*reused = true;
+
+	if (ac == NULL || ac->conn == NULL) {
+		for (i = 0; i < AGENT_MAX_CONNS; i++) {
+			if (agent_conns[i].conn == NULL) {
+				ac = agent_conns + i;
+				break;
+			}
+			if (ac == NULL || agent_conns[i].used < ac->used)
+				ac = agent_conns + i;
+		}
+
+		agent_conn_clear (ac);
+		ac->conn = adcli_conn_new (NULL);
+		ac->key = strdup (key);
+		if (ac->conn == NULL || ac->key == NULL) {
+			agent_conn_clear (ac);
+			return NULL;
+		}
+
+		/* Connections for different domain controllers live side by side */
+		adcli_conn_set_krb5_conf_in_memory (ac->conn, true);
+		ac->created = now;
+	}
+
+	/* Options parsed by the previous command may have changed these */
+	adcli_conn_set_password_func (ac->conn, adcli_prompt_password_func, NULL, NULL);
+	ac->used = now;
+	return ac;
+}
+
+/* Keep idle connections from being dropped by the domain controller */
+static void
+probe_idle_conns (void)
+{
+	time_t now;
+	int i;
+
+	now = time (NULL);
+	for (i = 0; i < AGENT_MAX_CONNS; i++) {
+		if (agent_conns[i].conn == NULL ||
+		    now - agent_conns[i].used < AGENT_PROBE_INTERVAL ||
+		    now - agent_conns[i].probed < AGENT_PROBE_INTERVAL)
+			continue;
+
+		/* A connection that went away is made again when next used */
+		if (adcli_conn_probe (agent_conns[i].conn) != ADCLI_SUCCESS)
+			_adcli_info ("Idle connection %s is no longer usable",
+			             agent_conns[i].key);
+		agent_conns[i].probed = now;
+	}
+}
+
+static bool
+has_verbose_option (int argc,
+                    char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "--") == 0)
+			break;
+		if (strcmp (argv[i], "--verbose") == 0 || strcmp (argv[i], "-v") == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static int
+run_agent_command (int index,
+                   int argc,
+                   char *argv[],
+                   char **env,
+                   bool verbose,
+                   int max_age,
+                   bool *reused)
+{
+	agent_conn *ac;
+	char *key;
+	int ret;
+
+	key = build_connection_key (agent_commands[index].class, argc, argv, env);
+	if (key == NULL) {
+		warnx ("unexpected memory problems");
+		return -1;
+	}
+
+	ac = lookup_agent_conn (key, max_age, reused);
+	free (key);
+
+	if (ac == NULL) {
+		warnx ("unexpected memory problems");
+		return -1;
+	}
+
+	if (verbose || has_verbose_option (argc, argv))
+		adcli_set_message_func (adcli_tool_message_func);
+	else
+		adcli_set_message_func (NULL);
+	adcli_clear_last_error ();
+
+	/* Each command parses its options from the start */
+	optind = 0;
+	ret = (agent_commands[index].function) (ac->conn, argc, argv);
+
+	/*
+	 * The key doesn't contain the password, so a connection that was
+	 * logged in with one would let the next client in without it.
+	 */
+	if (adcli_conn_get_user_password (ac->conn) != NULL ||
+	    adcli_conn_get_computer_password (ac->conn) != NULL)
+		agent_conn_clear (ac);
+
+	fflush (stdout);
+	fflush (stderr);
+	return ret;
+}
+
+static bool
+is_agent_environ (const char *pair)
+{
+	size_t len;
+	int i;
+
+	len = strcspn (pair, "=");
+	for (i = 0; agent_environ[i] != NULL; i++) {
+		if (strlen (agent_environ[i]) == len &&
+		    strncmp (agent_environ[i], pair, len) == 0 && pair[len] == '=')
+			return true;
+	}
+
+	return false;
+}
+
+static char **
+split_strings (char *data,
+               size_t len,
+               int *count)
+{
+	char **strv = NULL;
+	size_t at;
+
+	*count = 0;
+	for (at = 0; at < len; at += strlen (data + at) + 1) {
+		strv = _adcli_strv_add (strv, data + at, count);
+		if (strv == NULL)
+			return NULL;
+	}
+
+	return strv;
+}
+
+/*
+ * Read as much of the request as the client has sent, without waiting
+ * for more. Returns 1 once the request is complete, 0 if more is to
+ * come, and -1 on failure.
+ */
+static int
+read_request (agent_client *client)
+{
+	union {
+		struct cmsghdr cmsg;
+		char control[CMSG_SPACE (3 * sizeof (int))];
+	} u;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t ret;
+	size_t len;
+
+	for (;;) {
+		if (client->received < sizeof (client->header)) {
+			iov.iov_base = (char *)&client->header + client->received;
+			iov.iov_len = sizeof (client->header) - client->received;
+		} else {
+			len = client->received - sizeof (client->header);
+			iov.iov_base = client->data + len;
+			iov.iov_len = client->length - len;
+		}
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		/* The descriptors arrive along with the first byte */
+		if (client->received == 0) {
+			msg.msg_control = u.control;
+			msg.msg_controllen = sizeof (u.control);
+		}
+
+		ret = recvmsg (client->fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		} else if (ret == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+
+		if (client->received == 0) {
+			cmsg = CMSG_FIRSTHDR (&msg);
+			if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS ||
+			    cmsg->cmsg_len != CMSG_LEN (3 * sizeof (int))) {
+				errno = EPROTO;
+				return -1;
+			}
+			memcpy (client->fds, CMSG_DATA (cmsg), 3 * sizeof (int));
+		}
+
+		client->received += ret;
+
+		if (client->data == NULL && client->received == sizeof (client->header)) {
+			len = ntohl (client->header);
+			if (len == 0 || len > AGENT_MAX_REQUEST) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+
+			client->data = malloc (len + 1);
+			if (client->data == NULL)
+				return -1;
+			client->length = len;
+		}
+
+		if (client->data && client->received == sizeof (client->header) + client->length) {
+			/* Guarantee that the last string is terminated */
+			client->data[client->length] = '\0';
+			return 1;
+		}
+	}
+}
+
+static void
+agent_client_clear (agent_client *client)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (client->fds[i] >= 0)
+			close (client->fds[i]);
+	}
+
+	if (client->fd >= 0)
+		close (client->fd);
+	free (client->data);
+
+	memset (client, 0, sizeof (agent_client));
+	client->fd = -1;
+	for (i = 0; i < 3; i++)
+		client->fds[i] = -1;
+}
+
+static bool
+peer_is_trusted (int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof (cred);
+
+	if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return false;
+
+	return cred.uid == 0 || cred.uid == geteuid ();
+}
+
+static void
+handle_client (agent_client *client,
+               int saved[3],
+               int max_age,
+               bool verbose)
+{
+	char **strings = NULL;
+	char **globals = NULL;
+	char **env = NULL;
+	int32_t status = 2;
+	bool command_verbose = false;
+	bool reused = false;
+	int count;
+	int index;
+	int i, n, m;
+
+	strings = split_strings (client->data, client->length, &count);
+	if (strings == NULL || count < 3 || strcmp (strings[0], AGENT_PROTOCOL) != 0) {
+		warnx ("invalid agent request");
+		goto out;
+	}
+
+	/* Environment variables follow the working directory, until an empty string */
+	for (n = 2; n < count && strings[n][0] != '\0'; n++);
+	if (n + 1 >= count) {
+		warnx ("invalid agent request");
+		goto out;
+	}
+
+	strings[n] = NULL;
+	env = strings + 2;
+
+	/* The global options follow, until another empty string */
+	for (m = n + 1; m < count && strings[m][0] != '\0'; m++);
+	if (m + 1 >= count) {
+		warnx ("invalid agent request");
+		goto out;
+	}
+
+	strings[m] = NULL;
+	globals = strings + n + 1;
+
+	for (i = 0; globals[i] != NULL; i++) {
+		if (strcmp (globals[i], "--verbose") == 0) {
+			command_verbose = true;
+		} else {
+			warnx ("global option not supported by agent: %s", globals[i]);
+			goto out;
+		}
+	}
+
+	index = find_agent_command (strings[m + 1]);
+	if (index < 0) {
+		warnx ("command not supported by agent: %s", strings[m + 1]);
+		goto out;
+	}
+
+	if (chdir (strings[1]) < 0) {
+		warn ("couldn't change to directory: %s", strings[1]);
+		goto out;
+	}
+
+	for (i = 0; env[i] != NULL; i++) {
+		if (!is_agent_environ (env[i])) {
+			warnx ("invalid agent request");
+			goto out;
+		}
+	}
+
+	for (i = 0; agent_environ[i] != NULL; i++)
+		unsetenv (agent_environ[i]);
+	for (i = 0; env[i] != NULL; i++)
+		putenv (env[i]);
+
+	fflush (stdout);
+	fflush (stderr);
+	__fpurge (stdin);
+	clearerr (stdin);
+	for (i = 0; i < 3; i++)
+		dup2 (client->fds[i], i);
+
+	status = run_agent_command (index, count - m - 1, strings + m + 1,
+	                            env, command_verbose, max_age, &reused);
+
+	for (i = 0; i < 3; i++)
+		dup2 (saved[i], i);
+	__fpurge (stdin);
+	clearerr (stdin);
+
+	for (i = 0; agent_environ[i] != NULL; i++)
+		unsetenv (agent_environ[i]);
+	if (chdir ("/") < 0)
+		warn ("couldn't change to root directory");
+
+	adcli_set_message_func (verbose ? adcli_tool_message_func : NULL);
+	_adcli_info ("Ran %s with a %s connection, status %d",
+	             strings[m + 1], reused ? "reused" : "new", (int)status);
+
+out:
+	status = htonl ((uint32_t)status);
+	if (_adcli_write_all (client->fd, (const char *)&status, sizeof (status)) < 0)
+		warn ("couldn't send agent response");
+
+	free (strings);
+}
+
+static void
+accept_client (int listener,
+               agent_client *clients)
+{
+	int fd;
+	int i;
+
+	fd = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != ECONNABORTED)
+			warn ("couldn't accept client");
+		return;
+	}
+
+	if (!peer_is_trusted (fd)) {
+		warnx ("refusing request from another user");
+		close (fd);
+		return;
+	}
+
+	for (i = 0; i < AGENT_MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = fd;
+			clients[i].deadline = time (NULL) + AGENT_REQUEST_TIMEOUT;
+			return;
+		}
+	}
+
+	warnx ("too many clients waiting, refusing another");
+	close (fd);
+}
+
+/*
+ * Read from the clients that have something to send, and run the
+ * command of each one whose request is complete. Clients that don't
+ * send their request in time are dropped.
+ */
+static void
+service_clients (agent_client *clients,
+                 struct pollfd *pfds,
+                 int saved[3],
+                 int max_age,
+                 bool verbose)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < AGENT_MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0)
+			continue;
+
+		/* A command for another client may have taken a while */
+		if (pfds[i].revents == 0 && time (NULL) < clients[i].deadline)
+			continue;
+
+		ret = read_request (clients + i);
+		if (ret == 0) {
+			if (time (NULL) < clients[i].deadline)
+				continue;
+			errno = ETIMEDOUT;
+			ret = -1;
+		}
+
+		if (ret > 0) {
+			handle_client (clients + i, saved, max_age, verbose);
+
+		/* Probes from another agent just connect and hang up */
+		} else if (errno != ECONNRESET) {
+			warn ("couldn't read agent request");
+		}
+
+		agent_client_clear (clients + i);
+	}
+}
+
+static void
+on_quit_signal (int signo)
+{
+	agent_quit = 1;
+}
+
+static int
+listen_agent_socket (const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t old_mask;
+	int fd;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		warnx ("socket path is too long: %s", path);
+		return -1;
+	}
+	strcpy (addr.sun_path, path);
+
+	fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		warn ("couldn't create socket");
+		return -1;
+	}
+
+	/* Don't take the socket away from an agent that is running */
+	if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0) {
+		warnx ("an adcli agent is already listening on: %s", path);
+		close (fd);
+		return -1;
+	}
+
+	unlink (path);
+
+	old_mask = umask (0177);
+	if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+	    listen (fd, 16) < 0) {
+		umask (old_mask);
+		warn ("couldn't listen on socket: %s", path);
+		close (fd);
+		return -1;
+	}
+	umask (old_mask);
+
+	return fd;
+}
+
+typedef enum {
+	/* Have short equivalents */
+	opt_verbose = 'v',
+
+	/* Don't have short equivalents */
+	opt_socket = 1000,
+	opt_max_age,
+} Option;
+
+int
+adcli_tool_agent (adcli_conn *unused,
+                  int argc,
+                  char *argv[])
+{
+	const char *path = NULL;
+	int max_age = AGENT_DEFAULT_MAX_AGE;
+	bool verbose = false;
+	agent_client clients[AGENT_MAX_CLIENTS];
+	struct pollfd pfds[AGENT_MAX_CLIENTS + 1];
+	struct sigaction sa;
+	int saved[3];
+	time_t now;
+	int wait;
+	int ret;
+	char *end;
+	int listener;
+	int opt;
+	int i;
+
+	struct option options[] = {
+		{ "socket", required_argument, NULL, opt_socket },
+		{ "max-age", required_argument, NULL, opt_max_age },
+		{ "verbose", no_argument, NULL, opt_verbose },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+
+	static adcli_tool_desc usages[] = {
+		{ 0, "usage: adcli agent" },
+		{ opt_socket, "path of the socket to listen on", "path" },
+		{ opt_max_age, "seconds before a connection is made afresh", "secs" },
+		{ opt_verbose, "show verbose progress and failure messages", },
+		{ 0 },
+	};
+
+	while ((opt = adcli_tool_getopt (argc, argv, options)) != -1) {
+		switch (opt) {
+		case opt_socket:
+			path = optarg;
+			break;
+		case opt_max_age:
+			max_age = strtol (optarg, &end, 10);
+			if (*end != '\0' || max_age <= 0) {
+				warnx ("invalid --max-age: %s", optarg);
+				return 2;
+			}
+			break;
+		case opt_verbose:
+			verbose = true;
+			break;
+		case 'h':
+		case '?':
+		case ':':
+			adcli_tool_usage (options, usages);
+			return opt == 'h' ? 0 : 2;
+		default:
+			assert (0 && "not reached");
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0) {
+		warnx ("extra arguments specified");
+		return 2;
+	}
+
+	if (path == NULL)
+		path = agent_socket_path ();
+
+	listener = listen_agent_socket (path);
+	if (listener < 0)
+		return 1;
+
+	for (i = 0; i < 3; i++) {
+		saved[i] = fcntl (i, F_DUPFD_CLOEXEC, 3);
+		if (saved[i] < 0)
+			err (1, "couldn't save standard descriptors");
+	}
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = on_quit_signal;
+	sigaction (SIGTERM, &sa, NULL);
+	sigaction (SIGINT, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction (SIGPIPE, &sa, NULL);
+
+	if (chdir ("/") < 0)
+		warn ("couldn't change to root directory");
+
+	adcli_set_message_func (verbose ? adcli_tool_message_func : NULL);
+	_adcli_info ("Listening for adcli clients on %s", path);
+
+	memset (clients, 0, sizeof (clients));
+	for (i = 0; i < AGENT_MAX_CLIENTS; i++)
+		clients[i].fd = clients[i].fds[0] = clients[i].fds[1] = clients[i].fds[2] = -1;
+
+	while (!agent_quit) {
+		now = time (NULL);
+		wait = AGENT_PROBE_INTERVAL;
+
+		/* Requests are read without blocking, so one stalled client can't hold up the others */
+		for (i = 0; i < AGENT_MAX_CLIENTS; i++) {
+			pfds[i].fd = clients[i].fd;
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+			if (clients[i].fd >= 0 && clients[i].deadline - now < wait)
+				wait = clients[i].deadline - now;
+		}
+
+		pfds[AGENT_MAX_CLIENTS].fd = listener;
+		pfds[AGENT_MAX_CLIENTS].events = POLLIN;
+		pfds[AGENT_MAX_CLIENTS].revents = 0;
+
+		ret = poll (pfds, AGENT_MAX_CLIENTS + 1, wait > 0 ? wait * 1000 : 0);
+		if (ret < 0)
+			continue;
+
+		service_clients (clients, pfds, saved, max_age, verbose);
+		if (pfds[AGENT_MAX_CLIENTS].revents & POLLIN)
+			accept_client (listener, clients);
+		probe_idle_conns ();
+	}
+
+	for (i = 0; i < AGENT_MAX_CLIENTS; i++)
+		agent_client_clear (clients + i);
+	for (i = 0; i < AGENT_MAX_CONNS; i++)
+		agent_conn_clear (agent_conns + i);
+	for (i = 0; i < 3; i++)
+		close (saved[i]);
+
+	close (listener);
+	unlink (path);
+	return 0;
+}
+
+static int
+connect_agent (void)
+{
+	struct sockaddr_un addr;
+	const char *path;
+	int fd;
+
+	path = agent_socket_path ();
+	if (path[0] == '\0' || strlen (path) >= sizeof (addr.sun_path))
+		return -1;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+
+	fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool
+append_string (char **data,
+               size_t *len,
+               const char *str)
+{
+	size_t add = strlen (str) + 1;
+	char *mem;
+
+	mem = realloc (*data, *len + add);
+	if (mem == NULL)
+		return false;
+
+	memcpy (mem + *len, str, add);
+	*data = mem;
+	*len += add;
+	return true;
+}
+
+static bool
+send_request (int fd,
+              const char *data,
+              size_t len)
+{
+	union {
+		struct cmsghdr cmsg;
+		char control[CMSG_SPACE (3 * sizeof (int))];
+	} u;
+	int fds[3] = { 0, 1, 2 };
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	uint32_t header;
+	ssize_t ret;
+
+	header = htonl ((uint32_t)len);
+
+	memset (&msg, 0, sizeof (msg));
+	memset (&u, 0, sizeof (u));
+	iov.iov_base = &header;
+	iov.iov_len = sizeof (header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.control;
+	msg.msg_controllen = sizeof (u.control);
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+	memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+	do {
+		ret = sendmsg (fd, &msg, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret != sizeof (header))
+		return false;
+
+	return _adcli_write_all (fd, data, len) >= 0;
+}
+
+bool
+adcli_tool_agent_forward (int argc,
+                          char *argv[],
+                          bool verbose,
+                          int *status)
+{
+	char *data = NULL;
+	char *cwd = NULL;
+	size_t len = 0;
+	const char *value;
+	char *pair;
+	int32_t response;
+	bool ok;
+	int fd;
+	int i;
+
+	if (find_agent_command (argv[0]) < 0)
+		return false;
+
+	for (i = 1; i < argc; i++) {
+		if (_adcli_strv_has ((char **)local_options, argv[i]))
+			return false;
+	}
+
+	/* When no agent is running, the command runs here as usual */
+	fd = connect_agent ();
+	if (fd < 0)
+		return false;
+
+	cwd = getcwd (NULL, 0);
+	ok = cwd != NULL &&
+	     append_string (&data, &len, AGENT_PROTOCOL) &&
+	     append_string (&data, &len, cwd);
+
+	for (i = 0; ok && agent_environ[i] != NULL; i++) {
+		value = getenv (agent_environ[i]);
+		if (value == NULL)
+			continue;
+		if (asprintf (&pair, "%s=%s", agent_environ[i], value) < 0)
+			ok = false;
+		else {
+			ok = append_string (&data, &len, pair);
+			free (pair);
+		}
+	}
+
+	ok = ok && append_string (&data, &len, "");
+	if (verbose)
+		ok = ok && append_string (&data, &len, "--verbose");
+	ok = ok && append_string (&data, &len, "");
+	for (i = 0; ok && i < argc; i++)
+		ok = append_string (&data, &len, argv[i]);
+
+	free (cwd);
+
+	if (!ok || len > AGENT_MAX_REQUEST) {
+		free (data);
+		close (fd);
+		return false;
+	}
+
+	fflush (stdout);
+	fflush (stderr);
+
+	if (!send_request (fd, data, len)) {
+		/* Nothing was run yet, so fall back to running locally */
+		free (data);
+		close (fd);
+		return false;
+	}
+
+	free (data);
+
+	if (read_exact (fd, &response, sizeof (response)) < 0) {
+		warnx ("lost connection to the adcli agent");
+		*status = EFAIL;
+	} else {
+		*status = (int32_t)ntohl ((uint32_t)response);
+	}
+
+	close (fd);
+	return true;
+}
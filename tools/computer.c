@@ -24,12 +24,15 @@
 #include "config.h"
 
 #include "adcli.h"
+#include "adprivate.h"
 #include "tools.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 
 static void
@@ -120,6 +123,16 @@ typedef enum {
 	opt_use_ldaps,
 	opt_account_disable,
 	opt_ldap_passwd,
+	opt_auto_passwd,
+	opt_max_age,
+	opt_delete,
+	opt_disable,
+	opt_dry_run,
+	opt_host_file,
+	opt_rotation_window,
+	opt_schedule,
+	opt_global_catalog,
+	opt_recursive,
 } Option;
 
 static adcli_tool_desc common_usages[] = {
@@ -172,6 +185,22 @@ static adcli_tool_desc common_usages[] = {
 	                      "to the Samba specific configuration database" },
 	{ opt_samba_data_tool, "Absolute path to the tool used for add-samba-data" },
 	{ opt_ldap_passwd, "Use LDAP add/mod operation to set/change password" },
+	{ opt_auto_passwd, "set/change password with LDAP when the connection\n"
+	                   "is encrypted, otherwise or on failure with Kerberos" },
+	{ opt_max_age, "consider computer accounts unused for this many\n"
+	               "days as stale, the default is 90" },
+	{ opt_delete, "delete the stale computer accounts" },
+	{ opt_disable, "disable the stale computer accounts" },
+	{ opt_dry_run, "only show what would be done" },
+	{ opt_host_file, "file with host names of computer accounts, one\n"
+	                 "per line, or '-' for stdin" },
+	{ opt_rotation_window, "rotate the password at a point in this many days\n"
+	                       "before it expires, spread out per host" },
+	{ opt_schedule, "keep running, and rotate the password when it is\n"
+	                "due" },
+	{ opt_global_catalog, "look for the account in the other domains of the\n"
+	                      "forest with the global catalog" },
+	{ opt_recursive, "also delete the child objects of the account" },
 	{ opt_verbose, "show verbose progress and failure messages", },
 	{ 0 },
 };
@@ -180,11 +209,13 @@ static int
 parse_option (Option opt,
               const char *optarg,
               adcli_conn *conn,
-              adcli_enroll *enroll)
+              adcli_enroll *enroll,
+              int *password_opt)
 {
-	static int no_password = 0;
-	static int prompt_password = 0;
-	static int stdin_password = 0;
+	/* Which password option this command was given, if any */
+	int no_password = (*password_opt == opt_no_password);
+	int prompt_password = (*password_opt == opt_prompt_password);
+	int stdin_password = (*password_opt == opt_stdin_password);
 	char *endptr;
 	unsigned int lifetime;
 	int ret;
@@ -249,7 +280,7 @@ parse_option (Option opt,
 			return EUSAGE;
 		} else {
 			adcli_conn_set_password_func (conn, NULL, NULL, NULL);
-			no_password = 1;
+			*password_opt = opt_no_password;
 		}
 		return ADCLI_SUCCESS;
 	case opt_prompt_password:
@@ -259,7 +290,7 @@ parse_option (Option opt,
 			return EUSAGE;
 		} else {
 			adcli_conn_set_password_func (conn, adcli_prompt_password_func, NULL, NULL);
-			prompt_password = 1;
+			*password_opt = opt_prompt_password;
 		}
 		return ADCLI_SUCCESS;
 	case opt_stdin_password:
@@ -269,7 +300,7 @@ parse_option (Option opt,
 			return EUSAGE;
 		} else {
 			adcli_conn_set_password_func (conn, adcli_read_password_func, NULL, NULL);
-			stdin_password = 1;
+			*password_opt = opt_stdin_password;
 		}
 		return ADCLI_SUCCESS;
 	case opt_os_name:
@@ -364,6 +395,16 @@ parse_option (Option opt,
 	case opt_one_time_password:
 	case opt_add_samba_data:
 	case opt_ldap_passwd:
+	case opt_auto_passwd:
+	case opt_max_age:
+	case opt_delete:
+	case opt_disable:
+	case opt_dry_run:
+	case opt_host_file:
+	case opt_rotation_window:
+	case opt_schedule:
+	case opt_global_catalog:
+	case opt_recursive:
 		assert (0 && "not reached");
 		break;
 	}
@@ -386,6 +427,141 @@ parse_fqdn_or_name (adcli_enroll *enroll,
 	}
 }
 
+static int
+read_host_file (const char *filename,
+                char ***names,
+                int *length)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *file;
+	int ret = 0;
+
+	if (strcmp (filename, "-") == 0) {
+		file = stdin;
+	} else {
+		file = fopen (filename, "r");
+		if (file == NULL) {
+			warn ("couldn't open host file: %s", filename);
+			return EFAIL;
+		}
+	}
+
+	while ((len = getline (&line, &size, file)) != -1) {
+		while (len > 0 && isspace ((unsigned char)line[len - 1]))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		*names = _adcli_strv_add (*names, strdup (line), length);
+	}
+
+	if (ferror (file)) {
+		warn ("couldn't read host file: %s", filename);
+		ret = EFAIL;
+	}
+
+	free (line);
+	if (file != stdin)
+		fclose (file);
+
+	return ret;
+}
+
+static int
+read_host_names (const char *host_file,
+                 int argc,
+                 char *argv[],
+                 char ***names)
+{
+	int length = 0;
+	int ret;
+	int i;
+
+	if (host_file != NULL) {
+		ret = read_host_file (host_file, names, &length);
+		if (ret != 0)
+			return ret;
+	}
+
+	for (i = 0; i < argc; i++)
+		*names = _adcli_strv_add (*names, strdup (argv[i]), &length);
+
+	if (length == 0) {
+		warnx ("no host names of computer accounts specified");
+		return EUSAGE;
+	}
+
+	return 0;
+}
+
+typedef struct {
+	const char *action;
+	int failed;
+} BulkReport;
+
+static void
+print_bulk_result (const char *name,
+                   const char *computer_dn,
+                   adcli_result result,
+                   const char *message,
+                   void *data)
+{
+	BulkReport *report = data;
+
+	if (result == ADCLI_SUCCESS) {
+		printf ("%s\t%s\n", name, report->action);
+	/* When showing accounts only the missing ones are reported */
+	} else if (report->action == NULL) {
+		warnx ("%s", message ? message : name);
+		report->failed++;
+	} else {
+		printf ("%s\tfailed\t%s\n", name, message ? message : "");
+		report->failed++;
+	}
+}
+
+static int
+computer_bulk (adcli_conn *conn,
+               adcli_enroll *enroll,
+               adcli_enroll_flags flags,
+               char **names,
+               int reset)
+{
+	BulkReport report = { reset ? "reset" : "deleted", 0 };
+	adcli_result res;
+
+	res = adcli_conn_connect (conn);
+	if (res != ADCLI_SUCCESS) {
+		warnx ("couldn't connect to %s domain: %s",
+		       adcli_conn_get_domain_name (conn),
+		       adcli_get_last_error ());
+		return -res;
+	}
+
+	/* All the accounts share one connection and are changed in parallel */
+	if (reset)
+		res = adcli_enroll_reset_many (enroll, (const char **)names, print_bulk_result, &report);
+	else
+		res = adcli_enroll_delete_many (enroll, (const char **)names, flags, print_bulk_result, &report);
+
+	if (res != ADCLI_SUCCESS) {
+		if (report.failed) {
+			warnx ("%s %d of %d computer accounts in %s domain failed",
+			       reset ? "resetting" : "deleting", report.failed,
+			       _adcli_strv_len (names), adcli_conn_get_domain_name (conn));
+		} else {
+			warnx ("%s computer accounts in %s domain failed: %s",
+			       reset ? "resetting" : "deleting",
+			       adcli_conn_get_domain_name (conn),
+			       adcli_get_last_error ());
+		}
+		return -res;
+	}
+
+	return 0;
+}
+
 int
 adcli_tool_computer_join (adcli_conn *conn,
                           int argc,
@@ -396,6 +572,7 @@ adcli_tool_computer_join (adcli_conn *conn,
 	adcli_result res;
 	int show_password = 0;
 	int details = 0;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -432,6 +609,7 @@ adcli_tool_computer_join (adcli_conn *conn,
 		{ "add-samba-data", no_argument, NULL, opt_add_samba_data },
 		{ "samba-data-tool", required_argument, 0, opt_samba_data_tool },
 		{ "ldap-passwd", no_argument, NULL, opt_ldap_passwd },
+		{ "auto-passwd", no_argument, NULL, opt_auto_passwd },
 		{ "verbose", no_argument, NULL, opt_verbose },
 		{ "help", no_argument, NULL, 'h' },
 		{ 0 },
@@ -466,6 +644,9 @@ adcli_tool_computer_join (adcli_conn *conn,
 		case opt_ldap_passwd:
 			flags |= ADCLI_ENROLL_LDAP_PASSWD;
 			break;
+		case opt_auto_passwd:
+			flags |= ADCLI_ENROLL_AUTO_PASSWD;
+			break;
 		case 'h':
 		case '?':
 		case ':':
@@ -474,7 +655,7 @@ adcli_tool_computer_join (adcli_conn *conn,
 			adcli_enroll_unref (enroll);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn, enroll);
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_enroll_unref (enroll);
 				return res;
@@ -494,6 +675,8 @@ adcli_tool_computer_join (adcli_conn *conn,
 		return 2;
 	}
 
+	adcli_enroll_plan_password (enroll, flags);
+
 	res = adcli_conn_connect (conn);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't connect to %s domain: %s",
@@ -524,6 +707,75 @@ adcli_tool_computer_join (adcli_conn *conn,
 	return 0;
 }
 
+/* Retry delays when the domain controller is busy or can't be reached */
+#define SCHEDULE_BACKOFF_BASE   60
+#define SCHEDULE_BACKOFF_LIMIT  (6 * 60 * 60)
+
+/* Look again at least this often, in case the account changed elsewhere */
+#define SCHEDULE_RECHECK        (24 * 60 * 60)
+
+/* After a successful update, never look again sooner than this */
+#define SCHEDULE_MIN_INTERVAL   (60 * 60)
+
+static void
+schedule_sleep (unsigned int seconds)
+{
+	while (seconds > 0)
+		seconds = sleep (seconds);
+}
+
+static adcli_result
+schedule_updates (adcli_conn *conn,
+                  adcli_enroll *enroll,
+                  adcli_enroll_flags flags)
+{
+	unsigned int attempt = 0;
+	adcli_result res;
+	time_t when;
+	time_t now;
+
+	/* Spread rotations out over a week by default */
+	if (adcli_enroll_get_rotation_window (enroll) == 0)
+		adcli_enroll_set_rotation_window (enroll, 7);
+
+	for (;;) {
+		res = adcli_conn_connect (conn);
+		if (res == ADCLI_SUCCESS)
+			res = adcli_enroll_update (enroll, flags);
+
+		/* Read pwdLastSet again, it changed if the password was rotated */
+		if (res == ADCLI_SUCCESS)
+			res = adcli_enroll_read_computer_account (enroll, flags);
+
+		if (res == ADCLI_SUCCESS) {
+			attempt = 0;
+			now = time (NULL);
+			when = adcli_enroll_get_rotation_time (enroll);
+			if (when < now + SCHEDULE_MIN_INTERVAL)
+				when = now + SCHEDULE_MIN_INTERVAL;
+			if (when - now > SCHEDULE_RECHECK)
+				when = now + SCHEDULE_RECHECK;
+			schedule_sleep (when - now);
+			continue;
+		}
+
+		/* Only back off when the failure may go away by itself */
+		if (res != ADCLI_ERR_DIRECTORY && res != ADCLI_ERR_FAIL) {
+			warnx ("updating membership with domain %s failed: %s",
+			       adcli_conn_get_domain_name (conn),
+			       adcli_get_last_error ());
+			return res;
+		}
+
+		warnx ("updating membership with domain %s failed, retrying: %s",
+		       adcli_conn_get_domain_name (conn),
+		       adcli_get_last_error ());
+		schedule_sleep (_adcli_backoff_delay (attempt++, SCHEDULE_BACKOFF_BASE,
+		                                      SCHEDULE_BACKOFF_LIMIT,
+		                                      adcli_conn_get_netbios_computer_name (conn)));
+	}
+}
+
 int
 adcli_tool_computer_update (adcli_conn *conn,
 		            int argc,
@@ -534,7 +786,11 @@ adcli_tool_computer_update (adcli_conn *conn,
 	adcli_result res;
 	int show_password = 0;
 	int details = 0;
+	bool schedule = false;
 	const char *ktname;
+	unsigned long window;
+	char *end;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -564,6 +820,9 @@ adcli_tool_computer_update (adcli_conn *conn,
 		{ "add-samba-data", no_argument, NULL, opt_add_samba_data },
 		{ "samba-data-tool", required_argument, 0, opt_samba_data_tool },
 		{ "ldap-passwd", no_argument, NULL, opt_ldap_passwd },
+		{ "auto-passwd", no_argument, NULL, opt_auto_passwd },
+		{ "rotation-window", required_argument, NULL, opt_rotation_window },
+		{ "schedule", no_argument, NULL, opt_schedule },
 		{ "verbose", no_argument, NULL, opt_verbose },
 		{ "help", no_argument, NULL, 'h' },
 		{ 0 },
@@ -594,6 +853,22 @@ adcli_tool_computer_update (adcli_conn *conn,
 		case opt_ldap_passwd:
 			flags |= ADCLI_ENROLL_LDAP_PASSWD;
 			break;
+		case opt_auto_passwd:
+			flags |= ADCLI_ENROLL_AUTO_PASSWD;
+			break;
+		case opt_rotation_window:
+			errno = 0;
+			window = strtoul (optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || end == optarg || window > UINT_MAX) {
+				warnx ("invalid --rotation-window: %s", optarg);
+				adcli_enroll_unref (enroll);
+				return EUSAGE;
+			}
+			adcli_enroll_set_rotation_window (enroll, window);
+			break;
+		case opt_schedule:
+			schedule = true;
+			break;
 		case 'h':
 		case '?':
 		case ':':
@@ -602,7 +877,7 @@ adcli_tool_computer_update (adcli_conn *conn,
 			adcli_enroll_unref (enroll);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn, enroll);
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_enroll_unref (enroll);
 				return res;
@@ -629,6 +904,24 @@ adcli_tool_computer_update (adcli_conn *conn,
 		return -res;
 	}
 
+	if (schedule) {
+		/* A planned rotation never happens, so it would be due forever */
+		if (_adcli_planning ()) {
+			warnx ("--plan can't be used with --schedule");
+			adcli_enroll_unref (enroll);
+			return 2;
+		}
+		/* The password would always be due, and changed over and over */
+		if (adcli_enroll_get_computer_password_lifetime (enroll) == 0) {
+			warnx ("--computer-password-lifetime=0 can't be used with --schedule");
+			adcli_enroll_unref (enroll);
+			return 2;
+		}
+		res = schedule_updates (conn, enroll, flags);
+		adcli_enroll_unref (enroll);
+		return -res;
+	}
+
 	res = adcli_conn_connect (conn);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't connect to %s domain: %s",
@@ -665,6 +958,7 @@ adcli_tool_computer_testjoin (adcli_conn *conn,
 	adcli_enroll *enroll;
 	adcli_result res;
 	const char *ktname;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -698,7 +992,7 @@ adcli_tool_computer_testjoin (adcli_conn *conn,
 			adcli_enroll_unref (enroll);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn, enroll);
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_enroll_unref (enroll);
 				return res;
@@ -746,6 +1040,7 @@ adcli_tool_computer_preset (adcli_conn *conn,
 	adcli_result res;
 	adcli_enroll_flags flags;
 	int reset_password = 1;
+	int password_opt = 0;
 	int opt;
 	int i;
 
@@ -800,7 +1095,7 @@ adcli_tool_computer_preset (adcli_conn *conn,
 			adcli_enroll_unref (enroll);
 			return 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn, enroll);
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_enroll_unref (enroll);
 				return res;
@@ -821,6 +1116,8 @@ adcli_tool_computer_preset (adcli_conn *conn,
 	adcli_conn_set_allowed_login_types (conn, ADCLI_LOGIN_USER_ACCOUNT);
 	reset_password = (adcli_enroll_get_computer_password (enroll) == NULL);
 
+	adcli_enroll_plan_password (enroll, flags);
+
 	res = adcli_conn_connect (conn);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't connect to %s domain: %s",
@@ -858,8 +1155,11 @@ adcli_tool_computer_reset (adcli_conn *conn,
                            int argc,
                            char *argv[])
 {
+	const char *host_file = NULL;
 	adcli_enroll *enroll;
 	adcli_result res;
+	char **names = NULL;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -873,13 +1173,14 @@ adcli_tool_computer_reset (adcli_conn *conn,
 		{ "no-password", no_argument, 0, opt_no_password },
 		{ "stdin-password", no_argument, 0, opt_stdin_password },
 		{ "prompt-password", no_argument, 0, opt_prompt_password },
+		{ "host-file", required_argument, NULL, opt_host_file },
 		{ "verbose", no_argument, NULL, opt_verbose },
 		{ "help", no_argument, NULL, 'h' },
 		{ 0 },
 	};
 
 	static adcli_tool_desc usages[] = {
-		{ 0, "usage: adcli reset-computer --domain=xxxx host1.example.com" },
+		{ 0, "usage: adcli reset-computer --domain=xxxx host1.example.com ..." },
 		{ 0 },
 	};
 
@@ -891,6 +1192,9 @@ adcli_tool_computer_reset (adcli_conn *conn,
 
 	while ((opt = adcli_tool_getopt (argc, argv, options)) != -1) {
 		switch (opt) {
+		case opt_host_file:
+			host_file = optarg;
+			break;
 		case 'h':
 		case '?':
 		case ':':
@@ -899,7 +1203,7 @@ adcli_tool_computer_reset (adcli_conn *conn,
 			adcli_enroll_unref (enroll);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn, enroll);
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_enroll_unref (enroll);
 				return res;
@@ -911,12 +1215,23 @@ adcli_tool_computer_reset (adcli_conn *conn,
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1) {
-		warnx ("specify one host name of computer account to reset");
+	if (argc < 1 && host_file == NULL) {
+		warnx ("specify one or more host names of computer accounts to reset");
 		adcli_enroll_unref (enroll);
 		return EUSAGE;
 	}
 
+	adcli_enroll_plan_password (enroll, 0);
+
+	if (argc > 1 || host_file != NULL) {
+		res = read_host_names (host_file, argc, argv, &names);
+		if (res == ADCLI_SUCCESS)
+			res = computer_bulk (conn, enroll, 0, names, 1);
+		_adcli_strv_free (names);
+		adcli_enroll_unref (enroll);
+		return res;
+	}
+
 	res = adcli_conn_connect (conn);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't connect to %s domain: %s",
@@ -947,8 +1262,12 @@ adcli_tool_computer_delete (adcli_conn *conn,
                             int argc,
                             char *argv[])
 {
+	adcli_enroll_flags flags = 0;
+	const char *host_file = NULL;
 	adcli_enroll *enroll;
 	adcli_result res;
+	char **names = NULL;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -961,13 +1280,16 @@ adcli_tool_computer_delete (adcli_conn *conn,
 		{ "no-password", no_argument, 0, opt_no_password },
 		{ "stdin-password", no_argument, 0, opt_stdin_password },
 		{ "prompt-password", no_argument, 0, opt_prompt_password },
+		{ "host-file", required_argument, NULL, opt_host_file },
+		{ "global-catalog", no_argument, NULL, opt_global_catalog },
+		{ "recursive", no_argument, NULL, opt_recursive },
 		{ "verbose", no_argument, NULL, opt_verbose },
 		{ "help", no_argument, NULL, 'h' },
 		{ 0 },
 	};
 
 	static adcli_tool_desc usages[] = {
-		{ 0, "usage: adcli delete-computer --domain=xxxx [host1.example.com]" },
+		{ 0, "usage: adcli delete-computer --domain=xxxx [host1.example.com ...]" },
 		{ 0 },
 	};
 
@@ -979,6 +1301,15 @@ adcli_tool_computer_delete (adcli_conn *conn,
 
 	while ((opt = adcli_tool_getopt (argc, argv, options)) != -1) {
 		switch (opt) {
+		case opt_host_file:
+			host_file = optarg;
+			break;
+		case opt_global_catalog:
+			flags |= ADCLI_ENROLL_GLOBAL_CATALOG;
+			break;
+		case opt_recursive:
+			flags |= ADCLI_ENROLL_RECURSIVE_DELETE;
+			break;
 		case 'h':
 		case '?':
 		case ':':
@@ -987,7 +1318,7 @@ adcli_tool_computer_delete (adcli_conn *conn,
 			adcli_enroll_unref (enroll);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn, enroll);
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_enroll_unref (enroll);
 				return res;
@@ -999,12 +1330,6 @@ adcli_tool_computer_delete (adcli_conn *conn,
 	argc -= optind;
 	argv += optind;
 
-	if (argc > 1) {
-		warnx ("specify one host name of computer account to delete");
-		adcli_enroll_unref (enroll);
-		return EUSAGE;
-	}
-
 	adcli_conn_set_allowed_login_types (conn, ADCLI_LOGIN_USER_ACCOUNT);
 
 	res = adcli_enroll_load (enroll);
@@ -1013,6 +1338,15 @@ adcli_tool_computer_delete (adcli_conn *conn,
 		       adcli_get_last_error ());
 	}
 
+	if (argc > 1 || host_file != NULL) {
+		res = read_host_names (host_file, argc, argv, &names);
+		if (res == ADCLI_SUCCESS)
+			res = computer_bulk (conn, enroll, flags, names, 0);
+		_adcli_strv_free (names);
+		adcli_enroll_unref (enroll);
+		return res;
+	}
+
 	res = adcli_conn_connect (conn);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't connect to %s domain: %s",
@@ -1025,7 +1359,7 @@ adcli_tool_computer_delete (adcli_conn *conn,
 	if (argc == 1)
 		parse_fqdn_or_name (enroll, argv[0]);
 
-	res = adcli_enroll_delete (enroll, 0);
+	res = adcli_enroll_delete (enroll, flags);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("deleting %s in %s domain failed: %s", argv[0],
 		       adcli_conn_get_domain_name (conn),
@@ -1043,8 +1377,13 @@ adcli_tool_computer_show (adcli_conn *conn,
                           int argc,
                           char *argv[])
 {
+	adcli_enroll_flags flags = 0;
+	const char *host_file = NULL;
+	BulkReport report = { NULL, 0 };
 	adcli_enroll *enroll;
 	adcli_result res;
+	char **names = NULL;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -1058,13 +1397,15 @@ adcli_tool_computer_show (adcli_conn *conn,
 		{ "no-password", no_argument, 0, opt_no_password },
 		{ "stdin-password", no_argument, 0, opt_stdin_password },
 		{ "prompt-password", no_argument, 0, opt_prompt_password },
+		{ "host-file", required_argument, NULL, opt_host_file },
+		{ "global-catalog", no_argument, NULL, opt_global_catalog },
 		{ "verbose", no_argument, NULL, opt_verbose },
 		{ "help", no_argument, NULL, 'h' },
 		{ 0 },
 	};
 
 	static adcli_tool_desc usages[] = {
-		{ 0, "usage: adcli show-computer --domain=xxxx host1.example.com" },
+		{ 0, "usage: adcli show-computer --domain=xxxx host1.example.com ..." },
 		{ 0 },
 	};
 
@@ -1076,6 +1417,12 @@ adcli_tool_computer_show (adcli_conn *conn,
 
 	while ((opt = adcli_tool_getopt (argc, argv, options)) != -1) {
 		switch (opt) {
+		case opt_host_file:
+			host_file = optarg;
+			break;
+		case opt_global_catalog:
+			flags |= ADCLI_ENROLL_GLOBAL_CATALOG;
+			break;
 		case 'h':
 		case '?':
 		case ':':
@@ -1084,7 +1431,7 @@ adcli_tool_computer_show (adcli_conn *conn,
 			adcli_enroll_unref (enroll);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn, enroll);
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_enroll_unref (enroll);
 				return res;
@@ -1096,11 +1443,40 @@ adcli_tool_computer_show (adcli_conn *conn,
 	argc -= optind;
 	argv += optind;
 
+	if (argc > 1 || host_file != NULL) {
+		res = read_host_names (host_file, argc, argv, &names);
+		if (res != ADCLI_SUCCESS) {
+			adcli_enroll_unref (enroll);
+			return res;
+		}
+	}
+
 	res = adcli_conn_connect (conn);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't connect to %s domain: %s",
 		       adcli_conn_get_domain_name (conn),
 		       adcli_get_last_error ());
+		_adcli_strv_free (names);
+		adcli_enroll_unref (enroll);
+		return -res;
+	}
+
+	/* Many hosts are fetched with one search and printed as they arrive */
+	if (names != NULL) {
+		res = adcli_enroll_show_computers (enroll, (const char **)names,
+		                                   print_bulk_result, &report);
+		if (res != ADCLI_SUCCESS) {
+			if (report.failed) {
+				warnx ("couldn't find %d of %d computer accounts in %s domain",
+				       report.failed, _adcli_strv_len (names),
+				       adcli_conn_get_domain_name (conn));
+			} else {
+				warnx ("couldn't read computer accounts in %s domain: %s",
+				       adcli_conn_get_domain_name (conn),
+				       adcli_get_last_error ());
+			}
+		}
+		_adcli_strv_free (names);
 		adcli_enroll_unref (enroll);
 		return -res;
 	}
@@ -1109,7 +1485,7 @@ adcli_tool_computer_show (adcli_conn *conn,
 		parse_fqdn_or_name (enroll, argv[0]);
 	}
 
-	res = adcli_enroll_read_computer_account (enroll, 0);
+	res = adcli_enroll_read_computer_account (enroll, flags);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't read data for %s: %s",
 		       adcli_enroll_get_host_fqdn (enroll) != NULL
@@ -1132,6 +1508,184 @@ adcli_tool_computer_show (adcli_conn *conn,
 	return 0;
 }
 
+typedef struct {
+	adcli_stale_flags flags;
+	int failed;
+} StaleReport;
+
+static void
+print_stale_account (const char *computer_dn,
+                     const char *computer_sam,
+                     time_t last_used,
+                     adcli_result result,
+                     void *data)
+{
+	StaleReport *report = data;
+	const char *status;
+	char date[32];
+	struct tm tm;
+
+	if (last_used == 0 || gmtime_r (&last_used, &tm) == NULL ||
+	    strftime (date, sizeof (date), "%Y-%m-%d", &tm) == 0)
+		strcpy (date, "never");
+
+	if (result != ADCLI_SUCCESS) {
+		warnx ("%s", adcli_get_last_error ());
+		status = "failed";
+		report->failed++;
+	} else if (report->flags & ADCLI_STALE_DELETE) {
+		status = report->flags & ADCLI_STALE_DRY_RUN ? "would-delete" : "deleted";
+	} else if (report->flags & ADCLI_STALE_DISABLE) {
+		status = report->flags & ADCLI_STALE_DRY_RUN ? "would-disable" : "disabled";
+	} else {
+		status = "stale";
+	}
+
+	printf ("%s\t%s\t%s\t%s\n", computer_sam ? computer_sam : "",
+	        date, status, computer_dn);
+}
+
+/*
+ * Anything shorter than this would catch computers that are in use,
+ * since lastLogonTimestamp is only replicated every 9 to 14 days.
+ */
+#define STALE_MIN_MAX_AGE 30
+#define STALE_MAX_MAX_AGE (100 * 365)
+
+int
+adcli_tool_computer_stale (adcli_conn *conn,
+                           int argc,
+                           char *argv[])
+{
+	StaleReport report = { 0, 0 };
+	adcli_enroll *enroll;
+	adcli_result res;
+	unsigned int max_age = 90;
+	unsigned long value;
+	char *endptr;
+	int password_opt = 0;
+	int opt;
+
+	struct option options[] = {
+		{ "domain", required_argument, NULL, opt_domain },
+		{ "domain-realm", required_argument, NULL, opt_domain_realm },
+		{ "domain-controller", required_argument, NULL, opt_domain_controller },
+		{ "domain-ou", required_argument, NULL, opt_domain_ou },
+		{ "use-ldaps", no_argument, 0, opt_use_ldaps },
+		{ "login-user", required_argument, NULL, opt_login_user },
+		{ "login-ccache", optional_argument, NULL, opt_login_ccache },
+		{ "no-password", no_argument, 0, opt_no_password },
+		{ "stdin-password", no_argument, 0, opt_stdin_password },
+		{ "prompt-password", no_argument, 0, opt_prompt_password },
+		{ "max-age", required_argument, NULL, opt_max_age },
+		{ "delete", no_argument, NULL, opt_delete },
+		{ "disable", no_argument, NULL, opt_disable },
+		{ "dry-run", no_argument, NULL, opt_dry_run },
+		{ "verbose", no_argument, NULL, opt_verbose },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+
+	static adcli_tool_desc usages[] = {
+		{ 0, "usage: adcli stale-computers --domain=xxxx [--max-age=days] [--delete|--disable]" },
+		{ 0 },
+	};
+
+	enroll = adcli_enroll_new (conn);
+	if (enroll == NULL) {
+		warnx ("unexpected memory problems");
+		return -1;
+	}
+
+	while ((opt = adcli_tool_getopt (argc, argv, options)) != -1) {
+		switch (opt) {
+		case opt_max_age:
+			/* strtoul() would quietly wrap a negative number around */
+			errno = 0;
+			value = optarg[0] == '-' ? 0 : strtoul (optarg, &endptr, 10);
+			if (optarg[0] == '-' || errno != 0 || *endptr != '\0' ||
+			    endptr == optarg || value > STALE_MAX_MAX_AGE) {
+				warnx ("failure to parse value '%s' of option 'max-age'; "
+				       "expecting a positive integer indicating the age in days",
+				       optarg);
+				adcli_enroll_unref (enroll);
+				return EUSAGE;
+			}
+			if (value < STALE_MIN_MAX_AGE) {
+				warnx ("--max-age must be at least %d days, lastLogonTimestamp "
+				       "is only replicated every couple of weeks", STALE_MIN_MAX_AGE);
+				adcli_enroll_unref (enroll);
+				return EUSAGE;
+			}
+			max_age = value;
+			break;
+		case opt_delete:
+		case opt_disable:
+			if (report.flags & (ADCLI_STALE_DELETE | ADCLI_STALE_DISABLE)) {
+				warnx ("cannot use both --delete and --disable");
+				adcli_enroll_unref (enroll);
+				return EUSAGE;
+			}
+			report.flags |= opt == opt_delete ? ADCLI_STALE_DELETE : ADCLI_STALE_DISABLE;
+			break;
+		case opt_dry_run:
+			report.flags |= ADCLI_STALE_DRY_RUN;
+			break;
+		case 'h':
+		case '?':
+		case ':':
+			adcli_tool_usage (options, usages);
+			adcli_tool_usage (options, common_usages);
+			adcli_enroll_unref (enroll);
+			return opt == 'h' ? 0 : 2;
+		default:
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
+			if (res != ADCLI_SUCCESS) {
+				adcli_enroll_unref (enroll);
+				return res;
+			}
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0) {
+		warnx ("extra arguments specified");
+		adcli_enroll_unref (enroll);
+		return EUSAGE;
+	}
+
+	adcli_conn_set_allowed_login_types (conn, ADCLI_LOGIN_USER_ACCOUNT);
+
+	res = adcli_conn_connect (conn);
+	if (res != ADCLI_SUCCESS) {
+		warnx ("couldn't connect to %s domain: %s",
+		       adcli_conn_get_domain_name (conn),
+		       adcli_get_last_error ());
+		adcli_enroll_unref (enroll);
+		return -res;
+	}
+
+	res = adcli_enroll_stale_accounts (enroll, max_age, report.flags,
+	                                   print_stale_account, &report);
+	if (res != ADCLI_SUCCESS) {
+		if (report.failed)
+			warnx ("couldn't clean up %d stale computer accounts in %s domain",
+			       report.failed, adcli_conn_get_domain_name (conn));
+		else
+			warnx ("searching for stale computer accounts in %s domain failed: %s",
+			       adcli_conn_get_domain_name (conn),
+			       adcli_get_last_error ());
+		adcli_enroll_unref (enroll);
+		return -res;
+	}
+
+	adcli_enroll_unref (enroll);
+	return 0;
+}
+
 int
 adcli_tool_computer_managed_service_account (adcli_conn *conn,
                                              int argc,
@@ -1141,6 +1695,7 @@ adcli_tool_computer_managed_service_account (adcli_conn *conn,
 	adcli_result res;
 	int show_password = 0;
 	int details = 0;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -1195,7 +1750,7 @@ adcli_tool_computer_managed_service_account (adcli_conn *conn,
 			adcli_enroll_unref (enroll);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn, enroll);
+			res = parse_option ((Option)opt, optarg, conn, enroll, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_enroll_unref (enroll);
 				return res;
@@ -1235,6 +1790,8 @@ adcli_tool_computer_managed_service_account (adcli_conn *conn,
 		/* ignored */
 	}
 
+	adcli_enroll_plan_password (enroll, 0);
+
 	res = adcli_conn_connect (conn);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't connect to %s domain: %s",
@@ -29,7 +29,9 @@
 #include "tools.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 
 typedef enum {
@@ -55,6 +57,13 @@ typedef enum {
 	opt_unix_shell,
 	opt_nis_domain,
 	opt_use_ldaps,
+	opt_member_file,
+	opt_allow_empty,
+	opt_search_type,
+	opt_search_filter,
+	opt_search_format,
+	opt_page_size,
+	opt_sort,
 } Option;
 
 static adcli_tool_desc common_usages[] = {
@@ -66,6 +75,15 @@ static adcli_tool_desc common_usages[] = {
 	{ opt_unix_gid, "unix gid number" },
 	{ opt_unix_shell, "unix shell" },
 	{ opt_nis_domain, "NIS domain" },
+	{ opt_member_file, "file with the wanted group members, one per line,\n"
+	                   "use '-' to read them from stdin" },
+	{ opt_allow_empty, "remove all members when no members are given" },
+	{ opt_search_type, "type of entries to search for: computer, user\n"
+	                   "or group" },
+	{ opt_search_filter, "LDAP filter for the entries to search for" },
+	{ opt_search_format, "output format: ldif, tsv or json" },
+	{ opt_page_size, "number of entries to retrieve per page" },
+	{ opt_sort, "attribute to have the server sort the results by" },
 	{ opt_domain, "active directory domain name" },
 	{ opt_domain_realm, "kerberos realm for the domain" },
 	{ opt_domain_controller, "domain directory server to connect to" },
@@ -87,11 +105,13 @@ static adcli_tool_desc common_usages[] = {
 static int
 parse_option (Option opt,
               const char *optarg,
-              adcli_conn *conn)
+              adcli_conn *conn,
+              int *password_opt)
 {
-	static int no_password = 0;
-	static int prompt_password = 0;
-	static int stdin_password = 0;
+	/* Which password option this command was given, if any */
+	int no_password = (*password_opt == opt_no_password);
+	int prompt_password = (*password_opt == opt_prompt_password);
+	int stdin_password = (*password_opt == opt_stdin_password);
 
 	switch (opt) {
 	case opt_login_ccache:
@@ -116,7 +136,7 @@ parse_option (Option opt,
 			return EUSAGE;
 		} else {
 			adcli_conn_set_password_func (conn, NULL, NULL, NULL);
-			no_password = 1;
+			*password_opt = opt_no_password;
 		}
 		return ADCLI_SUCCESS;
 	case opt_prompt_password:
@@ -126,7 +146,7 @@ parse_option (Option opt,
 			return EUSAGE;
 		} else {
 			adcli_conn_set_password_func (conn, adcli_prompt_password_func, NULL, NULL);
-			prompt_password = 1;
+			*password_opt = opt_prompt_password;
 		}
 		return ADCLI_SUCCESS;
 	case opt_stdin_password:
@@ -136,7 +156,7 @@ parse_option (Option opt,
 			return EUSAGE;
 		} else {
 			adcli_conn_set_password_func (conn, adcli_read_password_func, NULL, NULL);
-			stdin_password = 1;
+			*password_opt = opt_stdin_password;
 		}
 		return ADCLI_SUCCESS;
 	case opt_use_ldaps:
@@ -162,6 +182,7 @@ adcli_tool_user_create (adcli_conn *conn,
 	adcli_result res;
 	adcli_attrs *attrs;
 	const char *ou = NULL;
+	int password_opt = 0;
 	int opt;
 	bool has_unix_attr = false;
 	bool has_nis_domain = false;
@@ -235,7 +256,7 @@ adcli_tool_user_create (adcli_conn *conn,
 			adcli_attrs_free (attrs);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn);
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_attrs_free (attrs);
 				return res;
@@ -307,6 +328,7 @@ adcli_tool_user_delete (adcli_conn *conn,
 {
 	adcli_result res;
 	adcli_entry *entry;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -338,7 +360,7 @@ adcli_tool_user_delete (adcli_conn *conn,
 			adcli_tool_usage (options, common_usages);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn);
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				return res;
 			}
@@ -393,6 +415,7 @@ adcli_tool_user_passwd (adcli_conn *conn,
 {
 	adcli_result res;
 	adcli_entry *entry;
+	int password_opt = 0;
 	int opt;
 	char *user_pwd = NULL;
 
@@ -425,7 +448,7 @@ adcli_tool_user_passwd (adcli_conn *conn,
 			adcli_tool_usage (options, common_usages);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn);
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				return res;
 			}
@@ -449,6 +472,8 @@ adcli_tool_user_passwd (adcli_conn *conn,
 
 	adcli_conn_set_allowed_login_types (conn, ADCLI_LOGIN_USER_ACCOUNT);
 
+	adcli_entry_plan_passwd (entry);
+
 	res = adcli_conn_connect (conn);
 	if (res != ADCLI_SUCCESS) {
 		warnx ("couldn't connect to %s domain: %s",
@@ -493,6 +518,7 @@ adcli_tool_group_create (adcli_conn *conn,
 	adcli_result res;
 	adcli_attrs *attrs;
 	const char *ou = NULL;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -535,7 +561,7 @@ adcli_tool_group_create (adcli_conn *conn,
 			adcli_attrs_free (attrs);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn);
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				adcli_attrs_free (attrs);
 				return res;
@@ -597,6 +623,7 @@ adcli_tool_group_delete (adcli_conn *conn,
 {
 	adcli_result res;
 	adcli_entry *entry;
+	int password_opt = 0;
 	int opt;
 
 	struct option options[] = {
@@ -628,7 +655,7 @@ adcli_tool_group_delete (adcli_conn *conn,
 			adcli_tool_usage (options, common_usages);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn);
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				return res;
 			}
@@ -677,10 +704,9 @@ adcli_tool_group_delete (adcli_conn *conn,
 }
 
 static int
-expand_user_dn_as_member (adcli_conn *conn,
-                          adcli_attrs *attrs,
-                          const char *user,
-                          int adding)
+lookup_member_dn (adcli_conn *conn,
+                  const char *user,
+                  char **member_dn)
 {
 	adcli_entry *entry;
 	adcli_result res;
@@ -694,7 +720,7 @@ expand_user_dn_as_member (adcli_conn *conn,
 		       user, adcli_conn_get_domain_name (conn),
 		       adcli_get_last_error ());
 		adcli_entry_unref (entry);
-		return -res;
+		return res;
 	}
 
 	dn = adcli_entry_get_dn (entry);
@@ -702,15 +728,39 @@ expand_user_dn_as_member (adcli_conn *conn,
 		warnx ("couldn't found user %s in domain %s",
 		       user, adcli_conn_get_domain_name (conn));
 		adcli_entry_unref (entry);
-		return -ADCLI_ERR_CONFIG;
+		return ADCLI_ERR_CONFIG;
 	}
 
+	*member_dn = strdup (dn);
+	adcli_entry_unref (entry);
+
+	if (*member_dn == NULL) {
+		warnx ("unexpected memory problems");
+		return ADCLI_ERR_UNEXPECTED;
+	}
+
+	return ADCLI_SUCCESS;
+}
+
+static int
+expand_user_dn_as_member (adcli_conn *conn,
+                          adcli_attrs *attrs,
+                          const char *user,
+                          int adding)
+{
+	adcli_result res;
+	char *dn;
+
+	res = lookup_member_dn (conn, user, &dn);
+	if (res != ADCLI_SUCCESS)
+		return -res;
+
 	if (adding)
 		adcli_attrs_add1 (attrs, "member", dn);
 	else
 		adcli_attrs_delete1 (attrs, "member", dn);
 
-	adcli_entry_unref (entry);
+	free (dn);
 
 	return ADCLI_SUCCESS;
 }
@@ -723,6 +773,7 @@ adcli_tool_member_add (adcli_conn *conn,
 	adcli_result res;
 	adcli_entry *entry;
 	adcli_attrs *attrs;
+	int password_opt = 0;
 	int opt;
 	int i;
 
@@ -756,7 +807,7 @@ adcli_tool_member_add (adcli_conn *conn,
 			adcli_tool_usage (options, common_usages);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn);
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				return res;
 			}
@@ -825,6 +876,7 @@ adcli_tool_member_remove (adcli_conn *conn,
 	adcli_result res;
 	adcli_entry *entry;
 	adcli_attrs *attrs;
+	int password_opt = 0;
 	int opt;
 	int i;
 
@@ -857,7 +909,7 @@ adcli_tool_member_remove (adcli_conn *conn,
 			adcli_tool_usage (options, common_usages);
 			return opt == 'h' ? 0 : 2;
 		default:
-			res = parse_option ((Option)opt, optarg, conn);
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
 			if (res != ADCLI_SUCCESS) {
 				return res;
 			}
@@ -917,3 +969,650 @@ adcli_tool_member_remove (adcli_conn *conn,
 
 	return 0;
 }
+
+static adcli_result
+add_member_dn (adcli_conn *conn,
+               char ***dns,
+               int *length,
+               const char *member)
+{
+	adcli_result res;
+	char *dn;
+
+	/* Distinguished names are used as is, saving a lookup per member */
+	if (strchr (member, '=') != NULL) {
+		dn = strdup (member);
+		if (dn == NULL) {
+			warnx ("unexpected memory problems");
+			return ADCLI_ERR_UNEXPECTED;
+		}
+	} else {
+		res = lookup_member_dn (conn, member, &dn);
+		if (res != ADCLI_SUCCESS)
+			return res;
+	}
+
+	*dns = _adcli_strv_add (*dns, dn, length);
+	return ADCLI_SUCCESS;
+}
+
+static adcli_result
+read_member_file (adcli_conn *conn,
+                  const char *filename,
+                  char ***dns,
+                  int *length)
+{
+	adcli_result res = ADCLI_SUCCESS;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *file;
+
+	if (strcmp (filename, "-") == 0) {
+		file = stdin;
+	} else {
+		file = fopen (filename, "r");
+		if (file == NULL) {
+			warn ("couldn't open member file: %s", filename);
+			return ADCLI_ERR_FAIL;
+		}
+	}
+
+	while (res == ADCLI_SUCCESS && (len = getline (&line, &size, file)) != -1) {
+		while (len > 0 && isspace ((unsigned char)line[len - 1]))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		res = add_member_dn (conn, dns, length, line);
+	}
+
+	if (res == ADCLI_SUCCESS && ferror (file)) {
+		warn ("couldn't read member file: %s", filename);
+		res = ADCLI_ERR_FAIL;
+	}
+
+	free (line);
+	if (file != stdin)
+		fclose (file);
+
+	return res;
+}
+
+int
+adcli_tool_member_sync (adcli_conn *conn,
+                        int argc,
+                        char *argv[])
+{
+	adcli_result res;
+	adcli_entry *entry;
+	const char *member_file = NULL;
+	bool allow_empty = false;
+	char **dns = NULL;
+	int length = 0;
+	int password_opt = 0;
+	int opt;
+	int i;
+
+	struct option options[] = {
+		{ "member-file", required_argument, NULL, opt_member_file },
+		{ "allow-empty", no_argument, NULL, opt_allow_empty },
+		{ "domain", required_argument, NULL, opt_domain },
+		{ "domain-realm", required_argument, NULL, opt_domain_realm },
+		{ "domain-controller", required_argument, NULL, opt_domain_controller },
+		{ "use-ldaps", no_argument, 0, opt_use_ldaps },
+		{ "login-user", required_argument, NULL, opt_login_user },
+		{ "login-ccache", optional_argument, NULL, opt_login_ccache },
+		{ "no-password", no_argument, 0, opt_no_password },
+		{ "stdin-password", no_argument, 0, opt_stdin_password },
+		{ "prompt-password", no_argument, 0, opt_prompt_password },
+		{ "verbose", no_argument, NULL, opt_verbose },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+
+	static adcli_tool_desc usages[] = {
+		{ 0, "usage: adcli sync-members --domain=xxxx group user ..." },
+		{ 0, "       adcli sync-members --domain=xxxx --member-file=members.txt group" },
+		{ 0 },
+	};
+
+	while ((opt = adcli_tool_getopt (argc, argv, options)) != -1) {
+		switch (opt) {
+		case opt_member_file:
+			member_file = optarg;
+			break;
+		case opt_allow_empty:
+			allow_empty = true;
+			break;
+		case 'h':
+		case '?':
+		case ':':
+			adcli_tool_usage (options, usages);
+			adcli_tool_usage (options, common_usages);
+			return opt == 'h' ? 0 : 2;
+		default:
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
+			if (res != ADCLI_SUCCESS) {
+				return res;
+			}
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || (argc < 2 && member_file == NULL)) {
+		warnx ("specify a group name and its members or a member file");
+		return 2;
+	}
+
+	entry = adcli_entry_new_group (conn, argv[0]);
+	if (entry == NULL) {
+		warnx ("unexpected memory problems");
+		return -1;
+	}
+
+	adcli_conn_set_allowed_login_types (conn, ADCLI_LOGIN_USER_ACCOUNT);
+
+	res = adcli_conn_connect (conn);
+	if (res != ADCLI_SUCCESS) {
+		warnx ("couldn't connect to %s domain: %s",
+		       adcli_conn_get_domain_name (conn),
+		       adcli_get_last_error ());
+		adcli_entry_unref (entry);
+		return -res;
+	}
+
+	for (i = 1; res == ADCLI_SUCCESS && i < argc; i++)
+		res = add_member_dn (conn, &dns, &length, argv[i]);
+	if (res == ADCLI_SUCCESS && member_file != NULL)
+		res = read_member_file (conn, member_file, &dns, &length);
+
+	if (res != ADCLI_SUCCESS) {
+		_adcli_strv_free (dns);
+		adcli_entry_unref (entry);
+		return -res;
+	}
+
+	/* An empty file or a broken pipe must not empty the group */
+	if (length == 0 && !allow_empty) {
+		warnx ("no members were given for group %s, use --allow-empty "
+		       "to remove all of its members", argv[0]);
+		adcli_entry_unref (entry);
+		return EUSAGE;
+	}
+
+	res = adcli_entry_sync_members (entry, (const char **)dns);
+	if (res != ADCLI_SUCCESS) {
+		warnx ("synchronizing members of group %s in domain %s failed: %s",
+		       adcli_entry_get_sam_name (entry),
+		       adcli_conn_get_domain_name (conn),
+		       adcli_get_last_error ());
+		_adcli_strv_free (dns);
+		adcli_entry_unref (entry);
+		return -res;
+	}
+
+	_adcli_strv_free (dns);
+	adcli_entry_unref (entry);
+
+	return 0;
+}
+
+typedef enum {
+	FORMAT_LDIF,
+	FORMAT_TSV,
+	FORMAT_JSON,
+} SearchFormat;
+
+typedef struct {
+	SearchFormat format;
+	char **attrs;
+	int count;
+} SearchOutput;
+
+static const char BASE64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void
+print_base64 (const unsigned char *data,
+              size_t len)
+{
+	unsigned int bits;
+	size_t i;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		bits = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+		putchar (BASE64[bits >> 18 & 0x3f]);
+		putchar (BASE64[bits >> 12 & 0x3f]);
+		putchar (BASE64[bits >> 6 & 0x3f]);
+		putchar (BASE64[bits & 0x3f]);
+	}
+
+	if (i < len) {
+		bits = data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0);
+		putchar (BASE64[bits >> 18 & 0x3f]);
+		putchar (BASE64[bits >> 12 & 0x3f]);
+		putchar (i + 1 < len ? BASE64[bits >> 6 & 0x3f] : '=');
+		putchar ('=');
+	}
+}
+
+/* Valid UTF-8 without any NUL, so that it can be shown as a string */
+static int
+is_text_value (const char *value,
+               size_t len)
+{
+	const unsigned char *at = (const unsigned char *)value;
+	const unsigned char *end = at + len;
+	int follow;
+
+	while (at < end) {
+		if (*at == 0)
+			return 0;
+		else if (*at < 0x80)
+			follow = 0;
+		else if (*at >= 0xc2 && *at <= 0xdf)
+			follow = 1;
+		else if (*at >= 0xe0 && *at <= 0xef)
+			follow = 2;
+		else if (*at >= 0xf0 && *at <= 0xf4)
+			follow = 3;
+		else
+			return 0;
+		for (at++; follow > 0; follow--, at++) {
+			if (at == end || (*at & 0xc0) != 0x80)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void
+print_ldif_value (const char *name,
+                  const char *value,
+                  size_t len)
+{
+	const unsigned char *at;
+	const unsigned char *end;
+	int safe;
+
+	/* See RFC 2849 for the SAFE-INIT-CHAR and SAFE-CHAR rules */
+	at = (const unsigned char *)value;
+	end = at + len;
+	safe = (len == 0 || (at[0] != ' ' && at[0] != ':' && at[0] != '<'));
+	for (; safe && at < end; at++) {
+		if (*at == 0 || *at > 127 || *at == '\n' || *at == '\r')
+			safe = 0;
+	}
+	if (safe && len > 0 && value[len - 1] == ' ')
+		safe = 0;
+
+	if (safe) {
+		printf ("%s: %.*s\n", name, (int)len, value);
+	} else {
+		printf ("%s:: ", name);
+		print_base64 ((const unsigned char *)value, len);
+		putchar ('\n');
+	}
+}
+
+static void
+print_tsv_value (const char *value,
+                 size_t len)
+{
+	const unsigned char *at;
+	const unsigned char *end;
+	int text;
+
+	/* Control characters, and all of binary values, as \xNN */
+	text = is_text_value (value, len);
+	end = (const unsigned char *)value + len;
+	for (at = (const unsigned char *)value; at < end; at++) {
+		switch (*at) {
+		case '\t':
+			fputs ("\\t", stdout);
+			break;
+		case '\n':
+			fputs ("\\n", stdout);
+			break;
+		case '\r':
+			fputs ("\\r", stdout);
+			break;
+		case '\\':
+			fputs ("\\\\", stdout);
+			break;
+		default:
+			if (*at < 0x20 || *at == 0x7f || (!text && *at > 0x7f))
+				printf ("\\x%02x", *at);
+			else
+				putchar (*at);
+			break;
+		}
+	}
+}
+
+static void
+print_json_value (const char *value,
+                  size_t len)
+{
+	/* Binary values can't be a JSON string, so they're base64 objects */
+	if (is_text_value (value, len)) {
+		adcli_tool_print_json_bytes (stdout, value, len);
+	} else {
+		fputs ("{\"base64\":\"", stdout);
+		print_base64 ((const unsigned char *)value, len);
+		fputs ("\"}", stdout);
+	}
+}
+
+static adcli_result
+print_search_entry (LDAP *ldap,
+                    LDAPMessage *entry,
+                    void *data)
+{
+	SearchOutput *output = data;
+	struct berval **values;
+	char *dn;
+	int i, j;
+
+	dn = ldap_get_dn (ldap, entry);
+	if (dn == NULL)
+		return ADCLI_ERR_UNEXPECTED;
+
+	switch (output->format) {
+	case FORMAT_LDIF:
+		print_ldif_value ("dn", dn, strlen (dn));
+		break;
+	case FORMAT_TSV:
+		print_tsv_value (dn, strlen (dn));
+		break;
+	case FORMAT_JSON:
+		fputs ("{\"dn\":", stdout);
+		print_json_value (dn, strlen (dn));
+		break;
+	}
+
+	ldap_memfree (dn);
+
+	for (i = 0; i < output->count; i++) {
+		values = ldap_get_values_len (ldap, entry, output->attrs[i]);
+
+		switch (output->format) {
+		case FORMAT_LDIF:
+			for (j = 0; values && values[j]; j++)
+				print_ldif_value (output->attrs[i], values[j]->bv_val, values[j]->bv_len);
+			break;
+		case FORMAT_TSV:
+			putchar ('\t');
+			for (j = 0; values && values[j]; j++) {
+				if (j > 0)
+					putchar (';');
+				print_tsv_value (values[j]->bv_val, values[j]->bv_len);
+			}
+			break;
+		case FORMAT_JSON:
+			if (values == NULL)
+				break;
+			putchar (',');
+			adcli_tool_print_json_string (stdout, output->attrs[i]);
+			fputs (":[", stdout);
+			for (j = 0; values[j]; j++) {
+				if (j > 0)
+					putchar (',');
+				print_json_value (values[j]->bv_val, values[j]->bv_len);
+			}
+			putchar (']');
+			break;
+		}
+
+		if (values)
+			ldap_value_free_len (values);
+	}
+
+	switch (output->format) {
+	case FORMAT_LDIF:
+		putchar ('\n');
+		break;
+	case FORMAT_TSV:
+		putchar ('\n');
+		break;
+	case FORMAT_JSON:
+		fputs ("}\n", stdout);
+		break;
+	}
+
+	if (ferror (stdout)) {
+		_adcli_err ("Couldn't write search results: %s", strerror (errno));
+		return ADCLI_ERR_FAIL;
+	}
+
+	return ADCLI_SUCCESS;
+}
+
+/*
+ * The filter is given without parentheses as a convenience. It has to be
+ * a single expression, so it can't break out of the one for --type.
+ * Parentheses within values are always escaped as \28 and \29.
+ */
+static char *
+parse_search_filter (const char *filter)
+{
+	const char *at;
+	char *result;
+	int depth = 0;
+
+	if (filter[0] != '(') {
+		if (asprintf (&result, "(%s)", filter) < 0)
+			return_val_if_reached (NULL);
+	} else {
+		result = strdup (filter);
+		return_val_if_fail (result != NULL, NULL);
+	}
+
+	for (at = result; *at != '\0'; at++) {
+		if (*at == '(')
+			depth++;
+		else if (*at == ')')
+			depth--;
+		if (depth < 0 || (depth == 0 && at[1] != '\0'))
+			break;
+	}
+
+	if (depth != 0 || *at != '\0' || result[1] == ')') {
+		free (result);
+		return NULL;
+	}
+
+	return result;
+}
+
+int
+adcli_tool_entry_search (adcli_conn *conn,
+                         int argc,
+                         char *argv[])
+{
+	const char *computer_attrs[] = { "sAMAccountName", "dNSHostName", "operatingSystem", "pwdLastSet", NULL };
+	const char *default_attrs[] = { "sAMAccountName", NULL };
+	SearchOutput output = { FORMAT_LDIF, NULL, 0 };
+	LDAPSortKey **sort_keys = NULL;
+	LDAPControl *sort_control = NULL;
+	const char **type_attrs = default_attrs;
+	const char *type_filter = NULL;
+	const char *filter = NULL;
+	const char *sort = NULL;
+	const char *base = NULL;
+	char *search_filter;
+	char *expr;
+	int page_size = 500;
+	adcli_result res;
+	char *end;
+	LDAP *ldap;
+	int password_opt = 0;
+	int opt;
+	int i;
+
+	struct option options[] = {
+		{ "type", required_argument, NULL, opt_search_type },
+		{ "filter", required_argument, NULL, opt_search_filter },
+		{ "format", required_argument, NULL, opt_search_format },
+		{ "page-size", required_argument, NULL, opt_page_size },
+		{ "sort", required_argument, NULL, opt_sort },
+		{ "domain", required_argument, NULL, opt_domain },
+		{ "domain-realm", required_argument, NULL, opt_domain_realm },
+		{ "domain-controller", required_argument, NULL, opt_domain_controller },
+		{ "domain-ou", required_argument, NULL, opt_domain_ou },
+		{ "use-ldaps", no_argument, 0, opt_use_ldaps },
+		{ "login-user", required_argument, NULL, opt_login_user },
+		{ "login-ccache", optional_argument, NULL, opt_login_ccache },
+		{ "no-password", no_argument, 0, opt_no_password },
+		{ "stdin-password", no_argument, 0, opt_stdin_password },
+		{ "prompt-password", no_argument, 0, opt_prompt_password },
+		{ "verbose", no_argument, NULL, opt_verbose },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+
+	static adcli_tool_desc usages[] = {
+		{ 0, "usage: adcli search --domain=xxxx --type=computer [attribute ...]" },
+		{ 0 },
+	};
+
+	while ((opt = adcli_tool_getopt (argc, argv, options)) != -1) {
+		switch (opt) {
+		case opt_search_type:
+			if (strcmp (optarg, "computer") == 0) {
+				type_filter = "(objectClass=computer)";
+				type_attrs = computer_attrs;
+			} else if (strcmp (optarg, "user") == 0) {
+				type_filter = "(&(objectCategory=person)(objectClass=user))";
+			} else if (strcmp (optarg, "group") == 0) {
+				type_filter = "(objectClass=group)";
+			} else {
+				warnx ("invalid --type argument: %s", optarg);
+				return EUSAGE;
+			}
+			break;
+		case opt_search_filter:
+			filter = optarg;
+			break;
+		case opt_search_format:
+			if (strcmp (optarg, "ldif") == 0) {
+				output.format = FORMAT_LDIF;
+			} else if (strcmp (optarg, "tsv") == 0) {
+				output.format = FORMAT_TSV;
+			} else if (strcmp (optarg, "json") == 0) {
+				output.format = FORMAT_JSON;
+			} else {
+				warnx ("invalid --format argument: %s", optarg);
+				return EUSAGE;
+			}
+			break;
+		case opt_page_size:
+			page_size = strtol (optarg, &end, 10);
+			if (*end != '\0' || page_size <= 0) {
+				warnx ("invalid --page-size argument: %s", optarg);
+				return EUSAGE;
+			}
+			break;
+		case opt_sort:
+			sort = optarg;
+			break;
+		case opt_domain_ou:
+			base = optarg;
+			break;
+		case 'h':
+		case '?':
+		case ':':
+			adcli_tool_usage (options, usages);
+			adcli_tool_usage (options, common_usages);
+			return opt == 'h' ? 0 : 2;
+		default:
+			res = parse_option ((Option)opt, optarg, conn, &password_opt);
+			if (res != ADCLI_SUCCESS) {
+				return res;
+			}
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 0) {
+		output.attrs = argv;
+		output.count = argc;
+	} else {
+		output.attrs = (char **)type_attrs;
+		output.count = _adcli_strv_len (output.attrs);
+	}
+
+	if (filter) {
+		expr = parse_search_filter (filter);
+		if (expr == NULL) {
+			warnx ("invalid --filter argument: %s", filter);
+			return EUSAGE;
+		}
+		if (type_filter) {
+			if (asprintf (&search_filter, "(&%s%s)", type_filter, expr) < 0)
+				return_val_if_reached (-1);
+			free (expr);
+		} else {
+			search_filter = expr;
+		}
+	} else {
+		search_filter = strdup (type_filter ? type_filter : "(objectClass=*)");
+		return_val_if_fail (search_filter != NULL, -1);
+	}
+
+	adcli_conn_set_allowed_login_types (conn, ADCLI_LOGIN_USER_ACCOUNT);
+
+	res = adcli_conn_connect (conn);
+	if (res != ADCLI_SUCCESS) {
+		warnx ("couldn't connect to %s domain: %s",
+		       adcli_conn_get_domain_name (conn),
+		       adcli_get_last_error ());
+		free (search_filter);
+		return -res;
+	}
+
+	ldap = adcli_conn_get_ldap_connection (conn);
+	if (base == NULL)
+		base = adcli_conn_get_default_naming_context (conn);
+
+	if (sort != NULL) {
+		if (ldap_create_sort_keylist (&sort_keys, (char *)sort) != LDAP_SUCCESS ||
+		    ldap_create_sort_control (ldap, sort_keys, 0, &sort_control) != LDAP_SUCCESS) {
+			warnx ("invalid --sort argument: %s", sort);
+			ldap_free_sort_keylist (sort_keys);
+			free (search_filter);
+			return EUSAGE;
+		}
+		ldap_free_sort_keylist (sort_keys);
+	}
+
+	if (output.format == FORMAT_TSV) {
+		fputs ("dn", stdout);
+		for (i = 0; i < output.count; i++)
+			printf ("\t%s", output.attrs[i]);
+		putchar ('\n');
+	}
+
+	res = _adcli_ldap_search_paged (ldap, base, LDAP_SCOPE_SUB, search_filter,
+	                                output.attrs, page_size, sort_control,
+	                                print_search_entry, &output);
+
+	ldap_control_free (sort_control);
+	free (search_filter);
+
+	if (res != ADCLI_SUCCESS) {
+		warnx ("searching in domain %s failed: %s",
+		       adcli_conn_get_domain_name (conn),
+		       adcli_get_last_error ());
+		return -res;
+	}
+
+	return 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * adcli
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Runs a command many times with a given concurrency, and reports the
+ * throughput and latency distribution as JSON. Any %n in the command
+ * arguments is replaced with the run number, so that each run can use
+ * its own computer name.
+ */
+
+#include "config.h"
+
+#include "tools.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+	pid_t pid;
+	double started;
+} running;
+
+static double
+now_clock (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static char *
+substitute_run (const char *arg,
+                int run)
+{
+	char number[16];
+	const char *at;
+	char *result;
+	size_t len;
+
+	snprintf (number, sizeof (number), "%d", run);
+
+	result = malloc (strlen (arg) * strlen (number) + 1);
+	if (result == NULL)
+		errx (1, "out of memory");
+
+	for (len = 0, at = arg; *at != '\0'; at++) {
+		if (at[0] == '%' && at[1] == 'n') {
+			memcpy (result + len, number, strlen (number));
+			len += strlen (number);
+			at++;
+		} else {
+			result[len++] = *at;
+		}
+	}
+
+	result[len] = '\0';
+	return result;
+}
+
+static pid_t
+spawn_run (char **command,
+           int run,
+           int quiet)
+{
+	char **argv;
+	pid_t pid;
+	int fd;
+	int i;
+
+	pid = fork ();
+	if (pid < 0)
+		err (1, "couldn't fork");
+	if (pid > 0)
+		return pid;
+
+	for (i = 0; command[i] != NULL; i++);
+	argv = calloc (i + 1, sizeof (char *));
+	if (argv == NULL)
+		_exit (127);
+	for (i = 0; command[i] != NULL; i++)
+		argv[i] = substitute_run (command[i], run);
+
+	if (quiet) {
+		fd = open ("/dev/null", O_RDWR);
+		if (fd >= 0) {
+			dup2 (fd, STDOUT_FILENO);
+			dup2 (fd, STDERR_FILENO);
+			close (fd);
+		}
+	}
+
+	execvp (argv[0], argv);
+	_exit (127);
+}
+
+static int
+compare_double (const void *a,
+                const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+static double
+percentile (double *sorted,
+            int count,
+            double fraction)
+{
+	int index;
+
+	if (count == 0)
+		return 0;
+
+	/* Nearest rank */
+	index = (int)(fraction * count + 0.999999) - 1;
+	if (index < 0)
+		index = 0;
+	if (index >= count)
+		index = count - 1;
+	return sorted[index];
+}
+
+static void
+usage (int code)
+{
+	FILE *out = code == 0 ? stdout : stderr;
+
+	fprintf (out, "usage: adcli-load [--count=N] [--concurrency=N] [--verbose] -- command [args...]\n");
+	fprintf (out, "  --count=N              Total number of runs (default 100)\n");
+	fprintf (out, "  --concurrency=N        Runs in flight at once (default 10)\n");
+	fprintf (out, "  --verbose              Don't discard the output of each run\n");
+	fprintf (out, "A %%n in the command arguments is replaced with the run number.\n");
+	exit (code);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	running *slots;
+	double *latencies;
+	double started;
+	double elapsed;
+	int concurrency = 10;
+	int count = 100;
+	int verbose = 0;
+	int completed = 0;
+	int failures = 0;
+	int launched = 0;
+	int active = 0;
+	long number;
+	int status;
+	pid_t pid;
+	int opt;
+	int i;
+
+	enum {
+		opt_count = 1,
+		opt_concurrency,
+		opt_verbose,
+		opt_help,
+	};
+
+	struct option options[] = {
+		{ "count", required_argument, NULL, opt_count },
+		{ "concurrency", required_argument, NULL, opt_concurrency },
+		{ "verbose", no_argument, NULL, opt_verbose },
+		{ "help", no_argument, NULL, opt_help },
+		{ 0 },
+	};
+
+	while ((opt = getopt_long (argc, argv, "+", options, NULL)) != -1) {
+		switch (opt) {
+		case opt_count:
+			if (!adcli_tool_parse_number (optarg, 1, INT_MAX, &number))
+				errx (2, "invalid count: %s", optarg);
+			count = number;
+			break;
+		case opt_concurrency:
+			if (!adcli_tool_parse_number (optarg, 1, INT_MAX, &number))
+				errx (2, "invalid concurrency: %s", optarg);
+			concurrency = number;
+			break;
+		case opt_verbose:
+			verbose = 1;
+			break;
+		case opt_help:
+			usage (0);
+			break;
+		default:
+			usage (2);
+			break;
+		}
+	}
+
+	if (optind >= argc || count <= 0 || concurrency <= 0)
+		usage (2);
+
+	slots = calloc (concurrency, sizeof (running));
+	latencies = calloc (count, sizeof (double));
+	if (slots == NULL || latencies == NULL)
+		errx (1, "out of memory");
+
+	started = now_clock ();
+
+	while (completed < count) {
+		while (active < concurrency && launched < count) {
+			for (i = 0; slots[i].pid != 0; i++);
+			slots[i].started = now_clock ();
+			slots[i].pid = spawn_run (argv + optind, launched, !verbose);
+			launched++;
+			active++;
+		}
+
+		pid = waitpid (-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			err (1, "couldn't wait for run");
+		}
+
+		for (i = 0; i < concurrency && slots[i].pid != pid; i++);
+		if (i == concurrency)
+			continue;
+
+		latencies[completed++] = now_clock () - slots[i].started;
+		if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+			failures++;
+		slots[i].pid = 0;
+		active--;
+	}
+
+	elapsed = now_clock () - started;
+	qsort (latencies, count, sizeof (double), compare_double);
+
+	printf ("{\"command\": ");
+	adcli_tool_print_json_string (stdout, argv[optind]);
+	printf (", \"runs\": %d, \"concurrency\": %d, \"failures\": %d, "
+	        "\"elapsed\": %.3f, \"throughput\": %.2f, \"latency_ms\": "
+	        "{\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+	        count, concurrency, failures, elapsed,
+	        elapsed > 0 ? count / elapsed : 0,
+	        latencies[0] * 1000, percentile (latencies, count, 0.50) * 1000,
+	        percentile (latencies, count, 0.90) * 1000,
+	        percentile (latencies, count, 0.99) * 1000,
+	        latencies[count - 1] * 1000);
+
+	free (slots);
+	free (latencies);
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,1619 @@
+/*
+ * adcli
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ *
+ */
+
+/*
+ * A local stand-in for a set of domain controllers. Each simulated DC
+ * answers NetLogon pings over CLDAP and LDAP on its own address, with
+ * optional injected latency and request loss. A DNS responder can answer
+ * the _ldap._tcp SRV and host address lookups for the domain.
+ *
+ * With --samba a Samba AD domain controller is provisioned and run as the
+ * directory, KDC and kpasswd service behind all the simulated DCs. Samba
+ * keeps the directory and the Kerberos principals in one database, so
+ * that accounts created over LDAP can log in, like in AD. All other LDAP
+ * traffic, and Kerberos and kpasswd traffic on ports 88 and 464, is relayed
+ * to it with the latency and loss of the simulated DC it arrived at.
+ */
+
+#include "config.h"
+
+#include "tools.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <lber.h>
+#include <limits.h>
+#include <ldap.h>
+#include <poll.h>
+#include <resolv.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DCS 32
+#define MAX_CONNS 256
+#define MAX_RELAYS 256
+#define MAX_MESSAGE 8192
+
+/* Stop reading from one side while this much is waiting for the other */
+#define MAX_BUFFERED (1024 * 1024)
+
+/* How long a relayed Kerberos datagram waits for its reply */
+#define RELAY_TIMEOUT 30
+
+/* How long Samba may take to start answering */
+#define SAMBA_TIMEOUT 120
+
+/* NETLOGON_SAM_LOGON_RESPONSE_EX flags for a healthy writable DC */
+#define STANDIN_DS_FLAGS 0x0003f3fd
+
+#define STANDIN_HOST_NAME "standin"
+#define STANDIN_ADMIN_PASSWORD "Stand-in-Passw0rd"
+
+enum {
+	SERVICE_LDAP,
+	SERVICE_KDC,
+	SERVICE_KPASSWD,
+	N_SERVICES
+};
+
+/* Where each service listens on Samba, the KDC ports are fixed for clients */
+static const int service_ports[N_SERVICES] = { 389, 88, 464 };
+
+typedef struct {
+	char *address;
+	char *host_name;
+	int latency;
+	int loss;
+	int udp_fds[N_SERVICES];
+	int tcp_fds[N_SERVICES];
+	struct in_addr in;
+	unsigned long requests;
+	unsigned long dropped;
+	unsigned long replied;
+	unsigned long relayed;
+} standin_dc;
+
+typedef struct {
+	unsigned char *data;
+	size_t length;
+	size_t allocated;
+} standin_buffer;
+
+typedef struct {
+	int fd;
+	int backend;
+	standin_dc *dc;
+	int service;
+	int relaying;
+	int connecting;
+	int dropped;
+	int closing;
+	int replied;
+	size_t queued;
+	unsigned char input[MAX_MESSAGE];
+	size_t length;
+	standin_buffer to_client;
+	standin_buffer to_backend;
+} standin_conn;
+
+typedef struct {
+	int fd;
+	int listener;
+	standin_dc *dc;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	double expires;
+} standin_relay;
+
+/* A reply held back for the latency of a domain controller */
+typedef struct _pending {
+	int fd;
+	standin_conn *conn;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	unsigned char *data;
+	size_t length;
+	double due;
+	struct _pending *next;
+} pending;
+
+enum {
+	POLLED_CLDAP,
+	POLLED_DATAGRAM,
+	POLLED_LISTEN,
+	POLLED_DNS,
+	POLLED_CLIENT,
+	POLLED_BACKEND,
+	POLLED_RELAY,
+};
+
+typedef struct {
+	int kind;
+	int service;
+	void *ptr;
+} polled;
+
+#define MAX_POLLED (MAX_DCS * N_SERVICES * 2 + 1 + MAX_CONNS * 2 + MAX_RELAYS)
+
+static struct {
+	standin_dc dcs[MAX_DCS];
+	int n_dcs;
+	const char *domain;
+	const char *site;
+	const char *dns_address;
+	int dns_port;
+	int dns_fd;
+	int port;
+	pending *queue;
+	standin_conn conns[MAX_CONNS];
+	standin_relay relays[MAX_RELAYS];
+
+	/* The Samba domain controller behind the simulated ones */
+	const char *samba_address;
+	struct in_addr samba_in;
+	char *samba_dir;
+	int samba_dir_given;
+	const char *admin_password;
+	pid_t samba_pid;
+} gl = {
+	.site = "Default-First-Site-Name",
+	.dns_port = 53,
+	.dns_fd = -1,
+	.port = 389,
+	.admin_password = STANDIN_ADMIN_PASSWORD,
+	.samba_pid = -1,
+};
+
+static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t child_exited = 0;
+
+static double
+now_clock (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static void
+on_signal (int signo)
+{
+	quit = 1;
+}
+
+static void
+on_child (int signo)
+{
+	child_exited = 1;
+}
+
+static int
+bind_socket (const char *address,
+             int port,
+             int type)
+{
+	struct sockaddr_in sin;
+	int one = 1;
+	int fd;
+
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons (port);
+	if (inet_pton (AF_INET, address, &sin.sin_addr) != 1)
+		errx (2, "invalid IPv4 address: %s", address);
+
+	fd = socket (AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err (1, "couldn't create socket");
+	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	if (bind (fd, (struct sockaddr *)&sin, sizeof (sin)) < 0)
+		err (1, "couldn't bind to %s:%d", address, port);
+	if (type == SOCK_STREAM && listen (fd, 128) < 0)
+		err (1, "couldn't listen on %s:%d", address, port);
+
+	return fd;
+}
+
+static int
+connect_samba (int service,
+               int type,
+               int *connecting)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons (service_ports[service]);
+	sin.sin_addr = gl.samba_in;
+
+	fd = socket (AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		warn ("couldn't create socket");
+		return -1;
+	}
+
+	*connecting = 0;
+	if (connect (fd, (struct sockaddr *)&sin, sizeof (sin)) < 0) {
+		if (errno != EINPROGRESS) {
+			close (fd);
+			return -1;
+		}
+		*connecting = 1;
+	}
+
+	return fd;
+}
+
+static void
+buffer_append (standin_buffer *buffer,
+               const unsigned char *data,
+               size_t length)
+{
+	size_t allocated;
+	void *memory;
+
+	if (buffer->length + length > buffer->allocated) {
+		allocated = buffer->allocated ? buffer->allocated : 4096;
+		while (allocated < buffer->length + length)
+			allocated *= 2;
+		memory = realloc (buffer->data, allocated);
+		if (memory == NULL)
+			errx (1, "out of memory");
+		buffer->data = memory;
+		buffer->allocated = allocated;
+	}
+
+	memcpy (buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
+
+static int
+buffer_write (int fd,
+              standin_buffer *buffer)
+{
+	ssize_t ret;
+
+	/* Only called when poll() said the socket can take more */
+	ret = send (fd, buffer->data, buffer->length, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+	memmove (buffer->data, buffer->data + ret, buffer->length - ret);
+	buffer->length -= ret;
+	return 1;
+}
+
+static void
+buffer_clear (standin_buffer *buffer)
+{
+	free (buffer->data);
+	buffer->data = NULL;
+	buffer->length = 0;
+	buffer->allocated = 0;
+}
+
+static void
+queue_reply (int fd,
+             standin_conn *conn,
+             struct sockaddr_storage *peer,
+             socklen_t peer_len,
+             unsigned char *data,
+             size_t length,
+             int latency)
+{
+	pending *reply;
+	pending **at;
+
+	reply = calloc (1, sizeof (pending));
+	if (reply == NULL)
+		errx (1, "out of memory");
+
+	reply->fd = fd;
+	reply->conn = conn;
+	if (peer_len > 0)
+		memcpy (&reply->peer, peer, peer_len);
+	reply->peer_len = peer_len;
+	reply->data = data;
+	reply->length = length;
+	reply->due = now_clock () + (double)latency / 1000.0;
+
+	if (conn)
+		conn->queued += length;
+
+	/* Keep the queue ordered by due time */
+	for (at = &gl.queue; *at != NULL && (*at)->due <= reply->due; at = &(*at)->next);
+	reply->next = *at;
+	*at = reply;
+}
+
+static void
+flush_replies (void)
+{
+	pending *reply;
+	double now;
+
+	now = now_clock ();
+	while (gl.queue != NULL && gl.queue->due <= now) {
+		reply = gl.queue;
+		gl.queue = reply->next;
+
+		/*
+		 * Stream replies go out when poll() says the connection can take
+		 * them, a datagram that doesn't fit in the socket buffer is lost.
+		 */
+		if (reply->conn) {
+			buffer_append (&reply->conn->to_client, reply->data, reply->length);
+			reply->conn->queued -= reply->length;
+		} else if (sendto (reply->fd, reply->data, reply->length,
+		                   MSG_NOSIGNAL | MSG_DONTWAIT,
+		                   (struct sockaddr *)&reply->peer, reply->peer_len) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				warn ("couldn't send reply");
+		}
+
+		free (reply->data);
+		free (reply);
+	}
+}
+
+static int
+put_name (unsigned char *buffer,
+          size_t length,
+          size_t *offset,
+          const char *name,
+          unsigned char **dnptrs,
+          unsigned char **lastdnptr)
+{
+	int n;
+
+	n = dn_comp (name, buffer + *offset, length - *offset,
+	             dnptrs, lastdnptr);
+	if (n < 0)
+		return 0;
+	*offset += n;
+	return 1;
+}
+
+static char *
+short_name (const char *name)
+{
+	char *result;
+	size_t i;
+
+	result = strndup (name, strcspn (name, "."));
+	if (result == NULL)
+		errx (1, "out of memory");
+	for (i = 0; result[i] != '\0'; i++)
+		result[i] = toupper ((unsigned char)result[i]);
+	return result;
+}
+
+static void
+put_32_le (unsigned char *buffer,
+           size_t *offset,
+           unsigned int value)
+{
+	buffer[(*offset)++] = value & 0xff;
+	buffer[(*offset)++] = (value >> 8) & 0xff;
+	buffer[(*offset)++] = (value >> 16) & 0xff;
+	buffer[(*offset)++] = (value >> 24) & 0xff;
+}
+
+static size_t
+build_netlogon (standin_dc *dc,
+                unsigned char *buffer,
+                size_t length)
+{
+	unsigned char *dnptrs[16];
+	unsigned char guid[16];
+	char *domain_short;
+	char *host_short;
+	size_t offset;
+	int ok;
+
+	memset (guid, 0, sizeof (guid));
+	memcpy (guid, &dc->in, sizeof (dc->in));
+
+	/* Compression pointers are relative to the start of the blob */
+	dnptrs[0] = buffer;
+	dnptrs[1] = NULL;
+
+	offset = 0;
+	put_32_le (buffer, &offset, 23);        /* LOGON_SAM_LOGON_RESPONSE_EX */
+	put_32_le (buffer, &offset, STANDIN_DS_FLAGS);
+	memcpy (buffer + offset, guid, sizeof (guid));
+	offset += sizeof (guid);
+
+	domain_short = short_name (gl.domain);
+	host_short = short_name (dc->host_name);
+
+	ok = put_name (buffer, length, &offset, gl.domain, dnptrs, dnptrs + 16) &&     /* forest */
+	     put_name (buffer, length, &offset, gl.domain, dnptrs, dnptrs + 16) &&     /* domain */
+	     put_name (buffer, length, &offset, dc->host_name, dnptrs, dnptrs + 16) &&
+	     put_name (buffer, length, &offset, domain_short, dnptrs, dnptrs + 16) &&
+	     put_name (buffer, length, &offset, host_short, dnptrs, dnptrs + 16) &&
+	     put_name (buffer, length, &offset, "", dnptrs, dnptrs + 16) &&           /* user */
+	     put_name (buffer, length, &offset, gl.site, dnptrs, dnptrs + 16) &&      /* server site */
+	     put_name (buffer, length, &offset, gl.site, dnptrs, dnptrs + 16) &&      /* client site */
+	     length - offset >= 8;
+
+	free (domain_short);
+	free (host_short);
+
+	if (!ok)
+		return 0;
+
+	/* NtVersion 5, then the LMNT and LM20 tokens */
+	put_32_le (buffer, &offset, 5);
+	put_32_le (buffer, &offset, 0xffffffff);
+	return offset;
+}
+
+static ber_tag_t
+parse_request (unsigned char *packet,
+               size_t length,
+               ber_int_t *msgid,
+               int *ping)
+{
+	struct berval request;
+	struct berval attr;
+	BerElement *ber;
+	ber_tag_t tag;
+	ber_len_t len;
+	char *last;
+
+	request.bv_val = (char *)packet;
+	request.bv_len = length;
+	ber = ber_init (&request);
+	if (ber == NULL)
+		return LBER_ERROR;
+	if (ber_scanf (ber, "{it", msgid, &tag) == LBER_ERROR)
+		tag = LBER_ERROR;
+
+	/* Without a directory behind us, every search is a NetLogon ping */
+	*ping = (tag == LDAP_REQ_SEARCH && gl.samba_address == NULL);
+
+	/* Otherwise only searches asking for the Netlogon attribute */
+	if (tag == LDAP_REQ_SEARCH && !*ping &&
+	    ber_scanf (ber, "{xxxxxxx") != LBER_ERROR) {
+		for (tag = ber_first_element (ber, &len, &last); tag != LBER_DEFAULT;
+		     tag = ber_next_element (ber, &len, last)) {
+			if (ber_scanf (ber, "m", &attr) == LBER_ERROR)
+				break;
+			if (attr.bv_len == 8 && strncasecmp (attr.bv_val, "Netlogon", 8) == 0)
+				*ping = 1;
+		}
+		tag = LDAP_REQ_SEARCH;
+	}
+
+	ber_free (ber, 1);
+	return tag;
+}
+
+static void
+answer_ping (standin_dc *dc,
+             int fd,
+             standin_conn *conn,
+             struct sockaddr_storage *peer,
+             socklen_t peer_len,
+             ber_int_t msgid)
+{
+	unsigned char netlogon[512];
+	struct berval *entry = NULL;
+	struct berval *done = NULL;
+	struct berval value;
+	BerElement *ber;
+	unsigned char *data;
+
+	dc->requests++;
+	if (dc->loss > 0 && (rand () % 100) < dc->loss) {
+		dc->dropped++;
+		return;
+	}
+
+	value.bv_val = (char *)netlogon;
+	value.bv_len = build_netlogon (dc, netlogon, sizeof (netlogon));
+	if (value.bv_len == 0)
+		errx (1, "couldn't build NetLogon response for %s", dc->host_name);
+
+	ber = ber_alloc_t (LBER_USE_DER);
+	if (ber == NULL ||
+	    ber_printf (ber, "{it{s{{s[O]}}}}", msgid, LDAP_RES_SEARCH_ENTRY,
+	                "", "Netlogon", &value) < 0 ||
+	    ber_flatten (ber, &entry) < 0)
+		errx (1, "couldn't encode search entry");
+	ber_free (ber, 1);
+
+	ber = ber_alloc_t (LBER_USE_DER);
+	if (ber == NULL ||
+	    ber_printf (ber, "{it{ess}}", msgid, LDAP_RES_SEARCH_RESULT,
+	                LDAP_SUCCESS, "", "") < 0 ||
+	    ber_flatten (ber, &done) < 0)
+		errx (1, "couldn't encode search result");
+	ber_free (ber, 1);
+
+	/* Like AD, send the entry and the result in a single datagram */
+	data = malloc (entry->bv_len + done->bv_len);
+	if (data == NULL)
+		errx (1, "out of memory");
+	memcpy (data, entry->bv_val, entry->bv_len);
+	memcpy (data + entry->bv_len, done->bv_val, done->bv_len);
+
+	dc->replied++;
+	queue_reply (fd, conn, peer, peer_len, data,
+	             entry->bv_len + done->bv_len, dc->latency);
+
+	ber_bvfree (entry);
+	ber_bvfree (done);
+}
+
+static void
+handle_cldap (standin_dc *dc)
+{
+	unsigned char packet[4096];
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	ber_int_t msgid;
+	ssize_t len;
+	int ping;
+
+	peer_len = sizeof (peer);
+	len = recvfrom (dc->udp_fds[SERVICE_LDAP], packet, sizeof (packet), 0,
+	                (struct sockaddr *)&peer, &peer_len);
+
+	/* CLDAP is only used for pings */
+	if (len > 0 &&
+	    parse_request (packet, len, &msgid, &ping) == LDAP_REQ_SEARCH)
+		answer_ping (dc, dc->udp_fds[SERVICE_LDAP], NULL, &peer, peer_len, msgid);
+}
+
+static void
+close_relay (standin_relay *relay)
+{
+	close (relay->fd);
+	relay->fd = -1;
+}
+
+static void
+handle_datagram (standin_dc *dc,
+                 int service)
+{
+	unsigned char packet[MAX_MESSAGE];
+	struct sockaddr_storage peer;
+	standin_relay *relay;
+	socklen_t peer_len;
+	int connecting;
+	ssize_t len;
+	int i;
+
+	peer_len = sizeof (peer);
+	len = recvfrom (dc->udp_fds[service], packet, sizeof (packet), 0,
+	                (struct sockaddr *)&peer, &peer_len);
+	if (len <= 0)
+		return;
+
+	dc->requests++;
+	if (dc->loss > 0 && (rand () % 100) < dc->loss) {
+		dc->dropped++;
+		return;
+	}
+
+	for (i = 0; i < MAX_RELAYS && gl.relays[i].fd >= 0; i++);
+	if (i == MAX_RELAYS) {
+		warnx ("too many datagrams in flight");
+		dc->dropped++;
+		return;
+	}
+
+	/* Each request gets its own socket, so the reply finds its way back */
+	relay = gl.relays + i;
+	relay->fd = connect_samba (service, SOCK_DGRAM, &connecting);
+	if (relay->fd < 0)
+		return;
+	relay->listener = dc->udp_fds[service];
+	relay->dc = dc;
+	memcpy (&relay->peer, &peer, peer_len);
+	relay->peer_len = peer_len;
+	relay->expires = now_clock () + RELAY_TIMEOUT;
+
+	if (send (relay->fd, packet, len, MSG_DONTWAIT) < 0)
+		close_relay (relay);
+}
+
+static void
+handle_relay (standin_relay *relay)
+{
+	unsigned char packet[MAX_MESSAGE];
+	unsigned char *data;
+	ssize_t len;
+
+	len = recv (relay->fd, packet, sizeof (packet), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (len > 0) {
+		data = malloc (len);
+		if (data == NULL)
+			errx (1, "out of memory");
+		memcpy (data, packet, len);
+		relay->dc->replied++;
+		queue_reply (relay->listener, NULL, &relay->peer, relay->peer_len,
+		             data, len, relay->dc->latency);
+	}
+
+	close_relay (relay);
+}
+
+static ssize_t
+message_length (unsigned char *data,
+                size_t length)
+{
+	size_t header;
+	size_t value;
+	int n;
+
+	/* The BER header of the outer LDAPMessage sequence */
+	if (length < 2)
+		return 0;
+	if (data[0] != 0x30)
+		return -1;
+	if (data[1] < 0x80) {
+		header = 2;
+		value = data[1];
+	} else {
+		n = data[1] & 0x7f;
+		if (n == 0 || n > 4)
+			return -1;
+		if (length < 2 + (size_t)n)
+			return 0;
+		header = 2 + n;
+		for (value = 0; n > 0; n--)
+			value = (value << 8) | data[header - n];
+	}
+
+	if (header + value > MAX_MESSAGE)
+		return -1;
+	if (length < header + value)
+		return 0;
+	return header + value;
+}
+
+static void
+close_conn (standin_conn *conn)
+{
+	pending **at;
+	pending *reply;
+
+	/* Drop any replies still queued for this connection */
+	for (at = &gl.queue; *at != NULL; ) {
+		reply = *at;
+		if (reply->conn == conn) {
+			*at = reply->next;
+			free (reply->data);
+			free (reply);
+		} else {
+			at = &reply->next;
+		}
+	}
+
+	close (conn->fd);
+	if (conn->backend >= 0)
+		close (conn->backend);
+	buffer_clear (&conn->to_client);
+	buffer_clear (&conn->to_backend);
+	memset (conn, 0, sizeof (standin_conn));
+	conn->fd = -1;
+	conn->backend = -1;
+}
+
+static int
+start_relaying (standin_conn *conn)
+{
+	conn->backend = connect_samba (conn->service, SOCK_STREAM, &conn->connecting);
+	if (conn->backend < 0) {
+		warnx ("couldn't connect to samba at %s", gl.samba_address);
+		return 0;
+	}
+
+	/* From here on bytes are passed along without looking at them */
+	conn->relaying = 1;
+	buffer_append (&conn->to_backend, conn->input, conn->length);
+	conn->length = 0;
+	return 1;
+}
+
+static void
+handle_ldap_input (standin_conn *conn)
+{
+	ber_int_t msgid;
+	ber_tag_t tag;
+	ssize_t len;
+	int ping;
+
+	for (;;) {
+		len = message_length (conn->input, conn->length);
+
+		/* Pings are small, anything else large goes to the directory */
+		if (len < 0) {
+			if (!gl.samba_address || !start_relaying (conn))
+				close_conn (conn);
+			return;
+		} else if (len == 0) {
+			return;
+		}
+
+		tag = parse_request (conn->input, len, &msgid, &ping);
+		if (ping) {
+			answer_ping (conn->dc, conn->fd, conn, NULL, 0, msgid);
+
+		} else if (tag == LDAP_REQ_UNBIND) {
+			close_conn (conn);
+			return;
+
+		/* The first other request hands the connection to the directory */
+		} else if (gl.samba_address) {
+			conn->dc->relayed++;
+			if (!start_relaying (conn))
+				close_conn (conn);
+			return;
+		}
+
+		memmove (conn->input, conn->input + len, conn->length - len);
+		conn->length -= len;
+	}
+}
+
+static void
+handle_client (standin_conn *conn)
+{
+	unsigned char data[MAX_MESSAGE];
+	ssize_t count;
+
+	if (conn->relaying || conn->dropped)
+		count = read (conn->fd, data, sizeof (data));
+	else
+		count = read (conn->fd, conn->input + conn->length,
+		              sizeof (conn->input) - conn->length);
+
+	if (count < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (count <= 0) {
+		close_conn (conn);
+		return;
+	}
+
+	if (conn->dropped)
+		return;
+
+	if (conn->relaying) {
+		buffer_append (&conn->to_backend, data, count);
+	} else {
+		conn->length += count;
+		handle_ldap_input (conn);
+	}
+}
+
+static void
+handle_backend (standin_conn *conn)
+{
+	unsigned char data[MAX_MESSAGE];
+	unsigned char *copy;
+	ssize_t count;
+
+	count = read (conn->backend, data, sizeof (data));
+	if (count < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	/* Samba is done, close once the replies have gone out */
+	if (count <= 0) {
+		close (conn->backend);
+		conn->backend = -1;
+		conn->closing = 1;
+		return;
+	}
+
+	if (!conn->replied && conn->service != SERVICE_LDAP)
+		conn->dc->replied++;
+	conn->replied = 1;
+
+	copy = malloc (count);
+	if (copy == NULL)
+		errx (1, "out of memory");
+	memcpy (copy, data, count);
+	queue_reply (-1, conn, NULL, 0, copy, count, conn->dc->latency);
+}
+
+static void
+handle_connected (standin_conn *conn)
+{
+	socklen_t len;
+	int error = 0;
+
+	len = sizeof (error);
+	if (getsockopt (conn->backend, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+		warnx ("couldn't connect to samba at %s: %s", gl.samba_address,
+		       strerror (error ? error : errno));
+		close_conn (conn);
+		return;
+	}
+
+	conn->connecting = 0;
+}
+
+static void
+accept_client (standin_dc *dc,
+               int service)
+{
+	standin_conn *conn;
+	int fd;
+	int i;
+
+	fd = accept4 (dc->tcp_fds[service], NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < MAX_CONNS && gl.conns[i].fd >= 0; i++);
+	if (i == MAX_CONNS) {
+		warnx ("too many connections");
+		close (fd);
+		return;
+	}
+
+	conn = gl.conns + i;
+	conn->fd = fd;
+	conn->dc = dc;
+	conn->service = service;
+
+	if (service == SERVICE_LDAP)
+		return;
+
+	/* A Kerberos connection carries one request, and may be lost as a whole */
+	dc->requests++;
+	if (dc->loss > 0 && (rand () % 100) < dc->loss) {
+		dc->dropped++;
+		conn->dropped = 1;
+	} else if (!start_relaying (conn)) {
+		close_conn (conn);
+	}
+}
+
+static int
+is_srv_name (const char *name)
+{
+	char buffer[NS_MAXDNAME];
+
+	snprintf (buffer, sizeof (buffer), "_ldap._tcp.%s", gl.domain);
+	if (strcasecmp (name, buffer) == 0)
+		return 1;
+	snprintf (buffer, sizeof (buffer), "_ldap._tcp.dc._msdcs.%s", gl.domain);
+	if (strcasecmp (name, buffer) == 0)
+		return 1;
+	snprintf (buffer, sizeof (buffer), "_ldap._tcp.%s._sites.%s", gl.site, gl.domain);
+	if (strcasecmp (name, buffer) == 0)
+		return 1;
+	snprintf (buffer, sizeof (buffer), "_ldap._tcp.%s._sites.dc._msdcs.%s", gl.site, gl.domain);
+	return strcasecmp (name, buffer) == 0;
+}
+
+static int
+put_answer (unsigned char *buffer,
+            size_t length,
+            size_t *offset,
+            const char *name,
+            int type,
+            unsigned char **dnptrs,
+            unsigned char **lastdnptr)
+{
+	if (!put_name (buffer, length, offset, name, dnptrs, lastdnptr) ||
+	    length - *offset < 10)
+		return 0;
+	ns_put16 (type, buffer + *offset);
+	ns_put16 (ns_c_in, buffer + *offset + 2);
+	ns_put32 (600, buffer + *offset + 4);
+	/* The rdlength is filled in by the caller */
+	*offset += 10;
+	return 1;
+}
+
+static void
+handle_dns (void)
+{
+	unsigned char query[512];
+	unsigned char *answer;
+	unsigned char *dnptrs[64];
+	char name[NS_MAXDNAME];
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	size_t length = 4096;
+	size_t offset;
+	size_t rdata;
+	HEADER *header;
+	int qtype;
+	int count;
+	ssize_t len;
+	int n;
+	int i;
+
+	peer_len = sizeof (peer);
+	len = recvfrom (gl.dns_fd, query, sizeof (query), 0,
+	                (struct sockaddr *)&peer, &peer_len);
+	if (len < (ssize_t)sizeof (HEADER))
+		return;
+
+	header = (HEADER *)query;
+	if (header->qr || ntohs (header->qdcount) != 1)
+		return;
+
+	n = dn_expand (query, query + len, query + sizeof (HEADER), name, sizeof (name));
+	if (n < 0 || sizeof (HEADER) + n + 4 > (size_t)len)
+		return;
+	qtype = ns_get16 (query + sizeof (HEADER) + n);
+
+	answer = calloc (1, length);
+	if (answer == NULL)
+		errx (1, "out of memory");
+
+	/* Echo the header and question */
+	offset = sizeof (HEADER) + n + 4;
+	memcpy (answer, query, offset);
+	header = (HEADER *)answer;
+	header->qr = 1;
+	header->aa = 1;
+	header->ra = 1;
+	header->rcode = NOERROR;
+	header->arcount = 0;
+	header->nscount = 0;
+
+	dnptrs[0] = answer;
+	dnptrs[1] = answer + sizeof (HEADER);
+	dnptrs[2] = NULL;
+
+	count = 0;
+	for (i = 0; i < gl.n_dcs; i++) {
+		if (qtype == ns_t_srv && is_srv_name (name)) {
+			if (!put_answer (answer, length, &offset, name, ns_t_srv, dnptrs, dnptrs + 64) ||
+			    length - offset < 6)
+				break;
+			rdata = offset;
+			ns_put16 (0, answer + offset);
+			ns_put16 (100, answer + offset + 2);
+			ns_put16 (gl.port, answer + offset + 4);
+			offset += 6;
+			if (!put_name (answer, length, &offset, gl.dcs[i].host_name, dnptrs, dnptrs + 64))
+				break;
+			ns_put16 (offset - rdata, answer + rdata - 2);
+			count++;
+
+		} else if (qtype == ns_t_a && strcasecmp (name, gl.dcs[i].host_name) == 0) {
+			if (!put_answer (answer, length, &offset, name, ns_t_a, dnptrs, dnptrs + 64) ||
+			    length - offset < 4)
+				break;
+			ns_put16 (4, answer + offset - 2);
+			memcpy (answer + offset, &gl.dcs[i].in, 4);
+			offset += 4;
+			count++;
+		}
+	}
+
+	header->ancount = htons (count);
+	if (count == 0 && !is_srv_name (name)) {
+		for (i = 0; i < gl.n_dcs; i++) {
+			if (strcasecmp (name, gl.dcs[i].host_name) == 0)
+				break;
+		}
+		if (i == gl.n_dcs)
+			header->rcode = NXDOMAIN;
+	}
+
+	queue_reply (gl.dns_fd, NULL, &peer, peer_len, answer, offset, 0);
+}
+
+static int
+run_command (char **argv)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork ();
+	if (pid < 0)
+		err (1, "couldn't fork");
+
+	/* Keep our stdout for the report */
+	if (pid == 0) {
+		dup2 (STDERR_FILENO, STDOUT_FILENO);
+		execvp (argv[0], argv);
+		warn ("couldn't run %s", argv[0]);
+		_exit (127);
+	}
+
+	while (waitpid (pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			err (1, "couldn't wait for %s", argv[0]);
+	}
+
+	return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+static char *
+samba_config (void)
+{
+	char *config;
+
+	if (asprintf (&config, "%s/etc/smb.conf", gl.samba_dir) < 0)
+		errx (1, "out of memory");
+	return config;
+}
+
+static void
+provision_samba (void)
+{
+	char *domain_short;
+	char *interfaces;
+	char *argv[24];
+	char *config;
+	char *realm;
+	char *spn;
+	int n;
+	int i;
+
+	config = samba_config ();
+
+	/* A directory given with --samba-dir is provisioned once, then reused */
+	if (access (config, F_OK) != 0) {
+		realm = strdup (gl.domain);
+		domain_short = short_name (gl.domain);
+		if (realm == NULL ||
+		    asprintf (&interfaces, "--option=interfaces = %s", gl.samba_address) < 0)
+			errx (1, "out of memory");
+		for (i = 0; realm[i] != '\0'; i++)
+			realm[i] = toupper ((unsigned char)realm[i]);
+		if (strlen (domain_short) > 15)
+			domain_short[15] = '\0';
+
+		n = 0;
+		argv[n++] = "samba-tool";
+		argv[n++] = "domain";
+		argv[n++] = "provision";
+		argv[n++] = "--server-role=dc";
+		argv[n++] = "--dns-backend=NONE";
+		argv[n++] = "--realm";
+		argv[n++] = realm;
+		argv[n++] = "--domain";
+		argv[n++] = domain_short;
+		argv[n++] = "--host-name=" STANDIN_HOST_NAME;
+		argv[n++] = "--adminpass";
+		argv[n++] = (char *)gl.admin_password;
+		argv[n++] = "--targetdir";
+		argv[n++] = gl.samba_dir;
+		argv[n++] = interfaces;
+		argv[n++] = "--option=bind interfaces only = yes";
+		argv[n++] = "--option=server services = ldap, kdc";
+		argv[n] = NULL;
+
+		if (!run_command (argv))
+			errx (1, "couldn't provision a samba domain controller in %s", gl.samba_dir);
+
+		free (interfaces);
+		free (domain_short);
+		free (realm);
+	}
+
+	/*
+	 * Clients ask for tickets to the simulated DCs by name, so each is an
+	 * alias of the Samba DC. Adding one fails harmlessly when the directory
+	 * is reused and the alias is already there.
+	 */
+	for (i = 0; i < gl.n_dcs; i++) {
+		if (asprintf (&spn, "ldap/%s", gl.dcs[i].host_name) < 0)
+			errx (1, "out of memory");
+
+		n = 0;
+		argv[n++] = "samba-tool";
+		argv[n++] = "spn";
+		argv[n++] = "add";
+		argv[n++] = spn;
+		argv[n++] = STANDIN_HOST_NAME "$";
+		argv[n++] = "--configfile";
+		argv[n++] = config;
+		argv[n] = NULL;
+
+		run_command (argv);
+		free (spn);
+	}
+
+	free (config);
+}
+
+static int
+samba_listening (void)
+{
+	struct sockaddr_in sin;
+	int service;
+	int ret;
+	int fd;
+
+	/* Only a local address, so a plain connect answers right away */
+	for (service = 0; service < N_SERVICES; service++) {
+		memset (&sin, 0, sizeof (sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons (service_ports[service]);
+		sin.sin_addr = gl.samba_in;
+
+		fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			err (1, "couldn't create socket");
+		ret = connect (fd, (struct sockaddr *)&sin, sizeof (sin));
+		close (fd);
+		if (ret < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+start_samba (void)
+{
+	struct timespec pause = { 0, 500 * 1000 * 1000 };
+	double until;
+	char *config;
+	int status;
+
+	config = samba_config ();
+
+	gl.samba_pid = fork ();
+	if (gl.samba_pid < 0)
+		err (1, "couldn't fork");
+
+	if (gl.samba_pid == 0) {
+		dup2 (STDERR_FILENO, STDOUT_FILENO);
+		execlp ("samba", "samba", "--interactive", "--configfile", config, NULL);
+		warn ("couldn't run samba");
+		_exit (127);
+	}
+
+	free (config);
+
+	until = now_clock () + SAMBA_TIMEOUT;
+	while (!samba_listening ()) {
+		if (waitpid (gl.samba_pid, &status, WNOHANG) == gl.samba_pid) {
+			gl.samba_pid = -1;
+			errx (1, "samba exited before it was ready");
+		}
+		if (now_clock () > until)
+			errx (1, "samba didn't start listening on %s", gl.samba_address);
+		nanosleep (&pause, NULL);
+	}
+
+	fprintf (stderr, "adcli-standin: samba for %s is ready at %s, "
+	         "the Administrator password is %s\n",
+	         gl.domain, gl.samba_address, gl.admin_password);
+}
+
+static int
+remove_path (const char *path,
+             const struct stat *sb,
+             int flag,
+             struct FTW *ftw)
+{
+	if (remove (path) < 0)
+		warn ("couldn't remove %s", path);
+	return 0;
+}
+
+static void
+stop_samba (void)
+{
+	int status;
+
+	if (gl.samba_pid > 0) {
+		kill (gl.samba_pid, SIGTERM);
+		while (waitpid (gl.samba_pid, &status, 0) < 0 && errno == EINTR);
+		gl.samba_pid = -1;
+	}
+
+	if (gl.samba_dir && !gl.samba_dir_given)
+		nftw (gl.samba_dir, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static long
+parse_option (const char *value,
+              const char *what,
+              long minimum,
+              long maximum)
+{
+	long number;
+
+	if (!adcli_tool_parse_number (value, minimum, maximum, &number))
+		errx (2, "invalid %s: %s", what, value);
+	return number;
+}
+
+static void
+parse_dc (const char *spec)
+{
+	standin_dc *dc;
+	char *copy;
+	char *latency;
+	char *loss;
+	int i;
+
+	if (gl.n_dcs == MAX_DCS)
+		errx (2, "too many domain controllers");
+
+	copy = strdup (spec);
+	if (copy == NULL)
+		errx (1, "out of memory");
+
+	/* ADDRESS[,LATENCY_MS[,LOSS_PERCENT]] */
+	latency = strchr (copy, ',');
+	if (latency)
+		*(latency++) = '\0';
+	loss = latency ? strchr (latency, ',') : NULL;
+	if (loss)
+		*(loss++) = '\0';
+
+	dc = gl.dcs + gl.n_dcs;
+	dc->address = copy;
+	dc->latency = latency ? parse_option (latency, "latency", 0, 3600000) : 0;
+	dc->loss = loss ? parse_option (loss, "loss", 0, 100) : 0;
+	for (i = 0; i < N_SERVICES; i++) {
+		dc->udp_fds[i] = -1;
+		dc->tcp_fds[i] = -1;
+	}
+	if (inet_pton (AF_INET, copy, &dc->in) != 1)
+		errx (2, "invalid IPv4 address: %s", copy);
+
+	gl.n_dcs++;
+}
+
+static void
+usage (int code)
+{
+	FILE *out = code == 0 ? stdout : stderr;
+
+	fprintf (out, "usage: adcli-standin --domain=DOMAIN --dc=ADDRESS[,LATENCY_MS[,LOSS_PERCENT]] ...\n");
+	fprintf (out, "  --domain=DOMAIN        Name of the simulated domain\n");
+	fprintf (out, "  --site=SITE            Site name returned to clients\n");
+	fprintf (out, "  --dc=SPEC              Simulated domain controller, may be repeated\n");
+	fprintf (out, "  --port=PORT            LDAP and CLDAP port for each domain controller (default 389)\n");
+	fprintf (out, "  --dns=ADDRESS          Answer SRV and address lookups on this address\n");
+	fprintf (out, "  --dns-port=PORT        DNS port (default 53)\n");
+	fprintf (out, "  --samba=ADDRESS        Run a Samba AD DC on this address as directory and KDC\n");
+	fprintf (out, "  --samba-dir=DIR        Provision Samba in this directory, and reuse it next time\n");
+	fprintf (out, "  --admin-password=PASS  Administrator password for a new Samba domain\n");
+	fprintf (out, "  --seed=N               Seed for the packet loss generator\n");
+	exit (code);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	struct pollfd fds[MAX_POLLED];
+	polled what[MAX_POLLED];
+	char template[] = "/tmp/adcli-standin.XXXXXX";
+	standin_conn *conn;
+	standin_relay *relay;
+	unsigned int seed = 1;
+	int services;
+	int relays;
+	int ret = 0;
+	double wait;
+	double now;
+	int timeout;
+	int status;
+	int nfds;
+	int opt;
+	int i;
+	int j;
+
+	enum {
+		opt_domain = 1,
+		opt_site,
+		opt_dc,
+		opt_port,
+		opt_dns,
+		opt_dns_port,
+		opt_samba,
+		opt_samba_dir,
+		opt_admin_password,
+		opt_seed,
+		opt_help,
+	};
+
+	struct option options[] = {
+		{ "domain", required_argument, NULL, opt_domain },
+		{ "site", required_argument, NULL, opt_site },
+		{ "dc", required_argument, NULL, opt_dc },
+		{ "port", required_argument, NULL, opt_port },
+		{ "dns", required_argument, NULL, opt_dns },
+		{ "dns-port", required_argument, NULL, opt_dns_port },
+		{ "samba", required_argument, NULL, opt_samba },
+		{ "samba-dir", required_argument, NULL, opt_samba_dir },
+		{ "admin-password", required_argument, NULL, opt_admin_password },
+		{ "seed", required_argument, NULL, opt_seed },
+		{ "help", no_argument, NULL, opt_help },
+		{ 0 },
+	};
+
+	while ((opt = getopt_long (argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+		case opt_domain:
+			gl.domain = optarg;
+			break;
+		case opt_site:
+			gl.site = optarg;
+			break;
+		case opt_dc:
+			parse_dc (optarg);
+			break;
+		case opt_port:
+			gl.port = parse_option (optarg, "port", 1, 65535);
+			break;
+		case opt_dns:
+			gl.dns_address = optarg;
+			break;
+		case opt_dns_port:
+			gl.dns_port = parse_option (optarg, "port", 1, 65535);
+			break;
+		case opt_samba:
+			gl.samba_address = optarg;
+			if (inet_pton (AF_INET, optarg, &gl.samba_in) != 1)
+				errx (2, "invalid IPv4 address: %s", optarg);
+			break;
+		case opt_samba_dir:
+			free (gl.samba_dir);
+			gl.samba_dir = strdup (optarg);
+			if (gl.samba_dir == NULL)
+				errx (1, "out of memory");
+			gl.samba_dir_given = 1;
+			break;
+		case opt_admin_password:
+			gl.admin_password = optarg;
+			break;
+		case opt_seed:
+			seed = parse_option (optarg, "seed", 0, INT_MAX);
+			break;
+		case opt_help:
+			usage (0);
+			break;
+		default:
+			usage (2);
+			break;
+		}
+	}
+
+	if (gl.domain == NULL || gl.n_dcs == 0 || optind != argc)
+		usage (2);
+
+	srand (seed);
+
+	/* Without samba there's nothing to relay Kerberos traffic to */
+	services = gl.samba_address ? N_SERVICES : SERVICE_LDAP + 1;
+
+	for (i = 0; i < gl.n_dcs; i++) {
+		if (asprintf (&gl.dcs[i].host_name, "dc%d.%s", i + 1, gl.domain) < 0)
+			errx (1, "out of memory");
+		for (j = 0; j < services; j++) {
+			gl.dcs[i].udp_fds[j] = bind_socket (gl.dcs[i].address,
+			                                    j == SERVICE_LDAP ? gl.port : service_ports[j],
+			                                    SOCK_DGRAM);
+			gl.dcs[i].tcp_fds[j] = bind_socket (gl.dcs[i].address,
+			                                    j == SERVICE_LDAP ? gl.port : service_ports[j],
+			                                    SOCK_STREAM);
+		}
+	}
+
+	if (gl.dns_address)
+		gl.dns_fd = bind_socket (gl.dns_address, gl.dns_port, SOCK_DGRAM);
+
+	for (i = 0; i < MAX_CONNS; i++) {
+		gl.conns[i].fd = -1;
+		gl.conns[i].backend = -1;
+	}
+	for (i = 0; i < MAX_RELAYS; i++)
+		gl.relays[i].fd = -1;
+
+	signal (SIGINT, on_signal);
+	signal (SIGTERM, on_signal);
+
+	if (gl.samba_address) {
+		if (gl.samba_dir == NULL) {
+			if (mkdtemp (template) == NULL)
+				err (1, "couldn't create temporary directory");
+			gl.samba_dir = strdup (template);
+			if (gl.samba_dir == NULL)
+				errx (1, "out of memory");
+		}
+
+		/* Also when we bail out while samba is starting */
+		atexit (stop_samba);
+		provision_samba ();
+		signal (SIGCHLD, on_child);
+		start_samba ();
+	}
+
+	while (!quit) {
+		if (child_exited) {
+			child_exited = 0;
+			if (gl.samba_pid > 0 && waitpid (gl.samba_pid, &status, WNOHANG) == gl.samba_pid) {
+				warnx ("samba exited");
+				gl.samba_pid = -1;
+				ret = 1;
+				break;
+			}
+		}
+
+		nfds = 0;
+		for (i = 0; i < gl.n_dcs; i++) {
+			for (j = 0; j < services; j++) {
+				what[nfds] = (polled){ j == SERVICE_LDAP ? POLLED_CLDAP : POLLED_DATAGRAM, j, gl.dcs + i };
+				fds[nfds++] = (struct pollfd){ gl.dcs[i].udp_fds[j], POLLIN, 0 };
+				what[nfds] = (polled){ POLLED_LISTEN, j, gl.dcs + i };
+				fds[nfds++] = (struct pollfd){ gl.dcs[i].tcp_fds[j], POLLIN, 0 };
+			}
+		}
+
+		if (gl.dns_fd >= 0) {
+			what[nfds] = (polled){ POLLED_DNS, 0, NULL };
+			fds[nfds++] = (struct pollfd){ gl.dns_fd, POLLIN, 0 };
+		}
+
+		/* Don't read more from one side while the other is backed up */
+		for (i = 0; i < MAX_CONNS; i++) {
+			conn = gl.conns + i;
+			if (conn->fd < 0)
+				continue;
+			what[nfds] = (polled){ POLLED_CLIENT, 0, conn };
+			fds[nfds++] = (struct pollfd){ conn->fd,
+				(conn->to_backend.length < MAX_BUFFERED ? POLLIN : 0) |
+				(conn->to_client.length ? POLLOUT : 0), 0 };
+			if (conn->backend < 0)
+				continue;
+			what[nfds] = (polled){ POLLED_BACKEND, 0, conn };
+			fds[nfds++] = (struct pollfd){ conn->backend,
+				(!conn->connecting && conn->queued + conn->to_client.length < MAX_BUFFERED ? POLLIN : 0) |
+				(conn->connecting || conn->to_backend.length ? POLLOUT : 0), 0 };
+		}
+
+		now = now_clock ();
+		relays = 0;
+		for (i = 0; i < MAX_RELAYS; i++) {
+			relay = gl.relays + i;
+			if (relay->fd < 0)
+				continue;
+			if (relay->expires < now) {
+				close_relay (relay);
+				continue;
+			}
+			what[nfds] = (polled){ POLLED_RELAY, 0, relay };
+			fds[nfds++] = (struct pollfd){ relay->fd, POLLIN, 0 };
+			relays++;
+		}
+
+		timeout = -1;
+		if (gl.queue) {
+			wait = gl.queue->due - now;
+			timeout = wait > 0 ? (int)(wait * 1000) + 1 : 0;
+		}
+
+		/* Wake up now and then to expire relays without a reply */
+		if (relays > 0 && (timeout < 0 || timeout > 1000))
+			timeout = 1000;
+
+		if (poll (fds, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			err (1, "couldn't poll");
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (fds[i].revents == 0)
+				continue;
+
+			switch (what[i].kind) {
+			case POLLED_CLDAP:
+				handle_cldap (what[i].ptr);
+				break;
+			case POLLED_DATAGRAM:
+				handle_datagram (what[i].ptr, what[i].service);
+				break;
+			case POLLED_LISTEN:
+				accept_client (what[i].ptr, what[i].service);
+				break;
+			case POLLED_DNS:
+				handle_dns ();
+				break;
+			case POLLED_RELAY:
+				relay = what[i].ptr;
+				if (relay->fd == fds[i].fd)
+					handle_relay (relay);
+				break;
+
+			/* A connection may have been closed earlier in this round */
+			case POLLED_CLIENT:
+				conn = what[i].ptr;
+				if (conn->fd != fds[i].fd)
+					break;
+				if ((fds[i].revents & POLLOUT) && !buffer_write (conn->fd, &conn->to_client))
+					close_conn (conn);
+				else if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+					handle_client (conn);
+				break;
+			case POLLED_BACKEND:
+				conn = what[i].ptr;
+				if (conn->backend != fds[i].fd)
+					break;
+				if (conn->connecting)
+					handle_connected (conn);
+				else if ((fds[i].revents & POLLOUT) && !buffer_write (conn->backend, &conn->to_backend))
+					close_conn (conn);
+				else if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+					handle_backend (conn);
+				break;
+			}
+		}
+
+		flush_replies ();
+
+		for (i = 0; i < MAX_CONNS; i++) {
+			conn = gl.conns + i;
+			if (conn->fd >= 0 && conn->closing &&
+			    conn->queued == 0 && conn->to_client.length == 0)
+				close_conn (conn);
+		}
+	}
+
+	/* Report what each simulated domain controller saw */
+	for (i = 0; i < gl.n_dcs; i++) {
+		printf ("{\"dc\": \"%s\", \"address\": \"%s\", \"latency\": %d, \"loss\": %d, "
+		        "\"requests\": %lu, \"dropped\": %lu, \"replied\": %lu, \"relayed\": %lu}\n",
+		        gl.dcs[i].host_name, gl.dcs[i].address, gl.dcs[i].latency,
+		        gl.dcs[i].loss, gl.dcs[i].requests, gl.dcs[i].dropped,
+		        gl.dcs[i].replied, gl.dcs[i].relayed);
+		for (j = 0; j < services; j++) {
+			close (gl.dcs[i].udp_fds[j]);
+			close (gl.dcs[i].tcp_fds[j]);
+		}
+		free (gl.dcs[i].host_name);
+		free (gl.dcs[i].address);
+	}
+
+	return ret;
+}
@@ -43,8 +43,32 @@ static char *adcli_temp_directory = NULL;
 static char *adcli_krb5_conf_filename = NULL;
 static char *adcli_krb5_d_directory = NULL;
 
+typedef struct {
+	char *phase;
+	char *detail;
+	adcli_result result;
+	double started;
+	double elapsed;
+} PhaseStat;
+
+static PhaseStat *phase_stats = NULL;
+static int n_phase_stats = 0;
+static double stats_started = 0;
+
+static int n_plan_operations = 0;
+static int n_plan_round_trips = 0;
+
+static FILE *trace_file = NULL;
+static double trace_started = 0;
+static char **trace_servers = NULL;
+static int n_trace_servers = 0;
+static int n_trace_events = 0;
+
+static FILE *log_file = NULL;
+
 enum {
 	CONNECTION_LESS = 1<<0,
+	NO_PLAN = 1<<1,
 };
 
 struct {
@@ -54,6 +78,7 @@ struct {
 	int flags;
 } commands[] = {
 	{ "info", adcli_tool_info, "Print information about a domain", CONNECTION_LESS },
+	{ "agent", adcli_tool_agent, "Keep connections warm for other adcli commands", CONNECTION_LESS | NO_PLAN },
 	{ "join", adcli_tool_computer_join, "Join this machine to a domain", },
 	{ "update", adcli_tool_computer_update, "Update machine membership in a domain", },
 	{ "testjoin", adcli_tool_computer_testjoin, "Test if machine account password is valid", },
@@ -61,6 +86,7 @@ struct {
 	{ "reset-computer", adcli_tool_computer_reset, "Reset a computer account", },
 	{ "delete-computer", adcli_tool_computer_delete, "Delete a computer account", },
 	{ "show-computer", adcli_tool_computer_show, "Show computer account attributes stored in AD", },
+	{ "stale-computers", adcli_tool_computer_stale, "Report or clean up unused computer accounts", },
 	{ "create-msa", adcli_tool_computer_managed_service_account, "Create a managed service account in the given AD domain", },
 	{ "create-user", adcli_tool_user_create, "Create a user account", },
 	{ "delete-user", adcli_tool_user_delete, "Delete a user account", },
@@ -69,6 +95,8 @@ struct {
 	{ "delete-group", adcli_tool_group_delete, "Delete a group", },
 	{ "add-member", adcli_tool_member_add, "Add users to a group", },
 	{ "remove-member", adcli_tool_member_remove, "Remove users from a group", },
+	{ "sync-members", adcli_tool_member_sync, "Make group members match a list", },
+	{ "search", adcli_tool_entry_search, "Search for computers, users or groups", },
 	{ 0, }
 };
 
@@ -464,9 +492,9 @@ setup_krb5_conf_directory (adcli_conn *conn)
 	atexit (cleanup_krb5_conf_directory);
 }
 
-static void
-message_func (adcli_message_type type,
-              const char *message)
+void
+adcli_tool_message_func (adcli_message_type type,
+                         const char *message)
 {
 	const char *prefix = "";
 
@@ -483,12 +511,282 @@ message_func (adcli_message_type type,
 	fprintf (stderr, "%s%s\n", prefix, message);
 }
 
+static void
+phase_func (const char *phase,
+            const char *detail,
+            adcli_result result,
+            double started,
+            double elapsed)
+{
+	PhaseStat *stat;
+
+	stat = realloc (phase_stats, (n_phase_stats + 1) * sizeof (PhaseStat));
+	return_if_fail (stat != NULL);
+	phase_stats = stat;
+
+	stat = phase_stats + n_phase_stats++;
+	stat->phase = strdup (phase);
+	stat->detail = detail ? strdup (detail) : NULL;
+	stat->result = result;
+	stat->started = started;
+	stat->elapsed = elapsed;
+}
+
+static void
+print_stats_json (const char *command,
+                  int ret)
+{
+	PhaseStat *stat;
+	int i;
+
+	fprintf (stderr, "{\"command\":");
+	adcli_tool_print_json_string (stderr, command);
+	fprintf (stderr, ",\"exit\":%d,\"elapsed\":%.6f,\"phases\":[",
+	         ret, adcli_phase_clock () - stats_started);
+
+	for (i = 0; i < n_phase_stats; i++) {
+		stat = phase_stats + i;
+		fprintf (stderr, "%s{\"phase\":", i ? "," : "");
+		adcli_tool_print_json_string (stderr, stat->phase ? stat->phase : "");
+		if (stat->detail) {
+			fprintf (stderr, ",\"detail\":");
+			adcli_tool_print_json_string (stderr, stat->detail);
+		}
+		fprintf (stderr, ",\"result\":%d,\"start\":%.6f,\"elapsed\":%.6f}",
+		         stat->result, stat->started - stats_started, stat->elapsed);
+		free (stat->phase);
+		free (stat->detail);
+	}
+
+	fprintf (stderr, "]}\n");
+	free (phase_stats);
+	phase_stats = NULL;
+	n_phase_stats = 0;
+}
+
+static void
+plan_func (const char *operation,
+           const char *target,
+           const char *detail,
+           int round_trips)
+{
+	printf ("%s: %s", operation, target ? target : "");
+	if (detail && detail[0])
+		printf (": %s", detail);
+	printf ("\n");
+
+	n_plan_operations++;
+	n_plan_round_trips += round_trips;
+}
+
+static void
+print_plan_summary (void)
+{
+	printf ("Planned %d operation%s with about %d round trip%s\n",
+	        n_plan_operations, n_plan_operations == 1 ? "" : "s",
+	        n_plan_round_trips, n_plan_round_trips == 1 ? "" : "s");
+}
+
+static void
+trace_event_begin (void)
+{
+	fputs (n_trace_events++ ? ",\n" : "[\n", trace_file);
+}
+
+static void
+trace_thread_name (int tid,
+                   const char *name)
+{
+	trace_event_begin ();
+	fprintf (trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+	         "\"tid\":%d,\"args\":{\"name\":", (int)getpid (), tid);
+	adcli_tool_print_json_string (trace_file, name);
+	fputs ("}}", trace_file);
+}
+
+/*
+ * Each domain controller gets its own row in the timeline. Events
+ * that aren't tied to a server go on the first row.
+ */
+static int
+trace_server_tid (const char *server)
+{
+	char **servers;
+	int i;
+
+	if (server == NULL)
+		return 1;
+
+	for (i = 0; i < n_trace_servers; i++) {
+		if (strcasecmp (trace_servers[i], server) == 0)
+			return i + 2;
+	}
+
+	servers = realloc (trace_servers, (n_trace_servers + 1) * sizeof (char *));
+	return_val_if_fail (servers != NULL, 1);
+	trace_servers = servers;
+	trace_servers[n_trace_servers] = strdup (server);
+	return_val_if_fail (trace_servers[n_trace_servers] != NULL, 1);
+	n_trace_servers++;
+
+	trace_thread_name (n_trace_servers + 1, server);
+	return n_trace_servers + 1;
+}
+
+static void
+trace_func (const char *category,
+            const char *name,
+            const char *server,
+            double started,
+            double elapsed,
+            const char **args)
+{
+	double offset;
+	int tid;
+	int i;
+
+	tid = trace_server_tid (server);
+	offset = started - trace_started;
+
+	trace_event_begin ();
+	fprintf (trace_file, "{\"name\":");
+	adcli_tool_print_json_string (trace_file, name);
+	fprintf (trace_file, ",\"cat\":");
+	adcli_tool_print_json_string (trace_file, category);
+	fprintf (trace_file, ",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%d,\"args\":{",
+	         offset > 0 ? offset * 1000000 : 0, elapsed * 1000000, (int)getpid (), tid);
+
+	for (i = 0; args[i] != NULL && args[i + 1] != NULL; i += 2) {
+		if (i > 0)
+			fputc (',', trace_file);
+		adcli_tool_print_json_string (trace_file, args[i]);
+		fputc (':', trace_file);
+		adcli_tool_print_json_string (trace_file, args[i + 1]);
+	}
+
+	fputs ("}}", trace_file);
+}
+
+static void
+close_trace_file (void)
+{
+	int i;
+
+	if (trace_file == NULL)
+		return;
+
+	adcli_set_trace_func (NULL);
+	fputs (n_trace_events ? "\n]\n" : "[]\n", trace_file);
+	if (fclose (trace_file) != 0)
+		warn ("couldn't write trace file");
+	trace_file = NULL;
+
+	for (i = 0; i < n_trace_servers; i++)
+		free (trace_servers[i]);
+	free (trace_servers);
+	trace_servers = NULL;
+	n_trace_servers = 0;
+}
+
+static void
+open_trace_file (const char *filename,
+                 const char *command)
+{
+	trace_file = fopen (filename, "w");
+	if (trace_file == NULL)
+		err (2, "couldn't open trace file: %s", filename);
+
+	trace_started = adcli_phase_clock ();
+	trace_thread_name (1, command);
+	adcli_set_trace_func (trace_func);
+	atexit (close_trace_file);
+}
+
+/* One JSON object per line, for log shippers */
+static void
+log_func (adcli_log_level level,
+          const char *category,
+          const char *message,
+          const char **fields)
+{
+	struct timespec ts;
+	int i;
+
+	if (clock_gettime (CLOCK_REALTIME, &ts) < 0)
+		ts.tv_sec = ts.tv_nsec = 0;
+
+	fprintf (log_file, "{\"time\":%ld.%06ld,\"pid\":%d,\"level\":\"%s\",\"category\":",
+	         (long)ts.tv_sec, (long)ts.tv_nsec / 1000, (int)getpid (),
+	         adcli_log_level_to_string (level));
+	adcli_tool_print_json_string (log_file, category);
+	fprintf (log_file, ",\"message\":");
+	adcli_tool_print_json_string (log_file, message);
+
+	for (i = 0; fields[i] != NULL && fields[i + 1] != NULL; i += 2) {
+		fputc (',', log_file);
+		adcli_tool_print_json_string (log_file, fields[i]);
+		fputc (':', log_file);
+		adcli_tool_print_json_string (log_file, fields[i + 1]);
+	}
+
+	fputs ("}\n", log_file);
+	fflush (log_file);
+}
+
+static void
+close_log_file (void)
+{
+	if (log_file == NULL)
+		return;
+
+	adcli_set_log_func (NULL, ADCLI_LOG_INFO);
+	if (log_file != stderr && fclose (log_file) != 0)
+		warn ("couldn't write log file");
+	log_file = NULL;
+}
+
+static void
+open_log_file (const char *filename,
+               adcli_log_level level)
+{
+	if (strcmp (filename, "-") == 0)
+		log_file = stderr;
+	else
+		log_file = fopen (filename, "a");
+	if (log_file == NULL)
+		err (2, "couldn't open log file: %s", filename);
+
+	adcli_set_log_func (log_func, level);
+	atexit (close_log_file);
+}
+
+static adcli_log_level
+parse_log_level (const char *value)
+{
+	int level;
+
+	for (level = ADCLI_LOG_DEBUG; level <= ADCLI_LOG_ERROR; level++) {
+		if (strcmp (value, adcli_log_level_to_string (level)) == 0)
+			return level;
+	}
+
+	errx (2, "unsupported log level: %s", value);
+}
+
 int
 main (int argc,
       char *argv[])
 {
 	adcli_conn *conn = NULL;
 	char *command = NULL;
+	const char *trace_filename = NULL;
+	const char *log_filename = NULL;
+	adcli_log_level log_level = ADCLI_LOG_INFO;
+	bool stats = false;
+	bool plan = false;
+	bool verbose = false;
+	bool krb5_conf_in_memory = false;
+	bool krb5_conf_given = false;
 	int skip;
 	int in, out;
 	int ret;
@@ -519,7 +817,44 @@ main (int argc,
 					errx (2, "no command specified");
 
 			} else if (strcmp (argv[in], "--verbose") == 0) {
-				adcli_set_message_func (message_func);
+				adcli_set_message_func (adcli_tool_message_func);
+				verbose = true;
+
+			} else if (strncmp (argv[in], "--stats=", 8) == 0) {
+				if (strcmp (argv[in] + 8, "json") != 0)
+					errx (2, "unsupported statistics format: %s", argv[in] + 8);
+				stats = true;
+				skip = 1;
+
+			} else if (strcmp (argv[in], "--plan") == 0) {
+				plan = true;
+				skip = 1;
+
+			} else if (strncmp (argv[in], "--krb5-conf=", 12) == 0) {
+				if (strcmp (argv[in] + 12, "memory") == 0)
+					krb5_conf_in_memory = true;
+				else if (strcmp (argv[in] + 12, "files") == 0)
+					krb5_conf_in_memory = false;
+				else
+					errx (2, "unsupported krb5 configuration mode: %s", argv[in] + 12);
+				krb5_conf_given = true;
+				skip = 1;
+
+			} else if (strncmp (argv[in], "--trace-file=", 13) == 0) {
+				trace_filename = argv[in] + 13;
+				if (trace_filename[0] == '\0')
+					errx (2, "no trace file specified");
+				skip = 1;
+
+			} else if (strncmp (argv[in], "--log-file=", 11) == 0) {
+				log_filename = argv[in] + 11;
+				if (log_filename[0] == '\0')
+					errx (2, "no log file specified");
+				skip = 1;
+
+			} else if (strncmp (argv[in], "--log-level=", 12) == 0) {
+				log_level = parse_log_level (argv[in] + 12);
+				skip = 1;
 
 			} else if (strcmp (argv[in], "--help") == 0) {
 				if (!command) {
@@ -546,7 +881,8 @@ main (int argc,
 					break;
 
 				case 'v':
-					adcli_set_message_func (message_func);
+					adcli_set_message_func (adcli_tool_message_func);
+					verbose = true;
 					break;
 
 				default:
@@ -576,24 +912,61 @@ main (int argc,
 	argc = out;
 	conn = NULL;
 
+	if (stats) {
+		stats_started = adcli_phase_clock ();
+		adcli_set_phase_func (phase_func);
+	}
+
+	if (trace_filename)
+		open_trace_file (trace_filename, command);
+
+	if (log_filename)
+		open_log_file (log_filename, log_level);
+
+	if (plan)
+		adcli_set_plan_func (plan_func);
+
 	/* Look for the command */
 	for (i = 0; commands[i].name != NULL; i++) {
 		if (strcmp (commands[i].name, command) != 0)
 			continue;
 
+		argv[0] = command;
+
+		/* Changes the plan can't hold back must not look like a dry run */
+		if (plan && (commands[i].flags & NO_PLAN))
+			errx (2, "--plan is not supported for the %s command", command);
+
+		/*
+		 * Statistics, traces, logs and plans are only available for local
+		 * commands, and the agent always keeps its krb5.conf in memory.
+		 */
+		if (!(commands[i].flags & CONNECTION_LESS) && !stats && !trace_filename &&
+		    !log_filename && !plan && !(krb5_conf_given && !krb5_conf_in_memory) &&
+		    adcli_tool_agent_forward (argc, argv, verbose, &ret))
+			return ret;
+
 		if (!(commands[i].flags & CONNECTION_LESS)) {
 			conn = adcli_conn_new (NULL);
 			if (conn == NULL)
 				errx (-1, "unexpected memory problems");
 			adcli_conn_set_password_func (conn, adcli_prompt_password_func, NULL, NULL);
-			setup_krb5_conf_directory (conn);
+			if (krb5_conf_in_memory) {
+				adcli_conn_set_krb5_conf_in_memory (conn, true);
+				setenv ("SSSD_KRB5_LOCATOR_DISABLE", "true", 1);
+			} else {
+				setup_krb5_conf_directory (conn);
+			}
 		}
 
-		argv[0] = command;
 		ret = (commands[i].function) (conn, argc, argv);
 
 		if (conn)
 			adcli_conn_unref (conn);
+		if (stats)
+			print_stats_json (command, ret);
+		if (plan && ret == 0)
+			print_plan_summary ();
 #ifdef VENDOR_MSG
 		if (ret != 0) {
 			fprintf (stderr, VENDOR_MSG"\n");
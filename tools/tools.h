@@ -27,6 +27,7 @@
 #include "adcli.h"
 
 #include <getopt.h>
+#include <stdio.h>
 
 #define EFAIL  (-ADCLI_ERR_FAIL)
 #define EUSAGE (-ADCLI_ERR_CONFIG)
@@ -44,6 +45,18 @@ int       adcli_tool_getopt            (int argc,
 void      adcli_tool_usage             (const struct option *longopts,
                                         const adcli_tool_desc *usages);
 
+void      adcli_tool_print_json_string (FILE *out,
+                                        const char *value);
+
+void      adcli_tool_print_json_bytes  (FILE *out,
+                                        const char *value,
+                                        size_t len);
+
+bool      adcli_tool_parse_number      (const char *value,
+                                        long minimum,
+                                        long maximum,
+                                        long *number);
+
 char *    adcli_prompt_password_func   (adcli_login_type login_type,
                                         const char *name,
                                         int flags,
@@ -82,6 +95,10 @@ int       adcli_tool_computer_show     (adcli_conn *conn,
                                         int argc,
                                         char *argv[]);
 
+int       adcli_tool_computer_stale    (adcli_conn *conn,
+                                        int argc,
+                                        char *argv[]);
+
 int       adcli_tool_computer_managed_service_account (adcli_conn *conn,
                                                        int argc,
                                                        char *argv[]);
@@ -114,8 +131,28 @@ int       adcli_tool_member_remove     (adcli_conn *conn,
                                         int argc,
                                         char *argv[]);
 
+int       adcli_tool_member_sync       (adcli_conn *conn,
+                                        int argc,
+                                        char *argv[]);
+
+int       adcli_tool_entry_search      (adcli_conn *conn,
+                                        int argc,
+                                        char *argv[]);
+
 int       adcli_tool_info              (adcli_conn *conn,
                                         int argc,
                                         char *argv[]);
 
+int       adcli_tool_agent             (adcli_conn *conn,
+                                        int argc,
+                                        char *argv[]);
+
+bool      adcli_tool_agent_forward     (int argc,
+                                        char *argv[],
+                                        bool verbose,
+                                        int *status);
+
+void      adcli_tool_message_func      (adcli_message_type type,
+                                        const char *message);
+
 #endif /* _ADCLI_TOOLS_H_ */
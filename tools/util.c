@@ -0,0 +1,79 @@
+/*
+ * adcli
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include "tools.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Helpers shared by the adcli tool and the adcli-standin and adcli-load
+ * test programs, which don't link against the library.
+ */
+
+void
+adcli_tool_print_json_bytes (FILE *out,
+                             const char *value,
+                             size_t len)
+{
+	const unsigned char *at;
+	const unsigned char *end;
+
+	fputc ('"', out);
+	end = (const unsigned char *)value + len;
+	for (at = (const unsigned char *)value; at < end; at++) {
+		if (*at == '"' || *at == '\\')
+			fprintf (out, "\\%c", *at);
+		else if (*at < 0x20)
+			fprintf (out, "\\u%04x", *at);
+		else
+			fputc (*at, out);
+	}
+	fputc ('"', out);
+}
+
+void
+adcli_tool_print_json_string (FILE *out,
+                              const char *value)
+{
+	adcli_tool_print_json_bytes (out, value, strlen (value));
+}
+
+bool
+adcli_tool_parse_number (const char *value,
+                         long minimum,
+                         long maximum,
+                         long *number)
+{
+	char *end;
+	long result;
+
+	errno = 0;
+	result = strtol (value, &end, 10);
+	if (errno != 0 || end == value || *end != '\0' ||
+	    result < minimum || result > maximum)
+		return false;
+
+	*number = result;
+	return true;
+}